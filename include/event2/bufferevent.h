@@ -59,7 +59,8 @@
     <dt>Paired bufferevents</dt>
       <dd>A pair of bufferevents that send and receive data to one
           another without touching the network.  Created with
-          bufferevent_pair_new().</dd>
+          bufferevent_pair_new(), or with bufferevent_pair_new_cross_thread()
+          when the two ends run on different threads.</dd>
 
     <dt>Filtering bufferevents</dt>
        <dd>A bufferevent that transforms data, and sends or receives it
@@ -227,6 +228,15 @@ struct evdns_base;
        ::1		(ipv6address)
        [::1]		([ipv6address])
 
+   If the bufferevent does not already have a socket, every resolved address
+   is tried, as described in RFC 8305 ("Happy Eyeballs"): with an evdns_base
+   and AF_UNSPEC, the IPv6 and IPv4 lookups run in parallel; connection
+   attempts alternate between address families, starting with IPv6; a new
+   attempt starts every 250 msec (or as soon as one fails) until one
+   connects.  The first socket to connect is used, and the others are
+   closed.  If every attempt fails, the error callback is invoked with the
+   socket error set to that of the last attempt.
+
    Performance note: If you do not provide an evdns_base, this function
    may block while it waits for a DNS response.	 This is probably not
    what you want.
@@ -244,6 +254,26 @@ int bufferevent_socket_connect_hostname(struct bufferevent *,
 */
 int bufferevent_socket_get_dns_error(struct bufferevent *bev);
 
+/**
+   Size the writes of a socket bufferevent to match its send buffer.
+
+   When enabled, the most the bufferevent will write in a single operation
+   follows the socket's current send buffer size, rounded down to a whole
+   number of 64KB segments, so that the kernel can coalesce large egress
+   into segmentation-offloaded packets with fewer system calls.  The size
+   is refreshed whenever the socket is set and once it finishes
+   connecting.  Disabling it, or calling bufferevent_set_max_single_write(),
+   returns to a fixed size.
+
+   This is only supported on Linux.
+
+   @param bev A socket bufferevent.
+   @param enable True to size writes automatically, false to stop.
+   @return 0 on success, -1 if unsupported.
+*/
+int bufferevent_socket_set_write_autosize(struct bufferevent *bev,
+    int enable);
+
 /**
   Assign a bufferevent to a specific event_base.
 
@@ -592,11 +622,62 @@ int bufferevent_pair_new(struct event_base *base, int options,
     struct bufferevent *pair[2]);
 
 /**
-   Given one bufferevent returned by bufferevent_pair_new(), returns the
-   other one if it still exists.  Otherwise returns NULL.
+   Allocate a pair of linked bufferevents whose ends run on different
+   event_bases, usually in different threads.
+
+   Each end has a lock of its own, so neither thread waits on the other to
+   read or write.  Everything written to one end during an iteration of
+   its event loop is handed over, without copying, as a single batch
+   through a lock-free queue; the other end's event_base is woken up
+   through its notification fd to read it.  Up to 256 batches may be
+   waiting in each direction, after which the writing end holds on to
+   what is written to it until the reading end catches up.
+
+   When one end is freed, or flushed with BEV_FINISHED, the other end
+   gets BEV_EVENT_EOF after it has read everything sent before that.
+
+   Threading support must have been turned on with evthread_use_pthreads()
+   or evthread_use_windows_threads() before either event_base was created.
+   Each end should only be used and freed from the thread running its own
+   event_base.  bufferevent_pair_set_batching() doesn't apply to these
+   pairs.
+
+   @param base1 The event base for pair[0].
+   @param base2 The event base for pair[1].
+   @param options A set of options for both bufferevents.
+     BEV_OPT_THREADSAFE is always turned on.
+   @param pair A pointer to an array to hold the two new bufferevent objects.
+   @return 0 on success, -1 on failure or if this platform has no atomic
+     operations we can use.
+ */
+int bufferevent_pair_new_cross_thread(struct event_base *base1,
+    struct event_base *base2, int options, struct bufferevent *pair[2]);
+
+/**
+   Given one bufferevent returned by bufferevent_pair_new() or
+   bufferevent_pair_new_cross_thread(), returns the other one if it still
+   exists.  Otherwise returns NULL.
  */
 struct bufferevent *bufferevent_pair_get_partner(struct bufferevent *bev);
 
+/**
+   Make data written to one bufferevent of a pair reach its partner in
+   batches.
+
+   Normally every write is handed to the partner at once.  With batching
+   on, writes pile up until the event loop finishes running the current
+   batch of callbacks, or until <b>threshold</b> bytes are waiting,
+   whichever comes first; the partner then gets them in a single transfer
+   and a single read callback.  bufferevent_flush() with BEV_FLUSH or
+   BEV_FINISHED hands over whatever is waiting right away.
+
+   @param bev One bufferevent returned by bufferevent_pair_new().
+   @param threshold How many bytes may wait before being handed over
+     immediately, or 0 to turn batching off.
+   @return 0 on success, -1 on failure.
+ */
+int bufferevent_pair_set_batching(struct bufferevent *bev, size_t threshold);
+
 /**
    Abstract type used to configure rate-limiting on a bufferevent or a group
    of bufferevents.
@@ -708,6 +789,28 @@ int bufferevent_rate_limit_group_set_min_share(
 */
 void bufferevent_rate_limit_group_free(struct bufferevent_rate_limit_group *);
 
+/**
+   Make 'parent' the parent of the rate-limiting group 'g', or detach 'g'
+   from its parent if 'parent' is NULL.
+
+   Every member of 'g' is then limited by 'parent' as well: bytes read or
+   written by a member count against 'g', against 'parent', and against
+   every group above 'parent'.  When a parent group runs out, all the
+   groups below it are suspended until it refills.  You can use this to
+   build hierarchies such as a global limit, a per-tenant limit, and a
+   per-connection limit.
+
+   Both groups should use the same event_base.  A group that has a parent
+   is detached from it when it is freed; a group with children cannot be
+   freed.
+
+   Returns 0 on success, -1 on failure (for example, if 'g' is already
+   above 'parent').
+ */
+int bufferevent_rate_limit_group_set_parent(
+	struct bufferevent_rate_limit_group *g,
+	struct bufferevent_rate_limit_group *parent);
+
 /**
    Add 'bev' to the list of bufferevents whose aggregate reading and writing
    is restricted by 'g'.  If 'g' is NULL, remove 'bev' from its current group.
@@ -742,6 +845,51 @@ ev_ssize_t bufferevent_get_write_limit(struct bufferevent *bev);
 ev_ssize_t bufferevent_get_max_to_read(struct bufferevent *bev);
 ev_ssize_t bufferevent_get_max_to_write(struct bufferevent *bev);
 
+/**
+   @name Single operation limits
+
+   Set or get the most a bufferevent will read or write in a single
+   operation, no matter how much its rate limits would allow.  The
+   default is 16384 bytes, or whatever was set for its event_base with
+   bufferevent_base_set_max_single_read() or
+   bufferevent_base_set_max_single_write() when it was created.
+
+   Bulk transfers may want a larger value to make fewer system calls per
+   byte; latency-sensitive connections may want a smaller one so that no
+   single bufferevent monopolizes the event loop.  Passing 0 restores the
+   default.
+
+   A socket-based bufferevent still reads at most 4096 bytes per
+   operation, as evbuffer_read() does, unless a max single read was set
+   for it or for its event_base.
+
+   Returns 0 on success, -1 on failure.
+
+   @{
+ */
+int bufferevent_set_max_single_read(struct bufferevent *bev, size_t size);
+int bufferevent_set_max_single_write(struct bufferevent *bev, size_t size);
+ev_ssize_t bufferevent_get_max_single_read(struct bufferevent *bev);
+ev_ssize_t bufferevent_get_max_single_write(struct bufferevent *bev);
+/*@}*/
+
+/**
+   @name Per-base single operation limits
+
+   Set the default most that bufferevents created on <b>base</b> after this
+   call will read or write in a single operation.  Passing 0 restores the
+   library default of 16384 bytes.  Existing bufferevents are unaffected.
+
+   Returns 0 on success, -1 on failure.
+
+   @{
+ */
+int bufferevent_base_set_max_single_read(struct event_base *base,
+    size_t size);
+int bufferevent_base_set_max_single_write(struct event_base *base,
+    size_t size);
+/*@}*/
+
 /**
    @name Group Rate limit inspection
 
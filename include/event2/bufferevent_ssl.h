@@ -41,6 +41,7 @@ extern "C" {
 
 /* This is what openssl's SSL objects are underneath. */
 struct ssl_st;
+struct ssl_ctx_st;
 
 /**
    The state of an SSL object to be used when creating a new
@@ -98,6 +99,158 @@ int bufferevent_ssl_renegotiate(struct bufferevent *bev);
 /** Return the most recent OpenSSL error reported on an SSL bufferevent. */
 unsigned long bufferevent_get_openssl_error(struct bufferevent *bev);
 
+/**
+   Ask for the session keys of a socket-based SSL bufferevent to be handed
+   to the kernel (Linux kTLS) once its handshake is done.
+
+   If the kernel accepts them, the bufferevent reads and writes plaintext
+   on the socket directly instead of going through SSL_read and SSL_write,
+   so that file segments added with evbuffer_add_file() can be sent with
+   sendfile.  Alerts and other non-data records still go through OpenSSL.
+   A bufferevent using kTLS can't be renegotiated.
+
+   Must be called before the handshake finishes.  Requires OpenSSL 3.0 or
+   later built with kTLS support.  If the kernel can't take the keys (for
+   instance, on a socketpair or for an unsupported cipher), the bufferevent
+   keeps using OpenSSL as usual and bufferevent_openssl_get_ktls() returns 0.
+
+   @param bev A bufferevent created with bufferevent_openssl_socket_new().
+   @param enable True to ask for kTLS, false not to.
+   @return 0 on success, -1 if kTLS is unavailable for this bufferevent.
+   @see bufferevent_openssl_get_ktls()
+ */
+int bufferevent_openssl_set_ktls(struct bufferevent *bev, int enable);
+
+/**
+   Return which directions of an SSL bufferevent the kernel is encrypting
+   or decrypting: a bitmask of EV_READ and EV_WRITE, or 0 if none.
+ */
+short bufferevent_openssl_get_ktls(struct bufferevent *bev);
+
+/**
+   A function that arranges for work(work_arg) to be run on some thread
+   other than the event loop's, such as one from the application's thread
+   pool.  <b>arg</b> is the pointer given to
+   bufferevent_openssl_set_handshake_offload().
+ */
+typedef void (*bufferevent_ssl_offload_cb)(void (*work)(void *),
+    void *work_arg, void *arg);
+
+/**
+   Run the handshake of a socket-based SSL bufferevent off the event loop.
+
+   Each time the socket is ready during the handshake, the bufferevent
+   hands its SSL to <b>cb</b>, which should run the expensive public-key
+   work of SSL_do_handshake() on another thread.  The worker wakes the
+   event loop when it is done, and the bufferevent picks the handshake
+   back up from there.  Other connections on the event_base keep being
+   served in the meantime.
+
+   The event_base must have been created after threading support was
+   turned on with evthread_use_pthreads() or
+   evthread_use_windows_threads().  While a step of the handshake is
+   running elsewhere, don't touch the bufferevent's SSL yourself.
+
+   @param bev A bufferevent created with bufferevent_openssl_socket_new()
+     that hasn't finished its handshake.
+   @param cb The function to run handshake steps with, or NULL to run
+     them in the event loop again.
+   @param arg An argument to pass to cb.
+   @return 0 on success, -1 on failure.
+ */
+int bufferevent_openssl_set_handshake_offload(struct bufferevent *bev,
+    bufferevent_ssl_offload_cb cb, void *arg);
+
+/**
+   A cache of client-side SSL sessions, keyed by host and port, so that
+   reconnecting to a server can resume a session instead of doing a full
+   handshake.  It may be shared by any number of SSL bufferevents.
+ */
+struct bufferevent_openssl_session_cache;
+
+/**
+   Create a new client session cache.
+
+   @param max_entries The most sessions to remember; once it is full, the
+     least recently used one is forgotten.
+   @param max_lifetime The most seconds to remember a session for.  A
+     session that the server says expires sooner is forgotten sooner.
+   @return the new cache, or NULL on failure.
+ */
+struct bufferevent_openssl_session_cache *
+bufferevent_openssl_session_cache_new(int max_entries, int max_lifetime);
+
+/**
+   Free a client session cache.  No bufferevent may be using it.
+ */
+void bufferevent_openssl_session_cache_free(
+	struct bufferevent_openssl_session_cache *cache);
+
+/**
+   Make a connecting SSL bufferevent resume its session from a cache, and
+   remember its session there for next time.
+
+   Sessions are looked up under <b>host</b> and <b>port</b>, which should
+   name the server the bufferevent is connecting to.  This must be called
+   before the handshake has started; for a bufferevent created with
+   bufferevent_openssl_socket_new(), that means before the event loop next
+   runs.
+
+   @param bev An SSL bufferevent in state BUFFEREVENT_SSL_CONNECTING.
+   @param cache The cache to use, or NULL to stop using one.
+   @param host The name of the server.  Required unless cache is NULL.
+   @param port The port on the server.
+   @return 0 on success, -1 on failure.
+ */
+int bufferevent_openssl_set_session_cache(struct bufferevent *bev,
+    struct bufferevent_openssl_session_cache *cache,
+    const char *host, int port);
+
+/**
+   Turn on OpenSSL's in-process server-side session cache for an SSL_CTX,
+   so that clients that connect to it again can resume their sessions.
+
+   @param ctx The SSL_CTX used for accepting connections.
+   @param max_entries The most sessions to remember.
+   @param max_lifetime The most seconds a session may be resumed for.
+   @return 0 on success, -1 on failure.
+ */
+int bufferevent_openssl_ctx_enable_session_cache(struct ssl_ctx_st *ctx,
+    long max_entries, long max_lifetime);
+
+/**
+   A set of session ticket keys that an SSL_CTX encrypts its session
+   tickets with, and that are replaced every so often.
+ */
+struct bufferevent_openssl_ticket_keys;
+
+/**
+   Make an SSL_CTX issue session tickets under random keys that are
+   replaced every <b>interval</b> seconds.
+
+   Tickets under the last two keys are still accepted, and a client that
+   presents one gets a fresh ticket under the current key.  The keys live
+   only in this process, so that a stolen ticket key can't decrypt traffic
+   recorded more than a few intervals earlier.
+
+   @param base The event_base to run the replacement timer on.
+   @param ctx The SSL_CTX used for accepting connections.
+   @param interval How many seconds to use each key for.
+   @return a handle for the keys, or NULL on failure or if ctx already has
+     rotating keys.
+   @see bufferevent_openssl_ticket_keys_free()
+ */
+struct bufferevent_openssl_ticket_keys *
+bufferevent_openssl_ctx_rotate_ticket_keys(struct event_base *base,
+    struct ssl_ctx_st *ctx, int interval);
+
+/**
+   Stop rotating ticket keys for an SSL_CTX and forget them.  The SSL_CTX
+   goes back to OpenSSL's default ticket handling.
+ */
+void bufferevent_openssl_ticket_keys_free(
+	struct bufferevent_openssl_ticket_keys *keys);
+
 #endif
 
 #ifdef __cplusplus
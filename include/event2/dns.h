@@ -267,6 +267,38 @@ int evdns_base_nameserver_add(struct evdns_base *base,
  */
 int evdns_base_count_nameservers(struct evdns_base *base);
 
+/**
+  A callback type for use with evdns_base_foreach_nameserver_rtt().
+
+  @param addr the address of the nameserver
+  @param addrlen the length of addr
+  @param srtt the smoothed round-trip time of the nameserver's replies
+  @param rttvar the mean deviation of the round-trip time
+  @param n_samples how many replies have been timed; srtt and rttvar are
+    meaningless when this is 0.
+  @param arg the argument passed to evdns_base_foreach_nameserver_rtt()
+ */
+typedef void (*evdns_nameserver_rtt_cb)(const struct sockaddr *addr,
+    ev_socklen_t addrlen, const struct timeval *srtt,
+    const struct timeval *rttvar, int n_samples, void *arg);
+
+/**
+  Report the round-trip time statistics for each configured nameserver.
+
+  We time the replies from each nameserver, much as TCP does, and send
+  requests to the faster ones by preference.  A timed-out request counts
+  against its nameserver's round-trip time.
+
+  The callback is invoked with the evdns_base locked.
+
+  @param base the evdns_base to examine
+  @param cb a function to call once for each nameserver
+  @param arg an argument to pass to cb
+  @return the number of nameservers reported
+ */
+int evdns_base_foreach_nameserver_rtt(struct evdns_base *base,
+    evdns_nameserver_rtt_cb cb, void *arg);
+
 /**
   Remove all configured nameservers, and suspend all pending resolves.
 
@@ -391,7 +423,26 @@ void evdns_cancel_request(struct evdns_base *base, struct evdns_request *req);
   The currently available configuration options are:
 
     ndots, timeout, max-timeouts, max-inflight, attempts, randomize-case,
-    bind-to, initial-probe-timeout, getaddrinfo-allow-skew.
+    bind-to, initial-probe-timeout, getaddrinfo-allow-skew, cache-size,
+    cache-min-ttl, cache-max-ttl, cache-prefetch, edns-udp-size, hedge.
+
+  cache-size is the number of answers to remember; 0 (the default) turns
+  the answer cache off.  TTLs from nameservers are clamped to the range
+  [cache-min-ttl, cache-max-ttl] seconds (by default [0, 86400]) before an
+  answer is cached.  When a cached answer is used within the last
+  cache-prefetch percent of its TTL (by default 10), we ask for a fresh
+  one in the background, so that popular names don't drop out of the
+  cache; 0 turns this off.
+
+  edns-udp-size is the UDP payload size to advertise in an EDNS0 OPT record
+  on every query, between 512 and 4096 bytes; 0 (the default) sends plain
+  DNS queries.  Whatever its value, a reply that comes back truncated is
+  asked for again over TCP.
+
+  If hedge is nonzero, a request that goes unanswered for a while longer
+  than its nameserver usually takes (its smoothed round-trip time plus four
+  times the deviation) is also sent to the fastest other good nameserver,
+  and we use whichever answer arrives first.
 
   In versions before Libevent 2.0.3-alpha, the option name needed to end with
   a colon.
@@ -404,6 +455,29 @@ void evdns_cancel_request(struct evdns_base *base, struct evdns_request *req);
 int evdns_base_set_option(struct evdns_base *base, const char *option, const char *val);
 
 
+/**
+  Forget every answer in the answer cache of an evdns_base.
+
+  @param base the evdns_base whose cache should be emptied
+  @see evdns_base_set_option()
+ */
+void evdns_base_cache_clear(struct evdns_base *base);
+
+/**
+  Report how well the answer cache of an evdns_base is doing.
+
+  A lookup that the cache answers, positively or negatively, counts as a
+  hit; one that has to go to a nameserver while the cache is on counts as
+  a miss.  Any of the output pointers may be NULL.
+
+  @param base the evdns_base to inspect
+  @param hits set to the number of lookups answered from the cache
+  @param misses set to the number of lookups sent to a nameserver
+  @param n_entries set to the number of answers currently cached
+ */
+void evdns_base_cache_get_stats(struct evdns_base *base, ev_uint64_t *hits,
+    ev_uint64_t *misses, int *n_entries);
+
 /**
   Parse a resolv.conf file.
 
@@ -440,6 +514,20 @@ int evdns_base_resolv_conf_parse(struct evdns_base *base, int flags, const char
 */
 int evdns_base_load_hosts(struct evdns_base *base, const char *hosts_fname);
 
+/**
+   Replace the /etc/hosts-style entries of 'base' with those in
+   'hosts_fname', without blocking the event loop for long.
+
+   The file is read at once, but parsed a slice at a time on successive
+   passes through the event loop.  Until it has been parsed completely,
+   lookups keep using the old entries.  Calling this again while a reload
+   is in progress abandons the earlier reload.
+
+   Return 0 if the reload was started, or -1 if the file couldn't be read,
+   in which case the old entries stay in place.
+*/
+int evdns_base_reload_hosts(struct evdns_base *base, const char *hosts_fname);
+
 /**
   Obtain nameserver information using the Windows API.
 
@@ -573,6 +661,34 @@ typedef void (*evdns_request_callback_fn_type)(struct evdns_server_request *, vo
     @return an evdns_server_port structure for this server port.
  */
 struct evdns_server_port *evdns_add_server_port_with_base(struct event_base *base, evutil_socket_t socket, int flags, evdns_request_callback_fn_type callback, void *user_data);
+
+/** Create a DNS server port for each of several event bases, all listening
+    on the same UDP address.
+
+    Each port gets its own socket, bound with SO_REUSEPORT, so the kernel
+    spreads incoming requests over the sockets.  Run each event base in its
+    own thread to answer requests on several CPUs at once; in that case the
+    callback may be invoked from all of those threads at the same time, and
+    Libevent's threading support must be turned on.
+
+    @param bases An array of n_bases event bases.
+    @param n_bases How many event bases (and so server ports) to use.
+    @param addr The address to listen on.  If its port is 0, we pick one
+      port and use it for every socket.
+    @param addrlen The length of addr.
+    @param flags Always 0 for now.
+    @param callback A function to invoke whenever we get a DNS request
+      on any of the sockets.
+    @param user_data Data to pass to the callback.
+    @param ports_out An array of n_bases pointers, which we set to the new
+      server ports, in the same order as bases.
+    @return 0 on success, or -1 on failure, in which case no ports are
+      left open.  This always fails on platforms without SO_REUSEPORT.
+ */
+int evdns_add_server_ports_with_bases(struct event_base **bases, int n_bases,
+    const struct sockaddr *addr, int addrlen, int flags,
+    evdns_request_callback_fn_type callback, void *user_data,
+    struct evdns_server_port **ports_out);
 /** Close down a DNS server port, and free associated structures. */
 void evdns_close_server_port(struct evdns_server_port *port);
 
@@ -52,6 +52,7 @@ struct event_base;
 /* Response codes */
 #define HTTP_OK			200	/**< request completed ok */
 #define HTTP_NOCONTENT		204	/**< request does not have content */
+#define HTTP_PARTIALCONTENT	206	/**< a range of the content was sent */
 #define HTTP_MOVEPERM		301	/**< the uri moved permanently */
 #define HTTP_MOVETEMP		302	/**< the uri moved temporarily */
 #define HTTP_NOTMODIFIED	304	/**< page was not modified from last */
@@ -59,6 +60,7 @@ struct event_base;
 #define HTTP_NOTFOUND		404	/**< could not find content for uri */
 #define HTTP_BADMETHOD		405 	/**< method not allowed for this uri */
 #define HTTP_ENTITYTOOLARGE	413	/**<  */
+#define HTTP_RANGENOTSATISFIABLE 416	/**< the requested range is not there */
 #define HTTP_EXPECTATIONFAILED	417	/**< we can't handle this expectation */
 #define HTTP_INTERNAL           500     /**< internal error */
 #define HTTP_NOTIMPLEMENTED     501     /**< not implemented */
@@ -219,6 +221,47 @@ int evhttp_set_cb(struct evhttp *http, const char *path,
 /** Removes the callback for a specified URI */
 int evhttp_del_cb(struct evhttp *, const char *);
 
+/**
+   Set a callback for the requests whose path matches a pattern.
+
+   A pattern is a path whose segments are matched one at a time.  A
+   segment of the form ":name" matches any non-empty segment, and a last
+   segment of the form "*name" matches the rest of the path.  The
+   decoded values they matched are available to the callback through
+   evhttp_request_get_route_params().
+
+   At each segment, a literal match is preferred over ":name", which is
+   preferred over "*name"; if the preferred choice leads to no route, the
+   next one is tried.  So with both "/users/me" and "/users/:id/posts"
+   set, "/users/me/posts" goes to the second.  A path that matches no
+   other route goes to the longest "*name" route that it matched a prefix
+   of, if any.
+
+   Routes are tried after the callbacks set with evhttp_set_cb().  A
+   request whose path matches a route but whose method doesn't is
+   answered with "405 Method Not Allowed".
+
+   @param http the http server on which to set the route
+   @param methods the methods to dispatch to cb, a bit mask constructed
+     from evhttp_cmd_type values
+   @param pattern the path pattern, for example "/users/:id"
+   @param cb the callback to invoke for matching requests
+   @param cb_arg an additional context argument for the callback
+   @return 0 on success, -1 if the pattern is invalid, if one of the
+     methods already has a callback for it, or on failure
+*/
+int evhttp_set_route(struct evhttp *http, ev_uint16_t methods,
+    const char *pattern, void (*cb)(struct evhttp_request *, void *),
+    void *cb_arg);
+
+/**
+   Removes a route set with evhttp_set_route() for some of its methods.
+
+   @return 0 on success, -1 if there was no such route
+*/
+int evhttp_del_route(struct evhttp *http, ev_uint16_t methods,
+    const char *pattern);
+
 /**
     Set a callback for all requests that are not caught by specific callbacks
 
@@ -233,6 +276,94 @@ int evhttp_del_cb(struct evhttp *, const char *);
 void evhttp_set_gencb(struct evhttp *http,
     void (*cb)(struct evhttp_request *, void *), void *arg);
 
+/**
+   Set a callback that sees every request once its headers are read.
+
+   The callback runs before the request body is read.  It lets a server
+   consume large bodies as they arrive, instead of having evhttp buffer
+   all of them in the request's input buffer first.  To do that, call
+   evhttp_request_set_chunked_cb() on the request from the callback.
+   Body data is then passed to the chunked callback as it is read, for
+   chunked and Content-Length bodies alike, with arg as its argument.
+   Use evhttp_request_set_body_watermark() to bound how much unconsumed
+   data may pile up.  The regular request callback runs once the whole
+   body has been read.
+
+   @param http the evhttp server object
+   @param cb the callback; it returns 0 to go on reading the request, or
+     -1 to reject it with "400 Bad Request"
+   @param arg an argument for cb, and for chunked callbacks set from it
+*/
+void evhttp_set_header_cb(struct evhttp *http,
+    int (*cb)(struct evhttp_request *, void *), void *arg);
+
+/**
+   Serve the files below a directory for a URI prefix.
+
+   Requests whose decoded path begins with prefix, and which are not
+   caught by a callback set with evhttp_set_cb(), are answered with the
+   corresponding regular file below docroot.  If more than one prefix
+   matches, the longest one wins.  Requests for anything other than a
+   regular file get a 404; methods other than GET and HEAD get a 405.
+
+   Single "bytes=" Range requests, If-Range, If-None-Match and
+   If-Modified-Since are honored, and every reply carries an ETag and
+   a Last-Modified header.  File bodies are added to the connection
+   with evbuffer_add_file(), so they are sent with sendfile() where
+   the platform supports it.
+
+   Open file descriptors and their stat() results are kept in a
+   per-server cache; see evhttp_set_static_cache_size().
+
+   @param http the evhttp server object
+   @param prefix the URI path prefix to serve, e.g. "/static/"
+   @param docroot the directory to serve files from
+   @return 0 on success, -1 if the prefix is already in use or on failure
+   @see evhttp_del_static_dir()
+*/
+int evhttp_set_static_dir(struct evhttp *http, const char *prefix,
+    const char *docroot);
+
+/** Stops serving files for a prefix set with evhttp_set_static_dir() */
+int evhttp_del_static_dir(struct evhttp *http, const char *prefix);
+
+/**
+   Set how many open files the static file handler may cache.
+
+   When the limit is exceeded, the least recently used file is closed.
+   Cached entries are re-validated with stat() at most once per second,
+   so replaced or modified files are picked up quickly.  A limit of 0
+   disables caching.  The default is 64.
+
+   @param http the evhttp server object
+   @param max_files the maximum number of files to keep open
+*/
+void evhttp_set_static_cache_size(struct evhttp *http, unsigned max_files);
+
+/**
+   Compress responses for clients that accept it.
+
+   Once enabled, bodies sent with evhttp_send_reply() or streamed with
+   evhttp_send_reply_start()/evhttp_send_reply_chunk()/evhttp_send_reply_end()
+   are gzip or deflate encoded according to the request's Accept-Encoding
+   header: whichever of the two it gives the higher q-value, or gzip if
+   it likes both as much.  Each chunk of a streamed body is flushed through the compressor,
+   so clients see it without delay.
+
+   Responses that already have a Content-Encoding, partial content,
+   media types that are compressed already (images, audio, video and
+   archives), streamed responses with an explicit Content-Length and
+   complete bodies shorter than min_size are sent unchanged.
+
+   @param http the evhttp server object
+   @param level the zlib compression level from 1 to 9, or -1 for zlib's
+      default; 0 turns compression off
+   @param min_size the smallest complete body that is worth compressing
+   @return 0 on success, -1 if the level is invalid or libevent was built
+      without zlib
+*/
+int evhttp_set_compression(struct evhttp *http, int level, size_t min_size);
+
 /**
    Adds a virtual host to the http server.
 
@@ -295,6 +426,21 @@ int evhttp_remove_server_alias(struct evhttp *http, const char *alias);
  */
 void evhttp_set_timeout(struct evhttp *http, int timeout_in_secs);
 
+/**
+ * Limit the number of connections the server keeps open.
+ *
+ * When a new connection would exceed the limit, the connection that has
+ * been waiting for a request for the longest time is closed to make room.
+ * If every connection is busy with a request, the server stops accepting
+ * until one of them goes away.  Running out of file descriptors while
+ * accepting is handled the same way, with or without a limit.
+ *
+ * @param http an evhttp object
+ * @param max_connections the maximum number of connections, or 0 for no
+ *   limit
+ */
+void evhttp_set_max_connections(struct evhttp *http, int max_connections);
+
 /* Request/Response functionality */
 
 /**
@@ -407,6 +553,26 @@ struct evhttp_request *evhttp_request_new(
 void evhttp_request_set_chunked_cb(struct evhttp_request *,
     void (*cb)(struct evhttp_request *, void *));
 
+/**
+   Apply flow control to the body data passed to a chunked callback.
+
+   Normally the input buffer is drained after every call of the chunked
+   callback.  Once a high-water mark is set, whatever the callback leaves
+   in the input buffer stays there, and evhttp stops reading the body
+   while the buffer holds highmark bytes or more.  Reading resumes, and
+   the chunked callback runs again, as soon as the buffer is drained
+   below highmark, e.g. with evbuffer_drain() once a slow consumer has
+   caught up.  The connection's read high-water mark is set to highmark
+   too, so at most about twice highmark bytes of body are held in memory.
+
+   @param req a request with a chunked callback
+   @param highmark the high-water mark in bytes, or 0 to drain the input
+     buffer after each callback again
+   @see evhttp_set_header_cb()
+*/
+void evhttp_request_set_body_watermark(struct evhttp_request *req,
+    size_t highmark);
+
 /** Frees the request object and removes associated events. */
 void evhttp_request_free(struct evhttp_request *req);
 
@@ -540,6 +706,10 @@ int evhttp_request_get_response_code(const struct evhttp_request *req);
 struct evkeyvalq *evhttp_request_get_input_headers(struct evhttp_request *req);
 /** Returns the output headers */
 struct evkeyvalq *evhttp_request_get_output_headers(struct evhttp_request *req);
+/** Returns the parameters of the route that matched the request, keyed by
+    the names of its ":name" and "*name" segments.  Use evhttp_find_header()
+    to look them up. */
+struct evkeyvalq *evhttp_request_get_route_params(struct evhttp_request *req);
 /** Returns the input buffer */
 struct evbuffer *evhttp_request_get_input_buffer(struct evhttp_request *req);
 /** Returns the output buffer */
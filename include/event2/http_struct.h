@@ -77,6 +77,8 @@ struct {
 #define EVHTTP_REQ_DEFER_FREE		0x0008
 /** The request should be freed upstack */
 #define EVHTTP_REQ_NEEDS_FREE		0x0010
+/** Reading the body waits for the chunked callback to drain input_buffer */
+#define EVHTTP_REQ_BODY_PAUSED		0x0020
 
 	struct evkeyvalq *input_headers;
 	struct evkeyvalq *output_headers;
@@ -120,6 +122,20 @@ struct {
 	 * the regular callback.
 	 */
 	void (*chunk_cb)(struct evhttp_request *, void *);
+
+	/*
+	 * If nonzero, data that chunk_cb leaves in input_buffer is kept,
+	 * and reading the body pauses while input_buffer holds this many
+	 * bytes or more.
+	 */
+	size_t body_highmark;
+
+	/* Deflate state of a response body that is compressed as it is
+	 * streamed out. */
+	struct evhttp_compressor *compressor;
+
+	/* values of the ":name" and "*name" segments of the matched route */
+	struct evkeyvalq *route_params;
 };
 
 #ifdef __cplusplus
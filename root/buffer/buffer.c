@@ -2056,6 +2056,13 @@ get_n_bytes_readable_on_socket(evutil_socket_t fd)
  * as howmuch? */
 int
 evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch)
+{
+	return _evbuffer_read(buf, fd, howmuch, EVBUFFER_MAX_READ);
+}
+
+int
+_evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch,
+    int max_read)
 {
 	struct evbuffer_chain **chainp;
 	int n;
@@ -2076,8 +2083,10 @@ evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch)
 	}
 
 	n = get_n_bytes_readable_on_socket(fd);
-	if (n <= 0 || n > EVBUFFER_MAX_READ)
+	if (n <= 0)
 		n = EVBUFFER_MAX_READ;
+	else if (n > max_read)
+		n = max_read;
 	if (howmuch < 0 || howmuch > n)
 		howmuch = n;
 
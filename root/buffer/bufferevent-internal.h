@@ -66,9 +66,18 @@ typedef ev_uint16_t bufferevent_suspend_flags;
 struct bufferevent_rate_limit_group {
 	/** List of all members in the group */
 	TAILQ_HEAD(rlim_group_member_list, bufferevent_private) members;
+	/** For reading ([0]) and writing ([1]): the members that are allowed
+	 * to use the group bucket, and the members waiting for their turn to
+	 * use it, in the order they will be woken.  Every member is on
+	 * exactly one of active[i] and waiting[i]. */
+	struct rlim_group_member_list active[2];
+	struct rlim_group_member_list waiting[2];
 	/** Current limits for the group. */
 	struct ev_token_bucket rate_limit;
 	struct ev_token_bucket_cfg rate_limit_cfg;
+	/** How full the bucket was for reading ([0]) and writing ([1]) right
+	 * after it last refilled; each member's share comes out of this. */
+	ev_ssize_t refill_level[2];
 
 	/** True iff we don't want to read from any member of the group.until
 	 * the token bucket refills.  */
@@ -94,6 +103,15 @@ struct bufferevent_rate_limit_group {
 
 	/** The number of bufferevents in the group. */
 	int n_members;
+	/** The number of bufferevents in the group and in every group below
+	 * it. */
+	int n_members_total;
+
+	/** The group that this group's members also draw from, or NULL. */
+	struct bufferevent_rate_limit_group *parent;
+	/** The groups whose parent is this group. */
+	TAILQ_HEAD(rlim_group_list, bufferevent_rate_limit_group) children;
+	TAILQ_ENTRY(bufferevent_rate_limit_group) next_sibling;
 
 	/** The smallest number of bytes that any member of the group should
 	 * be limited to read or write at a time. */
@@ -105,7 +123,9 @@ struct bufferevent_rate_limit_group {
 	struct event master_refill_event;
 	/** Lock to protect the members of this group.  This lock should nest
 	 * within every bufferevent lock: if you are holding this lock, do
-	 * not assume you can lock another bufferevent. */
+	 * not assume you can lock another bufferevent.  It nests within the
+	 * lock of the parent group, if any, and changing the parent also
+	 * takes a global lock outside all of these. */
 	void *lock;
 };
 
@@ -117,6 +137,13 @@ struct bufferevent_rate_limit {
 	 * Note that this field is supposed to be protected by the group
 	 * lock */
 	TAILQ_ENTRY(bufferevent_private) next_in_group;
+	/* Linked-list elements for the group's active or waiting queue, for
+	 * reading ([0]) and writing ([1]).  Also protected by the group
+	 * lock. */
+	TAILQ_ENTRY(bufferevent_private) next_in_queue[2];
+	/* True iff we are on the group's waiting queue for reading ([0]) or
+	 * writing ([1]). */
+	unsigned waiting[2];
 	/** The rate-limiting group for this bufferevent, or NULL if it is
 	 * only rate-limited on its own. */
 	struct bufferevent_rate_limit_group *group;
@@ -130,6 +157,9 @@ struct bufferevent_rate_limit {
 	/* Timeout event used when one this bufferevent's buckets are
 	 * empty. */
 	struct event refill_bucket_event;
+	/* cfg->tick_timeout, as a common timeout on our event_base if we
+	 * could get one. */
+	const struct timeval *tick_timeout;
 };
 
 /** Parts of the bufferevent structure that are shared among all bufferevent
@@ -191,8 +221,29 @@ struct bufferevent_private {
 
 	/** Rate-limiting information for this bufferevent */
 	struct bufferevent_rate_limit *rate_limiting;
+
+	/** The most we will read in a single read operation, no matter how
+	 * big our buckets get. */
+	ev_ssize_t max_single_read;
+	/** The most we will write in a single write operation, no matter how
+	 * big our buckets get. */
+	ev_ssize_t max_single_write;
+	/** Flag: set if max_single_write should follow the socket's send
+	 * buffer size; see bufferevent_socket_set_write_autosize(). */
+	unsigned write_autosize : 1;
+	/** Flag: set if max_single_read was chosen for this bufferevent or
+	 * its event_base.  Until then, a socket read is no bigger than
+	 * evbuffer_read() would make it. */
+	unsigned max_single_read_set : 1;
 };
 
+/** How much a bufferevent reads in a single operation unless told
+ * otherwise. */
+#define MAX_SINGLE_READ_DEFAULT 16384
+/** How much a bufferevent writes in a single operation unless told
+ * otherwise. */
+#define MAX_SINGLE_WRITE_DEFAULT 16384
+
 /** Possible operations for a control callback. */
 enum bufferevent_ctrl_op {
 	BEV_CTRL_SET_FD,
@@ -257,10 +308,12 @@ struct bufferevent_ops {
 extern const struct bufferevent_ops bufferevent_ops_socket;
 extern const struct bufferevent_ops bufferevent_ops_filter;
 extern const struct bufferevent_ops bufferevent_ops_pair;
+extern const struct bufferevent_ops bufferevent_ops_xpair;
 
 #define BEV_IS_SOCKET(bevp) ((bevp)->be_ops == &bufferevent_ops_socket)
 #define BEV_IS_FILTER(bevp) ((bevp)->be_ops == &bufferevent_ops_filter)
 #define BEV_IS_PAIR(bevp) ((bevp)->be_ops == &bufferevent_ops_pair)
+#define BEV_IS_XPAIR(bevp) ((bevp)->be_ops == &bufferevent_ops_xpair)
 
 #ifdef WIN32
 extern const struct bufferevent_ops bufferevent_ops_async;
@@ -402,6 +455,13 @@ int _bufferevent_decrement_read_buckets(struct bufferevent_private *bev,
 ev_ssize_t _bufferevent_get_read_max(struct bufferevent_private *bev);
 ev_ssize_t _bufferevent_get_write_max(struct bufferevent_private *bev);
 
+/** Return the default most that new bufferevents on base write in one
+ * operation if is_write, or read otherwise, or 0 if nobody has set one. */
+size_t event_base_get_bev_max_single(struct event_base *base, int is_write);
+/** Set the value that event_base_get_bev_max_single() returns. */
+void event_base_set_bev_max_single(struct event_base *base, int is_write,
+    size_t size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -268,6 +268,20 @@ _bufferevent_run_eventcb(struct bufferevent *bufev, short what)
 	}
 }
 
+/** Return the most a new bufferevent on <b>base</b> should write in a single
+ * operation if is_write, or read otherwise. */
+static ev_ssize_t
+_bufferevent_default_max_single(struct event_base *base, int is_write)
+{
+	size_t size = base ? event_base_get_bev_max_single(base, is_write) : 0;
+	if (size == 0)
+		return is_write ? MAX_SINGLE_WRITE_DEFAULT :
+		    MAX_SINGLE_READ_DEFAULT;
+	if (size > EV_SSIZE_MAX)
+		return EV_SSIZE_MAX;
+	return (ev_ssize_t)size;
+}
+
 int
 bufferevent_init_common(struct bufferevent_private *bufev_private,
     struct event_base *base,
@@ -333,6 +347,12 @@ bufferevent_init_common(struct bufferevent_private *bufev_private,
 	}
 
 	bufev_private->options = options;
+	bufev_private->max_single_read =
+	    _bufferevent_default_max_single(base, 0);
+	bufev_private->max_single_read_set =
+	    base && event_base_get_bev_max_single(base, 0) != 0;
+	bufev_private->max_single_write =
+	    _bufferevent_default_max_single(base, 1);
 
 	evbuffer_set_parent(bufev->input, bufev);
 	evbuffer_set_parent(bufev->output, bufev);
@@ -788,6 +808,79 @@ bufferevent_get_underlying(struct bufferevent *bev)
 	return (res<0) ? NULL : d.ptr;
 }
 
+int
+bufferevent_set_max_single_read(struct bufferevent *bev, size_t size)
+{
+	struct bufferevent_private *bevp = BEV_UPCAST(bev);
+	BEV_LOCK(bev);
+	if (size == 0) {
+		bevp->max_single_read =
+		    _bufferevent_default_max_single(bev->ev_base, 0);
+		bevp->max_single_read_set = bev->ev_base &&
+		    event_base_get_bev_max_single(bev->ev_base, 0) != 0;
+	} else if (size > EV_SSIZE_MAX) {
+		bevp->max_single_read = EV_SSIZE_MAX;
+		bevp->max_single_read_set = 1;
+	} else {
+		bevp->max_single_read = (ev_ssize_t)size;
+		bevp->max_single_read_set = 1;
+	}
+	BEV_UNLOCK(bev);
+	return 0;
+}
+
+int
+bufferevent_set_max_single_write(struct bufferevent *bev, size_t size)
+{
+	struct bufferevent_private *bevp = BEV_UPCAST(bev);
+	BEV_LOCK(bev);
+	/* An explicit size overrides any automatic sizing. */
+	bevp->write_autosize = 0;
+	if (size == 0)
+		bevp->max_single_write =
+		    _bufferevent_default_max_single(bev->ev_base, 1);
+	else if (size > EV_SSIZE_MAX)
+		bevp->max_single_write = EV_SSIZE_MAX;
+	else
+		bevp->max_single_write = (ev_ssize_t)size;
+	BEV_UNLOCK(bev);
+	return 0;
+}
+
+ev_ssize_t
+bufferevent_get_max_single_read(struct bufferevent *bev)
+{
+	ev_ssize_t r;
+	BEV_LOCK(bev);
+	r = BEV_UPCAST(bev)->max_single_read;
+	BEV_UNLOCK(bev);
+	return r;
+}
+
+ev_ssize_t
+bufferevent_get_max_single_write(struct bufferevent *bev)
+{
+	ev_ssize_t r;
+	BEV_LOCK(bev);
+	r = BEV_UPCAST(bev)->max_single_write;
+	BEV_UNLOCK(bev);
+	return r;
+}
+
+int
+bufferevent_base_set_max_single_read(struct event_base *base, size_t size)
+{
+	event_base_set_bev_max_single(base, 0, size);
+	return 0;
+}
+
+int
+bufferevent_base_set_max_single_write(struct event_base *base, size_t size)
+{
+	event_base_set_bev_max_single(base, 1, size);
+	return 0;
+}
+
 static void
 bufferevent_generic_read_timeout_cb(evutil_socket_t fd, short event, void *ctx)
 {
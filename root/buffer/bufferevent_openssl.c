@@ -53,13 +53,59 @@
 #include "event2/buffer.h"
 #include "event2/event.h"
 
+#include "event-internal.h"
 #include "mm-internal.h"
 #include "bufferevent-internal.h"
 #include "log-internal.h"
+#include "util-internal.h"
+#include "ht-internal.h"
 
 #include <openssl/bio.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+
+/* OpenSSL 3.0 and later can hand the session keys to the kernel (kTLS) once
+ * the handshake is done. */
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send) && \
+    defined(BIO_get_ktls_recv)
+#define HAVE_OPENSSL_KTLS
+#endif
+
+/* OpenSSL 1.1.0 made BIO and BIO_METHOD opaque.  Give older versions the
+ * accessors that newer ones require us to use. */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static BIO_METHOD *
+BIO_meth_new(int type, const char *name)
+{
+	BIO_METHOD *biom = calloc(1, sizeof(BIO_METHOD));
+
+	if (biom != NULL) {
+		biom->type = type;
+		biom->name = name;
+	}
+	return biom;
+}
+
+#define BIO_meth_set_write(b, f) ((b)->bwrite = (f))
+#define BIO_meth_set_read(b, f) ((b)->bread = (f))
+#define BIO_meth_set_puts(b, f) ((b)->bputs = (f))
+#define BIO_meth_set_ctrl(b, f) ((b)->ctrl = (f))
+#define BIO_meth_set_create(b, f) ((b)->create = (f))
+#define BIO_meth_set_destroy(b, f) ((b)->destroy = (f))
+
+#define BIO_set_init(b, val) ((b)->init = (val))
+#define BIO_get_init(b) ((b)->init)
+#define BIO_set_data(b, val) ((b)->ptr = (val))
+#define BIO_get_data(b) ((b)->ptr)
+#define BIO_set_shutdown(b, val) ((b)->shutdown = (val))
+#define BIO_get_shutdown(b) ((b)->shutdown)
+#endif
 
 /*
  * Define an OpenSSL bio that targets a bufferevent.
@@ -103,10 +149,9 @@ print_err(int val)
 static int
 bio_bufferevent_new(BIO *b)
 {
-	b->init = 0;
-	b->num = -1;
-	b->ptr = NULL; /* We'll be putting the bufferevent in this field.*/
-	b->flags = 0;
+	BIO_set_init(b, 0);
+	BIO_set_data(b, NULL); /* We'll be putting the bufferevent in this field.*/
+	BIO_clear_flags(b, ~0);
 	return 1;
 }
 
@@ -116,12 +161,12 @@ bio_bufferevent_free(BIO *b)
 {
 	if (!b)
 		return 0;
-	if (b->shutdown) {
-		if (b->init && b->ptr)
-			bufferevent_free(b->ptr);
-		b->init = 0;
-		b->flags = 0;
-		b->ptr = NULL;
+	if (BIO_get_shutdown(b)) {
+		if (BIO_get_init(b) && BIO_get_data(b))
+			bufferevent_free(BIO_get_data(b));
+		BIO_set_init(b, 0);
+		BIO_clear_flags(b, ~0);
+		BIO_set_data(b, NULL);
 	}
 	return 1;
 }
@@ -137,10 +182,10 @@ bio_bufferevent_read(BIO *b, char *out, int outlen)
 
 	if (!out)
 		return 0;
-	if (!b->ptr)
+	if (!BIO_get_data(b))
 		return -1;
 
-	input = bufferevent_get_input(b->ptr);
+	input = bufferevent_get_input(BIO_get_data(b));
 	if (evbuffer_get_length(input) == 0) {
 		/* If there's no data to read, say so. */
 		BIO_set_retry_read(b);
@@ -156,13 +201,13 @@ bio_bufferevent_read(BIO *b, char *out, int outlen)
 static int
 bio_bufferevent_write(BIO *b, const char *in, int inlen)
 {
-	struct bufferevent *bufev = b->ptr;
+	struct bufferevent *bufev = BIO_get_data(b);
 	struct evbuffer *output;
 	size_t outlen;
 
 	BIO_clear_retry_flags(b);
 
-	if (!b->ptr)
+	if (!bufev)
 		return -1;
 
 	output = bufferevent_get_output(bufev);
@@ -188,15 +233,15 @@ bio_bufferevent_write(BIO *b, const char *in, int inlen)
 static long
 bio_bufferevent_ctrl(BIO *b, int cmd, long num, void *ptr)
 {
-	struct bufferevent *bufev = b->ptr;
+	struct bufferevent *bufev = BIO_get_data(b);
 	long ret = 1;
 
 	switch (cmd) {
 	case BIO_CTRL_GET_CLOSE:
-		ret = b->shutdown;
+		ret = BIO_get_shutdown(b);
 		break;
 	case BIO_CTRL_SET_CLOSE:
-		b->shutdown = (int)num;
+		BIO_set_shutdown(b, (int)num);
 		break;
 	case BIO_CTRL_PENDING:
 		ret = evbuffer_get_length(bufferevent_get_input(bufev)) != 0;
@@ -224,24 +269,25 @@ bio_bufferevent_puts(BIO *b, const char *s)
 	return bio_bufferevent_write(b, s, strlen(s));
 }
 
-/* Method table for the bufferevent BIO */
-static BIO_METHOD methods_bufferevent = {
-	BIO_TYPE_LIBEVENT, "bufferevent",
-	bio_bufferevent_write,
-	bio_bufferevent_read,
-	bio_bufferevent_puts,
-	NULL /* bio_bufferevent_gets */,
-	bio_bufferevent_ctrl,
-	bio_bufferevent_new,
-	bio_bufferevent_free,
-	NULL /* callback_ctrl */,
-};
+/* Method table for the bufferevent BIO; built the first time it's needed. */
+static BIO_METHOD *methods_bufferevent;
 
 /* Return the method table for the bufferevents BIO */
 static BIO_METHOD *
 BIO_s_bufferevent(void)
 {
-	return &methods_bufferevent;
+	if (methods_bufferevent == NULL) {
+		methods_bufferevent = BIO_meth_new(BIO_TYPE_LIBEVENT, "bufferevent");
+		if (methods_bufferevent == NULL)
+			return NULL;
+		BIO_meth_set_write(methods_bufferevent, bio_bufferevent_write);
+		BIO_meth_set_read(methods_bufferevent, bio_bufferevent_read);
+		BIO_meth_set_puts(methods_bufferevent, bio_bufferevent_puts);
+		BIO_meth_set_ctrl(methods_bufferevent, bio_bufferevent_ctrl);
+		BIO_meth_set_create(methods_bufferevent, bio_bufferevent_new);
+		BIO_meth_set_destroy(methods_bufferevent, bio_bufferevent_free);
+	}
+	return methods_bufferevent;
 }
 
 /* Create a new BIO to wrap communication around a bufferevent.  If close_flag
@@ -250,13 +296,16 @@ static BIO *
 BIO_new_bufferevent(struct bufferevent *bufferevent, int close_flag)
 {
 	BIO *result;
+	BIO_METHOD *meth;
 	if (!bufferevent)
 		return NULL;
-	if (!(result = BIO_new(BIO_s_bufferevent())))
+	if (!(meth = BIO_s_bufferevent()))
+		return NULL;
+	if (!(result = BIO_new(meth)))
 		return NULL;
-	result->init = 1;
-	result->ptr = bufferevent;
-	result->shutdown = close_flag ? 1 : 0;
+	BIO_set_init(result, 1);
+	BIO_set_data(result, bufferevent);
+	BIO_set_shutdown(result, close_flag ? 1 : 0);
 	return result;
 }
 
@@ -318,9 +367,36 @@ struct bufferevent_openssl {
 	unsigned fd_is_set : 1;
 	/* XXX */
 	unsigned n_errors : 2;
+	/* Set if the kernel is encrypting what we write to the socket, so we
+	   can write plaintext to it directly. */
+	unsigned ktls_send : 1;
+	/* Set if the kernel is decrypting what we read from the socket, so we
+	   can read plaintext from it directly. */
+	unsigned ktls_recv : 1;
 
 	/* Are we currently connecting, accepting, or doing IO? */
 	unsigned state : 2;
+
+	/* If set, a function that runs the steps of our handshake on some
+	   other thread, and the argument to pass it. */
+	bufferevent_ssl_offload_cb handshake_work_fn;
+	void *handshake_work_arg;
+	/* Activated by the worker thread when it's done with a step of the
+	   handshake. */
+	struct event handshake_done_ev;
+	/* What the worker's SSL_do_handshake returned, what SSL_get_error
+	   said about that, and the errors OpenSSL queued on its thread. */
+	int handshake_r;
+	int handshake_err;
+	ev_uint32_t handshake_errors[NUM_ERRORS];
+	unsigned n_handshake_errors : 2;
+	/* Set while a worker thread owns our SSL. */
+	unsigned handshake_busy : 1;
+
+	/* If set, a cache of client sessions to resume from and to remember
+	   our session in, under the key session_key ("host:port"). */
+	struct bufferevent_openssl_session_cache *session_cache;
+	char *session_key;
 };
 
 static int be_openssl_enable(struct bufferevent *, short);
@@ -330,6 +406,7 @@ static int be_openssl_adj_timeouts(struct bufferevent *);
 static int be_openssl_flush(struct bufferevent *bufev,
     short iotype, enum bufferevent_flush_mode mode);
 static int be_openssl_ctrl(struct bufferevent *, enum bufferevent_ctrl_op, union bufferevent_ctrl_data *);
+static void remember_session(struct bufferevent_openssl *bev_ssl);
 
 const struct bufferevent_ops bufferevent_ops_openssl = {
 	"ssl",
@@ -560,6 +637,95 @@ decrement_buckets(struct bufferevent_openssl *bev_ssl)
 #define OP_BLOCKED 2
 #define OP_ERR 4
 
+/* Note whether OpenSSL has installed our session keys in the socket with
+ * kTLS.  Call whenever the handshake finishes or the fd changes. */
+static void
+check_ktls(struct bufferevent_openssl *bev_ssl)
+{
+	bev_ssl->ktls_send = bev_ssl->ktls_recv = 0;
+#ifdef HAVE_OPENSSL_KTLS
+	if (bev_ssl->underlying || !bev_ssl->fd_is_set ||
+	    bev_ssl->state != BUFFEREVENT_SSL_OPEN)
+		return;
+	if (BIO_get_ktls_send(SSL_get_wbio(bev_ssl->ssl)))
+		bev_ssl->ktls_send = 1;
+	if (BIO_get_ktls_recv(SSL_get_rbio(bev_ssl->ssl)))
+		bev_ssl->ktls_recv = 1;
+#endif
+}
+
+#ifdef HAVE_OPENSSL_KTLS
+/* Read plaintext straight from a socket that the kernel decrypts for us.
+   Return a bitmask as for do_read(), or -1 if the next record isn't
+   application data, and so must go through SSL_read(). */
+static int
+do_read_ktls(struct bufferevent_openssl *bev_ssl, int n_to_read)
+{
+	/* Requires lock */
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+	evutil_socket_t fd = event_get_fd(&bev->ev_read);
+	int r, err;
+
+	r = evbuffer_read(bev->input, fd, n_to_read);
+	if (r > 0) {
+		if (bev_ssl->read_blocked_on_write)
+			if (clear_rbow(bev_ssl) < 0)
+				return OP_ERR | OP_MADE_PROGRESS;
+		_bufferevent_decrement_read_buckets(&bev_ssl->bev, r);
+		return OP_MADE_PROGRESS;
+	} else if (r == 0) {
+		/* The connection closed without a close_notify alert. */
+		conn_closed(bev_ssl, SSL_ERROR_SYSCALL, 0);
+		return OP_BLOCKED;
+	}
+
+	err = evutil_socket_geterror(fd);
+	if (EVUTIL_ERR_RW_RETRIABLE(err))
+		return OP_BLOCKED;
+	/* The kernel won't hand us alerts or handshake messages through a
+	   plain read. */
+	if (err == EIO)
+		return -1;
+	conn_closed(bev_ssl, SSL_ERROR_SYSCALL, r);
+	return OP_BLOCKED;
+}
+
+/* Write plaintext straight to a socket that the kernel encrypts for us,
+   so that file segments in the output buffer can go out with sendfile.
+   Return a bitmask as for do_write(). */
+static int
+do_write_ktls(struct bufferevent_openssl *bev_ssl, int atmost)
+{
+	/* Requires lock */
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+	struct evbuffer *output = bev->output;
+	evutil_socket_t fd = event_get_fd(&bev->ev_write);
+	int r, err;
+
+	if (bev_ssl->bev.write_suspended)
+		return 0;
+
+	r = evbuffer_write_atmost(output, fd, atmost);
+	if (r > 0) {
+		if (bev_ssl->write_blocked_on_read)
+			if (clear_wbor(bev_ssl) < 0)
+				return OP_ERR | OP_MADE_PROGRESS;
+		_bufferevent_decrement_write_buckets(&bev_ssl->bev, r);
+		if (evbuffer_get_length(output) <= bev->wm_write.low)
+			_bufferevent_run_writecb(bev);
+		return OP_MADE_PROGRESS;
+	} else if (r == 0) {
+		return OP_BLOCKED;
+	}
+
+	err = evutil_socket_geterror(fd);
+	if (EVUTIL_ERR_RW_RETRIABLE(err))
+		return OP_BLOCKED;
+	conn_closed(bev_ssl, SSL_ERROR_SYSCALL, r);
+	return OP_BLOCKED;
+}
+#endif
+
 /* Return a bitmask of OP_MADE_PROGRESS (if we read anything); OP_BLOCKED (if
    we're now blocked); and OP_ERR (if an error occurred). */
 static int
@@ -578,45 +744,68 @@ do_read(struct bufferevent_openssl *bev_ssl, int n_to_read) {
 	if (n_to_read > atmost)
 		n_to_read = atmost;
 
+#ifdef HAVE_OPENSSL_KTLS
+	if (bev_ssl->ktls_recv && !SSL_pending(bev_ssl->ssl)) {
+		r = do_read_ktls(bev_ssl, n_to_read);
+		if (r >= 0)
+			return r;
+		/* Otherwise, let OpenSSL handle the next record. */
+	}
+#endif
+
 	n = evbuffer_reserve_space(input, n_to_read, space, 2);
 	if (n < 0)
 		return OP_ERR;
 
 	for (i=0; i<n; ++i) {
-		if (bev_ssl->bev.read_suspended)
-			break;
-		r = SSL_read(bev_ssl->ssl, space[i].iov_base, space[i].iov_len);
-		if (r>0) {
-			result |= OP_MADE_PROGRESS;
-			if (bev_ssl->read_blocked_on_write)
-				if (clear_rbow(bev_ssl) < 0)
-					return OP_ERR | result;
-			++n_used;
-			space[i].iov_len = r;
-			decrement_buckets(bev_ssl);
-		} else {
-			int err = SSL_get_error(bev_ssl->ssl, r);
-			print_err(err);
-			switch (err) {
-			case SSL_ERROR_WANT_READ:
-				/* Can't read until underlying has more data. */
+		size_t got = 0;
+		/* Keep filling this extent until it's full, so that a record
+		 * which ends partway through it doesn't waste the rest. */
+		while (got < space[i].iov_len) {
+			if (bev_ssl->bev.read_suspended)
+				break;
+			r = SSL_read(bev_ssl->ssl, (char*)space[i].iov_base + got,
+			    space[i].iov_len - got);
+			if (r>0) {
+				result |= OP_MADE_PROGRESS;
 				if (bev_ssl->read_blocked_on_write)
 					if (clear_rbow(bev_ssl) < 0)
 						return OP_ERR | result;
-				break;
-			case SSL_ERROR_WANT_WRITE:
-				/* This read operation requires a write, and the
-				 * underlying is full */
-				if (!bev_ssl->read_blocked_on_write)
-					if (set_rbow(bev_ssl) < 0)
-						return OP_ERR | result;
-				break;
-			default:
-				conn_closed(bev_ssl, err, r);
-				break;
+				got += r;
+				decrement_buckets(bev_ssl);
+			} else {
+				int err = SSL_get_error(bev_ssl->ssl, r);
+				print_err(err);
+				switch (err) {
+				case SSL_ERROR_WANT_READ:
+					/* Can't read until underlying has more
+					 * data. */
+					if (bev_ssl->read_blocked_on_write)
+						if (clear_rbow(bev_ssl) < 0)
+							return OP_ERR | result;
+					break;
+				case SSL_ERROR_WANT_WRITE:
+					/* This read operation requires a write,
+					 * and the underlying is full */
+					if (!bev_ssl->read_blocked_on_write)
+						if (set_rbow(bev_ssl) < 0)
+							return OP_ERR | result;
+					break;
+				default:
+					conn_closed(bev_ssl, err, r);
+					break;
+				}
+				result |= OP_BLOCKED;
+				break; /* out of the loop */
 			}
-			result |= OP_BLOCKED;
-			break; /* out of the loop */
+		}
+		if (got == 0)
+			break;
+		++n_used;
+		/* Only the last extent we commit may be partly filled. */
+		if (got < space[i].iov_len) {
+			space[i].iov_len = got;
+			break;
 		}
 	}
 
@@ -645,6 +834,13 @@ do_write(struct bufferevent_openssl *bev_ssl, int atmost)
 	else
 		atmost = _bufferevent_get_write_max(&bev_ssl->bev);
 
+#ifdef HAVE_OPENSSL_KTLS
+	/* If an SSL_write is waiting to be retried, OpenSSL still holds part
+	   of a record; finish it before bypassing OpenSSL. */
+	if (bev_ssl->ktls_send && bev_ssl->last_write <= 0)
+		return do_write_ktls(bev_ssl, atmost);
+#endif
+
 	n = evbuffer_peek(output, atmost, NULL, space, 8);
 	if (n < 0)
 		return OP_ERR | result;
@@ -712,7 +908,9 @@ do_write(struct bufferevent_openssl *bev_ssl, int atmost)
 
 #define WRITE_FRAME 15000
 
-#define READ_DEFAULT 4096
+/* Read a whole TLS record's worth of plaintext at a time, so that one
+ * SSL_read can hand over everything a record decrypts to. */
+#define READ_DEFAULT SSL3_RT_MAX_PLAIN_LENGTH
 
 /* Try to figure out how many bytes to read; return 0 if we shouldn't be
  * reading. */
@@ -744,8 +942,15 @@ bytes_to_read(struct bufferevent_openssl *bev)
 		}
 
 		result = wm->high - evbuffer_get_length(input);
+	} else if (bev->ktls_recv) {
+		/* We read straight from the socket; take as much as the
+		 * bufferevent will allow. */
+		result = _bufferevent_get_read_max(&bev->bev);
 	} else {
-		result = READ_DEFAULT;
+		/* Take a whole record, or everything OpenSSL has already
+		 * decrypted if that's more. */
+		int pending = SSL_pending(bev->ssl);
+		result = pending > READ_DEFAULT ? pending : READ_DEFAULT;
 	}
 
 	/* Respect the rate limit */
@@ -988,26 +1193,18 @@ set_open_callbacks(struct bufferevent_openssl *bev_ssl, evutil_socket_t fd)
 	}
 }
 
+/* Act on the result of a step of the handshake: r is what SSL_do_handshake
+   returned, and err is what SSL_get_error said about it. */
 static int
-do_handshake(struct bufferevent_openssl *bev_ssl)
+finish_handshake(struct bufferevent_openssl *bev_ssl, int r, int err)
 {
-	int r;
-
-	switch (bev_ssl->state) {
-	default:
-	case BUFFEREVENT_SSL_OPEN:
-		EVUTIL_ASSERT(0);
-		return -1;
-	case BUFFEREVENT_SSL_CONNECTING:
-	case BUFFEREVENT_SSL_ACCEPTING:
-		r = SSL_do_handshake(bev_ssl->ssl);
-		break;
-	}
 	decrement_buckets(bev_ssl);
 
 	if (r==1) {
 		/* We're done! */
 		bev_ssl->state = BUFFEREVENT_SSL_OPEN;
+		remember_session(bev_ssl);
+		check_ktls(bev_ssl);
 		set_open_callbacks(bev_ssl, -1); /* XXXX handle failure */
 		/* Call do_read and do_write as needed */
 		bufferevent_enable(&bev_ssl->bev.bev, bev_ssl->bev.bev.enabled);
@@ -1015,7 +1212,6 @@ do_handshake(struct bufferevent_openssl *bev_ssl)
 		    BEV_EVENT_CONNECTED);
 		return 1;
 	} else {
-		int err = SSL_get_error(bev_ssl->ssl, r);
 		print_err(err);
 		switch (err) {
 		case SSL_ERROR_WANT_WRITE:
@@ -1037,6 +1233,92 @@ do_handshake(struct bufferevent_openssl *bev_ssl)
 	}
 }
 
+/* Run one step of an offloaded handshake.  This happens on a worker
+   thread, which owns the SSL until it activates handshake_done_ev. */
+static void
+handshake_work(void *arg)
+{
+	struct bufferevent_openssl *bev_ssl = arg;
+	unsigned long err;
+	int r;
+
+	r = SSL_do_handshake(bev_ssl->ssl);
+	bev_ssl->handshake_r = r;
+	bev_ssl->handshake_err = (r == 1) ? SSL_ERROR_NONE :
+	    SSL_get_error(bev_ssl->ssl, r);
+	/* OpenSSL's error queue is per-thread; carry ours back with us. */
+	bev_ssl->n_handshake_errors = 0;
+	while ((err = ERR_get_error())) {
+		if (bev_ssl->n_handshake_errors < NUM_ERRORS)
+			bev_ssl->handshake_errors[
+			    bev_ssl->n_handshake_errors++] = err;
+	}
+	event_active(&bev_ssl->handshake_done_ev, EV_TIMEOUT, 1);
+}
+
+/* Called in the event loop once an offloaded handshake step is done. */
+static void
+be_openssl_handshake_done_cb(evutil_socket_t fd, short what, void *ptr)
+{
+	struct bufferevent_openssl *bev_ssl = ptr;
+	unsigned i;
+
+	BEV_LOCK(&bev_ssl->bev.bev);
+	bev_ssl->handshake_busy = 0;
+	event_base_del_virtual(bev_ssl->bev.bev.ev_base);
+	for (i = 0; i < bev_ssl->n_handshake_errors; ++i)
+		put_error(bev_ssl, bev_ssl->handshake_errors[i]);
+	bev_ssl->n_handshake_errors = 0;
+	finish_handshake(bev_ssl, bev_ssl->handshake_r,
+	    bev_ssl->handshake_err);
+	/* Drop the reference we took when handing the SSL over. */
+	_bufferevent_decref_and_unlock(&bev_ssl->bev.bev);
+}
+
+/* Hand the next step of the handshake to a worker thread. */
+static int
+offload_handshake(struct bufferevent_openssl *bev_ssl)
+{
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+
+	if (bev_ssl->handshake_busy)
+		return 0;
+	bev_ssl->handshake_busy = 1;
+	/* Nobody else may touch the SSL until the worker is done with it.
+	 * finish_handshake() decides what to wait for next. */
+	event_del(&bev->ev_read);
+	event_del(&bev->ev_write);
+	/* With those gone, keep the loop from deciding it has nothing left
+	 * to wait for while the worker runs. */
+	event_base_add_virtual(bev->ev_base);
+	bufferevent_incref(bev);
+	bev_ssl->handshake_work_fn(handshake_work, bev_ssl,
+	    bev_ssl->handshake_work_arg);
+	return 0;
+}
+
+static int
+do_handshake(struct bufferevent_openssl *bev_ssl)
+{
+	int r;
+
+	switch (bev_ssl->state) {
+	default:
+	case BUFFEREVENT_SSL_OPEN:
+		EVUTIL_ASSERT(0);
+		return -1;
+	case BUFFEREVENT_SSL_CONNECTING:
+	case BUFFEREVENT_SSL_ACCEPTING:
+		if (bev_ssl->handshake_work_fn)
+			return offload_handshake(bev_ssl);
+		r = SSL_do_handshake(bev_ssl->ssl);
+		break;
+	}
+
+	return finish_handshake(bev_ssl, r,
+	    r == 1 ? SSL_ERROR_NONE : SSL_get_error(bev_ssl->ssl, r));
+}
+
 static void
 be_openssl_handshakecb(struct bufferevent *bev_base, void *ctx)
 {
@@ -1094,6 +1376,9 @@ bufferevent_ssl_renegotiate(struct bufferevent *bev)
 	struct bufferevent_openssl *bev_ssl = upcast(bev);
 	if (!bev_ssl)
 		return -1;
+	/* The kernel can't take new keys for a kTLS socket. */
+	if (bev_ssl->ktls_send || bev_ssl->ktls_recv)
+		return -1;
 	if (SSL_renegotiate(bev_ssl->ssl) < 0)
 		return -1;
 	bev_ssl->state = BUFFEREVENT_SSL_CONNECTING;
@@ -1177,6 +1462,16 @@ be_openssl_destruct(struct bufferevent *bev)
 {
 	struct bufferevent_openssl *bev_ssl = upcast(bev);
 
+	/* TLS 1.3 servers send their tickets after the handshake, so we may
+	 * have a better session to remember now than we did then. */
+	if (bev_ssl->session_cache) {
+		if (bev_ssl->state == BUFFEREVENT_SSL_OPEN)
+			remember_session(bev_ssl);
+		mm_free(bev_ssl->session_key);
+		bev_ssl->session_key = NULL;
+		bev_ssl->session_cache = NULL;
+	}
+
 	if (bev_ssl->underlying) {
 		_bufferevent_del_generic_timeout_cbs(bev);
 	} else {
@@ -1245,13 +1540,14 @@ be_openssl_ctrl(struct bufferevent *bev,
 	struct bufferevent_openssl *bev_ssl = upcast(bev);
 	switch (op) {
 	case BEV_CTRL_SET_FD:
-		if (bev_ssl->underlying)
+		if (bev_ssl->underlying || bev_ssl->handshake_busy)
 			return -1;
 		{
 			BIO *bio;
 			bio = BIO_new_socket(data->fd, 0);
 			SSL_set_bio(bev_ssl->ssl, bio, bio);
 			bev_ssl->fd_is_set = 1;
+			check_ktls(bev_ssl);
 		}
 		if (bev_ssl->state == BUFFEREVENT_SSL_OPEN)
 			return set_open_callbacks(bev_ssl, data->fd);
@@ -1346,6 +1642,7 @@ bufferevent_openssl_new_impl(struct event_base *base,
 	case BUFFEREVENT_SSL_OPEN:
 		if (set_open_callbacks(bev_ssl, fd) < 0)
 			goto err;
+		check_ktls(bev_ssl);
 		break;
 	default:
 		goto err;
@@ -1452,3 +1749,501 @@ bufferevent_get_openssl_error(struct bufferevent *bev)
 	BEV_UNLOCK(bev);
 	return err;
 }
+
+int
+bufferevent_openssl_set_ktls(struct bufferevent *bev, int enable)
+{
+#ifdef HAVE_OPENSSL_KTLS
+	struct bufferevent_openssl *bev_ssl;
+	int r = -1;
+	BEV_LOCK(bev);
+	bev_ssl = upcast(bev);
+	if (!bev_ssl || bev_ssl->underlying ||
+	    bev_ssl->state == BUFFEREVENT_SSL_OPEN)
+		goto done;
+	/* OpenSSL installs the keys itself when the handshake is done, if
+	 * the kernel supports the negotiated cipher. */
+	if (enable)
+		SSL_set_options(bev_ssl->ssl, SSL_OP_ENABLE_KTLS);
+	else
+		SSL_clear_options(bev_ssl->ssl, SSL_OP_ENABLE_KTLS);
+	r = 0;
+done:
+	BEV_UNLOCK(bev);
+	return r;
+#else
+	return -1;
+#endif
+}
+
+short
+bufferevent_openssl_get_ktls(struct bufferevent *bev)
+{
+	struct bufferevent_openssl *bev_ssl;
+	short r = 0;
+	BEV_LOCK(bev);
+	bev_ssl = upcast(bev);
+	if (bev_ssl) {
+		if (bev_ssl->ktls_recv)
+			r |= EV_READ;
+		if (bev_ssl->ktls_send)
+			r |= EV_WRITE;
+	}
+	BEV_UNLOCK(bev);
+	return r;
+}
+
+/* ====================
+   Session resumption.
+
+   On the client side, a bufferevent_openssl_session_cache remembers the
+   last resumable session we got from each host:port, so that the next
+   connection there can skip the full handshake.  Entries expire after the
+   cache's lifetime or the session's own timeout, whichever comes first;
+   once max_entries are stored, the least recently used one is evicted.
+
+   On the server side, we just turn on OpenSSL's own in-process session
+   cache, and supply session ticket keys that we replace every so often.
+   ==================== */
+
+struct session_cache_entry {
+	HT_ENTRY(session_cache_entry) node;
+	/* Most recently used entries are at the head of the list. */
+	TAILQ_ENTRY(session_cache_entry) lru;
+	char *key; /* "host:port"; the text is appended to this structure */
+	SSL_SESSION *session;
+	time_t expires;
+};
+
+static unsigned
+session_cache_entry_hash(const struct session_cache_entry *ent)
+{
+	return ht_improve_hash(ht_string_hash(ent->key));
+}
+
+static int
+session_cache_entry_eq(const struct session_cache_entry *a,
+    const struct session_cache_entry *b)
+{
+	return !strcmp(a->key, b->key);
+}
+
+HT_HEAD(session_cache_map, session_cache_entry);
+HT_PROTOTYPE(session_cache_map, session_cache_entry, node,
+    session_cache_entry_hash, session_cache_entry_eq)
+HT_GENERATE(session_cache_map, session_cache_entry, node,
+    session_cache_entry_hash, session_cache_entry_eq,
+    0.5, mm_malloc, mm_realloc, mm_free)
+
+struct bufferevent_openssl_session_cache {
+	struct session_cache_map map;
+	TAILQ_HEAD(session_cache_lru, session_cache_entry) lru;
+	int max_entries;
+	int max_lifetime;
+	void *lock;
+};
+
+static time_t
+session_cache_now(void)
+{
+	struct timeval tv;
+	evutil_gettimeofday(&tv, NULL);
+	return tv.tv_sec;
+}
+
+static void
+session_cache_entry_free(struct bufferevent_openssl_session_cache *cache,
+    struct session_cache_entry *ent)
+{
+	HT_REMOVE(session_cache_map, &cache->map, ent);
+	TAILQ_REMOVE(&cache->lru, ent, lru);
+	SSL_SESSION_free(ent->session);
+	mm_free(ent);
+}
+
+/* Return the entry for key, or NULL if there is none.  Drops an expired
+ * entry rather than returning it.  Requires lock. */
+static struct session_cache_entry *
+session_cache_find(struct bufferevent_openssl_session_cache *cache,
+    const char *key)
+{
+	struct session_cache_entry find, *ent;
+	find.key = (char *)key;
+	ent = HT_FIND(session_cache_map, &cache->map, &find);
+	if (ent && ent->expires <= session_cache_now()) {
+		session_cache_entry_free(cache, ent);
+		ent = NULL;
+	}
+	return ent;
+}
+
+struct bufferevent_openssl_session_cache *
+bufferevent_openssl_session_cache_new(int max_entries, int max_lifetime)
+{
+	struct bufferevent_openssl_session_cache *cache;
+	if (max_entries <= 0 || max_lifetime <= 0)
+		return NULL;
+	if (!(cache = mm_calloc(1, sizeof(*cache))))
+		return NULL;
+	HT_INIT(session_cache_map, &cache->map);
+	TAILQ_INIT(&cache->lru);
+	cache->max_entries = max_entries;
+	cache->max_lifetime = max_lifetime;
+	EVTHREAD_ALLOC_LOCK(cache->lock, 0);
+	return cache;
+}
+
+void
+bufferevent_openssl_session_cache_free(
+	struct bufferevent_openssl_session_cache *cache)
+{
+	struct session_cache_entry *ent;
+	while ((ent = TAILQ_FIRST(&cache->lru)))
+		session_cache_entry_free(cache, ent);
+	HT_CLEAR(session_cache_map, &cache->map);
+	EVTHREAD_FREE_LOCK(cache->lock, 0);
+	mm_free(cache);
+}
+
+/* Store our SSL's session in our session cache, if it can be resumed. */
+static void
+remember_session(struct bufferevent_openssl *bev_ssl)
+{
+	struct bufferevent_openssl_session_cache *cache =
+	    bev_ssl->session_cache;
+	struct session_cache_entry *ent;
+	SSL_SESSION *session;
+	time_t now, expires;
+	long timeout;
+	size_t keylen;
+
+	if (!cache)
+		return;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	/* Keep a copy of our own: OpenSSL marks a connection's session
+	 * unresumable if the connection is freed without a clean shutdown,
+	 * which is how bufferevents are usually freed.  (Since TLS 1.1 an
+	 * unclean close needn't keep a session from being resumed.) */
+	if (!SSL_SESSION_is_resumable(SSL_get0_session(bev_ssl->ssl)))
+		return;
+	if (!(session = SSL_SESSION_dup(SSL_get0_session(bev_ssl->ssl))))
+		return;
+#else
+	if (!(session = SSL_get1_session(bev_ssl->ssl)))
+		return;
+#endif
+	/* The session runs out timeout seconds after it was made, not after
+	 * we got around to storing it; and we keep nothing past our own
+	 * limit. */
+	now = session_cache_now();
+	expires = now + cache->max_lifetime;
+	timeout = SSL_SESSION_get_timeout(session);
+	if (timeout > 0 &&
+	    (time_t)SSL_SESSION_get_time(session) + timeout < expires)
+		expires = (time_t)SSL_SESSION_get_time(session) + timeout;
+	if (expires <= now) {
+		SSL_SESSION_free(session);
+		return;
+	}
+
+	EVLOCK_LOCK(cache->lock, 0);
+	if ((ent = session_cache_find(cache, bev_ssl->session_key))) {
+		SSL_SESSION_free(ent->session);
+		TAILQ_REMOVE(&cache->lru, ent, lru);
+	} else {
+		keylen = strlen(bev_ssl->session_key);
+		if (!(ent = mm_malloc(sizeof(*ent) + keylen + 1))) {
+			EVLOCK_UNLOCK(cache->lock, 0);
+			SSL_SESSION_free(session);
+			return;
+		}
+		ent->key = (char *)(ent + 1);
+		memcpy(ent->key, bev_ssl->session_key, keylen + 1);
+		HT_INSERT(session_cache_map, &cache->map, ent);
+	}
+	ent->session = session;
+	ent->expires = expires;
+	TAILQ_INSERT_HEAD(&cache->lru, ent, lru);
+	while ((int)HT_SIZE(&cache->map) > cache->max_entries)
+		session_cache_entry_free(cache,
+		    TAILQ_LAST(&cache->lru, session_cache_lru));
+	EVLOCK_UNLOCK(cache->lock, 0);
+}
+
+int
+bufferevent_openssl_set_session_cache(struct bufferevent *bev,
+    struct bufferevent_openssl_session_cache *cache,
+    const char *host, int port)
+{
+	struct bufferevent_openssl *bev_ssl;
+	struct session_cache_entry *ent;
+	char *key = NULL, *cp;
+	size_t keylen;
+	int r = -1;
+
+	BEV_LOCK(bev);
+	bev_ssl = upcast(bev);
+	/* Resuming only helps if we haven't sent our ClientHello yet. */
+	if (!bev_ssl || bev_ssl->state != BUFFEREVENT_SSL_CONNECTING ||
+	    !SSL_in_before(bev_ssl->ssl))
+		goto done;
+
+	if (cache) {
+		if (!host)
+			goto done;
+		keylen = strlen(host) + 7;
+		if (!(key = mm_malloc(keylen)))
+			goto done;
+		evutil_snprintf(key, keylen, "%s:%d", host, port & 0xffff);
+		for (cp = key; *cp; ++cp)
+			*cp = EVUTIL_TOLOWER(*cp);
+
+		EVLOCK_LOCK(cache->lock, 0);
+		if ((ent = session_cache_find(cache, key))) {
+			SSL_set_session(bev_ssl->ssl, ent->session);
+			TAILQ_REMOVE(&cache->lru, ent, lru);
+			TAILQ_INSERT_HEAD(&cache->lru, ent, lru);
+		}
+		EVLOCK_UNLOCK(cache->lock, 0);
+	}
+
+	if (bev_ssl->session_key)
+		mm_free(bev_ssl->session_key);
+	bev_ssl->session_key = key;
+	bev_ssl->session_cache = cache;
+	r = 0;
+done:
+	BEV_UNLOCK(bev);
+	return r;
+}
+
+int
+bufferevent_openssl_ctx_enable_session_cache(SSL_CTX *ctx, long max_entries,
+    long max_lifetime)
+{
+	/* OpenSSL won't resume a session without an id context to check it
+	 * against. */
+	static const unsigned char sid_ctx[] = "libevent";
+
+	if (max_entries <= 0 || max_lifetime <= 0)
+		return -1;
+	if (!SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx)-1))
+		return -1;
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, max_entries);
+	SSL_CTX_set_timeout(ctx, max_lifetime);
+	return 0;
+}
+
+/* How many ticket keys we keep: the one we issue tickets with, and
+ * older ones that we still accept tickets from. */
+#define N_TICKET_KEYS 3
+
+struct ticket_key {
+	unsigned char name[16];
+	unsigned char aes_key[16];
+	unsigned char hmac_key[16];
+};
+
+struct bufferevent_openssl_ticket_keys {
+	SSL_CTX *ctx;
+	/* keys[0] is the current key; the others are older. */
+	struct ticket_key keys[N_TICKET_KEYS];
+	int n_keys;
+	struct event *rotate_event;
+	void *lock;
+};
+
+/* The SSL_CTX ex_data slot where we keep a bufferevent_openssl_ticket_keys.
+ * If two threads race to allocate it, one index goes unused; that's
+ * harmless. */
+static int ticket_keys_index = -1;
+
+/* Make a new current ticket key, pushing the oldest one out.  Requires
+ * lock. */
+static int
+ticket_keys_rotate(struct bufferevent_openssl_ticket_keys *keys)
+{
+	struct ticket_key k;
+	if (RAND_bytes((unsigned char *)&k, sizeof(k)) <= 0)
+		return -1;
+	memmove(&keys->keys[1], &keys->keys[0],
+	    sizeof(struct ticket_key) * (N_TICKET_KEYS - 1));
+	memcpy(&keys->keys[0], &k, sizeof(k));
+	if (keys->n_keys < N_TICKET_KEYS)
+		++keys->n_keys;
+	return 0;
+}
+
+static void
+ticket_keys_rotate_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent_openssl_ticket_keys *keys = arg;
+	EVLOCK_LOCK(keys->lock, 0);
+	if (ticket_keys_rotate(keys) < 0)
+		event_warnx("%s: couldn't make a new session ticket key; "
+		    "keeping the old one", __func__);
+	EVLOCK_UNLOCK(keys->lock, 0);
+}
+
+/* OpenSSL 3.0 deprecated the HMAC_CTX flavor of the ticket key callback in
+ * favor of one that takes an EVP_MAC_CTX. */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX ticket_mac_ctx;
+#define set_ticket_key_cb SSL_CTX_set_tlsext_ticket_key_evp_cb
+
+static int
+ticket_mac_init(ticket_mac_ctx *mac_ctx, struct ticket_key *k)
+{
+	OSSL_PARAM params[3];
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+	    k->hmac_key, sizeof(k->hmac_key));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+	    (char *)"SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	return EVP_MAC_CTX_set_params(mac_ctx, params);
+}
+#else
+typedef HMAC_CTX ticket_mac_ctx;
+#define set_ticket_key_cb SSL_CTX_set_tlsext_ticket_key_cb
+
+static int
+ticket_mac_init(ticket_mac_ctx *mac_ctx, struct ticket_key *k)
+{
+	return HMAC_Init_ex(mac_ctx, k->hmac_key, sizeof(k->hmac_key),
+	    EVP_sha256(), NULL);
+}
+#endif
+
+static int
+ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+    EVP_CIPHER_CTX *cipher_ctx, ticket_mac_ctx *mac_ctx, int enc)
+{
+	struct bufferevent_openssl_ticket_keys *keys;
+	struct ticket_key *k = NULL;
+	int i, r = 0;
+
+	keys = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ticket_keys_index);
+	if (!keys)
+		return 0;
+
+	EVLOCK_LOCK(keys->lock, 0);
+	if (enc) {
+		/* Issue a ticket under the current key. */
+		k = &keys->keys[0];
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_128_cbc())) <= 0)
+			goto done;
+		memcpy(key_name, k->name, sizeof(k->name));
+		if (!EVP_EncryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL,
+			k->aes_key, iv))
+			goto done;
+		r = 1;
+	} else {
+		/* Accept a ticket under any key we still have; if it isn't the
+		 * current one, ask OpenSSL to issue a fresh ticket. */
+		for (i = 0; i < keys->n_keys; ++i) {
+			if (!memcmp(key_name, keys->keys[i].name,
+				sizeof(keys->keys[i].name))) {
+				k = &keys->keys[i];
+				break;
+			}
+		}
+		if (!k)
+			goto done;
+		if (!EVP_DecryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL,
+			k->aes_key, iv))
+			goto done;
+		r = (i == 0) ? 1 : 2;
+	}
+	if (!ticket_mac_init(mac_ctx, k))
+		r = -1;
+done:
+	EVLOCK_UNLOCK(keys->lock, 0);
+	return r;
+}
+
+struct bufferevent_openssl_ticket_keys *
+bufferevent_openssl_ctx_rotate_ticket_keys(struct event_base *base,
+    SSL_CTX *ctx, int interval)
+{
+	struct bufferevent_openssl_ticket_keys *keys;
+	struct timeval tv;
+
+	if (interval <= 0)
+		return NULL;
+	if (ticket_keys_index < 0) {
+		ticket_keys_index = SSL_CTX_get_ex_new_index(0, NULL, NULL,
+		    NULL, NULL);
+		if (ticket_keys_index < 0)
+			return NULL;
+	}
+	if (SSL_CTX_get_ex_data(ctx, ticket_keys_index))
+		return NULL; /* Already rotating keys for this SSL_CTX. */
+
+	if (!(keys = mm_calloc(1, sizeof(*keys))))
+		return NULL;
+	keys->ctx = ctx;
+	/* The rotate callback takes the lock, so it has to exist before the
+	 * event is added. */
+	EVTHREAD_ALLOC_LOCK(keys->lock, 0);
+	if (ticket_keys_rotate(keys) < 0)
+		goto err;
+	keys->rotate_event = event_new(base, -1, EV_PERSIST,
+	    ticket_keys_rotate_cb, keys);
+	if (!keys->rotate_event)
+		goto err;
+	tv.tv_sec = interval;
+	tv.tv_usec = 0;
+	if (event_add(keys->rotate_event, &tv) < 0)
+		goto err;
+
+	if (!SSL_CTX_set_ex_data(ctx, ticket_keys_index, keys))
+		goto err;
+	set_ticket_key_cb(ctx, ticket_key_cb);
+	return keys;
+err:
+	if (keys->rotate_event)
+		event_free(keys->rotate_event);
+	EVTHREAD_FREE_LOCK(keys->lock, 0);
+	mm_free(keys);
+	return NULL;
+}
+
+void
+bufferevent_openssl_ticket_keys_free(
+	struct bufferevent_openssl_ticket_keys *keys)
+{
+	set_ticket_key_cb(keys->ctx, NULL);
+	SSL_CTX_set_ex_data(keys->ctx, ticket_keys_index, NULL);
+	event_free(keys->rotate_event);
+	EVTHREAD_FREE_LOCK(keys->lock, 0);
+	/* Don't leave key material lying around in freed memory. */
+	OPENSSL_cleanse(keys->keys, sizeof(keys->keys));
+	mm_free(keys);
+}
+
+int
+bufferevent_openssl_set_handshake_offload(struct bufferevent *bev,
+    bufferevent_ssl_offload_cb cb, void *arg)
+{
+	struct bufferevent_openssl *bev_ssl;
+	int r = -1;
+
+	BEV_LOCK(bev);
+	bev_ssl = upcast(bev);
+	/* A filter's BIO reads from the underlying bufferevent, which the
+	 * event loop would keep using behind the worker's back. */
+	if (!bev_ssl || bev_ssl->underlying ||
+	    bev_ssl->state == BUFFEREVENT_SSL_OPEN || bev_ssl->handshake_busy)
+		goto done;
+	if (cb && !bev_ssl->handshake_work_fn) {
+		event_assign(&bev_ssl->handshake_done_ev, bev->ev_base, -1, 0,
+		    be_openssl_handshake_done_cb, bev_ssl);
+	}
+	bev_ssl->handshake_work_fn = cb;
+	bev_ssl->handshake_work_arg = arg;
+	r = 0;
+done:
+	BEV_UNLOCK(bev);
+	return r;
+}
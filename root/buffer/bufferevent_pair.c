@@ -37,14 +37,22 @@
 #include "event2/bufferevent.h"
 #include "event2/bufferevent_struct.h"
 #include "event2/event.h"
+#include "event2/event_struct.h"
 #include "defer-internal.h"
 #include "bufferevent-internal.h"
+#include "event-internal.h"
 #include "mm-internal.h"
 #include "util-internal.h"
 
 struct bufferevent_pair {
 	struct bufferevent_private bev;
 	struct bufferevent_pair *partner;
+	/* If nonzero, we hold on to what's written to us until the event
+	 * loop gets around to our transfer_deferred callback, or until this
+	 * many bytes are waiting, and hand it to our partner all at once. */
+	size_t batch_threshold;
+	/* Used to hand a batch to our partner later in this loop iteration. */
+	struct deferred_cb transfer_deferred;
 };
 
 
@@ -86,6 +94,8 @@ decref_and_unlock(struct bufferevent *b)
 
 static void be_pair_outbuf_cb(struct evbuffer *,
     const struct evbuffer_cb_info *, void *);
+static void be_pair_transfer_deferred(struct deferred_cb *, void *);
+static struct bufferevent *be_xpair_get_partner(struct bufferevent *);
 
 static struct bufferevent_pair *
 bufferevent_pair_elt_new(struct event_base *base,
@@ -105,6 +115,8 @@ bufferevent_pair_elt_new(struct event_base *base,
 	}
 
 	_bufferevent_init_generic_timeout_cbs(&bufev->bev.bev);
+	event_deferred_cb_init(&bufev->transfer_deferred,
+	    be_pair_transfer_deferred, bufev);
 
 	return bufev;
 }
@@ -217,15 +229,45 @@ be_pair_outbuf_cb(struct evbuffer *outbuf,
 
 	if (info->n_added > info->n_deleted && partner) {
 		/* We got more data.  If the other side's reading, then
-		   hand it over. */
+		   hand it over, or arrange to hand it over along with
+		   whatever else gets written before long. */
 		if (be_pair_wants_to_talk(bev_pair, partner)) {
-			be_pair_transfer(downcast(bev_pair), downcast(partner), 0);
+			if (bev_pair->batch_threshold &&
+			    evbuffer_get_length(outbuf) <
+			    bev_pair->batch_threshold) {
+				if (!bev_pair->transfer_deferred.queued) {
+					bufferevent_incref(downcast(bev_pair));
+					event_deferred_cb_schedule(
+					    event_base_get_deferred_cb_queue(
+						downcast(bev_pair)->ev_base),
+					    &bev_pair->transfer_deferred);
+				}
+			} else {
+				be_pair_transfer(downcast(bev_pair),
+				    downcast(partner), 0);
+			}
 		}
 	}
 
 	decref_and_unlock(downcast(bev_pair));
 }
 
+/* Hand over a batch of data that be_pair_outbuf_cb held back. */
+static void
+be_pair_transfer_deferred(struct deferred_cb *cb, void *arg)
+{
+	struct bufferevent_pair *bev_pair = arg;
+	struct bufferevent *bev = downcast(bev_pair);
+
+	incref_and_lock(bev);
+	if (bev_pair->partner &&
+	    be_pair_wants_to_talk(bev_pair, bev_pair->partner))
+		be_pair_transfer(bev, downcast(bev_pair->partner), 0);
+	decref_and_unlock(bev);
+	/* Drop the reference we took when we scheduled this. */
+	bufferevent_decref(bev);
+}
+
 static int
 be_pair_enable(struct bufferevent *bufev, short events)
 {
@@ -311,6 +353,8 @@ bufferevent_pair_get_partner(struct bufferevent *bev)
 {
 	struct bufferevent_pair *bev_p;
 	struct bufferevent *partner;
+	if (BEV_IS_XPAIR(bev))
+		return be_xpair_get_partner(bev);
 	bev_p = upcast(bev);
 	if (! bev_p)
 		return NULL;
@@ -321,6 +365,20 @@ bufferevent_pair_get_partner(struct bufferevent *bev)
 	return partner;
 }
 
+int
+bufferevent_pair_set_batching(struct bufferevent *bev, size_t threshold)
+{
+	struct bufferevent_pair *bev_p;
+	bev_p = upcast(bev);
+	if (! bev_p)
+		return -1;
+
+	incref_and_lock(bev);
+	bev_p->batch_threshold = threshold;
+	decref_and_unlock(bev);
+	return 0;
+}
+
 const struct bufferevent_ops bufferevent_ops_pair = {
 	"pair_elt",
 	evutil_offsetof(struct bufferevent_pair, bev.bev),
@@ -331,3 +389,484 @@ const struct bufferevent_ops bufferevent_ops_pair = {
 	be_pair_flush,
 	NULL, /* ctrl */
 };
+
+/*
+ * Cross-thread pairs.
+ *
+ * The two ends of a cross-thread pair live on different event_bases, and
+ * each has its own lock.  Whatever is written to one end is moved (not
+ * copied) into a fresh evbuffer, and that evbuffer is handed to the other
+ * end through a single-producer/single-consumer ring: the writing end's
+ * thread is the only one that advances the ring's tail, and the reading
+ * end's thread is the only one that advances its head, so neither needs
+ * the other's lock.  To get the reader's attention, the writer activates
+ * the reader's wakeup event, which wakes the reader's event_base through
+ * its notification fd.
+ */
+
+#if defined(__ATOMIC_SEQ_CST)
+#define XPAIR_HAVE_ATOMICS
+#define XPAIR_LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define XPAIR_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define XPAIR_XCHG(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#elif defined(WIN32)
+#define XPAIR_HAVE_ATOMICS
+#define XPAIR_LOAD(p)							\
+	((ev_uint32_t)InterlockedCompareExchange((LONG volatile *)(p), 0, 0))
+#define XPAIR_STORE(p, v)						\
+	((void)InterlockedExchange((LONG volatile *)(p), (LONG)(v)))
+#define XPAIR_XCHG(p, v)						\
+	((ev_uint32_t)InterlockedExchange((LONG volatile *)(p), (LONG)(v)))
+#else
+/* No atomics we know how to use: bufferevent_pair_new_cross_thread()
+ * always fails, and these are never reached. */
+#define XPAIR_LOAD(p) (*(p))
+#define XPAIR_STORE(p, v) (*(p) = (v))
+#define XPAIR_XCHG(p, v) (*(p) = (v))
+#endif
+
+/* How many batches may be waiting in each direction.  Must be a power of
+ * two. */
+#define XPAIR_RING_SIZE 256
+#define XPAIR_RING_MASK (XPAIR_RING_SIZE - 1)
+
+struct xpair_ring {
+	struct evbuffer *slots[XPAIR_RING_SIZE];
+	/* The next slot to fill.  Only the writing end changes this. */
+	ev_uint32_t tail;
+	/* Keep the two indices on separate cache lines. */
+	char pad[64];
+	/* The next slot to empty.  Only the reading end changes this. */
+	ev_uint32_t head;
+};
+
+struct bufferevent_xpair;
+
+struct xpair_shared {
+	/* rings[i] carries what was written to end i over to end !i. */
+	struct xpair_ring rings[2];
+	/* wake_pending[i] is set when end i's wakeup event has been
+	 * activated and it hasn't looked at the rings since. */
+	ev_uint32_t wake_pending[2];
+	/* writer_blocked[i] is set when end i found rings[i] full. */
+	ev_uint32_t writer_blocked[2];
+	/* eof[i] is set once end i is done writing: after everything in
+	 * rings[i], end !i should see an EOF. */
+	ev_uint32_t eof[2];
+
+	/* Protects ends and refcnt, so that one end never activates the
+	 * other's wakeup event after the other end is gone. */
+	void *lock;
+	struct bufferevent_xpair *ends[2];
+	int refcnt;
+};
+
+struct bufferevent_xpair {
+	struct bufferevent_private bev;
+	struct xpair_shared *shared;
+	/* Which end of the pair we are: 0 or 1. */
+	int side;
+	/* Activated from the other end's thread when there is something for
+	 * us in the ring, or room in our own ring again. */
+	struct event wakeup;
+	/* Used to push everything written in one loop iteration as one
+	 * batch. */
+	struct deferred_cb push_deferred;
+	/* True if we've been told to send an EOF once our output is empty. */
+	unsigned finish_pending : 1;
+	/* True if we've told the user about the EOF from the other end. */
+	unsigned eof_reported : 1;
+	/* True if we hold a virtual event on our base; see
+	 * xpair_hold_base(). */
+	unsigned holding_base : 1;
+};
+
+static inline struct bufferevent_xpair *
+upcast_x(struct bufferevent *bev)
+{
+	if (bev->be_ops != &bufferevent_ops_xpair)
+		return NULL;
+	return EVUTIL_UPCAST(bev, struct bufferevent_xpair, bev.bev);
+}
+
+/* Called by the writing end of 'r'.  Returns -1 if the ring is full. */
+static int
+xpair_ring_push(struct xpair_ring *r, struct evbuffer *batch)
+{
+	ev_uint32_t tail = r->tail;
+	if (tail - XPAIR_LOAD(&r->head) == XPAIR_RING_SIZE)
+		return -1;
+	r->slots[tail & XPAIR_RING_MASK] = batch;
+	XPAIR_STORE(&r->tail, tail + 1);
+	return 0;
+}
+
+/* Called by the reading end of 'r'.  Returns NULL if the ring is empty. */
+static struct evbuffer *
+xpair_ring_pop(struct xpair_ring *r)
+{
+	ev_uint32_t head = r->head;
+	struct evbuffer *batch;
+	if (head == XPAIR_LOAD(&r->tail))
+		return NULL;
+	batch = r->slots[head & XPAIR_RING_MASK];
+	XPAIR_STORE(&r->head, head + 1);
+	return batch;
+}
+
+/* Get the attention of end 'side', unless it's already coming. */
+static void
+xpair_notify(struct xpair_shared *sh, int side)
+{
+	if (XPAIR_XCHG(&sh->wake_pending[side], 1))
+		return;
+	EVLOCK_LOCK(sh->lock, 0);
+	if (sh->ends[side])
+		event_active(&sh->ends[side]->wakeup, EV_READ, 1);
+	EVLOCK_UNLOCK(sh->lock, 0);
+}
+
+/* Nothing is ever added to our base on our behalf: the wakeup event is
+ * only ever activated.  So while we're reading and the other end might
+ * still send something, hold a virtual event to keep our base's loop
+ * from running out of things to wait for. */
+static void
+xpair_hold_base(struct bufferevent_xpair *xp)
+{
+	struct bufferevent *bev = downcast(xp);
+	int want = (bev->enabled & EV_READ) && !xp->eof_reported;
+
+	if (want && !xp->holding_base) {
+		xp->holding_base = 1;
+		event_base_add_virtual(bev->ev_base);
+	} else if (!want && xp->holding_base) {
+		xp->holding_base = 0;
+		event_base_del_virtual(bev->ev_base);
+	}
+}
+
+/* Move whatever the other end has sent us into our input buffer, as far
+ * as our read watermark allows.  Must hold the lock on xp. */
+static void
+xpair_pull(struct bufferevent_xpair *xp)
+{
+	struct xpair_shared *sh = xp->shared;
+	struct bufferevent *bev = downcast(xp);
+	struct xpair_ring *ring = &sh->rings[!xp->side];
+	struct evbuffer *batch;
+	int got = 0;
+
+	for (;;) {
+		if (!(bev->enabled & EV_READ) || xp->bev.read_suspended)
+			return;
+		if (bev->wm_read.high &&
+		    evbuffer_get_length(bev->input) >= bev->wm_read.high)
+			break;
+		if (!(batch = xpair_ring_pop(ring)))
+			break;
+		evbuffer_add_buffer(bev->input, batch);
+		evbuffer_free(batch);
+		got = 1;
+	}
+
+	if (got) {
+		/* There's room in the ring again. */
+		if (XPAIR_XCHG(&sh->writer_blocked[!xp->side], 0))
+			xpair_notify(sh, !xp->side);
+		BEV_RESET_GENERIC_READ_TIMEOUT(bev);
+		if (evbuffer_get_length(bev->input) >= bev->wm_read.low)
+			_bufferevent_run_readcb(bev);
+	}
+
+	if (!xp->eof_reported && XPAIR_LOAD(&sh->eof[!xp->side]) &&
+	    XPAIR_LOAD(&ring->head) == XPAIR_LOAD(&ring->tail)) {
+		xp->eof_reported = 1;
+		xpair_hold_base(xp);
+		_bufferevent_run_eventcb(bev, BEV_EVENT_READING|BEV_EVENT_EOF);
+	}
+}
+
+/* Hand everything in our output buffer to the other end as one batch.  If
+ * 'force' is false and we aren't finishing, only do so if we're enabled
+ * for writing.  Must hold the lock on xp. */
+static void
+xpair_push(struct bufferevent_xpair *xp, int force)
+{
+	struct xpair_shared *sh = xp->shared;
+	struct bufferevent *bev = downcast(xp);
+	struct xpair_ring *ring = &sh->rings[xp->side];
+	struct evbuffer *batch;
+
+	if (XPAIR_LOAD(&sh->eof[xp->side]))
+		return;
+	if (!force && !xp->finish_pending &&
+	    (!(bev->enabled & EV_WRITE) || xp->bev.write_suspended))
+		return;
+
+	if (evbuffer_get_length(bev->output)) {
+		if (ring->tail - XPAIR_LOAD(&ring->head) == XPAIR_RING_SIZE) {
+			/* Ask the reader to wake us when it takes something,
+			 * then make sure it didn't do so in the meantime. */
+			(void)XPAIR_XCHG(&sh->writer_blocked[xp->side], 1);
+			if (ring->tail - XPAIR_LOAD(&ring->head) ==
+			    XPAIR_RING_SIZE)
+				return;
+		}
+		if (!(batch = evbuffer_new()))
+			return;
+		evbuffer_add_buffer(batch, bev->output);
+		xpair_ring_push(ring, batch);
+		xpair_notify(sh, !xp->side);
+
+		BEV_DEL_GENERIC_WRITE_TIMEOUT(bev);
+		_bufferevent_run_writecb(bev);
+	}
+
+	if (xp->finish_pending) {
+		XPAIR_STORE(&sh->eof[xp->side], 1);
+		xpair_notify(sh, !xp->side);
+	}
+}
+
+static void
+be_xpair_wakeup_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent_xpair *xp = arg;
+	struct bufferevent *bev = downcast(xp);
+
+	_bufferevent_incref_and_lock(bev);
+	/* Clear this before we look at the rings, so that anything that
+	 * arrives after we've looked wakes us again. */
+	XPAIR_STORE(&xp->shared->wake_pending[xp->side], 0);
+	xpair_pull(xp);
+	xpair_push(xp, 0);
+	_bufferevent_decref_and_unlock(bev);
+}
+
+static void
+be_xpair_push_deferred(struct deferred_cb *cb, void *arg)
+{
+	struct bufferevent_xpair *xp = arg;
+	struct bufferevent *bev = downcast(xp);
+
+	_bufferevent_incref_and_lock(bev);
+	xpair_push(xp, 0);
+	_bufferevent_decref_and_unlock(bev);
+	/* Drop the reference we took when we scheduled this. */
+	bufferevent_decref(bev);
+}
+
+static void
+be_xpair_outbuf_cb(struct evbuffer *outbuf,
+    const struct evbuffer_cb_info *info, void *arg)
+{
+	struct bufferevent_xpair *xp = arg;
+	struct bufferevent *bev = downcast(xp);
+
+	if (info->n_added <= info->n_deleted)
+		return;
+
+	/* Push everything written before the loop next gets around to
+	 * deferred callbacks at once. */
+	_bufferevent_incref_and_lock(bev);
+	if (!xp->push_deferred.queued) {
+		bufferevent_incref(bev);
+		event_deferred_cb_schedule(
+		    event_base_get_deferred_cb_queue(bev->ev_base),
+		    &xp->push_deferred);
+	}
+	_bufferevent_decref_and_unlock(bev);
+}
+
+static void
+xpair_shared_decref(struct xpair_shared *sh)
+{
+	struct evbuffer *batch;
+	int i, refcnt;
+
+	EVLOCK_LOCK(sh->lock, 0);
+	refcnt = --sh->refcnt;
+	EVLOCK_UNLOCK(sh->lock, 0);
+	if (refcnt)
+		return;
+
+	for (i = 0; i < 2; ++i) {
+		while ((batch = xpair_ring_pop(&sh->rings[i])))
+			evbuffer_free(batch);
+	}
+	EVTHREAD_FREE_LOCK(sh->lock, 0);
+	mm_free(sh);
+}
+
+static struct bufferevent_xpair *
+bufferevent_xpair_elt_new(struct event_base *base, int options,
+    struct xpair_shared *sh, int side)
+{
+	struct bufferevent_xpair *xp;
+	if (! (xp = mm_calloc(1, sizeof(struct bufferevent_xpair))))
+		return NULL;
+	xp->shared = sh;
+	xp->side = side;
+	event_assign(&xp->wakeup, base, -1, 0, be_xpair_wakeup_cb, xp);
+	event_deferred_cb_init(&xp->push_deferred,
+	    be_xpair_push_deferred, xp);
+	if (bufferevent_init_common(&xp->bev, base, &bufferevent_ops_xpair,
+		options)) {
+		mm_free(xp);
+		return NULL;
+	}
+
+	EVLOCK_LOCK(sh->lock, 0);
+	sh->ends[side] = xp;
+	++sh->refcnt;
+	EVLOCK_UNLOCK(sh->lock, 0);
+
+	if (!evbuffer_add_cb(xp->bev.bev.output, be_xpair_outbuf_cb, xp)) {
+		bufferevent_free(downcast(xp));
+		return NULL;
+	}
+	_bufferevent_init_generic_timeout_cbs(&xp->bev.bev);
+
+	return xp;
+}
+
+int
+bufferevent_pair_new_cross_thread(struct event_base *base1,
+    struct event_base *base2, int options, struct bufferevent *pair[2])
+{
+#ifdef XPAIR_HAVE_ATOMICS
+	struct xpair_shared *sh;
+	struct bufferevent_xpair *xp1, *xp2;
+
+	if (!EVTHREAD_LOCKING_ENABLED())
+		return -1;
+
+	/* The two ends are used from different threads, so each needs a
+	 * lock of its own. */
+	options |= BEV_OPT_THREADSAFE;
+
+	if (!(sh = mm_calloc(1, sizeof(struct xpair_shared))))
+		return -1;
+	EVTHREAD_ALLOC_LOCK(sh->lock, 0);
+	if (!sh->lock) {
+		mm_free(sh);
+		return -1;
+	}
+	/* Hold a reference of our own while we're setting up, so that a
+	 * failure below frees sh exactly once. */
+	sh->refcnt = 1;
+
+	if (!(xp1 = bufferevent_xpair_elt_new(base1, options, sh, 0))) {
+		xpair_shared_decref(sh);
+		return -1;
+	}
+	if (!(xp2 = bufferevent_xpair_elt_new(base2, options, sh, 1))) {
+		bufferevent_free(downcast(xp1));
+		xpair_shared_decref(sh);
+		return -1;
+	}
+	xpair_shared_decref(sh);
+
+	pair[0] = downcast(xp1);
+	pair[1] = downcast(xp2);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static int
+be_xpair_enable(struct bufferevent *bev, short events)
+{
+	struct bufferevent_xpair *xp = upcast_x(bev);
+
+	if (events & EV_READ) {
+		BEV_RESET_GENERIC_READ_TIMEOUT(bev);
+		xpair_hold_base(xp);
+		xpair_pull(xp);
+	}
+	if (events & EV_WRITE) {
+		if (evbuffer_get_length(bev->output))
+			BEV_RESET_GENERIC_WRITE_TIMEOUT(bev);
+		xpair_push(xp, 0);
+	}
+	return 0;
+}
+
+static int
+be_xpair_disable(struct bufferevent *bev, short events)
+{
+	xpair_hold_base(upcast_x(bev));
+	if (events & EV_READ)
+		BEV_DEL_GENERIC_READ_TIMEOUT(bev);
+	if (events & EV_WRITE)
+		BEV_DEL_GENERIC_WRITE_TIMEOUT(bev);
+	return 0;
+}
+
+static void
+be_xpair_destruct(struct bufferevent *bev)
+{
+	struct bufferevent_xpair *xp = upcast_x(bev);
+	struct xpair_shared *sh = xp->shared;
+
+	/* Whatever we didn't get around to sending is lost; the other end
+	 * sees an EOF after what we did send. */
+	XPAIR_STORE(&sh->eof[xp->side], 1);
+	EVLOCK_LOCK(sh->lock, 0);
+	sh->ends[xp->side] = NULL;
+	EVLOCK_UNLOCK(sh->lock, 0);
+	xpair_notify(sh, !xp->side);
+
+	event_del(&xp->wakeup);
+	if (xp->holding_base) {
+		xp->holding_base = 0;
+		event_base_del_virtual(bev->ev_base);
+	}
+	_bufferevent_del_generic_timeout_cbs(bev);
+	xpair_shared_decref(sh);
+}
+
+static int
+be_xpair_flush(struct bufferevent *bev, short iotype,
+    enum bufferevent_flush_mode mode)
+{
+	struct bufferevent_xpair *xp = upcast_x(bev);
+
+	if (mode == BEV_NORMAL)
+		return 0;
+
+	if (iotype & EV_READ)
+		xpair_pull(xp);
+	if (iotype & EV_WRITE) {
+		if (mode == BEV_FINISHED)
+			xp->finish_pending = 1;
+		xpair_push(xp, 1);
+	}
+	return 0;
+}
+
+static struct bufferevent *
+be_xpair_get_partner(struct bufferevent *bev)
+{
+	struct bufferevent_xpair *xp = upcast_x(bev);
+	struct xpair_shared *sh = xp->shared;
+	struct bufferevent *partner;
+
+	EVLOCK_LOCK(sh->lock, 0);
+	partner = sh->ends[!xp->side] ?
+	    downcast(sh->ends[!xp->side]) : NULL;
+	EVLOCK_UNLOCK(sh->lock, 0);
+	return partner;
+}
+
+const struct bufferevent_ops bufferevent_ops_xpair = {
+	"pair_xthread_elt",
+	evutil_offsetof(struct bufferevent_xpair, bev.bev),
+	be_xpair_enable,
+	be_xpair_disable,
+	be_xpair_destruct,
+	_bufferevent_generic_adj_timeouts,
+	be_xpair_flush,
+	NULL, /* ctrl */
+};
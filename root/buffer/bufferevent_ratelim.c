@@ -177,20 +177,76 @@ ev_token_bucket_cfg_free(struct ev_token_bucket_cfg *cfg)
 	mm_free(cfg);
 }
 
-/* No matter how big our bucket gets, don't try to read more than this
- * much in a single read operation. */
-#define MAX_TO_READ_EVER 16384
-/* No matter how big our bucket gets, don't try to write more than this
- * much in a single write operation. */
-#define MAX_TO_WRITE_EVER 16384
-
 #define LOCK_GROUP(g) EVLOCK_LOCK((g)->lock, 0)
 #define UNLOCK_GROUP(g) EVLOCK_UNLOCK((g)->lock, 0)
 
+#ifndef _EVENT_DISABLE_THREAD_SUPPORT
+/* Lock held while changing the parent of any group.  It nests outside
+ * every group lock, so that two calls to set_parent() can't each hold
+ * one group's chain while waiting for the other's. */
+static void *rlim_tree_lock = NULL;
+#endif
+#define LOCK_TREE() EVLOCK_LOCK(rlim_tree_lock, 0)
+#define UNLOCK_TREE() EVLOCK_UNLOCK(rlim_tree_lock, 0)
+
 static int _bev_group_suspend_reading(struct bufferevent_rate_limit_group *g);
 static int _bev_group_suspend_writing(struct bufferevent_rate_limit_group *g);
 static void _bev_group_unsuspend_reading(struct bufferevent_rate_limit_group *g);
 static void _bev_group_unsuspend_writing(struct bufferevent_rate_limit_group *g);
+static ev_ssize_t _bev_group_share(struct bufferevent_rate_limit_group *g,
+    int is_write);
+static ev_ssize_t _bev_group_chain_share(
+    struct bufferevent_rate_limit_group *g, int is_write);
+static void _bev_group_enqueue_waiter(struct bufferevent_rate_limit_group *g,
+    struct bufferevent_private *bev, int is_write);
+
+/** Unlock <b>g</b> and every group above it. */
+static void
+_bev_group_unlock_chain(struct bufferevent_rate_limit_group *g)
+{
+	struct bufferevent_rate_limit_group *gg, *parent;
+	for (gg = g; gg; gg = parent) {
+		/* Once gg is unlocked, its parent can change. */
+		parent = gg->parent;
+		UNLOCK_GROUP(gg);
+	}
+}
+
+/** Lock <b>g</b> and every group above it, outermost first. */
+static void
+_bev_group_lock_chain(struct bufferevent_rate_limit_group *g)
+{
+	struct bufferevent_rate_limit_group *parent;
+	for (;;) {
+		parent = g->parent;
+		if (parent)
+			_bev_group_lock_chain(parent);
+		LOCK_GROUP(g);
+		if (g->parent == parent)
+			return;
+		/* set_parent() moved g while we were waiting; we locked
+		 * the wrong chain. */
+		UNLOCK_GROUP(g);
+		if (parent)
+			_bev_group_unlock_chain(parent);
+	}
+}
+
+/** Return true iff <b>g</b> or any group above it is suspended for writing
+    if is_write, or for reading otherwise. */
+static int
+_bev_group_chain_suspended(struct bufferevent_rate_limit_group *g,
+    int is_write)
+{
+	/* Needs lock on g and every group above it. */
+	for ( ; g; g = g->parent) {
+		if (is_write ? g->write_suspended : g->read_suspended)
+			return 1;
+	}
+	return 0;
+}
+static void _bev_group_note_served(struct bufferevent_rate_limit_group *g,
+    struct bufferevent_private *bev, int is_write);
 
 /** Helper: figure out the maximum amount we should write if is_write, or
     the maximum amount we should read if is_read.  Return that maximum, or
@@ -200,14 +256,11 @@ static inline ev_ssize_t
 _bufferevent_get_rlim_max(struct bufferevent_private *bev, int is_write)
 {
 	/* needs lock on bev. */
-	ev_ssize_t max_so_far = is_write?MAX_TO_WRITE_EVER:MAX_TO_READ_EVER;
+	ev_ssize_t max_so_far = is_write?bev->max_single_write:bev->max_single_read;
 
 #define LIM(x)						\
 	(is_write ? (x).write_limit : (x).read_limit)
 
-#define GROUP_SUSPENDED(g)			\
-	(is_write ? (g)->write_suspended : (g)->read_suspended)
-
 	/* Sets max_so_far to MIN(x, max_so_far) */
 #define CLAMPTO(x)				\
 	do {					\
@@ -231,11 +284,13 @@ _bufferevent_get_rlim_max(struct bufferevent_private *bev, int is_write)
 		struct bufferevent_rate_limit_group *g =
 		    bev->rate_limiting->group;
 		ev_ssize_t share;
-		LOCK_GROUP(g);
-		if (GROUP_SUSPENDED(g)) {
+		_bev_group_lock_chain(g);
+		if (_bev_group_chain_suspended(g, is_write) ||
+		    bev->rate_limiting->waiting[is_write]) {
 			/* We can get here if we failed to lock this
 			 * particular bufferevent while suspending the whole
-			 * group. */
+			 * group, or while it was not its turn. */
+			_bev_group_enqueue_waiter(g, bev, is_write);
 			if (is_write)
 				bufferevent_suspend_write(&bev->bev,
 				    BEV_SUSPEND_BW_GROUP);
@@ -244,13 +299,9 @@ _bufferevent_get_rlim_max(struct bufferevent_private *bev, int is_write)
 				    BEV_SUSPEND_BW_GROUP);
 			share = 0;
 		} else {
-			/* XXXX probably we should divide among the active
-			 * members, not the total members. */
-			share = LIM(g->rate_limit) / g->n_members;
-			if (share < g->min_share)
-				share = g->min_share;
+			share = _bev_group_chain_share(g, is_write);
 		}
-		UNLOCK_GROUP(g);
+		_bev_group_unlock_chain(g);
 		CLAMPTO(share);
 	}
 
@@ -271,6 +322,49 @@ _bufferevent_get_write_max(struct bufferevent_private *bev)
 	return _bufferevent_get_rlim_max(bev, 1);
 }
 
+/** Helper: schedule the refill timer on <b>bev</b> for when one of the
+    buckets it is suspended on will have refilled.  Buckets are brought up
+    to date lazily whenever we look at them, so this is the only timer a
+    rate-limited bufferevent needs, and only while it is suspended.
+    Usually the bucket is one tick away from refilling, and we use a common
+    timeout so that many suspended bufferevents stay cheap; if it is deeper
+    in debt, we sleep through the ticks that wouldn't help.
+ */
+static int
+_bev_refill_schedule(struct bufferevent_private *bev)
+{
+	/* Must hold lock on bev. */
+	struct bufferevent_rate_limit *rlim = bev->rate_limiting;
+	const struct ev_token_bucket_cfg *cfg = rlim->cfg;
+	ev_uint64_t n_ticks = 0, n, msec;
+	struct timeval tv;
+
+#define TICKS_TO_REFILL(lim, rate)					\
+	((rate) ? (ev_uint64_t)(-(lim)) / (rate) + 1 : 1)
+
+	if ((bev->read_suspended & BEV_SUSPEND_BW) &&
+	    rlim->limit.read_limit <= 0) {
+		n_ticks = TICKS_TO_REFILL(rlim->limit.read_limit,
+		    cfg->read_rate);
+	}
+	if ((bev->write_suspended & BEV_SUSPEND_BW) &&
+	    rlim->limit.write_limit <= 0) {
+		n = TICKS_TO_REFILL(rlim->limit.write_limit, cfg->write_rate);
+		if (!n_ticks || n < n_ticks)
+			n_ticks = n;
+	}
+#undef TICKS_TO_REFILL
+
+	if (n_ticks <= 1)
+		return event_add(&rlim->refill_bucket_event,
+		    rlim->tick_timeout ? rlim->tick_timeout : &cfg->tick_timeout);
+
+	msec = n_ticks * cfg->msec_per_tick;
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+	return event_add(&rlim->refill_bucket_event, &tv);
+}
+
 int
 _bufferevent_decrement_read_buckets(struct bufferevent_private *bev, ev_ssize_t bytes)
 {
@@ -284,8 +378,7 @@ _bufferevent_decrement_read_buckets(struct bufferevent_private *bev, ev_ssize_t
 		bev->rate_limiting->limit.read_limit -= bytes;
 		if (bev->rate_limiting->limit.read_limit <= 0) {
 			bufferevent_suspend_read(&bev->bev, BEV_SUSPEND_BW);
-			if (event_add(&bev->rate_limiting->refill_bucket_event,
-				&bev->rate_limiting->cfg->tick_timeout) < 0)
+			if (_bev_refill_schedule(bev) < 0)
 				r = -1;
 		} else if (bev->read_suspended & BEV_SUSPEND_BW) {
 			if (!(bev->write_suspended & BEV_SUSPEND_BW))
@@ -295,15 +388,23 @@ _bufferevent_decrement_read_buckets(struct bufferevent_private *bev, ev_ssize_t
 	}
 
 	if (bev->rate_limiting->group) {
-		LOCK_GROUP(bev->rate_limiting->group);
-		bev->rate_limiting->group->rate_limit.read_limit -= bytes;
-		bev->rate_limiting->group->total_read += bytes;
-		if (bev->rate_limiting->group->rate_limit.read_limit <= 0) {
-			_bev_group_suspend_reading(bev->rate_limiting->group);
-		} else if (bev->rate_limiting->group->read_suspended) {
-			_bev_group_unsuspend_reading(bev->rate_limiting->group);
+		struct bufferevent_rate_limit_group *g =
+		    bev->rate_limiting->group, *gg;
+		_bev_group_lock_chain(g);
+		_bev_group_note_served(g, bev, 0);
+		/* Charge every group in the hierarchy. */
+		for (gg = g; gg; gg = gg->parent) {
+			gg->rate_limit.read_limit -= bytes;
+			gg->total_read += bytes;
+		}
+		for (gg = g; gg; gg = gg->parent) {
+			if (gg->rate_limit.read_limit <= 0) {
+				_bev_group_suspend_reading(gg);
+			} else if (gg->read_suspended) {
+				_bev_group_unsuspend_reading(gg);
+			}
 		}
-		UNLOCK_GROUP(bev->rate_limiting->group);
+		_bev_group_unlock_chain(g);
 	}
 
 	return r;
@@ -322,8 +423,7 @@ _bufferevent_decrement_write_buckets(struct bufferevent_private *bev, ev_ssize_t
 		bev->rate_limiting->limit.write_limit -= bytes;
 		if (bev->rate_limiting->limit.write_limit <= 0) {
 			bufferevent_suspend_write(&bev->bev, BEV_SUSPEND_BW);
-			if (event_add(&bev->rate_limiting->refill_bucket_event,
-				&bev->rate_limiting->cfg->tick_timeout) < 0)
+			if (_bev_refill_schedule(bev) < 0)
 				r = -1;
 		} else if (bev->write_suspended & BEV_SUSPEND_BW) {
 			if (!(bev->read_suspended & BEV_SUSPEND_BW))
@@ -333,28 +433,109 @@ _bufferevent_decrement_write_buckets(struct bufferevent_private *bev, ev_ssize_t
 	}
 
 	if (bev->rate_limiting->group) {
-		LOCK_GROUP(bev->rate_limiting->group);
-		bev->rate_limiting->group->rate_limit.write_limit -= bytes;
-		bev->rate_limiting->group->total_written += bytes;
-		if (bev->rate_limiting->group->rate_limit.write_limit <= 0) {
-			_bev_group_suspend_writing(bev->rate_limiting->group);
-		} else if (bev->rate_limiting->group->write_suspended) {
-			_bev_group_unsuspend_writing(bev->rate_limiting->group);
+		struct bufferevent_rate_limit_group *g =
+		    bev->rate_limiting->group, *gg;
+		_bev_group_lock_chain(g);
+		_bev_group_note_served(g, bev, 1);
+		/* Charge every group in the hierarchy. */
+		for (gg = g; gg; gg = gg->parent) {
+			gg->rate_limit.write_limit -= bytes;
+			gg->total_written += bytes;
+		}
+		for (gg = g; gg; gg = gg->parent) {
+			if (gg->rate_limit.write_limit <= 0) {
+				_bev_group_suspend_writing(gg);
+			} else if (gg->write_suspended) {
+				_bev_group_unsuspend_writing(gg);
+			}
 		}
-		UNLOCK_GROUP(bev->rate_limiting->group);
+		_bev_group_unlock_chain(g);
 	}
 
 	return r;
 }
 
-/** Stop reading on every bufferevent in <b>g</b> */
-static int
-_bev_group_suspend_reading(struct bufferevent_rate_limit_group *g)
+/** Helper: move <b>bev</b> to the tail of <b>g</b>'s waiting queue for
+    writing if is_write, or for reading otherwise. */
+static void
+_bev_group_enqueue_waiter(struct bufferevent_rate_limit_group *g,
+    struct bufferevent_private *bev, int is_write)
+{
+	/* Needs group lock */
+	struct bufferevent_rate_limit *rlim = bev->rate_limiting;
+	if (rlim->waiting[is_write])
+		return;
+	TAILQ_REMOVE(&g->active[is_write], bev,
+	    rate_limiting->next_in_queue[is_write]);
+	TAILQ_INSERT_TAIL(&g->waiting[is_write], bev,
+	    rate_limiting->next_in_queue[is_write]);
+	rlim->waiting[is_write] = 1;
+}
+
+/** Helper: return the most that one member of <b>g</b> should write at a
+    time if is_write, or read at a time otherwise.
+
+    Every member gets the same quantum out of each refill, no matter how
+    much of the bucket the members ahead of it have already used, so that
+    being woken first is not an advantage.
+ */
+static ev_ssize_t
+_bev_group_share(struct bufferevent_rate_limit_group *g, int is_write)
+{
+	/* Needs group lock */
+	ev_ssize_t limit, share;
+
+	limit = is_write ? g->rate_limit.write_limit : g->rate_limit.read_limit;
+	share = g->refill_level[is_write] /
+	    (g->n_members_total ? g->n_members_total : 1);
+	if (share > limit)
+		share = limit;
+	if (share < g->min_share)
+		share = g->min_share;
+	return share;
+}
+
+/** Helper: return the smallest share a member of <b>g</b> gets from <b>g</b>
+    or any group above it. */
+static ev_ssize_t
+_bev_group_chain_share(struct bufferevent_rate_limit_group *g, int is_write)
+{
+	/* Needs lock on g and every group above it. */
+	ev_ssize_t share = _bev_group_share(g, is_write);
+	for (g = g->parent; g; g = g->parent) {
+		ev_ssize_t s = _bev_group_share(g, is_write);
+		if (share > s)
+			share = s;
+	}
+	return share;
+}
+
+/** Helper: <b>bev</b> has just used <b>g</b>'s bucket for writing if
+    is_write, or for reading otherwise; move it behind the other active
+    members, so that the ones served least recently go first next time. */
+static void
+_bev_group_note_served(struct bufferevent_rate_limit_group *g,
+    struct bufferevent_private *bev, int is_write)
+{
+	/* Needs group lock */
+	if (bev->rate_limiting->waiting[is_write])
+		return;
+	TAILQ_REMOVE(&g->active[is_write], bev,
+	    rate_limiting->next_in_queue[is_write]);
+	TAILQ_INSERT_TAIL(&g->active[is_write], bev,
+	    rate_limiting->next_in_queue[is_write]);
+}
+
+/** Helper: stop every active member of <b>g</b> and of the groups below it
+    from writing if is_write, or from reading otherwise, and put it at the
+    back of its waiting queue.  Members that were already waiting keep
+    their place ahead of it. */
+static void
+_bev_group_suspend(struct bufferevent_rate_limit_group *g, int is_write)
 {
 	/* Needs group lock */
 	struct bufferevent_private *bev;
-	g->read_suspended = 1;
-	g->pending_unsuspend_read = 0;
+	struct bufferevent_rate_limit_group *child;
 
 	/* Note that in this loop we call EVLOCK_TRY_LOCK instead of BEV_LOCK,
 	   to prevent a deadlock.  (Ordinarily, the group lock nests inside
@@ -362,13 +543,35 @@ _bev_group_suspend_reading(struct bufferevent_rate_limit_group *g)
 	   bufferevent, it will find out later when it looks at its limit
 	   and sees that its group is suspended.
 	*/
-	TAILQ_FOREACH(bev, &g->members, rate_limiting->next_in_group) {
+	while ((bev = TAILQ_FIRST(&g->active[is_write]))) {
+		_bev_group_enqueue_waiter(g, bev, is_write);
 		if (EVLOCK_TRY_LOCK(bev->lock)) {
-			bufferevent_suspend_read(&bev->bev,
-			    BEV_SUSPEND_BW_GROUP);
+			if (is_write)
+				bufferevent_suspend_write(&bev->bev,
+				    BEV_SUSPEND_BW_GROUP);
+			else
+				bufferevent_suspend_read(&bev->bev,
+				    BEV_SUSPEND_BW_GROUP);
 			EVLOCK_UNLOCK(bev->lock, 0);
 		}
 	}
+
+	/* Everybody below us draws from our bucket too. */
+	TAILQ_FOREACH(child, &g->children, next_sibling) {
+		LOCK_GROUP(child);
+		_bev_group_suspend(child, is_write);
+		UNLOCK_GROUP(child);
+	}
+}
+
+/** Stop reading on every bufferevent in <b>g</b> */
+static int
+_bev_group_suspend_reading(struct bufferevent_rate_limit_group *g)
+{
+	/* Needs group lock */
+	g->read_suspended = 1;
+	g->pending_unsuspend_read = 0;
+	_bev_group_suspend(g, 0);
 	return 0;
 }
 
@@ -377,16 +580,9 @@ static int
 _bev_group_suspend_writing(struct bufferevent_rate_limit_group *g)
 {
 	/* Needs group lock */
-	struct bufferevent_private *bev;
 	g->write_suspended = 1;
 	g->pending_unsuspend_write = 0;
-	TAILQ_FOREACH(bev, &g->members, rate_limiting->next_in_group) {
-		if (EVLOCK_TRY_LOCK(bev->lock)) {
-			bufferevent_suspend_write(&bev->bev,
-			    BEV_SUSPEND_BW_GROUP);
-			EVLOCK_UNLOCK(bev->lock, 0);
-		}
-	}
+	_bev_group_suspend(g, 1);
 	return 0;
 }
 
@@ -428,97 +624,97 @@ _bev_refill_callback(evutil_socket_t fd, short what, void *arg)
 	}
 	if (again) {
 		/* One or more of the buckets may need another refill if they
-		   started negative.
-
-		   XXXX if we need to be quiet for more ticks, we should
-		   maybe figure out what timeout we really want.
-		*/
+		   started negative. */
 		/* XXXX Handle event_add failure somehow */
-		event_add(&bev->rate_limiting->refill_bucket_event,
-		    &bev->rate_limiting->cfg->tick_timeout);
+		_bev_refill_schedule(bev);
 	}
 	BEV_UNLOCK(&bev->bev);
 }
 
-/** Helper: grab a random element from a bufferevent group. */
-static struct bufferevent_private *
-_bev_group_random_element(struct bufferevent_rate_limit_group *group)
+/** Helper: wake members of <b>g</b> from the front of its waiting queue
+    for writing if is_write, or for reading otherwise, and move them to
+    the back of the active queue.
+
+    This is a round-robin over the members that want the bucket: we only
+    wake as many members as the bucket has shares for, so a refill costs
+    time proportional to the number of members that can actually use it,
+    not to the size of the group.  Members we don't wake keep their place
+    at the front of the queue for the next refill.  Groups below <b>g</b>
+    get the same treatment, unless their own bucket is empty.  Return true
+    iff some member could not be locked and we should try again.
+ */
+static int
+_bev_group_unsuspend(struct bufferevent_rate_limit_group *g, int is_write)
 {
-	int which;
-	struct bufferevent_private *bev;
-
-	/* requires group lock */
-
-	if (!group->n_members)
-		return NULL;
-
-	EVUTIL_ASSERT(! TAILQ_EMPTY(&group->members));
-
-	which = _evutil_weakrand() % group->n_members;
+	/* Needs lock on g and every group above it. */
+	struct bufferevent_private *bev, *next;
+	struct bufferevent_rate_limit_group *child, *gg;
+	ev_ssize_t limit, share;
+	int n_to_wake, again = 0;
+
+	/* If a group above us is still empty, it will wake us when it
+	 * refills. */
+	if (_bev_group_chain_suspended(g, is_write))
+		return 0;
 
-	bev = TAILQ_FIRST(&group->members);
-	while (which--)
-		bev = TAILQ_NEXT(bev, rate_limiting->next_in_group);
+	/* The bucket we can actually use is the emptiest one above us. */
+	limit = is_write ? g->rate_limit.write_limit : g->rate_limit.read_limit;
+	for (gg = g->parent; gg; gg = gg->parent) {
+		ev_ssize_t l = is_write ? gg->rate_limit.write_limit :
+		    gg->rate_limit.read_limit;
+		if (limit > l)
+			limit = l;
+	}
+	share = _bev_group_chain_share(g, is_write);
+	if (share < 1)
+		share = 1;
+	n_to_wake = limit > share ? (int)(limit / share) : 1;
+
+	for (bev = TAILQ_FIRST(&g->waiting[is_write]); bev && n_to_wake;
+	    bev = next) {
+		next = TAILQ_NEXT(bev, rate_limiting->next_in_queue[is_write]);
+		if (!EVLOCK_TRY_LOCK(bev->lock)) {
+			again = 1;
+			continue;
+		}
+		if (is_write)
+			bufferevent_unsuspend_write(&bev->bev,
+			    BEV_SUSPEND_BW_GROUP);
+		else
+			bufferevent_unsuspend_read(&bev->bev,
+			    BEV_SUSPEND_BW_GROUP);
+		EVLOCK_UNLOCK(bev->lock, 0);
+
+		TAILQ_REMOVE(&g->waiting[is_write], bev,
+		    rate_limiting->next_in_queue[is_write]);
+		TAILQ_INSERT_TAIL(&g->active[is_write], bev,
+		    rate_limiting->next_in_queue[is_write]);
+		bev->rate_limiting->waiting[is_write] = 0;
+		--n_to_wake;
+	}
 
-	return bev;
+	/* Cascade the refill down to the groups below us. */
+	TAILQ_FOREACH(child, &g->children, next_sibling) {
+		LOCK_GROUP(child);
+		if (_bev_group_unsuspend(child, is_write))
+			again = 1;
+		UNLOCK_GROUP(child);
+	}
+	return again;
 }
 
-/** Iterate over the elements of a rate-limiting group 'g' with a random
-    starting point, assigning each to the variable 'bev', and executing the
-    block 'block'.
-
-    We do this in a half-baked effort to get fairness among group members.
-    XXX Round-robin or some kind of priority queue would be even more fair.
- */
-#define FOREACH_RANDOM_ORDER(block)			\
-	do {						\
-		first = _bev_group_random_element(g);	\
-		for (bev = first; bev != TAILQ_END(&g->members); \
-		    bev = TAILQ_NEXT(bev, rate_limiting->next_in_group)) { \
-			block ;					 \
-		}						 \
-		for (bev = TAILQ_FIRST(&g->members); bev && bev != first; \
-		    bev = TAILQ_NEXT(bev, rate_limiting->next_in_group)) { \
-			block ;						\
-		}							\
-	} while (0)
-
 static void
 _bev_group_unsuspend_reading(struct bufferevent_rate_limit_group *g)
 {
-	int again = 0;
-	struct bufferevent_private *bev, *first;
-
 	g->read_suspended = 0;
-	FOREACH_RANDOM_ORDER({
-		if (EVLOCK_TRY_LOCK(bev->lock)) {
-			bufferevent_unsuspend_read(&bev->bev,
-			    BEV_SUSPEND_BW_GROUP);
-			EVLOCK_UNLOCK(bev->lock, 0);
-		} else {
-			again = 1;
-		}
-	});
-	g->pending_unsuspend_read = again;
+	g->pending_unsuspend_read = _bev_group_unsuspend(g, 0);
 }
 
 static void
 _bev_group_unsuspend_writing(struct bufferevent_rate_limit_group *g)
 {
-	int again = 0;
-	struct bufferevent_private *bev, *first;
 	g->write_suspended = 0;
-
-	FOREACH_RANDOM_ORDER({
-		if (EVLOCK_TRY_LOCK(bev->lock)) {
-			bufferevent_unsuspend_write(&bev->bev,
-			    BEV_SUSPEND_BW_GROUP);
-			EVLOCK_UNLOCK(bev->lock, 0);
-		} else {
-			again = 1;
-		}
-	});
-	g->pending_unsuspend_write = again;
+	g->pending_unsuspend_write = _bev_group_unsuspend(g, 1);
 }
 
 /** Callback invoked every tick to add more elements to the group bucket
@@ -533,17 +729,23 @@ _bev_group_refill_callback(evutil_socket_t fd, short what, void *arg)
 
 	event_base_gettimeofday_cached(event_get_base(&g->master_refill_event), &now);
 
-	LOCK_GROUP(g);
+	_bev_group_lock_chain(g);
 
 	tick = ev_token_bucket_get_tick(&now, &g->rate_limit_cfg);
 	ev_token_bucket_update(&g->rate_limit, &g->rate_limit_cfg, tick);
+	g->refill_level[0] = g->rate_limit.read_limit;
+	g->refill_level[1] = g->rate_limit.write_limit;
 
+	/* Give the next members in line their turn, if the bucket has room
+	 * for them. */
 	if (g->pending_unsuspend_read ||
-	    (g->read_suspended && (g->rate_limit.read_limit >= g->min_share))) {
+	    ((g->read_suspended || !TAILQ_EMPTY(&g->waiting[0])) &&
+		(g->rate_limit.read_limit >= g->min_share))) {
 		_bev_group_unsuspend_reading(g);
 	}
 	if (g->pending_unsuspend_write ||
-	    (g->write_suspended && (g->rate_limit.write_limit >= g->min_share))){
+	    ((g->write_suspended || !TAILQ_EMPTY(&g->waiting[1])) &&
+		(g->rate_limit.write_limit >= g->min_share))) {
 		_bev_group_unsuspend_writing(g);
 	}
 
@@ -552,7 +754,7 @@ _bev_group_refill_callback(evutil_socket_t fd, short what, void *arg)
 	 * next iteration of the mainloop.
 	 */
 
-	UNLOCK_GROUP(g);
+	_bev_group_unlock_chain(g);
 }
 
 int
@@ -603,6 +805,8 @@ bufferevent_set_rate_limit(struct bufferevent *bev,
 
 	rlim->cfg = cfg;
 	ev_token_bucket_init(&rlim->limit, cfg, tick, reinit);
+	rlim->tick_timeout = event_base_init_common_timeout(bev->ev_base,
+	    &cfg->tick_timeout);
 
 	if (reinit) {
 		EVUTIL_ASSERT(event_initialized(&rlim->refill_bucket_event));
@@ -625,7 +829,7 @@ bufferevent_set_rate_limit(struct bufferevent *bev,
 	}
 
 	if (suspended)
-		event_add(&rlim->refill_bucket_event, &cfg->tick_timeout);
+		_bev_refill_schedule(bevp);
 
 	r = 0;
 
@@ -650,8 +854,15 @@ bufferevent_rate_limit_group_new(struct event_base *base,
 		return NULL;
 	memcpy(&g->rate_limit_cfg, cfg, sizeof(g->rate_limit_cfg));
 	TAILQ_INIT(&g->members);
+	TAILQ_INIT(&g->active[0]);
+	TAILQ_INIT(&g->active[1]);
+	TAILQ_INIT(&g->waiting[0]);
+	TAILQ_INIT(&g->waiting[1]);
+	TAILQ_INIT(&g->children);
 
 	ev_token_bucket_init(&g->rate_limit, cfg, tick, 0);
+	g->refill_level[0] = g->rate_limit.read_limit;
+	g->refill_level[1] = g->rate_limit.write_limit;
 
 	event_assign(&g->master_refill_event, base, -1, EV_PERSIST,
 	    _bev_group_refill_callback, g);
@@ -683,6 +894,8 @@ bufferevent_rate_limit_group_set_cfg(
 		g->rate_limit.read_limit = cfg->read_maximum;
 	if (g->rate_limit.write_limit > (ev_ssize_t)cfg->write_maximum)
 		g->rate_limit.write_limit = cfg->write_maximum;
+	g->refill_level[0] = g->rate_limit.read_limit;
+	g->refill_level[1] = g->rate_limit.write_limit;
 
 	if (!same_tick) {
 		/* This can cause a hiccup in the schedule */
@@ -720,19 +933,97 @@ bufferevent_rate_limit_group_set_min_share(
 void
 bufferevent_rate_limit_group_free(struct bufferevent_rate_limit_group *g)
 {
+	bufferevent_rate_limit_group_set_parent(g, NULL);
 	LOCK_GROUP(g);
 	EVUTIL_ASSERT(0 == g->n_members);
+	EVUTIL_ASSERT(TAILQ_EMPTY(&g->children));
 	event_del(&g->master_refill_event);
 	UNLOCK_GROUP(g);
 	EVTHREAD_FREE_LOCK(g->lock, EVTHREAD_LOCKTYPE_RECURSIVE);
 	mm_free(g);
 }
 
+int
+bufferevent_rate_limit_group_set_parent(
+	struct bufferevent_rate_limit_group *g,
+	struct bufferevent_rate_limit_group *parent)
+{
+	struct bufferevent_rate_limit_group *gg, *old_parent;
+
+	if (!g)
+		return -1;
+	LOCK_TREE();
+	/* No cycles. */
+	for (gg = parent; gg; gg = gg->parent) {
+		if (gg == g) {
+			UNLOCK_TREE();
+			return -1;
+		}
+	}
+
+	/* With the tree lock held, nobody else is taking two chains at
+	 * once, and each chain is locked outermost first, so this can't
+	 * deadlock against anybody who is using the groups. */
+	if (parent)
+		_bev_group_lock_chain(parent);
+	_bev_group_lock_chain(g);
+	old_parent = g->parent;
+
+	if (old_parent != parent) {
+		if (old_parent) {
+			for (gg = old_parent; gg; gg = gg->parent)
+				gg->n_members_total -= g->n_members_total;
+			TAILQ_REMOVE(&old_parent->children, g, next_sibling);
+		}
+		g->parent = parent;
+		if (parent) {
+			TAILQ_INSERT_TAIL(&parent->children, g, next_sibling);
+			for (gg = parent; gg; gg = gg->parent)
+				gg->n_members_total += g->n_members_total;
+			/* If the new parent's bucket is empty, our members
+			 * wait for it to refill. */
+			if (_bev_group_chain_suspended(parent, 0))
+				_bev_group_suspend(g, 0);
+			if (_bev_group_chain_suspended(parent, 1))
+				_bev_group_suspend(g, 1);
+		}
+		/* Members that were only waiting for the old parent to
+		 * refill can go now, if nothing else is holding them. */
+		if (old_parent) {
+			if (g->rate_limit.read_limit >= g->min_share &&
+			    _bev_group_unsuspend(g, 0))
+				g->pending_unsuspend_read = 1;
+			if (g->rate_limit.write_limit >= g->min_share &&
+			    _bev_group_unsuspend(g, 1))
+				g->pending_unsuspend_write = 1;
+		}
+	}
+
+	/* Release the locks we took above, on g and its old parents. */
+	UNLOCK_GROUP(g);
+	if (old_parent)
+		_bev_group_unlock_chain(old_parent);
+	if (parent)
+		_bev_group_unlock_chain(parent);
+	UNLOCK_TREE();
+	return 0;
+}
+
+#ifndef _EVENT_DISABLE_THREAD_SUPPORT
+int
+bufferevent_ratelim_global_setup_locks_(const int enable_locks)
+{
+	EVTHREAD_SETUP_GLOBAL_LOCK(rlim_tree_lock, 0);
+	return 0;
+}
+#endif
+
 int
 bufferevent_add_to_rate_limit_group(struct bufferevent *bev,
     struct bufferevent_rate_limit_group *g)
 {
 	int wsuspend, rsuspend;
+	struct bufferevent_rate_limit_group *gg;
 	struct bufferevent_private *bevp =
 	    EVUTIL_UPCAST(bev, struct bufferevent_private, bev);
 	BEV_LOCK(bev);
@@ -756,15 +1047,27 @@ bufferevent_add_to_rate_limit_group(struct bufferevent *bev,
 	if (bevp->rate_limiting->group)
 		bufferevent_remove_from_rate_limit_group(bev);
 
-	LOCK_GROUP(g);
+	_bev_group_lock_chain(g);
 	bevp->rate_limiting->group = g;
 	++g->n_members;
+	for (gg = g; gg; gg = gg->parent)
+		++gg->n_members_total;
 	TAILQ_INSERT_TAIL(&g->members, bevp, rate_limiting->next_in_group);
 
-	rsuspend = g->read_suspended;
-	wsuspend = g->write_suspended;
-
-	UNLOCK_GROUP(g);
+	/* If anybody is already waiting for their turn, we wait behind
+	 * them. */
+	rsuspend = _bev_group_chain_suspended(g, 0) ||
+	    !TAILQ_EMPTY(&g->waiting[0]);
+	wsuspend = _bev_group_chain_suspended(g, 1) ||
+	    !TAILQ_EMPTY(&g->waiting[1]);
+	bevp->rate_limiting->waiting[0] = rsuspend;
+	bevp->rate_limiting->waiting[1] = wsuspend;
+	TAILQ_INSERT_TAIL(rsuspend ? &g->waiting[0] : &g->active[0], bevp,
+	    rate_limiting->next_in_queue[0]);
+	TAILQ_INSERT_TAIL(wsuspend ? &g->waiting[1] : &g->active[1], bevp,
+	    rate_limiting->next_in_queue[1]);
+
+	_bev_group_unlock_chain(g);
 
 	if (rsuspend)
 		bufferevent_suspend_read(bev, BEV_SUSPEND_BW_GROUP);
@@ -791,11 +1094,21 @@ bufferevent_remove_from_rate_limit_group_internal(struct bufferevent *bev,
 	if (bevp->rate_limiting && bevp->rate_limiting->group) {
 		struct bufferevent_rate_limit_group *g =
 		    bevp->rate_limiting->group;
-		LOCK_GROUP(g);
-		bevp->rate_limiting->group = NULL;
+		struct bufferevent_rate_limit_group *gg;
+		struct bufferevent_rate_limit *rlim = bevp->rate_limiting;
+		int i;
+		_bev_group_lock_chain(g);
+		rlim->group = NULL;
 		--g->n_members;
+		for (gg = g; gg; gg = gg->parent)
+			--gg->n_members_total;
 		TAILQ_REMOVE(&g->members, bevp, rate_limiting->next_in_group);
-		UNLOCK_GROUP(g);
+		for (i = 0; i < 2; ++i) {
+			TAILQ_REMOVE(rlim->waiting[i] ? &g->waiting[i] :
+			    &g->active[i], bevp, rate_limiting->next_in_queue[i]);
+			rlim->waiting[i] = 0;
+		}
+		_bev_group_unlock_chain(g);
 	}
 	if (unsuspend) {
 		bufferevent_unsuspend_read(bev, BEV_SUSPEND_BW_GROUP);
@@ -911,8 +1224,7 @@ bufferevent_decrement_read_limit(struct bufferevent *bev, ev_ssize_t decr)
 	new_limit = (bevp->rate_limiting->limit.read_limit -= decr);
 	if (old_limit > 0 && new_limit <= 0) {
 		bufferevent_suspend_read(bev, BEV_SUSPEND_BW);
-		if (event_add(&bevp->rate_limiting->refill_bucket_event,
-			&bevp->rate_limiting->cfg->tick_timeout) < 0)
+		if (_bev_refill_schedule(bevp) < 0)
 			r = -1;
 	} else if (old_limit <= 0 && new_limit > 0) {
 		if (!(bevp->write_suspended & BEV_SUSPEND_BW))
@@ -940,8 +1252,7 @@ bufferevent_decrement_write_limit(struct bufferevent *bev, ev_ssize_t decr)
 	new_limit = (bevp->rate_limiting->limit.write_limit -= decr);
 	if (old_limit > 0 && new_limit <= 0) {
 		bufferevent_suspend_write(bev, BEV_SUSPEND_BW);
-		if (event_add(&bevp->rate_limiting->refill_bucket_event,
-			&bevp->rate_limiting->cfg->tick_timeout) < 0)
+		if (_bev_refill_schedule(bevp) < 0)
 			r = -1;
 	} else if (old_limit <= 0 && new_limit > 0) {
 		if (!(bevp->read_suspended & BEV_SUSPEND_BW))
@@ -959,17 +1270,21 @@ bufferevent_rate_limit_group_decrement_read(
 {
 	int r = 0;
 	ev_ssize_t old_limit, new_limit;
-	LOCK_GROUP(grp);
-	old_limit = grp->rate_limit.read_limit;
-	new_limit = (grp->rate_limit.read_limit -= decr);
-
-	if (old_limit > 0 && new_limit <= 0) {
-		_bev_group_suspend_reading(grp);
-	} else if (old_limit <= 0 && new_limit > 0) {
-		_bev_group_unsuspend_reading(grp);
+	struct bufferevent_rate_limit_group *g;
+	_bev_group_lock_chain(grp);
+	/* The groups above this one are charged as well. */
+	for (g = grp; g; g = g->parent) {
+		old_limit = g->rate_limit.read_limit;
+		new_limit = (g->rate_limit.read_limit -= decr);
+
+		if (old_limit > 0 && new_limit <= 0) {
+			_bev_group_suspend_reading(g);
+		} else if (old_limit <= 0 && new_limit > 0) {
+			_bev_group_unsuspend_reading(g);
+		}
 	}
 
-	UNLOCK_GROUP(grp);
+	_bev_group_unlock_chain(grp);
 	return r;
 }
 
@@ -979,17 +1294,21 @@ bufferevent_rate_limit_group_decrement_write(
 {
 	int r = 0;
 	ev_ssize_t old_limit, new_limit;
-	LOCK_GROUP(grp);
-	old_limit = grp->rate_limit.write_limit;
-	new_limit = (grp->rate_limit.write_limit -= decr);
-
-	if (old_limit > 0 && new_limit <= 0) {
-		_bev_group_suspend_writing(grp);
-	} else if (old_limit <= 0 && new_limit > 0) {
-		_bev_group_unsuspend_writing(grp);
+	struct bufferevent_rate_limit_group *g;
+	_bev_group_lock_chain(grp);
+	/* The groups above this one are charged as well. */
+	for (g = grp; g; g = g->parent) {
+		old_limit = g->rate_limit.write_limit;
+		new_limit = (g->rate_limit.write_limit -= decr);
+
+		if (old_limit > 0 && new_limit <= 0) {
+			_bev_group_suspend_writing(g);
+		} else if (old_limit <= 0 && new_limit > 0) {
+			_bev_group_unsuspend_writing(g);
+		}
 	}
 
-	UNLOCK_GROUP(grp);
+	_bev_group_unlock_chain(grp);
 	return r;
 }
 
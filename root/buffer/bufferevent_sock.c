@@ -38,6 +38,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #ifdef _EVENT_HAVE_STDARG_H
 #include <stdarg.h>
 #endif
@@ -63,12 +64,14 @@
 #include "event2/util.h"
 #include "event2/bufferevent.h"
 #include "event2/buffer.h"
+#include "event2/buffer_compat.h"
 #include "event2/bufferevent_struct.h"
 #include "event2/bufferevent_compat.h"
 #include "event2/event.h"
 #include "log-internal.h"
 #include "mm-internal.h"
 #include "bufferevent-internal.h"
+#include "evbuffer-internal.h"
 #include "util-internal.h"
 #ifdef WIN32
 #include "iocp-internal.h"
@@ -83,6 +86,7 @@ static int be_socket_flush(struct bufferevent *, short, enum bufferevent_flush_m
 static int be_socket_ctrl(struct bufferevent *, enum bufferevent_ctrl_op, union bufferevent_ctrl_data *);
 
 static void be_socket_setfd(struct bufferevent *, evutil_socket_t);
+static void be_socket_autosize_write(struct bufferevent *);
 
 const struct bufferevent_ops bufferevent_ops_socket = {
 	"socket",
@@ -162,7 +166,14 @@ bufferevent_readcb(evutil_socket_t fd, short event, void *arg)
 		goto done;
 
 	evbuffer_unfreeze(input, 0);
-	res = evbuffer_read(input, fd, (int)howmuch); /* XXXX evbuffer_read would do better to take and return ev_ssize_t */
+	/* Only read more than evbuffer_read() usually would if somebody
+	 * asked for bigger reads. */
+	if (howmuch > INT_MAX)
+		howmuch = INT_MAX;
+	if (bufev_p->max_single_read_set)
+		res = _evbuffer_read(input, fd, (int)howmuch, (int)howmuch);
+	else
+		res = evbuffer_read(input, fd, (int)howmuch); /* XXXX evbuffer_read would do better to take and return ev_ssize_t */
 	evbuffer_freeze(input, 0);
 
 	if (res == -1) {
@@ -238,6 +249,8 @@ bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 			goto done;
 		} else {
 			connected = 1;
+			/* The send buffer is sized for the route by now. */
+			be_socket_autosize_write(bufev);
 #ifdef WIN32
 			if (BEV_IS_ASYNC(bufev)) {
 				event_del(&bufev->ev_write);
@@ -464,13 +477,362 @@ bufferevent_connect_getaddrinfo_cb(int result, struct evutil_addrinfo *ai,
 	evutil_freeaddrinfo(ai);
 }
 
+/* State for racing connection attempts to every address of a hostname, as
+ * described in RFC 8305 ("Happy Eyeballs").  The AAAA and A lookups run in
+ * parallel; we start connecting as soon as we have addresses, alternate
+ * between the families starting with IPv6, and start a new attempt every
+ * BEV_RACE_ATTEMPT_DELAY_MSEC until one of them connects.  The first socket
+ * to connect becomes the bufferevent's fd, and the rest are closed. */
+
+/* How long to wait for a AAAA answer once the A answer has arrived. */
+#define BEV_RACE_RESOLUTION_DELAY_MSEC 50
+/* How long to wait for one connection attempt before starting the next. */
+#define BEV_RACE_ATTEMPT_DELAY_MSEC 250
+
+struct bev_connect_race;
+
+struct bev_connect_attempt {
+	struct bev_connect_race *race;
+	/* EV_WRITE event on fd, used to learn when the connect finishes. */
+	struct event ev;
+	evutil_socket_t fd;
+	struct bev_connect_attempt *next;
+};
+
+struct bev_connect_race {
+	struct bufferevent *bev;
+	/* Outstanding lookups: slot 0 is for IPv6 (or for every address when
+	 * we only do one lookup); slot 1 is for IPv4. */
+	struct evdns_getaddrinfo_request *lookup[2];
+	/* Results of the lookups, freed with the race. */
+	struct evutil_addrinfo *results[2];
+	/* The next IPv6 and IPv4 address to try. */
+	struct evutil_addrinfo *next[2];
+	/* Number of lookups whose callbacks have not run yet. */
+	int lookups_pending;
+	/* The first error from a lookup, if any. */
+	int dns_error;
+	/* The most recent error from a connection attempt. */
+	int sock_error;
+	/* Connection attempts in progress. */
+	struct bev_connect_attempt *attempts;
+	/* Resolution delay, then connection attempt delay. */
+	struct event timer;
+	/* Which slot of 'next' we should use next. */
+	unsigned next_family : 1;
+	/* Have we finished the lookup for slot 0? */
+	unsigned lookup0_done : 1;
+	/* Have we started connecting? */
+	unsigned started : 1;
+	/* Have we made any connection attempt? */
+	unsigned tried_any : 1;
+	/* Have we connected or given up? */
+	unsigned done : 1;
+};
+
+static void bev_race_start_attempt(struct bev_connect_race *race);
+
+static struct evutil_addrinfo *
+bev_race_skip_to_family(struct evutil_addrinfo *ai, int family)
+{
+	while (ai && ai->ai_family != family)
+		ai = ai->ai_next;
+	return ai;
+}
+
+/* Return the next address to try, alternating address families. */
+static struct evutil_addrinfo *
+bev_race_next_addr(struct bev_connect_race *race)
+{
+	int i;
+	for (i = 0; i < 2; ++i) {
+		int idx = (race->next_family + i) & 1;
+		struct evutil_addrinfo *ai = race->next[idx];
+		if (ai) {
+			race->next[idx] = bev_race_skip_to_family(ai->ai_next,
+			    ai->ai_family);
+			race->next_family = !idx;
+			return ai;
+		}
+	}
+	return NULL;
+}
+
+static void
+bev_race_attempt_free(struct bev_connect_race *race,
+    struct bev_connect_attempt *attempt, int close_fd)
+{
+	struct bev_connect_attempt **ap;
+	for (ap = &race->attempts; *ap; ap = &(*ap)->next) {
+		if (*ap == attempt) {
+			*ap = attempt->next;
+			break;
+		}
+	}
+	event_del(&attempt->ev);
+	if (close_fd)
+		evutil_closesocket(attempt->fd);
+	mm_free(attempt);
+}
+
+/* Release the race once it is over and no lookup callback can still refer
+ * to it.  Drops the reference the race held on its bufferevent; the caller
+ * must hold another one. */
+static void
+bev_race_maybe_free(struct bev_connect_race *race)
+{
+	struct bufferevent *bev = race->bev;
+	int i;
+
+	if (!race->done || race->lookups_pending)
+		return;
+
+	EVUTIL_ASSERT(race->attempts == NULL);
+	event_del(&race->timer);
+	for (i = 0; i < 2; ++i) {
+		if (race->results[i])
+			evutil_freeaddrinfo(race->results[i]);
+	}
+	mm_free(race);
+	bufferevent_decref(bev);
+}
+
+/* Stop racing: close every losing attempt and cancel any lookups that are
+ * still outstanding. */
+static void
+bev_race_finish(struct bev_connect_race *race)
+{
+	struct bufferevent *bev = race->bev;
+	int i;
+
+	race->done = 1;
+	event_del(&race->timer);
+	while (race->attempts)
+		bev_race_attempt_free(race, race->attempts, 1);
+	for (i = 0; i < 2; ++i) {
+		if (race->lookup[i])
+			evutil_getaddrinfo_cancel_async(race->lookup[i]);
+	}
+
+	bufferevent_unsuspend_write(bev, BEV_SUSPEND_LOOKUP);
+	bufferevent_unsuspend_read(bev, BEV_SUSPEND_LOOKUP);
+}
+
+static void
+bev_race_won(struct bev_connect_race *race, evutil_socket_t fd)
+{
+	struct bufferevent *bev = race->bev;
+
+	bev_race_finish(race);
+	bufferevent_setfd(bev, fd);
+	_bufferevent_run_eventcb(bev, BEV_EVENT_CONNECTED);
+}
+
+/* Give up if there is nothing left to try and nothing left to wait for. */
+static void
+bev_race_maybe_fail(struct bev_connect_race *race)
+{
+	struct bufferevent *bev = race->bev;
+	struct bufferevent_private *bev_p =
+	    EVUTIL_UPCAST(bev, struct bufferevent_private, bev);
+
+	if (race->done || race->attempts || race->lookups_pending)
+		return;
+
+	bev_race_finish(race);
+	if (race->tried_any) {
+		EVUTIL_SET_SOCKET_ERROR(race->sock_error);
+	} else {
+		bev_p->dns_error = race->dns_error ?
+		    race->dns_error : EVUTIL_EAI_NONAME;
+	}
+	_bufferevent_run_eventcb(bev, BEV_EVENT_ERROR);
+}
+
+static void
+bev_race_attempt_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bev_connect_attempt *attempt = arg;
+	struct bev_connect_race *race = attempt->race;
+	struct bufferevent *bev = race->bev;
+	int c;
+
+	_bufferevent_incref_and_lock(bev);
+
+	c = evutil_socket_finished_connecting(fd);
+	if (c == 0) {
+		event_add(&attempt->ev, NULL);
+	} else if (c > 0) {
+		bev_race_attempt_free(race, attempt, 0);
+		bev_race_won(race, fd);
+	} else {
+		/* This one failed; don't wait for the timer to try the next
+		 * address. */
+		race->sock_error = EVUTIL_SOCKET_ERROR();
+		bev_race_attempt_free(race, attempt, 1);
+		event_del(&race->timer);
+		bev_race_start_attempt(race);
+	}
+	bev_race_maybe_free(race);
+
+	_bufferevent_decref_and_unlock(bev);
+}
+
+/* Start a connection attempt to the next address we have, if any. */
+static void
+bev_race_start_attempt(struct bev_connect_race *race)
+{
+	struct bufferevent *bev = race->bev;
+	struct evutil_addrinfo *ai;
+	struct timeval tv;
+
+	while (!race->done && (ai = bev_race_next_addr(race))) {
+		struct bev_connect_attempt *attempt;
+		evutil_socket_t fd = -1;
+		int r;
+
+		race->tried_any = 1;
+		r = evutil_socket_connect(&fd, ai->ai_addr, (int)ai->ai_addrlen);
+		if (r < 0 || r == 2) {
+			race->sock_error = EVUTIL_SOCKET_ERROR();
+			if (fd >= 0)
+				evutil_closesocket(fd);
+			continue;
+		}
+		if (r == 1) {
+			/* The connect succeeded already. */
+			bev_race_won(race, fd);
+			return;
+		}
+
+		attempt = mm_calloc(1, sizeof(*attempt));
+		if (!attempt) {
+			race->sock_error = ENOMEM;
+			evutil_closesocket(fd);
+			continue;
+		}
+		attempt->race = race;
+		attempt->fd = fd;
+		event_assign(&attempt->ev, bev->ev_base, fd, EV_WRITE,
+		    bev_race_attempt_cb, attempt);
+		if (event_add(&attempt->ev, NULL) < 0) {
+			race->sock_error = ENOMEM;
+			evutil_closesocket(fd);
+			mm_free(attempt);
+			continue;
+		}
+		attempt->next = race->attempts;
+		race->attempts = attempt;
+
+		tv.tv_sec = 0;
+		tv.tv_usec = BEV_RACE_ATTEMPT_DELAY_MSEC * 1000;
+		event_add(&race->timer, &tv);
+		return;
+	}
+
+	bev_race_maybe_fail(race);
+}
+
+/* Called whenever the race has new information: decide whether to start
+ * connecting now, or to keep waiting. */
+static void
+bev_race_progress(struct bev_connect_race *race)
+{
+	struct timeval tv;
+
+	if (race->done)
+		return;
+
+	if (!race->started) {
+		if (race->lookup0_done || !race->lookups_pending) {
+			race->started = 1;
+			event_del(&race->timer);
+		} else {
+			/* We have A answers, but the AAAA answers might be
+			 * along shortly. */
+			if (race->next[1] &&
+			    !evtimer_pending(&race->timer, NULL)) {
+				tv.tv_sec = 0;
+				tv.tv_usec =
+				    BEV_RACE_RESOLUTION_DELAY_MSEC * 1000;
+				event_add(&race->timer, &tv);
+			}
+			return;
+		}
+	}
+
+	/* If we're between attempts, new addresses can go right now.
+	 * Otherwise the timer will pick them up. */
+	if (!evtimer_pending(&race->timer, NULL))
+		bev_race_start_attempt(race);
+}
+
+static void
+bev_race_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bev_connect_race *race = arg;
+	struct bufferevent *bev = race->bev;
+
+	_bufferevent_incref_and_lock(bev);
+	race->started = 1;
+	bev_race_start_attempt(race);
+	bev_race_maybe_free(race);
+	_bufferevent_decref_and_unlock(bev);
+}
+
+static void
+bev_race_lookup_done(struct bev_connect_race *race, int slot, int result,
+    struct evutil_addrinfo *ai)
+{
+	struct bufferevent *bev = race->bev;
+
+	_bufferevent_incref_and_lock(bev);
+
+	race->lookup[slot] = NULL;
+	--race->lookups_pending;
+	if (slot == 0)
+		race->lookup0_done = 1;
+
+	if (race->done || result != 0) {
+		if (result != 0 && !race->dns_error)
+			race->dns_error = result;
+		if (ai)
+			evutil_freeaddrinfo(ai);
+	} else if (ai) {
+		race->results[slot] = ai;
+		if (slot == 0) {
+			race->next[0] = bev_race_skip_to_family(ai, AF_INET6);
+			race->next[1] = bev_race_skip_to_family(ai, AF_INET);
+		} else {
+			race->next[1] = bev_race_skip_to_family(ai, AF_INET);
+		}
+	}
+
+	bev_race_progress(race);
+	bev_race_maybe_free(race);
+
+	_bufferevent_decref_and_unlock(bev);
+}
+
+static void
+bev_race_lookup0_cb(int result, struct evutil_addrinfo *ai, void *arg)
+{
+	bev_race_lookup_done(arg, 0, result, ai);
+}
+
+static void
+bev_race_lookup1_cb(int result, struct evutil_addrinfo *ai, void *arg)
+{
+	bev_race_lookup_done(arg, 1, result, ai);
+}
+
 int
 bufferevent_socket_connect_hostname(struct bufferevent *bev,
     struct evdns_base *evdns_base, int family, const char *hostname, int port)
 {
 	char portbuf[10];
 	struct evutil_addrinfo hint;
-	int err;
+	struct bev_connect_race *race;
 	struct bufferevent_private *bev_p =
 	    EVUTIL_UPCAST(bev, struct bufferevent_private, bev);
 
@@ -479,9 +841,8 @@ bufferevent_socket_connect_hostname(struct bufferevent *bev,
 	if (port < 1 || port > 65535)
 		return -1;
 
-	BEV_LOCK(bev);
+	_bufferevent_incref_and_lock(bev);
 	bev_p->dns_error = 0;
-	BEV_UNLOCK(bev);
 
 	evutil_snprintf(portbuf, sizeof(portbuf), "%d", port);
 
@@ -493,17 +854,55 @@ bufferevent_socket_connect_hostname(struct bufferevent *bev,
 	bufferevent_suspend_write(bev, BEV_SUSPEND_LOOKUP);
 	bufferevent_suspend_read(bev, BEV_SUSPEND_LOOKUP);
 
-	bufferevent_incref(bev);
-	err = evutil_getaddrinfo_async(evdns_base, hostname, portbuf,
-	    &hint, bufferevent_connect_getaddrinfo_cb, bev);
-
-	if (err == 0) {
+	/* A socket the caller gave us can only be connected once, so there's
+	 * nothing to race: connect it to the first address we get. */
+	if (bufferevent_getfd(bev) >= 0
+#ifdef WIN32
+	    || BEV_IS_ASYNC(bev)
+#endif
+	    ) {
+		bufferevent_incref(bev);
+		evutil_getaddrinfo_async(evdns_base, hostname, portbuf,
+		    &hint, bufferevent_connect_getaddrinfo_cb, bev);
+		_bufferevent_decref_and_unlock(bev);
 		return 0;
-	} else {
+	}
+
+	race = mm_calloc(1, sizeof(*race));
+	if (!race) {
 		bufferevent_unsuspend_write(bev, BEV_SUSPEND_LOOKUP);
 		bufferevent_unsuspend_read(bev, BEV_SUSPEND_LOOKUP);
+		_bufferevent_decref_and_unlock(bev);
 		return -1;
 	}
+	race->bev = bev;
+	evtimer_assign(&race->timer, bev->ev_base, bev_race_timer_cb, race);
+	bufferevent_incref(bev);
+
+	/* With a nameserver and no family preference, look up AAAA and A
+	 * separately so that we can start on whichever answers first.  The
+	 * blocking resolver gives us everything at once anyway. The extra
+	 * pending lookup keeps the race alive if the callbacks run before we
+	 * return. */
+	if (family == AF_UNSPEC && evdns_base) {
+		race->lookups_pending = 3;
+		hint.ai_family = AF_INET6;
+		race->lookup[0] = evutil_getaddrinfo_async(evdns_base,
+		    hostname, portbuf, &hint, bev_race_lookup0_cb, race);
+		hint.ai_family = AF_INET;
+		race->lookup[1] = evutil_getaddrinfo_async(evdns_base,
+		    hostname, portbuf, &hint, bev_race_lookup1_cb, race);
+	} else {
+		race->lookups_pending = 2;
+		race->lookup[0] = evutil_getaddrinfo_async(evdns_base,
+		    hostname, portbuf, &hint, bev_race_lookup0_cb, race);
+	}
+	--race->lookups_pending;
+	bev_race_progress(race);
+	bev_race_maybe_free(race);
+
+	_bufferevent_decref_and_unlock(bev);
+	return 0;
 }
 
 int
@@ -515,7 +914,7 @@ bufferevent_socket_get_dns_error(struct bufferevent *bev)
 
 	BEV_LOCK(bev);
 	rv = bev_p->dns_error;
-	BEV_LOCK(bev);
+	BEV_UNLOCK(bev);
 
 	return rv;
 }
@@ -617,6 +1016,64 @@ be_socket_flush(struct bufferevent *bev, short iotype,
 }
 
 
+#ifdef __linux__
+/* The most payload the kernel will pack into a single GSO/TSO
+ * super-packet. */
+#define BEV_GSO_SEGMENT_MAX 65536
+#endif
+
+/** If write autosizing is on for <b>bufev</b>, set its max_single_write from
+ * the current send buffer size of its socket. */
+static void
+be_socket_autosize_write(struct bufferevent *bufev)
+{
+#ifdef __linux__
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	evutil_socket_t fd = event_get_fd(&bufev->ev_write);
+	int sndbuf = 0;
+	ev_socklen_t len = sizeof(sndbuf);
+
+	if (!bufev_p->write_autosize || fd < 0)
+		return;
+	if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void *)&sndbuf, &len) < 0 ||
+	    sndbuf <= 0)
+		return;
+	/* Hand the kernel whole segments, so that it can coalesce what we
+	 * write into as few packets as it likes. */
+	sndbuf -= sndbuf % BEV_GSO_SEGMENT_MAX;
+	if (sndbuf < BEV_GSO_SEGMENT_MAX)
+		sndbuf = BEV_GSO_SEGMENT_MAX;
+	bufev_p->max_single_write = sndbuf;
+#endif
+}
+
+int
+bufferevent_socket_set_write_autosize(struct bufferevent *bev, int enable)
+{
+#ifdef __linux__
+	struct bufferevent_private *bev_p =
+	    EVUTIL_UPCAST(bev, struct bufferevent_private, bev);
+	int r = -1;
+
+	BEV_LOCK(bev);
+	if (bev->be_ops != &bufferevent_ops_socket)
+		goto done;
+	if (enable) {
+		bev_p->write_autosize = 1;
+		be_socket_autosize_write(bev);
+	} else if (bev_p->write_autosize) {
+		bufferevent_set_max_single_write(bev, 0);
+	}
+	r = 0;
+done:
+	BEV_UNLOCK(bev);
+	return r;
+#else
+	return -1;
+#endif
+}
+
 static void
 be_socket_setfd(struct bufferevent *bufev, evutil_socket_t fd)
 {
@@ -630,6 +1087,7 @@ be_socket_setfd(struct bufferevent *bufev, evutil_socket_t fd)
 	    EV_READ|EV_PERSIST, bufferevent_readcb, bufev);
 	event_assign(&bufev->ev_write, bufev->ev_base, fd,
 	    EV_WRITE|EV_PERSIST, bufferevent_writecb, bufev);
+	be_socket_autosize_write(bufev);
 
 	if (fd >= 0)
 		bufferevent_enable(bufev, bufev->enabled);
@@ -261,6 +261,11 @@ int _evbuffer_read_setup_vecs(struct evbuffer *buf, ev_ssize_t howmuch,
     struct evbuffer_iovec *vecs, int n_vecs, struct evbuffer_chain ***chainp,
     int exact);
 
+/** As evbuffer_read, but reads up to max_read bytes at once if the socket
+ * has that many waiting, instead of the usual 4096. */
+int _evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch,
+    int max_read);
+
 /* Helper macro: copies an evbuffer_iovec in ei to a win32 WSABUF in i. */
 #define WSABUF_FROM_EVBUFFER_IOV(i,ei) do {		\
 		(i)->buf = (ei)->iov_base;		\
@@ -48,9 +48,15 @@
  * Version: 0.1b
  */
 
-#include <sys/types.h>
 #include "event2/event-config.h"
 
+#if defined(_EVENT_HAVE_RECVMMSG) || defined(_EVENT_HAVE_SENDMMSG)
+/* glibc only declares recvmmsg() and sendmmsg() for _GNU_SOURCE. */
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+
 #ifndef _FORTIFY_SOURCE
 #define _FORTIFY_SOURCE 3
 #endif
@@ -90,6 +96,7 @@
 #include "event2/event_struct.h"
 #include "event2/thread.h"
 
+#include "event2/buffer.h"
 #include "event2/bufferevent.h"
 #include "event2/bufferevent_struct.h"
 #include "bufferevent-internal.h"
@@ -101,6 +108,7 @@
 #include "ipv6-internal.h"
 #include "util-internal.h"
 #include "evthread-internal.h"
+#include "ht-internal.h"
 #ifdef WIN32
 #include <ctype.h>
 #include <winsock2.h>
@@ -138,6 +146,11 @@
 #define u16 ev_uint16_t
 #define u8  ev_uint8_t
 
+/* nameserver_pick ignores latency once in this many picks */
+#define EVDNS_EXPLORE_INTERVAL 16
+/* Never hedge a request sooner than this many usec after sending it. */
+#define EVDNS_HEDGE_MIN_USEC 5000
+
 /* maximum number of addresses from a single packet */
 /* that we bother recording */
 #define MAX_V4_ADDRS 32
@@ -149,9 +162,16 @@
 #define TYPE_PTR       EVDNS_TYPE_PTR
 #define TYPE_SOA       EVDNS_TYPE_SOA
 #define TYPE_AAAA      EVDNS_TYPE_AAAA
+#define TYPE_OPT       41
 
 #define CLASS_INET     EVDNS_CLASS_INET
 
+/* Largest UDP payload size we'll advertise with EDNS0, and so the largest
+ * datagram we need to be able to read. */
+#define EVDNS_MAX_UDP_SIZE 4096
+/* Length of the OPT pseudo-record we add to queries when using EDNS0. */
+#define EVDNS_OPT_LEN 11
+
 /* Persistent handle.  We keep this separate from 'struct request' since we
  * need some object to last for as long as an evdns_request is outstanding so
  * that it can be canceled, whereas a search request can lead to multiple
@@ -187,8 +207,20 @@ struct request {
 	struct event timeout_event;
 
 	u16 trans_id;  /* the transaction id */
+	/* When we last sent the request, for timing the reply, by the
+	 * base's monotonic clock. */
+	struct timeval sent_at;
+	/* If we sent a hedged copy of the request to a second server, that
+	 * server. */
+	struct nameserver *hedge_ns;
 	unsigned request_appended :1;	/* true if the request pointer is data which follows this struct */
 	unsigned transmit_me :1;  /* needs to be transmitted */
+	unsigned cached :1;  /* will be answered from the answer cache */
+	unsigned probe :1;  /* checks whether ns is up; only ns may answer it */
+	unsigned in_question_map :1;  /* other requests may coalesce onto us */
+	unsigned edns :1;  /* the request ends with an EDNS0 OPT record */
+	unsigned tcp :1;  /* the UDP reply was truncated; ask over TCP */
+	unsigned hedge_pending :1;  /* timeout_event is the hedge delay */
 
 	/* XXXX This is a horrible hack. */
 	char **put_cname_in_ptr; /* store the cname here if we get one. */
@@ -196,6 +228,13 @@ struct request {
 	struct evdns_base *base;
 
 	struct evdns_request *handle;
+
+	/* If we asked the same question as an outstanding request, we don't
+	 * send anything ourselves: we sit on the 'followers' list of that
+	 * request ('leader') and share its answer. */
+	struct request *leader;
+	struct request *followers;
+	HT_ENTRY(request) question_node;
 };
 
 struct reply {
@@ -233,17 +272,70 @@ struct nameserver {
 	char state;  /* zero if we think that this server is down */
 	char choked;  /* true if we have an EAGAIN from this server's socket */
 	char write_waiting;  /* true if we are waiting for EV_WRITE events */
+	char tcp_connected;  /* true once tcp_bev has finished connecting */
+	/* Smoothed round-trip time and its mean deviation, in usec, kept as
+	 * in RFC 6298.  srtt_usec is 0 until we've heard from the server. */
+	int srtt_usec;
+	int rttvar_usec;
+	int rtt_samples;  /* number of replies we've timed */
+	/* Connection for queries whose answers didn't fit in a datagram,
+	 * or NULL if we don't have one open. */
+	struct bufferevent *tcp_bev;
 	struct evdns_base *base;
 };
 
 
 /* Represents a local port where we're listening for DNS requests. Right now, */
 /* only UDP is supported. */
+/* How many datagrams we try to read with one recvmmsg() call, or write
+ * with one sendmmsg() call. */
+#ifdef _EVENT_HAVE_RECVMMSG
+#define EVDNS_RECV_BATCH 16
+#else
+#define EVDNS_RECV_BATCH 1
+#endif
+#define EVDNS_SEND_BATCH 16
+
+/* Space for the datagrams read by one call to evdns_recv_batch(). */
+struct evdns_recv_batch {
+#ifdef _EVENT_HAVE_RECVMMSG
+	struct mmsghdr msgs[EVDNS_RECV_BATCH];
+	struct iovec iov[EVDNS_RECV_BATCH];
+#endif
+	struct sockaddr_storage addrs[EVDNS_RECV_BATCH];
+	ev_socklen_t addrlens[EVDNS_RECV_BATCH];
+	int lens[EVDNS_RECV_BATCH];
+	u8 packets[EVDNS_RECV_BATCH][EVDNS_MAX_UDP_SIZE];
+};
+
+/* This is an inefficient representation; only use it via the dnslabel_table_*
+ * functions, so that is can be safely replaced with something smarter later. */
+#define MAX_LABELS 128
+/* Bytes of name suffixes a dnslabel_table can remember. */
+#define MAX_LABEL_SPACE 2048
+/* Structures used to implement name compression */
+struct dnslabel_entry { char *v; off_t pos; };
+struct dnslabel_table {
+	int n_labels; /* number of current entries */
+	/* map from name to position in message */
+	struct dnslabel_entry labels[MAX_LABELS];
+	/* the names that the entries point into */
+	size_t space_used;
+	char space[MAX_LABEL_SPACE];
+};
+
+/* We never send a response longer than this; longer ones are truncated. */
+#define EVDNS_SERVER_MAX_RESPONSE 512
+
 struct evdns_server_port {
 	evutil_socket_t socket; /* socket we use to read queries and write replies. */
 	int refcnt; /* reference count. */
 	char choked; /* Are we currently blocked from writing? */
 	char closing; /* Are we trying to close this port, pending writes? */
+	/* True while we're handling a batch of requests; replies made
+	 * meanwhile are queued and sent together afterwards. */
+	char batching;
+	struct evdns_recv_batch *recv_batch;
 	evdns_request_callback_fn_type user_callback; /* Fn to handle requests */
 	void *user_data; /* Opaque pointer passed to user_callback */
 	struct event event; /* Read/write event */
@@ -251,6 +343,16 @@ struct evdns_server_port {
 	struct server_request *pending_replies;
 	struct event_base *event_base;
 
+	/* We format responses in place here rather than allocating memory
+	 * for each one.  During a batch, the i'th response queued uses
+	 * responses[i]; otherwise only responses[0] is used, and only
+	 * until the response is sent.  A response that has to wait for
+	 * the socket gets copied to the heap. */
+	u8 responses[EVDNS_SEND_BATCH][EVDNS_SERVER_MAX_RESPONSE];
+	int n_responses; /* how many of responses are in use */
+	/* Name compression table, reused for every response. */
+	struct dnslabel_table label_table;
+
 #ifndef _EVENT_DISABLE_THREAD_SUPPORT
 	void *lock;
 #endif
@@ -294,25 +396,66 @@ struct server_request {
 	/* Once this is set, the RR fields are cleared, and no more should be set. */
 	char *response;
 	size_t response_len;
+	/* True if response points into port->responses. */
+	char response_borrowed;
 
 	/* Caller-visible fields: flags, questions. */
 	struct evdns_server_request base;
 };
 
+/* An answer (or a negative answer) that we remember from a nameserver.
+ * Entries are indexed by lowercased name and query type. */
+struct evdns_cache_entry {
+	HT_ENTRY(evdns_cache_entry) node;
+	/* Most recently used entries are at the head of the list. */
+	TAILQ_ENTRY(evdns_cache_entry) lru;
+	char *name;  /* the text string is appended to this structure */
+	u8 type;  /* TYPE_PTR or TYPE_A or TYPE_AAAA */
+	u32 err;  /* 0, or DNS_ERR_NOTEXIST/DNS_ERR_NODATA if negative */
+	u8 refreshing;  /* true once we've asked for a fresh answer */
+	u32 ttl;  /* how long the entry was good for when we stored it */
+	time_t expires;
+	struct reply reply;
+};
+
+/* The entries of a hosts file, in file order and indexed by name. */
+struct hosts_db {
+	TAILQ_HEAD(hosts_list, hosts_entry) entries;
+	HT_HEAD(evdns_hosts_map, hosts_entry) by_name;
+};
+
+/* A hosts file that we're parsing a slice at a time; it replaces the
+ * current hosts_db once we reach the end. */
+struct hosts_reload {
+	struct hosts_db *db;
+	char *text;  /* the file contents; needs to be free()ed */
+	char *pos;  /* the next line to parse, or NULL at the end */
+	struct event event;
+};
+
 struct evdns_base {
 	/* An array of n_req_heads circular lists for inflight requests.
-	 * Each inflight request req is in req_heads[req->trans_id % n_req_heads].
+	 * Each inflight request req is in
+	 * req_heads[req->trans_id & (n_req_heads-1)].  n_req_heads is a power
+	 * of two no smaller than the inflight limit, so the lists are about
+	 * one request long; at 65536 every transaction id has its own slot.
 	 */
 	struct request **req_heads;
 	/* A circular list of requests that we're waiting to send, but haven't
 	 * sent yet because there are too many requests inflight */
 	struct request *req_waiting_head;
+	/* A circular list of requests that we're going to answer from the
+	 * answer cache on the next pass through the event loop. */
+	struct request *req_cached_head;
 	/* A circular list of nameservers. */
 	struct nameserver *server_head;
 	int n_req_heads;
 
 	struct event_base *event_base;
 
+	/* Where nameserver_read puts the replies it reads. */
+	struct evdns_recv_batch *recv_batch;
+
 	/* The number of good nameservers that we have */
 	int global_good_nameservers;
 
@@ -351,7 +494,36 @@ struct evdns_base {
 
 	struct search_state *global_search_state;
 
-	TAILQ_HEAD(hosts_list, hosts_entry) hostsdb;
+	struct hosts_db *hostsdb;
+	/* Set while evdns_base_reload_hosts is parsing a new hosts file. */
+	struct hosts_reload *hosts_reload;
+
+	/* The answer cache; disabled when cache_max_entries is 0. */
+	HT_HEAD(evdns_cache_map, evdns_cache_entry) cache;
+	TAILQ_HEAD(evdns_cache_lru, evdns_cache_entry) cache_lru;
+
+	/* Requests that we've sent or queued, indexed by question, so that
+	 * identical queries can share one trip to the nameserver. */
+	HT_HEAD(evdns_question_map, request) questions;
+	int cache_max_entries;
+	/* TTLs from nameservers are clamped to [cache_min_ttl,cache_max_ttl]
+	 * before we store an answer. */
+	u32 cache_min_ttl;
+	u32 cache_max_ttl;
+	/* A hit on an entry within the last cache_prefetch_pct percent of
+	 * its TTL makes us ask for a fresh answer in the background. */
+	int cache_prefetch_pct;
+	ev_uint64_t cache_hits;
+	ev_uint64_t cache_misses;
+
+	/* UDP payload size we advertise with EDNS0, or 0 not to use EDNS0. */
+	int edns_udp_size;
+
+	/* True if we send a second copy of a slow request to another
+	 * nameserver. */
+	int hedge_requests;
+	/* How many times nameserver_pick has been called. */
+	unsigned n_picks;
 
 #ifndef _EVENT_DISABLE_THREAD_SUPPORT
 	void *lock;
@@ -360,15 +532,70 @@ struct evdns_base {
 
 struct hosts_entry {
 	TAILQ_ENTRY(hosts_entry) next;
+	/* Only the first entry for each name is in the by_name table; later
+	 * ones follow it on the same_name list, in file order. */
+	HT_ENTRY(hosts_entry) node;
+	struct hosts_entry *same_name_next;
 	union {
 		struct sockaddr sa;
 		struct sockaddr_in sin;
 		struct sockaddr_in6 sin6;
 	} addr;
 	int addrlen;
-	char hostname[1];
+	char *hostname;  /* the text string is appended to this structure */
 };
 
+static unsigned
+hosts_entry_hash(const struct hosts_entry *e)
+{
+	/* names match case-insensitively, so hash them that way. */
+	const char *cp;
+	unsigned h = 0;
+	for (cp = e->hostname; *cp; ++cp)
+		h = (h * 33) + (u8)EVUTIL_TOLOWER(*cp);
+	return ht_improve_hash(h);
+}
+
+static int
+hosts_entry_eq(const struct hosts_entry *a, const struct hosts_entry *b)
+{
+	return !evutil_ascii_strcasecmp(a->hostname, b->hostname);
+}
+
+HT_PROTOTYPE(evdns_hosts_map, hosts_entry, node, hosts_entry_hash, hosts_entry_eq)
+HT_GENERATE(evdns_hosts_map, hosts_entry, node, hosts_entry_hash, hosts_entry_eq,
+    0.5, mm_malloc, mm_realloc, mm_free)
+
+/* Index of outstanding requests by question; see "Query coalescing". */
+static unsigned
+request_question_hash(const struct request *req)
+{
+	/* the question name follows the header; label lengths are all
+	 * under 64, so lowercasing them does no harm. */
+	const u8 *cp = req->request + 12;
+	unsigned h = req->request_type;
+	while (*cp)
+		h = (h * 33) + (u8)EVUTIL_TOLOWER((char)*cp++);
+	return ht_improve_hash(h);
+}
+
+static int
+request_question_eq(const struct request *a, const struct request *b)
+{
+	const u8 *pa = a->request + 12, *pb = b->request + 12;
+	if (a->request_type != b->request_type)
+		return 0;
+	for (;; ++pa, ++pb) {
+		if (EVUTIL_TOLOWER((char)*pa) != EVUTIL_TOLOWER((char)*pb))
+			return 0;
+		if (!*pa)
+			return 1;
+	}
+}
+
+HT_PROTOTYPE(evdns_question_map, request, question_node,
+    request_question_hash, request_question_eq)
+
 static struct evdns_base *current_base = NULL;
 
 struct evdns_base *
@@ -383,7 +610,7 @@ evdns_get_global_base(void)
 	((struct server_request*)					\
 	  (((char*)(base_ptr) - evutil_offsetof(struct server_request, base))))
 
-#define REQ_HEAD(base, id) ((base)->req_heads[id % (base)->n_req_heads])
+#define REQ_HEAD(base, id) ((base)->req_heads[(id) & ((base)->n_req_heads - 1)])
 
 static struct nameserver *nameserver_pick(struct evdns_base *base);
 static void evdns_request_insert(struct request *req, struct request **head);
@@ -391,6 +618,7 @@ static void evdns_request_remove(struct request *req, struct request **head);
 static void nameserver_ready_callback(evutil_socket_t fd, short events, void *arg);
 static int evdns_transmit(struct evdns_base *base);
 static int evdns_request_transmit(struct request *req);
+static int evdns_request_transmit_to(struct request *req, struct nameserver *server);
 static void nameserver_send_probe(struct nameserver *const ns);
 static void search_request_finished(struct evdns_request *const);
 static int search_try_next(struct evdns_request *const req);
@@ -399,15 +627,31 @@ static void evdns_requests_pump_waiting_queue(struct evdns_base *base);
 static u16 transaction_id_pick(struct evdns_base *base);
 static struct request *request_new(struct evdns_base *base, struct evdns_request *handle, int type, const char *name, int flags, evdns_callback_type callback, void *ptr);
 static void request_submit(struct request *const req);
+static struct request **request_list_head(struct request *req);
+static int name_parse(u8 *packet, int length, int *idx, char *name_out, int name_out_len);
+static void evdns_cache_store(struct request *req, u32 ttl, u32 err, struct reply *reply);
+static void evdns_cache_clear(struct evdns_base *base);
+static void request_fanout(struct request *leader, u32 ttl, u32 err, struct reply *reply, int try_search);
+static void request_resubmit(struct request *req);
+static int nameserver_tcp_send(struct nameserver *ns, struct request *req);
+static void request_note_reply(struct request *req, struct nameserver *ns);
+static void nameserver_tcp_close(struct nameserver *ns);
 
 static int server_request_free(struct server_request *req);
 static void server_request_free_answers(struct server_request *req);
 static void server_port_free(struct evdns_server_port *port);
 static void server_port_ready_callback(evutil_socket_t fd, short events, void *arg);
+static void server_port_choke(struct evdns_server_port *port);
+static int server_port_send_pending(struct evdns_server_port *port);
+static int server_request_keep_response(struct server_request *req);
+static int server_port_keep_pending(struct evdns_server_port *port);
 static int evdns_base_resolv_conf_parse_impl(struct evdns_base *base, int flags, const char *const filename);
 static int evdns_base_set_option_impl(struct evdns_base *base,
     const char *option, const char *val, int flags);
 static void evdns_base_free_and_unlock(struct evdns_base *base, int fail_requests);
+static struct hosts_db *hosts_db_new(void);
+static void hosts_db_free(struct hosts_db *db);
+static void evdns_hosts_reload_cancel(struct evdns_base *base);
 
 static int strtoint(const char *const str);
 
@@ -654,10 +898,26 @@ request_finished(struct request *const req, struct request **head, int free_hand
 	if (head)
 		evdns_request_remove(req, head);
 
+	if (req->in_question_map) {
+		HT_REMOVE(evdns_question_map, &base->questions, req);
+		req->in_question_map = 0;
+	}
+	/* If we're going away without an answer (say, we were canceled),
+	 * the requests that were waiting on us have to ask for themselves. */
+	while (req->followers) {
+		struct request *follower = req->followers;
+		evdns_request_remove(follower, &req->followers);
+		follower->leader = NULL;
+		request_resubmit(follower);
+	}
+
 	log(EVDNS_LOG_DEBUG, "Removing timeout for request %p", req);
 	if (was_inflight) {
 		evtimer_del(&req->timeout_event);
-		base->global_requests_inflight--;
+		/* requests answered from the cache or coalesced onto another
+		 * request never took a slot */
+		if (!req->cached && !req->leader)
+			base->global_requests_inflight--;
 	} else {
 		base->global_requests_waiting--;
 	}
@@ -842,6 +1102,16 @@ reply_schedule_callback(struct request *const req, u32 ttl, u32 err, struct repl
 }
 
 /* this processes a parsed reply packet */
+/* Remove the EDNS0 OPT record from the end of req's packet. */
+static void
+request_strip_edns(struct request *const req)
+{
+	EVUTIL_ASSERT(req->edns);
+	req->request_len -= EVDNS_OPT_LEN;
+	req->request[10] = req->request[11] = 0;  /* no additional */
+	req->edns = 0;
+}
+
 static void
 reply_handle(struct request *const req, u16 flags, u32 ttl, struct reply *reply) {
 	int error;
@@ -871,6 +1141,22 @@ reply_handle(struct request *const req, u16 flags, u32 ttl, struct reply *reply)
 			error = DNS_ERR_UNKNOWN;
 		}
 
+		if (error == DNS_ERR_TRUNCATED && !req->tcp) {
+			/* The answer didn't fit in a datagram; ask the same
+			 * server again over TCP. */
+			req->tcp = 1;
+			(void) evtimer_del(&req->timeout_event);
+			if (!evdns_request_transmit(req))
+				return;
+		} else if (error == DNS_ERR_FORMAT && req->edns) {
+			/* Probably a server that predates EDNS0: ask again
+			 * without the OPT record. */
+			request_strip_edns(req);
+			(void) evtimer_del(&req->timeout_event);
+			if (!evdns_request_transmit(req))
+				return;
+		}
+
 		switch (error) {
 		case DNS_ERR_NOTIMPL:
 		case DNS_ERR_REFUSED:
@@ -905,6 +1191,10 @@ reply_handle(struct request *const req, u16 flags, u32 ttl, struct reply *reply)
 			nameserver_up(req->ns);
 		}
 
+		if (error == DNS_ERR_NOTEXIST || error == DNS_ERR_NODATA)
+			evdns_cache_store(req, ttl, error, NULL);
+		request_fanout(req, ttl, error, NULL, 1);
+
 		if (req->handle->search_state &&
 		    req->request_type != TYPE_PTR) {
 			/* if we have a list of domains to search in,
@@ -924,7 +1214,9 @@ reply_handle(struct request *const req, u16 flags, u32 ttl, struct reply *reply)
 		request_finished(req, &REQ_HEAD(req->base, req->trans_id), 1);
 	} else {
 		/* all ok, tell the user */
+		evdns_cache_store(req, ttl, 0, reply);
 		reply_schedule_callback(req, ttl, 0, reply);
+		request_fanout(req, ttl, 0, reply, 0);
 		if (req->handle == req->ns->probe_request)
 			req->ns->probe_request = NULL; /* Avoid double-free */
 		nameserver_up(req->ns);
@@ -988,9 +1280,10 @@ name_parse(u8 *packet, int length, int *idx, char *name_out, int name_out_len) {
 	return -1;
 }
 
-/* parses a raw request from a nameserver */
+/* parses a raw request from the nameserver ns */
 static int
-reply_parse(struct evdns_base *base, u8 *packet, int length) {
+reply_parse(struct evdns_base *base, struct nameserver *ns, u8 *packet,
+    int length) {
 	int j = 0, k = 0;  /* index into packet */
 	u16 _t;	 /* used by the macros */
 	u32 _t32;  /* used by the macros */
@@ -1024,7 +1317,9 @@ reply_parse(struct evdns_base *base, u8 *packet, int length) {
 	/* If it's not an answer, it doesn't correspond to any request. */
 	if (!(flags & 0x8000)) return -1;  /* must be an answer */
 	if ((flags & 0x020f) && (flags & 0x020f) != DNS_ERR_NOTEXIST) {
-		/* there was an error and it's not NXDOMAIN */
+		/* there was an error and it's not NXDOMAIN; the header is
+		 * all there is to this reply. */
+		request_note_reply(req, ns);
 		goto err;
 	}
 	/* if (!answers) return; */  /* must have an answer of some form */
@@ -1179,6 +1474,9 @@ reply_parse(struct evdns_base *base, u8 *packet, int length) {
 	if (ttl_r == 0xffffffff)
 		ttl_r = 0;
 
+	/* Only a reply that made sense gets to say who answered, and how
+	 * fast. */
+	request_note_reply(req, ns);
 	reply_handle(req, flags, ttl_r, &reply);
 	return 0;
  err:
@@ -1311,7 +1609,7 @@ transaction_id_pick(struct evdns_base *base) {
 /* by updating the server_head global each time. */
 static struct nameserver *
 nameserver_pick(struct evdns_base *base) {
-	struct nameserver *started_at = base->server_head, *picked;
+	struct nameserver *started_at = base->server_head, *picked, *ns;
 	ASSERT_LOCKED(base);
 	if (!base->server_head) return NULL;
 
@@ -1322,6 +1620,29 @@ nameserver_pick(struct evdns_base *base) {
 		return base->server_head;
 	}
 
+	/* Usually we want the good server with the lowest smoothed RTT.
+	 * One that we haven't heard from yet counts as fastest, so every
+	 * server gets tried; one has to be more than an eighth faster to
+	 * beat a server earlier in the list, so that servers which are
+	 * about as fast as each other share the load.  Every
+	 * EVDNS_EXPLORE_INTERVAL picks we fall back to round-robin, so
+	 * that a server which was slow gets a chance to show it's better
+	 * now. */
+	if (++base->n_picks % EVDNS_EXPLORE_INTERVAL) {
+		picked = NULL;
+		ns = started_at;
+		do {
+			if (ns->state && (!picked ||
+				ns->srtt_usec < picked->srtt_usec -
+				picked->srtt_usec / 8))
+				picked = ns;
+			ns = ns->next;
+		} while (ns != started_at);
+		EVUTIL_ASSERT(picked);
+		base->server_head = picked->next;
+		return picked;
+	}
+
 	/* remember that nameservers are in a circular list */
 	for (;;) {
 		if (base->server_head->state) {
@@ -1344,20 +1665,168 @@ nameserver_pick(struct evdns_base *base) {
 	}
 }
 
+/* Convert tv to microseconds, capped at 2000 seconds. */
+static int
+timeval_to_usec(const struct timeval *tv)
+{
+	if (tv->tv_sec >= 2000)
+		return 2000000000;
+	return (int)(tv->tv_sec * 1000000 + tv->tv_usec);
+}
+
+/* Add a round-trip time sample to ns's smoothed RTT. */
+static void
+nameserver_rtt_sample(struct nameserver *ns, const struct timeval *rtt)
+{
+	int r, delta;
+
+	if (rtt->tv_sec < 0)
+		return;  /* the clock jumped */
+	r = timeval_to_usec(rtt);
+	if (r <= 0)
+		r = 1;
+	if (!ns->rtt_samples) {
+		ns->srtt_usec = r;
+		ns->rttvar_usec = r / 2;
+	} else {
+		delta = ns->srtt_usec - r;
+		if (delta < 0)
+			delta = -delta;
+		ns->rttvar_usec += (delta - ns->rttvar_usec) / 4;
+		ns->srtt_usec += (r - ns->srtt_usec) / 8;
+		if (ns->srtt_usec <= 0)
+			ns->srtt_usec = 1;
+	}
+	++ns->rtt_samples;
+}
+
+/* A request to ns timed out: move its smoothed RTT halfway towards the */
+/* timeout, so that we lean towards other servers for a while. */
+static void
+nameserver_rtt_timeout(struct nameserver *ns)
+{
+	const int timeout_usec = timeval_to_usec(&ns->base->global_timeout);
+
+	if (ns->srtt_usec < timeout_usec)
+		ns->srtt_usec += (timeout_usec - ns->srtt_usec) / 2;
+}
+
+/* We got a reply to req from ns: time it, if we can tell which */
+/* transmission it answers. */
+static void
+request_note_reply(struct request *req, struct nameserver *ns)
+{
+	struct timeval now, rtt = { 0, 0 };
+	/* We only time requests that went out once over UDP; a reply to a
+	 * retransmitted one could be for any of the copies. */
+	const int timeable = req->tx_count == 1 && !req->tcp;
+
+	if (timeable) {
+		_event_base_gettime_monotonic(req->base->event_base, &now);
+		evutil_timersub(&now, &req->sent_at, &rtt);
+	}
+	if (ns == req->ns) {
+		if (timeable)
+			nameserver_rtt_sample(ns, &rtt);
+	} else if (ns && ns == req->hedge_ns) {
+		/* The hedge won: the first server has taken at least this
+		 * long, and the answer is to be credited to the second. */
+		if (timeable)
+			nameserver_rtt_sample(req->ns, &rtt);
+		req->ns = ns;
+	}
+}
+
+#if defined(_EVENT_HAVE_RECVMMSG) || defined(_EVENT_HAVE_SENDMMSG)
+/* Set if the kernel turns out not to implement recvmmsg()/sendmmsg(), so
+ * that we use one syscall per datagram from then on. */
+static int evdns_recvmmsg_unsupported = 0;
+static int evdns_sendmmsg_unsupported = 0;
+#endif
+
+/* Read up to EVDNS_RECV_BATCH datagrams from fd into b.  Returns the
+ * number read, or -1 on error. */
+static int
+evdns_recv_batch(evutil_socket_t fd, struct evdns_recv_batch *b)
+{
+	int n;
+#ifdef _EVENT_HAVE_RECVMMSG
+	if (!evdns_recvmmsg_unsupported) {
+		int i;
+		for (i = 0; i < EVDNS_RECV_BATCH; ++i) {
+			b->iov[i].iov_base = b->packets[i];
+			b->iov[i].iov_len = sizeof(b->packets[i]);
+			memset(&b->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+			b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+			b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+			b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+			b->msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		n = recvmmsg(fd, b->msgs, EVDNS_RECV_BATCH, 0, NULL);
+		if (n >= 0) {
+			for (i = 0; i < n; ++i) {
+				b->lens[i] = (int)b->msgs[i].msg_len;
+				b->addrlens[i] = b->msgs[i].msg_hdr.msg_namelen;
+			}
+			return n;
+		}
+		if (errno != ENOSYS)
+			return -1;
+		evdns_recvmmsg_unsupported = 1;
+	}
+#endif
+	b->addrlens[0] = sizeof(b->addrs[0]);
+	n = recvfrom(fd, (void*)b->packets[0], sizeof(b->packets[0]), 0,
+	    (struct sockaddr*)&b->addrs[0], &b->addrlens[0]);
+	if (n < 0)
+		return -1;
+	b->lens[0] = n;
+	return 1;
+}
+
+/* Send the responses for the first n requests in reqs from fd, as far as
+ * we can.  Returns the number sent, or -1 on error. */
+static int
+evdns_send_replies(evutil_socket_t fd, struct server_request **reqs, int n)
+{
+	int r;
+#ifdef _EVENT_HAVE_SENDMMSG
+	if (n > 1 && !evdns_sendmmsg_unsupported) {
+		struct mmsghdr msgs[EVDNS_SEND_BATCH];
+		struct iovec iov[EVDNS_SEND_BATCH];
+		int i;
+		EVUTIL_ASSERT(n <= EVDNS_SEND_BATCH);
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < n; ++i) {
+			iov[i].iov_base = reqs[i]->response;
+			iov[i].iov_len = reqs[i]->response_len;
+			msgs[i].msg_hdr.msg_name = &reqs[i]->addr;
+			msgs[i].msg_hdr.msg_namelen = reqs[i]->addrlen;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		r = sendmmsg(fd, msgs, n, 0);
+		if (r >= 0 || errno != ENOSYS)
+			return r;
+		evdns_sendmmsg_unsupported = 1;
+	}
+#endif
+	r = sendto(fd, reqs[0]->response, (int)reqs[0]->response_len, 0,
+	    (struct sockaddr*) &reqs[0]->addr, (ev_socklen_t)reqs[0]->addrlen);
+	return r < 0 ? -1 : 1;
+}
+
 /* this is called when a namesever socket is ready for reading */
 static void
 nameserver_read(struct nameserver *ns) {
-	struct sockaddr_storage ss;
-	ev_socklen_t addrlen = sizeof(ss);
-	u8 packet[1500];
+	struct evdns_recv_batch *const b = ns->base->recv_batch;
 	char addrbuf[128];
+	int n, i;
 	ASSERT_LOCKED(ns->base);
 
 	for (;;) {
-		const int r = recvfrom(ns->socket, (void*)packet,
-		    sizeof(packet), 0,
-		    (struct sockaddr*)&ss, &addrlen);
-		if (r < 0) {
+		n = evdns_recv_batch(ns->socket, b);
+		if (n < 0) {
 			int err = evutil_socket_geterror(ns->socket);
 			if (EVUTIL_ERR_RW_RETRIABLE(err))
 				return;
@@ -1365,36 +1834,36 @@ nameserver_read(struct nameserver *ns) {
 			    evutil_socket_error_to_string(err));
 			return;
 		}
-		if (evutil_sockaddr_cmp((struct sockaddr*)&ss,
-			(struct sockaddr*)&ns->address, 0)) {
-			log(EVDNS_LOG_WARN, "Address mismatch on received "
-			    "DNS packet.  Apparent source was %s",
-			    evutil_format_sockaddr_port(
-				    (struct sockaddr *)&ss,
-				    addrbuf, sizeof(addrbuf)));
-			return;
-		}
+		for (i = 0; i < n; ++i) {
+			if (evutil_sockaddr_cmp((struct sockaddr*)&b->addrs[i],
+				(struct sockaddr*)&ns->address, 0)) {
+				log(EVDNS_LOG_WARN, "Address mismatch on received "
+				    "DNS packet.  Apparent source was %s",
+				    evutil_format_sockaddr_port(
+					    (struct sockaddr *)&b->addrs[i],
+					    addrbuf, sizeof(addrbuf)));
+				continue;
+			}
 
-		ns->timedout = 0;
-		reply_parse(ns->base, packet, r);
+			ns->timedout = 0;
+			reply_parse(ns->base, ns, b->packets[i], b->lens[i]);
+		}
+		if (n < EVDNS_RECV_BATCH)
+			return;
 	}
 }
 
-/* Read a packet from a DNS client on a server port s, parse it, and */
+/* Read packets from DNS clients on a server port s, parse them, and */
 /* act accordingly. */
 static void
 server_port_read(struct evdns_server_port *s) {
-	u8 packet[1500];
-	struct sockaddr_storage addr;
-	ev_socklen_t addrlen;
-	int r;
+	struct evdns_recv_batch *const b = s->recv_batch;
+	int n, i;
 	ASSERT_LOCKED(s);
 
 	for (;;) {
-		addrlen = sizeof(struct sockaddr_storage);
-		r = recvfrom(s->socket, (void*)packet, sizeof(packet), 0,
-					 (struct sockaddr*) &addr, &addrlen);
-		if (r < 0) {
+		n = evdns_recv_batch(s->socket, b);
+		if (n < 0) {
 			int err = evutil_socket_geterror(s->socket);
 			if (EVUTIL_ERR_RW_RETRIABLE(err))
 				return;
@@ -1403,33 +1872,128 @@ server_port_read(struct evdns_server_port *s) {
 			    evutil_socket_error_to_string(err), err);
 			return;
 		}
-		request_parse(packet, r, s, (struct sockaddr*) &addr, addrlen);
+		/* Replies that the callbacks make right away get sent
+		 * together once the whole batch is handled. */
+		s->batching = 1;
+		for (i = 0; i < n; ++i)
+			request_parse(b->packets[i], b->lens[i], s,
+			    (struct sockaddr*)&b->addrs[i], b->addrlens[i]);
+		s->batching = 0;
+		if (s->pending_replies && !s->choked) {
+			int r = server_port_send_pending(s);
+			if (r < 0)
+				return; /* we released the last reference */
+			if (r > 0) {
+				if (server_port_keep_pending(s) < 0)
+					return;
+				server_port_choke(s);
+			}
+		}
+		s->n_responses = 0;
 	}
 }
 
-/* Try to write all pending replies on a given DNS server port. */
+/* Ask to be told when port is writable, so we can send pending replies. */
 static void
-server_port_flush(struct evdns_server_port *port)
+server_port_choke(struct evdns_server_port *port)
 {
-	struct server_request *req = port->pending_replies;
 	ASSERT_LOCKED(port);
-	while (req) {
-		int r = sendto(port->socket, req->response, (int)req->response_len, 0,
-			   (struct sockaddr*) &req->addr, (ev_socklen_t)req->addrlen);
-		if (r < 0) {
+	port->choked = 1;
+
+	(void) event_del(&port->event);
+	event_assign(&port->event, port->event_base, port->socket, (port->closing?0:EV_READ) | EV_WRITE | EV_PERSIST, server_port_ready_callback, port);
+
+	if (event_add(&port->event, NULL) < 0) {
+		log(EVDNS_LOG_WARN, "Error from libevent when adding event for DNS server");
+	}
+}
+
+/* Give every pending reply on port its own copy of its response, so that */
+/* the port's response space can be reused.  A reply that we can't copy */
+/* is dropped.  Returns 0 on success, or -1 if we released the last */
+/* reference to port. */
+static int
+server_port_keep_pending(struct evdns_server_port *port)
+{
+	struct server_request *req;
+	ASSERT_LOCKED(port);
+again:
+	if (!(req = port->pending_replies))
+		return 0;
+	do {
+		if (server_request_keep_response(req) < 0) {
+			log(EVDNS_LOG_WARN, "Out of memory queueing response; "
+			    "dropping");
+			if (server_request_free(req))
+				return -1;
+			goto again;
+		}
+		req = req->next_pending;
+	} while (req != port->pending_replies);
+	return 0;
+}
+
+/* Add req to the tail of the pending replies on port. */
+static void
+server_port_queue_reply(struct evdns_server_port *port,
+    struct server_request *req)
+{
+	ASSERT_LOCKED(port);
+	if (port->pending_replies) {
+		req->prev_pending = port->pending_replies->prev_pending;
+		req->next_pending = port->pending_replies;
+		req->prev_pending->next_pending =
+			req->next_pending->prev_pending = req;
+	} else {
+		req->prev_pending = req->next_pending = req;
+		port->pending_replies = req;
+	}
+}
+
+/* Send as many of the pending replies on port as we can, up to
+ * EVDNS_SEND_BATCH per syscall.  Returns 0 if they all went out, 1 if the
+ * socket would block, or -1 if we released the last reference to port. */
+static int
+server_port_send_pending(struct evdns_server_port *port)
+{
+	ASSERT_LOCKED(port);
+	while (port->pending_replies) {
+		struct server_request *batch[EVDNS_SEND_BATCH];
+		struct server_request *req = port->pending_replies;
+		int n = 0, sent, i;
+		do {
+			batch[n++] = req;
+			req = req->next_pending;
+		} while (req != port->pending_replies && n < EVDNS_SEND_BATCH);
+
+		sent = evdns_send_replies(port->socket, batch, n);
+		if (sent < 0) {
 			int err = evutil_socket_geterror(port->socket);
 			if (EVUTIL_ERR_RW_RETRIABLE(err))
-				return;
+				return 1;
 			log(EVDNS_LOG_WARN, "Error %s (%d) while writing response to port; dropping", evutil_socket_error_to_string(err), err);
+			sent = 1;
+		} else if (sent == 0) {
+			return 1;
 		}
-		if (server_request_free(req)) {
-			/* we released the last reference to req->port. */
-			return;
-		} else {
-			EVUTIL_ASSERT(req != port->pending_replies);
-			req = port->pending_replies;
+		for (i = 0; i < sent; ++i) {
+			if (server_request_free(batch[i])) {
+				/* we released the last reference to
+				 * the port. */
+				return -1;
+			}
 		}
 	}
+	return 0;
+}
+
+/* Try to write all pending replies on a given DNS server port. */
+static void
+server_port_flush(struct evdns_server_port *port)
+{
+	ASSERT_LOCKED(port);
+	if (server_port_send_pending(port))
+		return;
 
 	/* We have no more pending requests; stop listening for 'writeable' events. */
 	(void) event_del(&port->event);
@@ -1504,32 +2068,20 @@ server_port_ready_callback(evutil_socket_t fd, short events, void *arg) {
 	EVDNS_UNLOCK(port);
 }
 
-/* This is an inefficient representation; only use it via the dnslabel_table_*
- * functions, so that is can be safely replaced with something smarter later. */
-#define MAX_LABELS 128
-/* Structures used to implement name compression */
-struct dnslabel_entry { char *v; off_t pos; };
-struct dnslabel_table {
-	int n_labels; /* number of current entries */
-	/* map from name to position in message */
-	struct dnslabel_entry labels[MAX_LABELS];
-};
-
 /* Initialize dnslabel_table. */
 static void
 dnslabel_table_init(struct dnslabel_table *table)
 {
 	table->n_labels = 0;
+	table->space_used = 0;
 }
 
-/* Free all storage held by table, but not the table itself. */
+/* Forget all the labels in table. */
 static void
 dnslabel_clear(struct dnslabel_table *table)
 {
-	int i;
-	for (i = 0; i < table->n_labels; ++i)
-		mm_free(table->labels[i].v);
 	table->n_labels = 0;
+	table->space_used = 0;
 }
 
 /* return the position of the label in the current message, or -1 if the label */
@@ -1551,11 +2103,13 @@ dnslabel_table_add(struct dnslabel_table *table, const char *label, off_t pos)
 {
 	char *v;
 	int p;
-	if (table->n_labels == MAX_LABELS)
-		return (-1);
-	v = mm_strdup(label);
-	if (v == NULL)
+	size_t len = strlen(label) + 1;
+	if (table->n_labels == MAX_LABELS ||
+	    len > MAX_LABEL_SPACE - table->space_used)
 		return (-1);
+	v = table->space + table->space_used;
+	memcpy(v, label, len);
+	table->space_used += len;
 	p = table->n_labels++;
 	table->labels[p].v = v;
 	table->labels[p].pos = pos;
@@ -1647,26 +2201,29 @@ static size_t
 evdns_request_len(const size_t name_len) {
 	return 96 + /* length of the DNS standard header */
 		name_len + 2 +
-		4;  /* space for the resource type */
+		4 +  /* space for the resource type */
+		EVDNS_OPT_LEN;  /* space for an EDNS0 OPT record */
 }
 
 /* build a dns request packet into buf. buf should be at least as long */
-/* as evdns_request_len told you it should be. */
+/* as evdns_request_len told you it should be.  If edns_udp_size is */
+/* nonzero, we add an EDNS0 OPT record advertising that payload size. */
 /* */
 /* Returns the amount of space used. Negative on error. */
 static int
 evdns_request_data_build(const char *const name, const size_t name_len,
     const u16 trans_id, const u16 type, const u16 class,
-    u8 *const buf, size_t buf_len) {
+    const u16 edns_udp_size, u8 *const buf, size_t buf_len) {
 	off_t j = 0;  /* current offset into buf */
 	u16 _t;	 /* used by the macros */
+	u32 _t32;  /* used by the macros */
 
 	APPEND16(trans_id);
 	APPEND16(0x0100);  /* standard query, recusion needed */
 	APPEND16(1);  /* one question */
 	APPEND16(0);  /* no answers */
 	APPEND16(0);  /* no authority */
-	APPEND16(0);  /* no additional */
+	APPEND16(edns_udp_size ? 1 : 0);  /* the OPT record, if any */
 
 	j = dnsname_to_labels(buf, buf_len, j, name, name_len, NULL);
 	if (j < 0) {
@@ -1676,6 +2233,16 @@ evdns_request_data_build(const char *const name, const size_t name_len,
 	APPEND16(type);
 	APPEND16(class);
 
+	if (edns_udp_size) {
+		if (j + 1 > (off_t)buf_len)
+			goto overflow;
+		buf[j++] = 0;  /* the root domain */
+		APPEND16(TYPE_OPT);
+		APPEND16(edns_udp_size);  /* in place of the class */
+		APPEND32(0);  /* extended rcode, version 0, no flags */
+		APPEND16(0);  /* no options */
+	}
+
 	return (int)j;
  overflow:
 	return (-1);
@@ -1691,7 +2258,10 @@ evdns_add_server_port_with_base(struct event_base *base, evutil_socket_t socket,
 	if (!(port = mm_malloc(sizeof(struct evdns_server_port))))
 		return NULL;
 	memset(port, 0, sizeof(struct evdns_server_port));
-
+	if (!(port->recv_batch = mm_malloc(sizeof(struct evdns_recv_batch)))) {
+		mm_free(port);
+		return NULL;
+	}
 
 	port->socket = socket;
 	port->refcnt = 1;
@@ -1706,6 +2276,7 @@ evdns_add_server_port_with_base(struct event_base *base, evutil_socket_t socket,
 				 port->socket, EV_READ | EV_PERSIST,
 				 server_port_ready_callback, port);
 	if (event_add(&port->event, NULL) < 0) {
+		mm_free(port->recv_batch);
 		mm_free(port);
 		return NULL;
 	}
@@ -1719,6 +2290,73 @@ evdns_add_server_port(evutil_socket_t socket, int flags, evdns_request_callback_
 	return evdns_add_server_port_with_base(NULL, socket, flags, cb, user_data);
 }
 
+/* exported function */
+int
+evdns_add_server_ports_with_bases(struct event_base **bases, int n_bases,
+    const struct sockaddr *addr, int addrlen, int flags,
+    evdns_request_callback_fn_type cb, void *user_data,
+    struct evdns_server_port **ports_out)
+{
+#ifdef SO_REUSEPORT
+	struct sockaddr_storage ss;
+	ev_socklen_t sslen = addrlen;
+	evutil_socket_t fd;
+	int i, err, one = 1;
+
+	if (n_bases < 1 || addrlen > (int)sizeof(ss) || flags)
+		return -1;
+	memcpy(&ss, addr, addrlen);
+	for (i = 0; i < n_bases; ++i)
+		ports_out[i] = NULL;
+
+	for (i = 0; i < n_bases; ++i) {
+		fd = socket(ss.ss_family, SOCK_DGRAM, 0);
+		if (fd < 0)
+			goto err;
+		evutil_make_socket_closeonexec(fd);
+		evutil_make_socket_nonblocking(fd);
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void*)&one,
+			sizeof(one)) < 0 ||
+		    bind(fd, (struct sockaddr*)&ss, sslen) < 0)
+			goto err_close;
+		if (i == 0) {
+			/* If the caller let us pick the port, the other
+			 * sockets need to use the one we got. */
+			sslen = sizeof(ss);
+			if (getsockname(fd, (struct sockaddr*)&ss, &sslen) < 0)
+				goto err_close;
+		}
+		ports_out[i] = evdns_add_server_port_with_base(bases[i], fd,
+		    0, cb, user_data);
+		if (!ports_out[i])
+			goto err_close;
+	}
+	return 0;
+
+err_close:
+	err = EVUTIL_SOCKET_ERROR();
+	evutil_closesocket(fd);
+	goto fail;
+err:
+	err = EVUTIL_SOCKET_ERROR();
+fail:
+	log(EVDNS_LOG_WARN, "Unable to open server port %d of %d: %s",
+	    i + 1, n_bases, evutil_socket_error_to_string(err));
+	for (i = 0; i < n_bases; ++i) {
+		if (ports_out[i]) {
+			evdns_close_server_port(ports_out[i]);
+			ports_out[i] = NULL;
+		}
+	}
+	return -1;
+#else
+	(void) bases; (void) n_bases; (void) addr; (void) addrlen;
+	(void) flags; (void) cb; (void) user_data; (void) ports_out;
+	log(EVDNS_LOG_WARN, "SO_REUSEPORT is not available on this platform");
+	return -1;
+#endif
+}
+
 /* exported function */
 void
 evdns_close_server_port(struct evdns_server_port *port)
@@ -1865,56 +2503,88 @@ evdns_server_request_set_flags(struct evdns_server_request *exreq, int flags)
 	req->base.flags |= flags;
 }
 
+/* Make sure that req's response is ours to keep, and not in space that the */
+/* port will reuse.  Returns 0 on success, -1 on failure. */
+static int
+server_request_keep_response(struct server_request *req)
+{
+	char *response;
+	if (!req->response_borrowed)
+		return 0;
+	if (!(response = mm_malloc(req->response_len)))
+		return -1;
+	memcpy(response, req->response, req->response_len);
+	req->response = response;
+	req->response_borrowed = 0;
+	return 0;
+}
+
 static int
 evdns_server_request_format_response(struct server_request *req, int err)
 {
-	unsigned char buf[1500];
-	size_t buf_len = sizeof(buf);
-	off_t j = 0, r;
+	struct evdns_server_port *port = req->port;
+	unsigned char spare[EVDNS_SERVER_MAX_RESPONSE];
+	unsigned char *buf;
+	const size_t buf_len = EVDNS_SERVER_MAX_RESPONSE;
+	off_t j = 0, r, last_complete;
 	u16 _t;
 	u32 _t32;
-	int i;
+	int i, section;
 	u16 flags;
-	struct dnslabel_table table;
+	/* how many records of each section we've finished writing */
+	u16 n_written[4] = { 0, 0, 0, 0 };
+	struct dnslabel_table *table = &port->label_table;
 
 	if (err < 0 || err > 15) return -1;
 
+	/* Use the next free response space on the port, if there is one. */
+	if (port->n_responses < EVDNS_SEND_BATCH)
+		buf = port->responses[port->n_responses];
+	else
+		buf = spare;
+
 	/* Set response bit and error code; copy OPCODE and RD fields from
 	 * question; copy RA and AA if set by caller. */
 	flags = req->base.flags;
 	flags |= (0x8000 | err);
 
-	dnslabel_table_init(&table);
+	dnslabel_table_init(table);
 	APPEND16(req->trans_id);
 	APPEND16(flags);
 	APPEND16(req->base.nquestions);
 	APPEND16(req->n_answer);
 	APPEND16(req->n_authority);
 	APPEND16(req->n_additional);
+	last_complete = j;
 
 	/* Add questions. */
 	for (i=0; i < req->base.nquestions; ++i) {
 		const char *s = req->base.questions[i]->name;
-		j = dnsname_to_labels(buf, buf_len, j, s, strlen(s), &table);
-		if (j < 0) {
-			dnslabel_clear(&table);
-			return (int) j;
+		r = dnsname_to_labels(buf, buf_len, j, s, strlen(s), table);
+		if (r == -1) {
+			dnslabel_clear(table);
+			return (int) r;
+		} else if (r < 0) {
+			goto overflow;
 		}
+		j = r;
 		APPEND16(req->base.questions[i]->type);
 		APPEND16(req->base.questions[i]->dns_question_class);
+		++n_written[0];
+		last_complete = j;
 	}
 
 	/* Add answer, authority, and additional sections. */
-	for (i=0; i<3; ++i) {
+	for (section=1; section<4; ++section) {
 		struct server_reply_item *item;
-		if (i==0)
+		if (section==1)
 			item = req->answer;
-		else if (i==1)
+		else if (section==2)
 			item = req->authority;
 		else
 			item = req->additional;
 		while (item) {
-			r = dnsname_to_labels(buf, buf_len, j, item->name, strlen(item->name), &table);
+			r = dnsname_to_labels(buf, buf_len, j, item->name, strlen(item->name), table);
 			if (r < 0)
 				goto overflow;
 			j = r;
@@ -1926,7 +2596,7 @@ evdns_server_request_format_response(struct server_request *req, int err)
 				off_t len_idx = j, name_start;
 				j += 2;
 				name_start = j;
-				r = dnsname_to_labels(buf, buf_len, j, item->data, strlen(item->data), &table);
+				r = dnsname_to_labels(buf, buf_len, j, item->data, strlen(item->data), table);
 				if (r < 0)
 					goto overflow;
 				j = r;
@@ -1939,26 +2609,36 @@ evdns_server_request_format_response(struct server_request *req, int err)
 				memcpy(buf+j, item->data, item->datalen);
 				j += item->datalen;
 			}
+			++n_written[section];
+			last_complete = j;
 			item = item->next;
 		}
 	}
 
-	if (j > 512) {
+	if (0) {
 overflow:
-		j = 512;
+		/* Send the records that fit, and say that there were more. */
+		j = last_complete;
+		for (i = 0; i < 4; ++i) {
+			_t = htons(n_written[i]);
+			memcpy(buf + 4 + 2*i, &_t, 2);
+		}
 		buf[2] |= 0x02; /* set the truncated bit. */
 	}
 
 	req->response_len = j;
+	dnslabel_clear(table);
+	server_request_free_answers(req);
 
-	if (!(req->response = mm_malloc(req->response_len))) {
-		server_request_free_answers(req);
-		dnslabel_clear(&table);
-		return (-1);
+	if (buf != spare) {
+		req->response = (char *)buf;
+		req->response_borrowed = 1;
+		++port->n_responses;
+	} else {
+		if (!(req->response = mm_malloc(req->response_len)))
+			return (-1);
+		memcpy(req->response, buf, req->response_len);
 	}
-	memcpy(req->response, buf, req->response_len);
-	server_request_free_answers(req);
-	dnslabel_clear(&table);
 	return (0);
 }
 
@@ -1968,7 +2648,7 @@ evdns_server_request_respond(struct evdns_server_request *_req, int err)
 {
 	struct server_request *req = TO_SERVER_REQUEST(_req);
 	struct evdns_server_port *port = req->port;
-	int r = -1;
+	int r = -1, was_idle;
 
 	EVDNS_LOCK(port);
 	if (!req->response) {
@@ -1976,38 +2656,35 @@ evdns_server_request_respond(struct evdns_server_request *_req, int err)
 			goto done;
 	}
 
+	if (port->batching && !port->choked) {
+		/* server_port_read will send this with the rest of its
+		 * batch. */
+		server_port_queue_reply(port, req);
+		r = 0;
+		goto done;
+	}
+
 	r = sendto(port->socket, req->response, (int)req->response_len, 0,
 			   (struct sockaddr*) &req->addr, (ev_socklen_t)req->addrlen);
 	if (r<0) {
 		int sock_err = evutil_socket_geterror(port->socket);
-		if (EVUTIL_ERR_RW_RETRIABLE(sock_err))
+		if (!EVUTIL_ERR_RW_RETRIABLE(sock_err) ||
+		    server_request_keep_response(req) < 0) {
+			r = -1;
 			goto done;
-
-		if (port->pending_replies) {
-			req->prev_pending = port->pending_replies->prev_pending;
-			req->next_pending = port->pending_replies;
-			req->prev_pending->next_pending =
-				req->next_pending->prev_pending = req;
-		} else {
-			req->prev_pending = req->next_pending = req;
-			port->pending_replies = req;
-			port->choked = 1;
-
-			(void) event_del(&port->event);
-			event_assign(&port->event, port->event_base, port->socket, (port->closing?0:EV_READ) | EV_WRITE | EV_PERSIST, server_port_ready_callback, port);
-
-			if (event_add(&port->event, NULL) < 0) {
-				log(EVDNS_LOG_WARN, "Error from libevent when adding event for DNS server");
-			}
-
 		}
 
+		was_idle = (port->pending_replies == NULL);
+		server_port_queue_reply(port, req);
+		if (was_idle)
+			server_port_choke(port);
+
 		r = 1;
 		goto done;
 	}
 	if (server_request_free(req)) {
-		r = 0;
-		goto done;
+		/* we released the last reference to the port */
+		return 0;
 	}
 
 	if (port->pending_replies)
@@ -2015,6 +2692,16 @@ evdns_server_request_respond(struct evdns_server_request *_req, int err)
 
 	r = 0;
 done:
+	if (!port->batching) {
+		/* Anything still using the port's response space (say,
+		 * after an error) gets its own copy. */
+		if (r < 0 && req->response_borrowed &&
+		    server_request_keep_response(req) < 0) {
+			req->response = NULL;
+			req->response_borrowed = 0;
+		}
+		port->n_responses = 0;
+	}
 	EVDNS_UNLOCK(port);
 	return r;
 }
@@ -2070,7 +2757,7 @@ server_request_free(struct server_request *req)
 		rc = --req->port->refcnt;
 	}
 
-	if (req->response) {
+	if (req->response && !req->response_borrowed) {
 		mm_free(req->response);
 	}
 
@@ -2107,6 +2794,7 @@ server_port_free(struct evdns_server_port *port)
 	(void) event_del(&port->event);
 	event_debug_unassign(&port->event);
 	EVTHREAD_FREE_LOCK(port->lock, EVTHREAD_LOCKTYPE_RECURSIVE);
+	mm_free(port->recv_batch);
 	mm_free(port);
 }
 
@@ -2133,6 +2821,66 @@ evdns_server_request_get_requesting_addr(struct evdns_server_request *_req, stru
 #undef APPEND16
 #undef APPEND32
 
+/* How long after sending req to wait before hedging it, in usec, or -1 */
+/* not to hedge it at all. */
+static int
+evdns_request_hedge_delay(struct request *req)
+{
+	struct evdns_base *base = req->base;
+	const struct nameserver *ns = req->ns;
+	int delay;
+
+	/* Only the nameserver a probe is for may answer it. */
+	if (!base->hedge_requests || req->probe || req->tx_count ||
+	    req->tcp || base->global_good_nameservers < 2 ||
+	    !ns->rtt_samples)
+		return -1;
+	/* Wait about as long as TCP would before retransmitting. */
+	delay = ns->srtt_usec + 4 * ns->rttvar_usec;
+	if (delay < EVDNS_HEDGE_MIN_USEC)
+		delay = EVDNS_HEDGE_MIN_USEC;
+	if (delay >= timeval_to_usec(&base->global_timeout))
+		return -1;
+	return delay;
+}
+
+/* req has gone unanswered for its hedge delay: send a copy to the best */
+/* other good nameserver, then wait out the rest of the timeout. */
+static void
+evdns_request_hedge(struct request *req)
+{
+	struct evdns_base *base = req->base;
+	struct nameserver *ns, *alt = NULL;
+	struct timeval now, deadline, remaining;
+
+	ASSERT_LOCKED(base);
+	ns = base->server_head;
+	do {
+		if (ns != req->ns && ns->state &&
+		    (!alt || ns->srtt_usec < alt->srtt_usec))
+			alt = ns;
+		ns = ns->next;
+	} while (ns != base->server_head);
+
+	if (alt && !evdns_request_transmit_to(req, alt)) {
+		log(EVDNS_LOG_DEBUG, "Hedging request %p to nameserver %p",
+		    req, alt);
+		req->hedge_ns = alt;
+	}
+
+	evutil_timeradd(&req->sent_at, &base->global_timeout, &deadline);
+	_event_base_gettime_monotonic(base->event_base, &now);
+	if (evutil_timercmp(&deadline, &now, <))
+		evutil_timerclear(&remaining);
+	else
+		evutil_timersub(&deadline, &now, &remaining);
+	if (evtimer_add(&req->timeout_event, &remaining) < 0) {
+		log(EVDNS_LOG_WARN,
+		    "Error from libevent when adding timer for request %p",
+		    req);
+	}
+}
+
 /* this is a libevent callback function which is called when a request */
 /* has timed out. */
 static void
@@ -2143,9 +2891,17 @@ evdns_request_timeout_callback(evutil_socket_t fd, short events, void *arg) {
 	(void) fd;
 	(void) events;
 
-	log(EVDNS_LOG_DEBUG, "Request %p timed out", arg);
 	EVDNS_LOCK(base);
+	if (req->hedge_pending) {
+		/* Not a timeout, just time to send the hedge. */
+		req->hedge_pending = 0;
+		evdns_request_hedge(req);
+		EVDNS_UNLOCK(base);
+		return;
+	}
 
+	log(EVDNS_LOG_DEBUG, "Request %p timed out", arg);
+	nameserver_rtt_timeout(req->ns);
 	req->ns->timedout++;
 	if (req->ns->timedout > req->base->global_max_nameserver_timeout) {
 		req->ns->timedout = 0;
@@ -2157,6 +2913,7 @@ evdns_request_timeout_callback(evutil_socket_t fd, short events, void *arg) {
 		log(EVDNS_LOG_DEBUG, "Giving up on request %p; tx_count==%d",
 		    arg, req->tx_count);
 		reply_schedule_callback(req, 0, DNS_ERR_TIMEOUT, NULL);
+		request_fanout(req, 0, DNS_ERR_TIMEOUT, NULL, 0);
 		request_finished(req, &REQ_HEAD(req->base, req->trans_id), 1);
 	} else {
 		/* retransmit it */
@@ -2164,7 +2921,8 @@ evdns_request_timeout_callback(evutil_socket_t fd, short events, void *arg) {
 		log(EVDNS_LOG_DEBUG, "Retransmitting request %p; tx_count==%d",
 		    arg, req->tx_count);
 		(void) evtimer_del(&req->timeout_event);
-		new_ns = nameserver_pick(base);
+		/* A probe has to keep asking the same nameserver. */
+		new_ns = req->probe ? NULL : nameserver_pick(base);
 		if (new_ns)
 			req->ns = new_ns;
 		evdns_request_transmit(req);
@@ -2183,13 +2941,15 @@ evdns_request_transmit_to(struct request *req, struct nameserver *server) {
 	int r;
 	ASSERT_LOCKED(req->base);
 	ASSERT_VALID_REQUEST(req);
+	if (req->tcp)
+		return nameserver_tcp_send(server, req) < 0 ? 2 : 0;
 	r = sendto(server->socket, (void*)req->request, req->request_len, 0,
 	    (struct sockaddr *)&server->address, server->addrlen);
 	if (r < 0) {
 		int err = evutil_socket_geterror(server->socket);
 		if (EVUTIL_ERR_RW_RETRIABLE(err))
 			return 1;
-		nameserver_failed(req->ns, evutil_socket_error_to_string(err));
+		nameserver_failed(server, evutil_socket_error_to_string(err));
 		return 2;
 	} else if (r != (int)req->request_len) {
 		return 1;  /* short write */
@@ -2206,7 +2966,7 @@ evdns_request_transmit_to(struct request *req, struct nameserver *server) {
 /*   1 failed */
 static int
 evdns_request_transmit(struct request *req) {
-	int retcode = 0, r;
+	int retcode = 0, r, hedge_delay;
 
 	ASSERT_LOCKED(req->base);
 	ASSERT_VALID_REQUEST(req);
@@ -2215,7 +2975,7 @@ evdns_request_transmit(struct request *req) {
 	req->transmit_me = 1;
 	EVUTIL_ASSERT(req->trans_id != 0xffff);
 
-	if (req->ns->choked) {
+	if (req->ns->choked && !req->tcp) {
 		/* don't bother trying to write to a socket */
 		/* which we have had EAGAIN from */
 		return 1;
@@ -2237,7 +2997,21 @@ evdns_request_transmit(struct request *req) {
 		/* all ok */
 		log(EVDNS_LOG_DEBUG,
 		    "Setting timeout for request %p, sent to nameserver %p", req, req->ns);
-		if (evtimer_add(&req->timeout_event, &req->base->global_timeout) < 0) {
+		_event_base_gettime_monotonic(req->base->event_base,
+		    &req->sent_at);
+		req->hedge_ns = NULL;
+		hedge_delay = evdns_request_hedge_delay(req);
+		req->hedge_pending = hedge_delay >= 0;
+		if (req->hedge_pending) {
+			struct timeval tv;
+			tv.tv_sec = hedge_delay / 1000000;
+			tv.tv_usec = hedge_delay % 1000000;
+			r = evtimer_add(&req->timeout_event, &tv);
+		} else {
+			r = evtimer_add(&req->timeout_event,
+			    &req->base->global_timeout);
+		}
+		if (r < 0) {
 			log(EVDNS_LOG_WARN,
 		      "Error from libevent when adding timer for request %p",
 			    req);
@@ -2249,6 +3023,165 @@ evdns_request_transmit(struct request *req) {
 	}
 }
 
+/* ================================================================= */
+/* TCP fallback */
+/* */
+/* When a reply comes back with the TC bit set, we ask the same question */
+/* again over TCP.  Each nameserver gets at most one TCP connection, which */
+/* we open the first time we need it and keep for as long as the server */
+/* will let us.  Queries are pipelined on it and matched with their */
+/* replies by transaction id, just as on the UDP socket. */
+
+static void
+nameserver_tcp_readcb(struct bufferevent *bev, void *arg)
+{
+	struct nameserver *const ns = arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	u8 lenbuf[2];
+	u8 *packet;
+	size_t len;
+
+	EVDNS_LOCK(ns->base);
+	/* Each message is preceded by its length as a u16. */
+	while (evbuffer_copyout(input, lenbuf, 2) == 2) {
+		len = ((size_t)lenbuf[0] << 8) | lenbuf[1];
+		if (evbuffer_get_length(input) < len + 2)
+			break;
+		packet = evbuffer_pullup(input, len + 2);
+		if (!packet)
+			break;
+		ns->timedout = 0;
+		reply_parse(ns->base, ns, packet + 2, (int)len);
+		evbuffer_drain(input, len + 2);
+	}
+	EVDNS_UNLOCK(ns->base);
+}
+
+/* Send every inflight TCP request for ns again, if it hasn't used up its */
+/* retransmits. */
+static void
+nameserver_tcp_resend(struct nameserver *ns)
+{
+	struct evdns_base *base = ns->base;
+	int i;
+
+	ASSERT_LOCKED(base);
+	for (i = 0; i < base->n_req_heads; ++i) {
+		struct request *req = base->req_heads[i], *started_at = req;
+		if (!req)
+			continue;
+		do {
+			if (req->tcp && req->ns == ns && !req->transmit_me &&
+			    req->tx_count < base->global_max_retransmits) {
+				(void) evtimer_del(&req->timeout_event);
+				evdns_request_transmit(req);
+			}
+			req = req->next;
+		} while (req != started_at);
+	}
+}
+
+static void
+nameserver_tcp_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct nameserver *const ns = arg;
+	char addrbuf[128];
+	int was_connected;
+	(void) bev;
+
+	EVDNS_LOCK(ns->base);
+	if (what & BEV_EVENT_CONNECTED) {
+		ns->tcp_connected = 1;
+	} else if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		log(EVDNS_LOG_DEBUG, "TCP connection to nameserver %s closed",
+		    evutil_format_sockaddr_port(
+			    (struct sockaddr *)&ns->address,
+			    addrbuf, sizeof(addrbuf)));
+		was_connected = ns->tcp_connected;
+		nameserver_tcp_close(ns);
+		/* Servers may close idle connections, or stop reading after
+		 * a few queries: whatever was still outstanding has to go
+		 * out on a new connection.  If we never got connected at
+		 * all, leave the requests to time out instead. */
+		if (was_connected)
+			nameserver_tcp_resend(ns);
+	}
+	EVDNS_UNLOCK(ns->base);
+}
+
+static void
+nameserver_tcp_close(struct nameserver *ns)
+{
+	if (ns->tcp_bev) {
+		bufferevent_free(ns->tcp_bev);
+		ns->tcp_bev = NULL;
+	}
+	ns->tcp_connected = 0;
+}
+
+/* Start connecting to ns over TCP.  Returns 0 on success, -1 on failure. */
+static int
+nameserver_tcp_open(struct nameserver *ns)
+{
+	struct evdns_base *base = ns->base;
+	int options = BEV_OPT_CLOSE_ON_FREE|BEV_OPT_DEFER_CALLBACKS|
+	    BEV_OPT_UNLOCK_CALLBACKS;
+	evutil_socket_t fd;
+
+	ASSERT_LOCKED(base);
+#ifndef _EVENT_DISABLE_THREAD_SUPPORT
+	if (base->lock)
+		options |= BEV_OPT_THREADSAFE;
+#endif
+	fd = socket(ns->address.ss_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	evutil_make_socket_closeonexec(fd);
+	evutil_make_socket_nonblocking(fd);
+	if (base->global_outgoing_addrlen &&
+	    !evutil_sockaddr_is_loopback((struct sockaddr*)&ns->address)) {
+		if (bind(fd, (struct sockaddr*)&base->global_outgoing_address,
+			base->global_outgoing_addrlen) < 0) {
+			log(EVDNS_LOG_WARN,"Couldn't bind to outgoing address");
+			evutil_closesocket(fd);
+			return -1;
+		}
+	}
+
+	ns->tcp_bev = bufferevent_socket_new(base->event_base, fd, options);
+	if (!ns->tcp_bev) {
+		evutil_closesocket(fd);
+		return -1;
+	}
+	bufferevent_setcb(ns->tcp_bev, nameserver_tcp_readcb, NULL,
+	    nameserver_tcp_eventcb, ns);
+	if (bufferevent_enable(ns->tcp_bev, EV_READ|EV_WRITE) < 0 ||
+	    bufferevent_socket_connect(ns->tcp_bev,
+		(struct sockaddr*)&ns->address, ns->addrlen) < 0) {
+		nameserver_tcp_close(ns);
+		return -1;
+	}
+	return 0;
+}
+
+/* Queue req to go out on ns's TCP connection, opening one if we need to. */
+/* Returns 0 on success, -1 on failure. */
+static int
+nameserver_tcp_send(struct nameserver *ns, struct request *req)
+{
+	u8 lenbuf[2];
+
+	ASSERT_LOCKED(ns->base);
+	if (!ns->tcp_bev && nameserver_tcp_open(ns) < 0)
+		return -1;
+	lenbuf[0] = (u8)(req->request_len >> 8);
+	lenbuf[1] = (u8)(req->request_len & 0xff);
+	if (bufferevent_write(ns->tcp_bev, lenbuf, 2) < 0 ||
+	    bufferevent_write(ns->tcp_bev, req->request, req->request_len) < 0)
+		return -1;
+	return 0;
+}
+
 static void
 nameserver_probe_callback(int result, char type, int count, int ttl, void *addresses, void *arg) {
 	struct nameserver *const ns = (struct nameserver *) arg;
@@ -2299,6 +3232,7 @@ nameserver_send_probe(struct nameserver *const ns) {
 	/* we force this into the inflight queue no matter what */
 	request_trans_id_set(req, transaction_id_pick(ns->base));
 	req->ns = ns;
+	req->probe = 1;
 	request_submit(req);
 }
 
@@ -2349,6 +3283,33 @@ done:
 	return n;
 }
 
+int
+evdns_base_foreach_nameserver_rtt(struct evdns_base *base,
+    evdns_nameserver_rtt_cb cb, void *arg)
+{
+	const struct nameserver *server;
+	struct timeval srtt, rttvar;
+	int n = 0;
+
+	EVDNS_LOCK(base);
+	server = base->server_head;
+	if (!server)
+		goto done;
+	do {
+		srtt.tv_sec = server->srtt_usec / 1000000;
+		srtt.tv_usec = server->srtt_usec % 1000000;
+		rttvar.tv_sec = server->rttvar_usec / 1000000;
+		rttvar.tv_usec = server->rttvar_usec % 1000000;
+		cb((const struct sockaddr *)&server->address, server->addrlen,
+		    &srtt, &rttvar, server->rtt_samples, arg);
+		++n;
+		server = server->next;
+	} while (server != base->server_head);
+done:
+	EVDNS_UNLOCK(base);
+	return n;
+}
+
 int
 evdns_count_nameservers(void)
 {
@@ -2380,6 +3341,7 @@ evdns_base_clear_nameservers_and_suspend(struct evdns_base *base)
 		}
 		if (server->socket >= 0)
 			evutil_closesocket(server->socket);
+		nameserver_tcp_close(server);
 		mm_free(server);
 		if (next == started_at)
 			break;
@@ -2394,7 +3356,8 @@ evdns_base_clear_nameservers_and_suspend(struct evdns_base *base)
 		while (req) {
 			struct request *next = req->next;
 			req->tx_count = req->reissue_count = 0;
-			req->ns = NULL;
+			req->ns = req->hedge_ns = NULL;
+			req->hedge_pending = 0;
 			/* ???? What to do about searches? */
 			(void) evtimer_del(&req->timeout_event);
 			req->trans_id = 0;
@@ -2731,11 +3694,13 @@ request_new(struct evdns_base *base, struct evdns_request *handle, int type,
 	/* denotes that the request data shouldn't be free()ed */
 	req->request_appended = 1;
 	rlen = evdns_request_data_build(name, name_len, trans_id,
-	    type, CLASS_INET, req->request, request_max_len);
+	    type, CLASS_INET, (u16)base->edns_udp_size,
+	    req->request, request_max_len);
 	if (rlen < 0)
 		goto err1;
 
 	req->request_len = rlen;
+	req->edns = base->edns_udp_size != 0;
 	req->trans_id = trans_id;
 	req->tx_count = 0;
 	req->request_type = type;
@@ -2755,11 +3720,230 @@ err1:
 	return NULL;
 }
 
+/* ================================================================= */
+/* Answer cache */
+/* */
+/* We remember answers keyed by the (lowercased) name that went out on */
+/* the wire and the query type, for as long as the TTL in the reply */
+/* allows, clamped to [cache-min-ttl, cache-max-ttl].  NXDOMAIN and */
+/* NODATA answers are remembered as long as the SOA in the authority */
+/* section allows; without an SOA they are not cached at all (RFC 2308). */
+/* Once cache-size entries are stored, the least recently used one is */
+/* evicted. */
+
+static unsigned
+evdns_cache_entry_hash(const struct evdns_cache_entry *ent)
+{
+	return ht_improve_hash(ht_string_hash(ent->name) ^ ent->type);
+}
+
+static int
+evdns_cache_entry_eq(const struct evdns_cache_entry *a,
+    const struct evdns_cache_entry *b)
+{
+	return a->type == b->type && !strcmp(a->name, b->name);
+}
+
+HT_PROTOTYPE(evdns_cache_map, evdns_cache_entry, node,
+    evdns_cache_entry_hash, evdns_cache_entry_eq)
+HT_GENERATE(evdns_cache_map, evdns_cache_entry, node,
+    evdns_cache_entry_hash, evdns_cache_entry_eq,
+    0.5, mm_malloc, mm_realloc, mm_free)
+
+/* Cache entries expire by the base's monotonic clock, so that setting the
+ * system time doesn't make them expire early or live forever. */
+static time_t
+evdns_cache_now(struct evdns_base *base)
+{
+	struct timeval tv;
+	_event_base_gettime_monotonic(base->event_base, &tv);
+	return tv.tv_sec;
+}
+
+/* Store the lowercased name that req asks about in buf. */
+static int
+request_get_name(struct request *req, char *buf, int buflen) {
+	int j = 12; /* skip the header */
+	char *cp;
+	if (name_parse(req->request, req->request_len, &j, buf, buflen) < 0)
+		return -1;
+	for (cp = buf; *cp; ++cp)
+		*cp = EVUTIL_TOLOWER(*cp);
+	return 0;
+}
+
 static void
-request_submit(struct request *const req) {
+evdns_cache_entry_free(struct evdns_base *base, struct evdns_cache_entry *ent)
+{
+	HT_REMOVE(evdns_cache_map, &base->cache, ent);
+	TAILQ_REMOVE(&base->cache_lru, ent, lru);
+	mm_free(ent);
+}
+
+/* Evict least recently used entries until we are within the limit. */
+static void
+evdns_cache_trim(struct evdns_base *base)
+{
+	while ((int)HT_SIZE(&base->cache) > base->cache_max_entries)
+		evdns_cache_entry_free(base,
+		    TAILQ_LAST(&base->cache_lru, evdns_cache_lru));
+}
+
+static void
+evdns_cache_clear(struct evdns_base *base)
+{
+	struct evdns_cache_entry *ent;
+	while ((ent = TAILQ_FIRST(&base->cache_lru)))
+		evdns_cache_entry_free(base, ent);
+}
+
+/* Return the unexpired cache entry that answers req, or NULL. */
+static struct evdns_cache_entry *
+evdns_cache_find(struct request *req, time_t now)
+{
+	struct evdns_base *base = req->base;
+	struct evdns_cache_entry find, *ent;
+	char name[256];
+
+	ASSERT_LOCKED(base);
+	if (!base->cache_max_entries)
+		return NULL;
+	if (request_get_name(req, name, sizeof(name)) < 0)
+		return NULL;
+	find.name = name;
+	find.type = req->request_type;
+	ent = HT_FIND(evdns_cache_map, &base->cache, &find);
+	if (!ent)
+		return NULL;
+	if (ent->expires <= now) {
+		evdns_cache_entry_free(base, ent);
+		return NULL;
+	}
+	TAILQ_REMOVE(&base->cache_lru, ent, lru);
+	TAILQ_INSERT_HEAD(&base->cache_lru, ent, lru);
+	return ent;
+}
+
+/* Remember the answer to req: either reply, or the negative answer err. */
+static void
+evdns_cache_store(struct request *req, u32 ttl, u32 err, struct reply *reply)
+{
+	struct evdns_base *base = req->base;
+	struct evdns_cache_entry find, *ent;
+	char name[256];
+	size_t len;
+
+	ASSERT_LOCKED(base);
+	if (!base->cache_max_entries)
+		return;
+	/* A negative answer without an SOA may not be cached. */
+	if (err && !ttl)
+		return;
+	if (ttl < base->cache_min_ttl)
+		ttl = base->cache_min_ttl;
+	if (ttl > base->cache_max_ttl)
+		ttl = base->cache_max_ttl;
+	if (!ttl)
+		return;
+	if (request_get_name(req, name, sizeof(name)) < 0)
+		return;
+
+	find.name = name;
+	find.type = req->request_type;
+	if ((ent = HT_FIND(evdns_cache_map, &base->cache, &find)))
+		evdns_cache_entry_free(base, ent);
+
+	len = strlen(name);
+	/* the name lives just after the entry */
+	if (!(ent = mm_malloc(sizeof(*ent) + len + 1)))
+		return;
+	memset(ent, 0, sizeof(*ent));
+	ent->name = ((char *) ent) + sizeof(*ent);
+	memcpy(ent->name, name, len + 1);
+	ent->type = req->request_type;
+	ent->err = err;
+	ent->ttl = ttl;
+	ent->expires = evdns_cache_now(base) + ttl;
+	if (reply)
+		memcpy(&ent->reply, reply, sizeof(struct reply));
+
+	HT_INSERT(evdns_cache_map, &base->cache, ent);
+	TAILQ_INSERT_HEAD(&base->cache_lru, ent, lru);
+	evdns_cache_trim(base);
+}
+
+/* ================================================================= */
+/* Query coalescing */
+/* */
+/* A request that asks the same question (name and type, ignoring the */
+/* case randomization) as one we've already sent or queued doesn't go */
+/* out on its own.  It waits on the earlier request's followers list, */
+/* and when that request gets an answer, each follower is handled as */
+/* if the answer had been sent to it. */
+
+HT_GENERATE(evdns_question_map, request, question_node,
+    request_question_hash, request_question_eq,
+    0.5, mm_malloc, mm_realloc, mm_free)
+
+/* Hand the outcome of leader to every request coalesced onto it.  A
+ * positive answer is in reply; otherwise err says what went wrong.  If
+ * try_search is set, followers that are part of a search go on to their
+ * next name rather than failing. */
+static void
+request_fanout(struct request *leader, u32 ttl, u32 err, struct reply *reply,
+    int try_search)
+{
+	struct request *req;
+	ASSERT_LOCKED(leader->base);
+	while ((req = leader->followers)) {
+		if (err && try_search && req->handle &&
+		    req->handle->search_state &&
+		    req->request_type != TYPE_PTR &&
+		    !search_try_next(req->handle))
+			continue; /* req is finished; its next name is out */
+		if (!err && req->put_cname_in_ptr && !*req->put_cname_in_ptr &&
+		    leader->put_cname_in_ptr && *leader->put_cname_in_ptr)
+			*req->put_cname_in_ptr =
+			    mm_strdup(*leader->put_cname_in_ptr);
+		reply_schedule_callback(req, ttl, err, err ? NULL : reply);
+		request_finished(req, &leader->followers, 1);
+	}
+}
+
+/* Return the list that req is currently on. */
+static struct request **
+request_list_head(struct request *req) {
+	struct evdns_base *base = req->base;
+	if (req->leader)
+		return &req->leader->followers;
+	else if (req->cached)
+		return &base->req_cached_head;
+	else if (req->ns)
+		return &REQ_HEAD(base, req->trans_id);
+	else
+		return &base->req_waiting_head;
+}
+
+static void
+request_submit_to_network(struct request *const req) {
 	struct evdns_base *base = req->base;
+	struct request *leader;
 	ASSERT_LOCKED(base);
 	ASSERT_VALID_REQUEST(req);
+	/* A probe has to go to its own nameserver, and nobody else wants
+	 * to wait on a nameserver that we think is down. */
+	if (!req->probe) {
+		if ((leader = HT_FIND(evdns_question_map, &base->questions,
+			    req))) {
+			log(EVDNS_LOG_DEBUG, "Coalescing request %p onto %p",
+			    req, leader);
+			req->leader = leader;
+			evdns_request_insert(req, &leader->followers);
+			return;
+		}
+		HT_INSERT(evdns_question_map, &base->questions, req);
+		req->in_question_map = 1;
+	}
 	if (req->ns) {
 		/* if it has a nameserver assigned then this is going */
 		/* straight into the inflight queue */
@@ -2772,6 +3956,160 @@ request_submit(struct request *const req) {
 	}
 }
 
+/* Send req, which isn't on any list, to a nameserver after all.  The
+ * nameserver and transaction id it got from request_new may be stale. */
+static void
+request_resubmit(struct request *req) {
+	struct evdns_base *base = req->base;
+	ASSERT_LOCKED(base);
+	if (base->global_requests_inflight <
+	    base->global_max_requests_inflight) {
+		req->ns = nameserver_pick(base);
+		request_trans_id_set(req, transaction_id_pick(base));
+	} else {
+		req->ns = NULL;
+	}
+	request_submit_to_network(req);
+}
+
+/* Called when a background refresh of a cached answer finishes. */
+static void
+evdns_cache_prefetch_callback(int result, char type, int count, int ttl,
+    void *addresses, void *arg)
+{
+	/* reply_handle has already put any answer in the cache. */
+	(void) type; (void) count; (void) ttl; (void) addresses; (void) arg;
+	log(EVDNS_LOG_DEBUG, "Cache refresh finished: %s",
+	    evdns_err_to_string(result));
+}
+
+/* If ent is close enough to expiring, ask for a fresh answer in the */
+/* background, so that the next request for it doesn't have to wait. */
+static void
+evdns_cache_maybe_prefetch(struct evdns_base *base,
+    struct evdns_cache_entry *ent, time_t now)
+{
+	struct evdns_request *handle;
+	struct request *req;
+
+	ASSERT_LOCKED(base);
+	if (ent->refreshing || !base->cache_prefetch_pct ||
+	    (u64)(ent->expires - now) * 100 >
+	    (u64)ent->ttl * base->cache_prefetch_pct)
+		return;
+
+	log(EVDNS_LOG_DEBUG, "Refreshing cached answer for %s", ent->name);
+	ent->refreshing = 1;
+	handle = mm_calloc(1, sizeof(*handle));
+	if (!handle)
+		return;
+	req = request_new(base, handle, ent->type, ent->name,
+	    DNS_QUERY_NO_SEARCH, evdns_cache_prefetch_callback, NULL);
+	if (!req) {
+		mm_free(handle);
+		return;
+	}
+	/* Skip the cache check in request_submit: that's the answer we're
+	 * replacing. */
+	request_submit_to_network(req);
+}
+
+/* Called on the first pass through the event loop after we decided to
+ * answer req from the cache. */
+static void
+evdns_request_cache_callback(evutil_socket_t fd, short events, void *arg) {
+	struct request *const req = (struct request *) arg;
+	struct evdns_base *base = req->base;
+	struct evdns_cache_entry *ent;
+	time_t now;
+
+	(void) fd;
+	(void) events;
+
+	EVDNS_LOCK(base);
+	now = evdns_cache_now(base);
+	/* We can't report a CNAME from the cache, and the entry may have
+	 * gone away since we looked; in either case, ask a nameserver. */
+	ent = req->put_cname_in_ptr ? NULL : evdns_cache_find(req, now);
+	if (!ent) {
+		base->cache_misses++;
+		evdns_request_remove(req, &base->req_cached_head);
+		req->cached = 0;
+		evtimer_assign(&req->timeout_event, base->event_base,
+		    evdns_request_timeout_callback, req);
+		request_resubmit(req);
+		EVDNS_UNLOCK(base);
+		return;
+	}
+
+	base->cache_hits++;
+	log(EVDNS_LOG_DEBUG, "Answering request %p from the cache", req);
+	evdns_cache_maybe_prefetch(base, ent, now);
+	if (!ent->err) {
+		reply_schedule_callback(req, (u32)(ent->expires - now), 0,
+		    &ent->reply);
+	} else {
+		if (req->handle && req->handle->search_state &&
+		    req->request_type != TYPE_PTR &&
+		    !search_try_next(req->handle)) {
+			/* a new request was issued for the next name */
+			EVDNS_UNLOCK(base);
+			return;
+		}
+		reply_schedule_callback(req, (u32)(ent->expires - now),
+		    ent->err, NULL);
+	}
+	request_finished(req, &base->req_cached_head, 1);
+	EVDNS_UNLOCK(base);
+}
+
+static void
+request_submit(struct request *const req) {
+	struct evdns_base *base = req->base;
+	ASSERT_LOCKED(base);
+	ASSERT_VALID_REQUEST(req);
+	/* A probe is only worth anything if the nameserver answers it. */
+	if (base->cache_max_entries && !req->probe) {
+		if (evdns_cache_find(req, evdns_cache_now(base))) {
+			/* Answer it from the event loop, so that the
+			 * callback never runs before we return a handle. */
+			struct timeval now_tv = { 0, 0 };
+			req->cached = 1;
+			evtimer_assign(&req->timeout_event, base->event_base,
+			    evdns_request_cache_callback, req);
+			evdns_request_insert(req, &base->req_cached_head);
+			evtimer_add(&req->timeout_event, &now_tv);
+			return;
+		}
+		base->cache_misses++;
+	}
+	request_submit_to_network(req);
+}
+
+/* exported function */
+void
+evdns_base_cache_clear(struct evdns_base *base)
+{
+	EVDNS_LOCK(base);
+	evdns_cache_clear(base);
+	EVDNS_UNLOCK(base);
+}
+
+/* exported function */
+void
+evdns_base_cache_get_stats(struct evdns_base *base, ev_uint64_t *hits,
+    ev_uint64_t *misses, int *n_entries)
+{
+	EVDNS_LOCK(base);
+	if (hits)
+		*hits = base->cache_hits;
+	if (misses)
+		*misses = base->cache_misses;
+	if (n_entries)
+		*n_entries = (int)HT_SIZE(&base->cache);
+	EVDNS_UNLOCK(base);
+}
+
 /* exported function */
 void
 evdns_cancel_request(struct evdns_base *base, struct evdns_request *handle)
@@ -2798,13 +4136,7 @@ evdns_cancel_request(struct evdns_base *base, struct evdns_request *handle)
 	ASSERT_VALID_REQUEST(req);
 
 	reply_schedule_callback(req, 0, DNS_ERR_CANCEL, NULL);
-	if (req->ns) {
-		/* remove from inflight queue */
-		request_finished(req, &REQ_HEAD(base, req->trans_id), 1);
-	} else {
-		/* remove from global_waiting head */
-		request_finished(req, &base->req_waiting_head, 1);
-	}
+	request_finished(req, request_list_head(req), 1);
 	EVDNS_UNLOCK(base);
 }
 
@@ -3217,7 +4549,7 @@ search_try_next(struct evdns_request *const handle) {
 	return 1;
 
 submit_next:
-	request_finished(req, &REQ_HEAD(req->base, req->trans_id), 0);
+	request_finished(req, request_list_head(req), 0);
 	handle->current_req = newreq;
 	newreq->handle = handle;
 	request_submit(newreq);
@@ -3321,8 +4653,10 @@ evdns_base_set_max_requests_inflight(struct evdns_base *base, int maxinflight)
 	ASSERT_LOCKED(base);
 	if (maxinflight < 1)
 		maxinflight = 1;
-	n_heads = (maxinflight+4) / 5;
-	EVUTIL_ASSERT(n_heads > 0);
+	/* Transaction ids are 16 bits, so there is no point in going past
+	 * 65536 heads. */
+	for (n_heads = 1; n_heads < maxinflight && n_heads < 65536; n_heads <<= 1)
+		;
 	new_heads = mm_calloc(n_heads, sizeof(struct request*));
 	if (!new_heads)
 		return (-1);
@@ -3331,7 +4665,7 @@ evdns_base_set_max_requests_inflight(struct evdns_base *base, int maxinflight)
 			while (old_heads[i]) {
 				req = old_heads[i];
 				evdns_request_remove(req, &old_heads[i]);
-				evdns_request_insert(req, &new_heads[req->trans_id % n_heads]);
+				evdns_request_insert(req, &new_heads[req->trans_id & (n_heads - 1)]);
 			}
 		}
 		mm_free(old_heads);
@@ -3441,6 +4775,46 @@ evdns_base_set_option_impl(struct evdns_base *base,
 		    val);
 		memcpy(&base->global_nameserver_probe_initial_timeout, &tv,
 		    sizeof(tv));
+	} else if (str_matches_option(option, "cache-size:")) {
+		const int size = strtoint_clipped(val, 0, 1000000);
+		if (size == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting cache size to %d", size);
+		base->cache_max_entries = size;
+		evdns_cache_trim(base);
+	} else if (str_matches_option(option, "cache-min-ttl:")) {
+		const int ttl = strtoint(val);
+		if (ttl == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting minimum cache TTL to %d", ttl);
+		base->cache_min_ttl = ttl;
+	} else if (str_matches_option(option, "cache-max-ttl:")) {
+		const int ttl = strtoint(val);
+		if (ttl == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting maximum cache TTL to %d", ttl);
+		base->cache_max_ttl = ttl;
+	} else if (str_matches_option(option, "cache-prefetch:")) {
+		const int pct = strtoint_clipped(val, 0, 100);
+		if (pct == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting cache prefetch to %d%%", pct);
+		base->cache_prefetch_pct = pct;
+	} else if (str_matches_option(option, "edns-udp-size:")) {
+		int size = strtoint(val);
+		if (size == -1) return -1;
+		if (size && size < 512) size = 512;
+		if (size > EVDNS_MAX_UDP_SIZE) size = EVDNS_MAX_UDP_SIZE;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting EDNS0 UDP payload size to %d",
+		    size);
+		base->edns_udp_size = size;
+	} else if (str_matches_option(option, "hedge:")) {
+		int hedge = strtoint(val);
+		if (hedge == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting hedge to %d", hedge);
+		base->hedge_requests = hedge != 0;
 	}
 	return 0;
 }
@@ -3839,6 +5213,7 @@ evdns_base_new(struct event_base *event_base, int initialize_nameservers)
 	 * functionality.  We can't just call evdns_getaddrinfo directly or
 	 * else libevent-core will depend on libevent-extras. */
 	evutil_set_evdns_getaddrinfo_fn(evdns_getaddrinfo);
+	evutil_set_evdns_getaddrinfo_cancel_fn(evdns_getaddrinfo_cancel);
 
 	base = mm_malloc(sizeof(struct evdns_base));
 	if (base == NULL)
@@ -3871,7 +5246,20 @@ evdns_base_new(struct event_base *event_base, int initialize_nameservers)
 	base->global_nameserver_probe_initial_timeout.tv_sec = 10;
 	base->global_nameserver_probe_initial_timeout.tv_usec = 0;
 
-	TAILQ_INIT(&base->hostsdb);
+	base->hostsdb = hosts_db_new();
+	base->recv_batch = mm_malloc(sizeof(struct evdns_recv_batch));
+	if (!base->hostsdb || !base->recv_batch) {
+		evdns_base_free_and_unlock(base, 0);
+		return NULL;
+	}
+
+	HT_INIT(evdns_cache_map, &base->cache);
+	HT_INIT(evdns_question_map, &base->questions);
+	TAILQ_INIT(&base->cache_lru);
+	base->cache_max_entries = 0;
+	base->cache_min_ttl = 0;
+	base->cache_max_ttl = 86400;
+	base->cache_prefetch_pct = 10;
 
 	if (initialize_nameservers) {
 		int r;
@@ -3932,9 +5320,26 @@ evdns_nameserver_free(struct nameserver *server)
 	if (server->state == 0)
 		(void) event_del(&server->timeout_event);
 	event_debug_unassign(&server->timeout_event);
+	nameserver_tcp_close(server);
 	mm_free(server);
 }
 
+/* Finish req, which is on the list at head, for evdns_base_free. */
+static void
+evdns_base_free_request(struct request *req, struct request **head,
+    int fail_requests)
+{
+	/* requests coalesced onto req go down with it */
+	while (req->followers) {
+		if (fail_requests)
+			reply_schedule_callback(req->followers, 0, DNS_ERR_SHUTDOWN, NULL);
+		request_finished(req->followers, &req->followers, 1);
+	}
+	if (fail_requests)
+		reply_schedule_callback(req, 0, DNS_ERR_SHUTDOWN, NULL);
+	request_finished(req, head, 1);
+}
+
 static void
 evdns_base_free_and_unlock(struct evdns_base *base, int fail_requests)
 {
@@ -3948,15 +5353,14 @@ evdns_base_free_and_unlock(struct evdns_base *base, int fail_requests)
 
 	for (i = 0; i < base->n_req_heads; ++i) {
 		while (base->req_heads[i]) {
-			if (fail_requests)
-				reply_schedule_callback(base->req_heads[i], 0, DNS_ERR_SHUTDOWN, NULL);
-			request_finished(base->req_heads[i], &REQ_HEAD(base, base->req_heads[i]->trans_id), 1);
+			evdns_base_free_request(base->req_heads[i], &REQ_HEAD(base, base->req_heads[i]->trans_id), fail_requests);
 		}
 	}
 	while (base->req_waiting_head) {
-		if (fail_requests)
-			reply_schedule_callback(base->req_waiting_head, 0, DNS_ERR_SHUTDOWN, NULL);
-		request_finished(base->req_waiting_head, &base->req_waiting_head, 1);
+		evdns_base_free_request(base->req_waiting_head, &base->req_waiting_head, fail_requests);
+	}
+	while (base->req_cached_head) {
+		evdns_base_free_request(base->req_cached_head, &base->req_cached_head, fail_requests);
 	}
 	base->global_requests_inflight = base->global_requests_waiting = 0;
 
@@ -3978,13 +5382,15 @@ evdns_base_free_and_unlock(struct evdns_base *base, int fail_requests)
 		base->global_search_state = NULL;
 	}
 
-	{
-		struct hosts_entry *victim;
-		while ((victim = TAILQ_FIRST(&base->hostsdb))) {
-			TAILQ_REMOVE(&base->hostsdb, victim, next);
-			mm_free(victim);
-		}
-	}
+	evdns_hosts_reload_cancel(base);
+	if (base->hostsdb)
+		hosts_db_free(base->hostsdb);
+	if (base->recv_batch)
+		mm_free(base->recv_batch);
+
+	evdns_cache_clear(base);
+	HT_CLEAR(evdns_cache_map, &base->cache);
+	HT_CLEAR(evdns_question_map, &base->questions);
 
 	mm_free(base->req_heads);
 
@@ -4012,8 +5418,31 @@ evdns_shutdown(int fail_requests)
 	evdns_log_fn = NULL;
 }
 
+static struct hosts_db *
+hosts_db_new(void)
+{
+	struct hosts_db *db = mm_malloc(sizeof(struct hosts_db));
+	if (!db)
+		return NULL;
+	TAILQ_INIT(&db->entries);
+	HT_INIT(evdns_hosts_map, &db->by_name);
+	return db;
+}
+
+static void
+hosts_db_free(struct hosts_db *db)
+{
+	struct hosts_entry *victim;
+	while ((victim = TAILQ_FIRST(&db->entries))) {
+		TAILQ_REMOVE(&db->entries, victim, next);
+		mm_free(victim);
+	}
+	HT_CLEAR(evdns_hosts_map, &db->by_name);
+	mm_free(db);
+}
+
 static int
-evdns_base_parse_hosts_line(struct evdns_base *base, char *line)
+hosts_db_parse_line(struct hosts_db *db, char *line)
 {
 	char *strtok_state;
 	static const char *const delims = " \t";
@@ -4021,7 +5450,6 @@ evdns_base_parse_hosts_line(struct evdns_base *base, char *line)
 	char *hostname, *hash;
 	struct sockaddr_storage ss;
 	int socklen = sizeof(ss);
-	ASSERT_LOCKED(base);
 
 #define NEXT_TOKEN strtok_r(NULL, delims, &strtok_state)
 
@@ -4038,7 +5466,7 @@ evdns_base_parse_hosts_line(struct evdns_base *base, char *line)
 		return -1;
 
 	while ((hostname = NEXT_TOKEN)) {
-		struct hosts_entry *he;
+		struct hosts_entry *he, *first;
 		size_t namelen;
 		if ((hash = strchr(hostname, '#'))) {
 			if (hash == hostname)
@@ -4048,15 +5476,24 @@ evdns_base_parse_hosts_line(struct evdns_base *base, char *line)
 
 		namelen = strlen(hostname);
 
-		he = mm_calloc(1, sizeof(struct hosts_entry)+namelen);
+		/* the hostname lives just after the entry */
+		he = mm_calloc(1, sizeof(struct hosts_entry)+namelen+1);
 		if (!he)
 			return -1;
 		EVUTIL_ASSERT(socklen <= (int)sizeof(he->addr));
 		memcpy(&he->addr, &ss, socklen);
+		he->hostname = ((char *) he) + sizeof(struct hosts_entry);
 		memcpy(he->hostname, hostname, namelen+1);
 		he->addrlen = socklen;
 
-		TAILQ_INSERT_TAIL(&base->hostsdb, he, next);
+		TAILQ_INSERT_TAIL(&db->entries, he, next);
+		if ((first = HT_FIND(evdns_hosts_map, &db->by_name, he))) {
+			while (first->same_name_next)
+				first = first->same_name_next;
+			first->same_name_next = he;
+		} else {
+			HT_INSERT(evdns_hosts_map, &db->by_name, he);
+		}
 
 		if (hash)
 			return 0;
@@ -4066,6 +5503,13 @@ evdns_base_parse_hosts_line(struct evdns_base *base, char *line)
 #undef NEXT_TOKEN
 }
 
+static int
+evdns_base_parse_hosts_line(struct evdns_base *base, char *line)
+{
+	ASSERT_LOCKED(base);
+	return hosts_db_parse_line(base->hostsdb, line);
+}
+
 static int
 evdns_base_load_hosts_impl(struct evdns_base *base, const char *hosts_fname)
 {
@@ -4117,6 +5561,96 @@ evdns_base_load_hosts(struct evdns_base *base, const char *hosts_fname)
 	return res;
 }
 
+/* How many lines of a hosts file evdns_base_reload_hosts parses on each
+ * pass through the event loop. */
+#define EVDNS_HOSTS_LINES_PER_PASS 512
+
+static void
+evdns_hosts_reload_cancel(struct evdns_base *base)
+{
+	struct hosts_reload *reload = base->hosts_reload;
+	ASSERT_LOCKED(base);
+	if (!reload)
+		return;
+	evtimer_del(&reload->event);
+	event_debug_unassign(&reload->event);
+	if (reload->db)
+		hosts_db_free(reload->db);
+	mm_free(reload->text);
+	mm_free(reload);
+	base->hosts_reload = NULL;
+}
+
+static void
+evdns_hosts_reload_cb(evutil_socket_t fd, short events, void *arg)
+{
+	struct evdns_base *base = arg;
+	struct hosts_reload *reload;
+	int n;
+
+	(void) fd;
+	(void) events;
+
+	EVDNS_LOCK(base);
+	reload = base->hosts_reload;
+	for (n = 0; reload->pos && n < EVDNS_HOSTS_LINES_PER_PASS; ++n) {
+		char *eol = strchr(reload->pos, '\n');
+		if (eol)
+			*eol = '\0';
+		hosts_db_parse_line(reload->db, reload->pos);
+		reload->pos = eol ? eol+1 : NULL;
+	}
+
+	if (reload->pos) {
+		struct timeval now_tv = { 0, 0 };
+		evtimer_add(&reload->event, &now_tv);
+	} else {
+		/* the whole file is parsed: put the new entries in service */
+		log(EVDNS_LOG_DEBUG, "Finished reloading hosts file");
+		hosts_db_free(base->hostsdb);
+		base->hostsdb = reload->db;
+		reload->db = NULL;
+		evdns_hosts_reload_cancel(base);
+	}
+	EVDNS_UNLOCK(base);
+}
+
+int
+evdns_base_reload_hosts(struct evdns_base *base, const char *hosts_fname)
+{
+	struct hosts_reload *reload;
+	struct timeval now_tv = { 0, 0 };
+	char *str = NULL;
+	size_t len;
+
+	if (!base)
+		base = current_base;
+	/* Reading the file is one read(); it's parsing that takes a while. */
+	if (evutil_read_file(hosts_fname, &str, &len, 0) < 0)
+		return -1;
+
+	if (!(reload = mm_calloc(1, sizeof(struct hosts_reload)))) {
+		mm_free(str);
+		return -1;
+	}
+	if (!(reload->db = hosts_db_new())) {
+		mm_free(reload);
+		mm_free(str);
+		return -1;
+	}
+	reload->text = reload->pos = str;
+
+	EVDNS_LOCK(base);
+	/* a reload that's still running is out of date */
+	evdns_hosts_reload_cancel(base);
+	base->hosts_reload = reload;
+	evtimer_assign(&reload->event, base->event_base,
+	    evdns_hosts_reload_cb, base);
+	evtimer_add(&reload->event, &now_tv);
+	EVDNS_UNLOCK(base);
+	return 0;
+}
+
 /* A single request for a getaddrinfo, either v4 or v6. */
 struct getaddrinfo_subrequest {
 	struct evdns_request *r;
@@ -4458,18 +5992,13 @@ static struct hosts_entry *
 find_hosts_entry(struct evdns_base *base, const char *hostname,
     struct hosts_entry *find_after)
 {
-	struct hosts_entry *e;
+	struct hosts_entry find;
 
 	if (find_after)
-		e = TAILQ_NEXT(find_after, next);
-	else
-		e = TAILQ_FIRST(&base->hostsdb);
+		return find_after->same_name_next;
 
-	for (; e; e = TAILQ_NEXT(e, next)) {
-		if (!evutil_ascii_strcasecmp(e->hostname, hostname))
-			return e;
-	}
-	return NULL;
+	find.hostname = (char *)hostname;
+	return HT_FIND(evdns_hosts_map, &base->hostsdb->by_name, &find);
 }
 
 static int
@@ -4498,8 +6027,8 @@ evdns_getaddrinfo_fromhosts(struct evdns_base *base,
 		sockaddr_setport(ai_new->ai_addr, port);
 		ai = evutil_addrinfo_append(ai, ai_new);
 	}
-	EVDNS_UNLOCK(base);
 out:
+	EVDNS_UNLOCK(base);
 	if (n_found) {
 		/* Note that we return an empty answer if we found entries for
 		 * this hostname but none were of the right address type. */
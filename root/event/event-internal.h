@@ -291,6 +291,13 @@ struct event_base {
 	struct event th_notify;//等待唤醒的函数就在此结构中,即那个回调函数
 	/** A function used to wake up the main thread from another thread. */
 	int (*th_notify_fn)(struct event_base *base);//用于从其它线程唤醒主线程的函数
+
+	/** Default most bytes a new bufferevent on this base will read in a
+	 * single operation, or 0 for the library default. */
+	size_t bev_max_single_read;
+	/** Default most bytes a new bufferevent on this base will write in a
+	 * single operation, or 0 for the library default. */
+	size_t bev_max_single_write;
 };
 
 //链表，用来存放“避免使用的方法”
@@ -57,8 +57,11 @@
 #include "event2/event.h"
 #include "event2/event_struct.h"
 #include "event2/event_compat.h"
+#include "event2/bufferevent.h"
+#include "event2/bufferevent_struct.h"
 #include "event-internal.h"
 #include "defer-internal.h"
+#include "bufferevent-internal.h"
 #include "evthread-internal.h"
 #include "event2/thread.h"
 #include "event2/util.h"
@@ -412,6 +415,22 @@ event_base_gettimeofday_cached(struct event_base *base, struct timeval *tv)
 	return r;
 }
 
+int
+_event_base_gettime_monotonic(struct event_base *base, struct timeval *tv)
+{
+	int r;
+	if (!base) {
+		base = current_base;
+		if (!current_base)
+			return evutil_gettimeofday(tv, NULL);
+	}
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	r = gettime(base, tv);
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return r;
+}
+
 /** Make 'base' have no current cached time. */
 static inline void
 clear_time_cache(struct event_base *base)
@@ -521,6 +540,29 @@ event_base_get_deferred_cb_queue(struct event_base *base)
 	return base ? &base->defer_queue : NULL;
 }
 
+size_t
+event_base_get_bev_max_single(struct event_base *base, int is_write)
+{
+	size_t size;
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	size = is_write ? base->bev_max_single_write :
+	    base->bev_max_single_read;
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return size;
+}
+
+void
+event_base_set_bev_max_single(struct event_base *base, int is_write,
+    size_t size)
+{
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	if (is_write)
+		base->bev_max_single_write = size;
+	else
+		base->bev_max_single_read = size;
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+}
+
 void
 event_enable_debug_mode(void)
 {
@@ -2898,6 +2940,8 @@ event_global_setup_locks_(const int enable_locks)
 		return -1;
 	if (evutil_secure_rng_global_setup_locks_(enable_locks) < 0)
 		return -1;
+	if (bufferevent_ratelim_global_setup_locks_(enable_locks) < 0)
+		return -1;
 	return 0;
 }
 #endif
@@ -13,6 +13,7 @@
 #include "event2/event_struct.h"
 #include "util-internal.h"
 #include "defer-internal.h"
+#include "ht-internal.h"
 
 #define HTTP_CONNECT_TIMEOUT	45
 #define HTTP_WRITE_TIMEOUT	50
@@ -63,6 +64,8 @@ struct evhttp_connection {
 	/* we use this tailq only if this connection was created for an http
 	 * server */
 	TAILQ_ENTRY(evhttp_connection) next;
+	/* on the server's list of connections waiting for a request */
+	TAILQ_ENTRY(evhttp_connection) idle_next;
 
 	evutil_socket_t fd;
 	struct bufferevent *bufev;
@@ -82,6 +85,7 @@ struct evhttp_connection {
 #define EVHTTP_CON_INCOMING	0x0001	/* only one request on it ever */
 #define EVHTTP_CON_OUTGOING	0x0002  /* multiple requests possible */
 #define EVHTTP_CON_CLOSEDETECT  0x0004  /* detecting if persistent close */
+#define EVHTTP_CON_IDLE		0x0008	/* waiting for the next request */
 
 	int timeout;			/* timeout in seconds for events */
 	int retry_cnt;			/* retry count */
@@ -109,6 +113,7 @@ struct evhttp_connection {
 /* A callback for an http server */
 struct evhttp_cb {
 	TAILQ_ENTRY(evhttp_cb) next;
+	HT_ENTRY(evhttp_cb) node;	/* in cb_map, keyed by what */
 
 	char *what;
 
@@ -116,6 +121,71 @@ struct evhttp_cb {
 	void *cbarg;
 };
 
+HT_HEAD(evhttp_cb_map, evhttp_cb);
+
+/* A callback set with evhttp_set_route() for some of the methods */
+struct evhttp_route_handler {
+	TAILQ_ENTRY(evhttp_route_handler) next;
+
+	ev_uint16_t methods;
+	void (*cb)(struct evhttp_request *req, void *);
+	void *cbarg;
+};
+
+/* One path segment in the tree of routes.  Literal children are found in
+ * the server's route_edges table by parent and segment, so looking up a
+ * path costs one hash lookup per segment however many routes there are;
+ * ":name" and "*name" children hang off their parent directly. */
+struct evhttp_route_node {
+	HT_ENTRY(evhttp_route_node) node;
+	TAILQ_ENTRY(evhttp_route_node) next;	/* in route_nodes */
+
+	struct evhttp_route_node *parent;
+	char *segment;			/* literal text, or parameter name */
+	int depth;			/* number of segments from the root */
+
+	struct evhttp_route_node *param;	/* ":name" child */
+	struct evhttp_route_node *catchall;	/* "*name" child */
+	int n_literals;			/* number of literal children */
+
+	TAILQ_HEAD(evhttp_route_handlerq, evhttp_route_handler) handlers;
+};
+
+HT_HEAD(evhttp_route_map, evhttp_route_node);
+TAILQ_HEAD(evhttp_route_nodeq, evhttp_route_node);
+
+/* a directory served by the static file handler */
+struct evhttp_static_dir {
+	TAILQ_ENTRY(evhttp_static_dir) next;
+
+	char *prefix;			/* decoded URI path prefix */
+	size_t prefix_len;
+	char *docroot;			/* directory the files live in */
+};
+
+/* An open file cached by the static file handler.  Entries are found by
+ * path through a hash table, and kept on a list in order of last use so
+ * that the least recently used one can be closed first. */
+struct evhttp_static_file {
+	HT_ENTRY(evhttp_static_file) node;
+	TAILQ_ENTRY(evhttp_static_file) lru;
+
+	char *path;			/* path of the file on disk */
+	int fd;				/* read-only descriptor for path */
+	ev_off_t size;
+	time_t mtime;
+	ev_uint64_t dev;		/* identity of the file, to notice */
+	ev_uint64_t ino;		/* when path gets replaced */
+	time_t checked;			/* when we last stat()ed path */
+
+	const char *content_type;
+	char etag[48];
+	char last_modified[32];
+};
+
+HT_HEAD(evhttp_static_map, evhttp_static_file);
+TAILQ_HEAD(evhttp_static_lru, evhttp_static_file);
+
 /* both the http server as well as the rpc system need to queue connections */
 TAILQ_HEAD(evconq, evhttp_connection);
 
@@ -141,9 +211,23 @@ struct evhttp {
 	TAILQ_HEAD(boundq, evhttp_bound_socket) sockets;
 
 	TAILQ_HEAD(httpcbq, evhttp_cb) callbacks;
+	struct evhttp_cb_map cb_map;
+
+	/* Routes set with evhttp_set_route(); see evhttp_route_node. */
+	struct evhttp_route_node *route_root;
+	struct evhttp_route_map route_edges;
+	struct evhttp_route_nodeq route_nodes;
 
 	/* All live connections on this host. */
 	struct evconq connections;
+	int connection_cnt;
+	int connection_max;		/* 0 for no limit */
+
+	/* Connections waiting for a request, least recently used first;
+	 * the first one is closed when we need room for another. */
+	struct evconq idle_connections;
+	int accept_paused;		/* listeners are disabled */
+	struct event *accept_retry;	/* re-enables them after EMFILE */
 
 	TAILQ_HEAD(vhostsq, evhttp) virtualhosts;
 
@@ -166,6 +250,21 @@ struct evhttp {
 	void (*gencb)(struct evhttp_request *req, void *);
 	void *gencbarg;
 
+	/* Called when the headers of a request have been read. */
+	int (*headercb)(struct evhttp_request *req, void *);
+	void *headercbarg;
+
+	/* Directories served by the static file handler, and the cache of
+	 * files it has open. */
+	TAILQ_HEAD(staticdirq, evhttp_static_dir) static_dirs;
+	struct evhttp_static_map static_files;
+	struct evhttp_static_lru static_lru;
+	unsigned static_cache_max;
+
+	/* zlib level for compressing responses, or 0 if we don't. */
+	int compress_level;
+	size_t compress_min_size;
+
 	struct event_base *base;
 };
 
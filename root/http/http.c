@@ -82,6 +82,19 @@
 #ifdef _EVENT_HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef _EVENT_HAVE_LIBZ
+/* zlib 1.2.4 and 1.2.5 test these with "FOO-0"; keep -Wundef quiet. */
+#ifndef _LARGEFILE64_SOURCE
+#define _LARGEFILE64_SOURCE 0
+#endif
+#ifndef _LFS64_LARGEFILE
+#define _LFS64_LARGEFILE 0
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 0
+#endif
+#include <zlib.h>
+#endif
 
 #undef timeout_pending
 #undef timeout_initialized
@@ -188,6 +201,7 @@ static void evhttp_get_request(struct evhttp *, evutil_socket_t, struct sockaddr
 static void evhttp_write_buffer(struct evhttp_connection *,
     void (*)(struct evhttp_connection *, void *), void *);
 static void evhttp_make_header(struct evhttp_connection *, struct evhttp_request *);
+static void evhttp_resume_accepting(struct evhttp *);
 
 /* callbacks for bufferevent */
 static void evhttp_read_cb(struct bufferevent *, void *);
@@ -490,27 +504,35 @@ evhttp_is_connection_keepalive(struct evkeyvalq* headers)
 	    && evutil_ascii_strncasecmp(connection, "keep-alive", 10) == 0);
 }
 
-/* Add a correct "Date" header to headers, unless it already has one. */
-static void
-evhttp_maybe_add_date_header(struct evkeyvalq *headers)
+/* Format 't' as an RFC 1123 date, as used in HTTP headers, into 'date'.
+ * Returns 0 on success, -1 if 'date' is too short. */
+static int
+evhttp_format_date(time_t t, char *date, size_t datelen)
 {
-	if (evhttp_find_header(headers, "Date") == NULL) {
-		char date[50];
 #ifndef WIN32
-		struct tm cur;
+	struct tm cur;
 #endif
-		struct tm *cur_p;
-		time_t t = time(NULL);
+	struct tm *cur_p;
 #ifdef WIN32
-		cur_p = gmtime(&t);
+	cur_p = gmtime(&t);
 #else
-		gmtime_r(&t, &cur);
-		cur_p = &cur;
+	gmtime_r(&t, &cur);
+	cur_p = &cur;
 #endif
-		if (strftime(date, sizeof(date),
-			"%a, %d %b %Y %H:%M:%S GMT", cur_p) != 0) {
+	if (strftime(date, datelen,
+		"%a, %d %b %Y %H:%M:%S GMT", cur_p) == 0)
+		return (-1);
+	return (0);
+}
+
+/* Add a correct "Date" header to headers, unless it already has one. */
+static void
+evhttp_maybe_add_date_header(struct evkeyvalq *headers)
+{
+	if (evhttp_find_header(headers, "Date") == NULL) {
+		char date[50];
+		if (evhttp_format_date(time(NULL), date, sizeof(date)) == 0)
 			evhttp_add_header(headers, "Date", date);
-		}
 	}
 }
 
@@ -690,6 +712,9 @@ evhttp_connection_incoming_fail(struct evhttp_request *req,
 	return (0);
 }
 
+#define get_deferred_queue(evcon)		\
+	(event_base_get_deferred_cb_queue((evcon)->base))
+
 /* Called when evcon has experienced a (non-recoverable? -NM) error, as
  * given in error. If it's an outgoing connection, reset the connection,
  * retry any pending requests, and inform the user.  If it's incoming,
@@ -704,6 +729,9 @@ evhttp_connection_fail(struct evhttp_connection *evcon,
 	EVUTIL_ASSERT(req != NULL);
 
 	bufferevent_disable(evcon->bufev, EV_READ|EV_WRITE);
+	/* A paused body may have queued a read of its own. */
+	event_deferred_cb_cancel(get_deferred_queue(evcon),
+	    &evcon->read_more_deferred_cb);
 
 	if (evcon->flags & EVHTTP_CON_INCOMING) {
 		/*
@@ -773,6 +801,10 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
 	int con_outgoing = evcon->flags & EVHTTP_CON_OUTGOING;
 
+	/* The body has been read; don't hold back what comes next. */
+	if (req->body_highmark)
+		bufferevent_setwatermark(evcon->bufev, EV_READ, 0, 0);
+
 	if (con_outgoing) {
 		/* idle or close the connection */
 		int need_close;
@@ -824,6 +856,62 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 	}
 }
 
+/* Pass the data in req's input buffer to its chunked callback.  Unless
+ * the request is flow-controlled, whatever the callback leaves behind is
+ * drained.  Returns -1 if the request was canceled from the callback. */
+static int
+evhttp_run_chunk_cb(struct evhttp_request *req)
+{
+	struct evhttp_connection *evcon = req->evcon;
+	void *arg = req->cb_arg;
+
+	/* Requests received by a server call back into
+	 * evhttp_handle_request(); their chunked callback gets the argument
+	 * of the header callback that set it. */
+	if (evcon->http_server != NULL)
+		arg = evcon->http_server->headercbarg;
+
+	req->flags |= EVHTTP_REQ_DEFER_FREE;
+	(*req->chunk_cb)(req, arg);
+	req->flags &= ~EVHTTP_REQ_DEFER_FREE;
+	if ((req->flags & EVHTTP_REQ_NEEDS_FREE) != 0)
+		return (-1);
+
+	if (req->body_highmark == 0) {
+		evbuffer_drain(req->input_buffer,
+		    evbuffer_get_length(req->input_buffer));
+	} else if (evbuffer_get_length(req->input_buffer) >=
+	    req->body_highmark) {
+		/* The consumer is behind: stop moving data out of the
+		 * bufferevent until evhttp_body_drained_cb() sees the input
+		 * buffer drop below the mark. */
+		req->flags |= EVHTTP_REQ_BODY_PAUSED;
+	}
+	return (0);
+}
+
+/* Evbuffer callback for the input buffer of a flow-controlled request:
+ * resumes reading the body once the consumer has caught up. */
+static void
+evhttp_body_drained_cb(struct evbuffer *buf,
+    const struct evbuffer_cb_info *info, void *arg)
+{
+	struct evhttp_request *req = arg;
+	struct evhttp_connection *evcon = req->evcon;
+
+	if (info->n_deleted == 0 || evcon == NULL ||
+	    (req->flags & EVHTTP_REQ_BODY_PAUSED) == 0 ||
+	    evbuffer_get_length(buf) >= req->body_highmark)
+		return;
+
+	req->flags &= ~EVHTTP_REQ_BODY_PAUSED;
+	/* We may be inside the chunked callback or elsewhere in user
+	 * code; pick up the buffered body from the loop. */
+	if (evcon->state == EVCON_READING_BODY)
+		event_deferred_cb_schedule(get_deferred_queue(evcon),
+		    &evcon->read_more_deferred_cb);
+}
+
 /*
  * Handles reading from a chunked request.
  *   return ALL_DATA_READ:
@@ -907,23 +995,31 @@ evhttp_handle_chunked_read(struct evhttp_request *req, struct evbuffer *buf)
 			return DATA_CORRUPTED;
 		}
 
-		/* don't have enough to complete a chunk; wait for more */
-		if (req->ntoread > 0 && buflen < (ev_uint64_t)req->ntoread)
-			return (MORE_DATA_EXPECTED);
+		if (req->chunk_cb == NULL) {
+			/* don't have enough to complete a chunk; wait for
+			 * more */
+			if (buflen < (ev_uint64_t)req->ntoread)
+				return (MORE_DATA_EXPECTED);
 
-		/* Completed chunk */
-		evbuffer_remove_buffer(buf, req->input_buffer, (size_t)req->ntoread);
-		req->ntoread = -1;
-		if (req->chunk_cb != NULL) {
-			req->flags |= EVHTTP_REQ_DEFER_FREE;
-			(*req->chunk_cb)(req, req->cb_arg);
-			evbuffer_drain(req->input_buffer,
-			    evbuffer_get_length(req->input_buffer));
-			req->flags &= ~EVHTTP_REQ_DEFER_FREE;
-			if ((req->flags & EVHTTP_REQ_NEEDS_FREE) != 0) {
-				return (REQUEST_CANCELED);
-			}
+			/* Completed chunk */
+			evbuffer_remove_buffer(buf, req->input_buffer,
+			    (size_t)req->ntoread);
+			req->ntoread = -1;
+			continue;
 		}
+
+		/* A streaming reader gets chunk data as it arrives, whether
+		 * or not the chunk is complete. */
+		if (buflen > (ev_uint64_t)req->ntoread)
+			buflen = (size_t)req->ntoread;
+		evbuffer_remove_buffer(buf, req->input_buffer, buflen);
+		req->ntoread -= buflen;
+		if (req->ntoread == 0)
+			req->ntoread = -1;
+		if (evhttp_run_chunk_cb(req) == -1)
+			return (REQUEST_CANCELED);
+		if (req->flags & EVHTTP_REQ_BODY_PAUSED)
+			return (MORE_DATA_EXPECTED);
 	}
 
 	return (MORE_DATA_EXPECTED);
@@ -956,6 +1052,12 @@ evhttp_read_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 {
 	struct evbuffer *buf = bufferevent_get_input(evcon->bufev);
 
+	if (req->flags & EVHTTP_REQ_BODY_PAUSED) {
+		/* Leave the data in the bufferevent; its read high-water mark
+		 * stops reading once enough of it has piled up. */
+		return;
+	}
+
 	if (req->chunked) {
 		switch (evhttp_handle_chunked_read(req, buf)) {
 		case ALL_DATA_READ:
@@ -1011,15 +1113,12 @@ evhttp_read_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 	}
 
 	if (evbuffer_get_length(req->input_buffer) > 0 && req->chunk_cb != NULL) {
-		req->flags |= EVHTTP_REQ_DEFER_FREE;
-		(*req->chunk_cb)(req, req->cb_arg);
-		req->flags &= ~EVHTTP_REQ_DEFER_FREE;
-		evbuffer_drain(req->input_buffer,
-		    evbuffer_get_length(req->input_buffer));
-		if ((req->flags & EVHTTP_REQ_NEEDS_FREE) != 0) {
+		if (evhttp_run_chunk_cb(req) == -1) {
 			evhttp_request_free(req);
 			return;
 		}
+		if (req->flags & EVHTTP_REQ_BODY_PAUSED)
+			return;
 	}
 
 	if (req->ntoread == 0) {
@@ -1033,8 +1132,104 @@ evhttp_read_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 	bufferevent_enable(evcon->bufev, EV_READ);
 }
 
-#define get_deferred_queue(evcon)		\
-	(event_base_get_deferred_cb_queue((evcon)->base))
+/* Server connection limits.  A server connection is idle while it waits
+ * for the first byte of its next request; idle connections are kept on a
+ * list in the order in which they became idle, so that the one that has
+ * waited longest can be closed when we need its descriptor. */
+
+static void
+evhttp_connection_set_idle(struct evhttp_connection *evcon)
+{
+	struct evhttp *http = evcon->http_server;
+
+	evcon->flags |= EVHTTP_CON_IDLE;
+	TAILQ_INSERT_TAIL(&http->idle_connections, evcon, idle_next);
+	/* we can make room again */
+	if (http->accept_paused)
+		evhttp_resume_accepting(http);
+}
+
+static void
+evhttp_connection_set_busy(struct evhttp_connection *evcon)
+{
+	struct evhttp *http = evcon->http_server;
+
+	evcon->flags &= ~EVHTTP_CON_IDLE;
+	TAILQ_REMOVE(&http->idle_connections, evcon, idle_next);
+}
+
+/* Close the connection that has been idle longest.  Returns 0 if there
+ * was none. */
+static int
+evhttp_evict_idle(struct evhttp *http)
+{
+	struct evhttp_connection *evcon = TAILQ_FIRST(&http->idle_connections);
+
+	if (evcon == NULL)
+		return (0);
+	event_debug(("%s: closing idle connection "EV_SOCK_FMT, __func__,
+		EV_SOCK_ARG(evcon->fd)));
+	evhttp_connection_free(evcon);
+	return (1);
+}
+
+static void
+evhttp_pause_accepting(struct evhttp *http)
+{
+	struct evhttp_bound_socket *bound;
+
+	if (http->accept_paused)
+		return;
+	event_debug(("%s: %d connections, none idle", __func__,
+		http->connection_cnt));
+	http->accept_paused = 1;
+	TAILQ_FOREACH(bound, &http->sockets, next)
+		evconnlistener_disable(bound->listener);
+}
+
+static void
+evhttp_resume_accepting(struct evhttp *http)
+{
+	struct evhttp_bound_socket *bound;
+
+	if (http->connection_max &&
+	    http->connection_cnt >= http->connection_max &&
+	    TAILQ_EMPTY(&http->idle_connections))
+		return;
+	http->accept_paused = 0;
+	if (http->accept_retry != NULL)
+		evtimer_del(http->accept_retry);
+	TAILQ_FOREACH(bound, &http->sockets, next)
+		evconnlistener_enable(bound->listener);
+}
+
+static void
+evhttp_accept_retry_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evhttp *http = arg;
+
+	/* If we are still out of descriptors, the next accept() fails
+	 * and we pause again. */
+	if (http->accept_paused)
+		evhttp_resume_accepting(http);
+}
+
+/* We ran out of descriptors with no idle connection to close.  Other
+ * descriptors in the process may come free without any connection of
+ * ours going away, so don't wait for that alone: try again in a while. */
+static void
+evhttp_retry_accepting_later(struct evhttp *http, struct event_base *base)
+{
+	static const struct timeval retry = { 1, 0 };
+
+	if (http->accept_retry == NULL &&
+	    (http->accept_retry = evtimer_new(base,
+		evhttp_accept_retry_cb, http)) == NULL) {
+		event_warn("%s: evtimer_new", __func__);
+		return;
+	}
+	evtimer_add(http->accept_retry, &retry);
+}
 
 /*
  * Gets called when more data becomes available
@@ -1050,6 +1245,10 @@ evhttp_read_cb(struct bufferevent *bufev, void *arg)
 	event_deferred_cb_cancel(get_deferred_queue(evcon),
 	    &evcon->read_more_deferred_cb);
 
+	/* A request is coming in; this connection can't be evicted now. */
+	if (evcon->flags & EVHTTP_CON_IDLE)
+		evhttp_connection_set_busy(evcon);
+
 	switch (evcon->state) {
 	case EVCON_READING_FIRSTLINE:
 		evhttp_read_firstline(evcon, req);
@@ -1145,6 +1344,11 @@ evhttp_connection_free(struct evhttp_connection *evcon)
 	if (evcon->http_server != NULL) {
 		struct evhttp *http = evcon->http_server;
 		TAILQ_REMOVE(&http->connections, evcon, next);
+		if (evcon->flags & EVHTTP_CON_IDLE)
+			TAILQ_REMOVE(&http->idle_connections, evcon, idle_next);
+		--http->connection_cnt;
+		if (http->accept_paused)
+			evhttp_resume_accepting(http);
 	}
 
 	if (event_initialized(&evcon->retry_ev)) {
@@ -2017,6 +2221,14 @@ evhttp_read_header(struct evhttp_connection *evcon,
 	/* Done reading headers, do the real work */
 	switch (req->kind) {
 	case EVHTTP_REQUEST:
+		if (evcon->http_server != NULL &&
+		    evcon->http_server->headercb != NULL &&
+		    (*evcon->http_server->headercb)(req,
+			evcon->http_server->headercbarg) == -1) {
+			evhttp_connection_fail(evcon,
+			    EVCON_HTTP_INVALID_HEADER);
+			return;
+		}
 		event_debug(("%s: checking for post data on "EV_SOCK_FMT"\n",
 			__func__, EV_SOCK_ARG(fd)));
 		evhttp_get_body(evcon, req);
@@ -2398,6 +2610,248 @@ evhttp_send_error(struct evhttp_request *req, int error, const char *reason)
 #undef ERR_FORMAT
 }
 
+#ifdef _EVENT_HAVE_LIBZ
+struct evhttp_compressor {
+	z_stream stream;
+};
+
+/* Media types that gain nothing from another round of compression. */
+static const char *evhttp_compressed_types[] = {
+	"image/",
+	"audio/",
+	"video/",
+	"font/woff",
+	"application/zip",
+	"application/gzip",
+	"application/x-gzip",
+	"application/x-bzip2",
+	"application/x-xz",
+	"application/x-7z-compressed",
+	"application/x-rar-compressed",
+	NULL
+};
+
+static int
+evhttp_is_compressible_type(const char *type)
+{
+	const char **p;
+
+	if (type == NULL)
+		return (1);
+	/* SVG is XML text, whatever its top-level type says. */
+	if (!evutil_ascii_strncasecmp(type, "image/svg+xml", 13))
+		return (1);
+	for (p = evhttp_compressed_types; *p != NULL; ++p) {
+		if (!evutil_ascii_strncasecmp(type, *p, strlen(*p)))
+			return (0);
+	}
+	return (1);
+}
+
+/* Parses the qvalue at s, up to end, in thousandths: "0.5" is 500.
+ * Anything from 1 up counts as 1. */
+static int
+evhttp_parse_qvalue(const char *s, const char *end)
+{
+	int q = 0, scale = 1000;
+
+	while (s < end && (*s == ' ' || *s == '\t'))
+		++s;
+	if (s < end && *s >= '1' && *s <= '9')
+		return (1000);
+	while (s < end && *s == '0')
+		++s;
+	if (s < end && *s == '.') {
+		for (++s; s < end && EVUTIL_ISDIGIT(*s) && scale > 1; ++s) {
+			scale /= 10;
+			q += (*s - '0') * scale;
+		}
+	}
+	return (q);
+}
+
+/* Returns how much an Accept-Encoding value wants the content coding
+ * 'coding', in thousandths, either by naming it or through "*".  0 means
+ * that it isn't acceptable. */
+static int
+evhttp_coding_qvalue(const char *accept, const char *coding)
+{
+	size_t len = strlen(coding);
+	int wildcard = 0;
+
+	while (*accept) {
+		const char *name, *end;
+		size_t name_len;
+		int q = 1000;
+
+		accept += strspn(accept, " \t,");
+		name = accept;
+		name_len = strcspn(name, " \t;,");
+		end = name + strcspn(name, ",");
+
+		accept = name + name_len;
+		while (accept < end) {
+			accept += strspn(accept, " \t;");
+			if (accept < end && (*accept == 'q' || *accept == 'Q') &&
+			    accept[1] == '=') {
+				accept += 2;
+				q = evhttp_parse_qvalue(accept, end);
+			}
+			accept += strcspn(accept, ";,");
+			if (accept > end)
+				accept = end;
+		}
+
+		if (name_len == len &&
+		    !evutil_ascii_strncasecmp(name, coding, len))
+			return (q);
+		if (name_len == 1 && *name == '*')
+			wildcard = q;
+	}
+
+	return (wildcard);
+}
+
+/* Run the data in src through z, appending the output to dst.  flush is
+ * passed to deflate() once all of src has been handed over. */
+static int
+evhttp_deflate(z_streamp z, struct evbuffer *src, struct evbuffer *dst,
+    int flush)
+{
+	struct evbuffer_iovec v_in, v_out;
+	size_t len;
+	int mode, res;
+
+	for (;;) {
+		mode = flush;
+		if ((len = evbuffer_get_length(src)) > 0) {
+			evbuffer_peek(src, -1, NULL, &v_in, 1);
+			if (v_in.iov_len < len)
+				mode = Z_NO_FLUSH;
+			z->next_in = v_in.iov_base;
+			z->avail_in = (uInt)v_in.iov_len;
+		} else {
+			z->next_in = NULL;
+			z->avail_in = 0;
+		}
+
+		if (evbuffer_reserve_space(dst, 4096, &v_out, 1) < 1)
+			return (-1);
+		z->next_out = v_out.iov_base;
+		z->avail_out = (uInt)v_out.iov_len;
+
+		res = deflate(z, mode);
+
+		if (len > 0)
+			evbuffer_drain(src, v_in.iov_len - z->avail_in);
+		v_out.iov_len -= z->avail_out;
+		evbuffer_commit_space(dst, &v_out, 1);
+
+		if (res == Z_STREAM_END)
+			break;
+		if (res == Z_STREAM_ERROR)
+			return (-1);
+		/* Z_BUF_ERROR only says that no progress was possible */
+		if (res == Z_BUF_ERROR ||
+		    (evbuffer_get_length(src) == 0 && z->avail_out != 0 &&
+			flush != Z_FINISH))
+			break;
+	}
+
+	return (0);
+}
+
+static void
+evhttp_compressor_free(struct evhttp_compressor *c)
+{
+	deflateEnd(&c->stream);
+	mm_free(c);
+}
+
+/* Decides whether the response to req is to be compressed, and if so,
+ * updates its headers.  A complete body is compressed in place; a
+ * streamed one gets a compressor for evhttp_send_reply_chunk(). */
+static void
+evhttp_response_maybe_compress(struct evhttp_request *req, int streamed)
+{
+	struct evhttp_connection *evcon = req->evcon;
+	struct evhttp *http = evcon->http_server;
+	struct evhttp_compressor *c;
+	const char *accept, *coding;
+	int window_bits, gzip_q, deflate_q;
+
+	if (http == NULL || http->compress_level == 0 ||
+	    !evhttp_response_needs_body(req) ||
+	    req->response_code == HTTP_PARTIALCONTENT ||
+	    evhttp_find_header(req->output_headers, "Content-Encoding") ||
+	    !evhttp_is_compressible_type(
+		evhttp_find_header(req->output_headers, "Content-Type")))
+		return;
+	if (streamed) {
+		/* we won't know the compressed length in advance */
+		if (evhttp_find_header(req->output_headers, "Content-Length"))
+			return;
+	} else if (evbuffer_get_length(req->output_buffer) <
+	    http->compress_min_size) {
+		return;
+	}
+
+	/* The representation now depends on the request's headers. */
+	if (evhttp_find_header(req->output_headers, "Vary") == NULL)
+		evhttp_add_header(req->output_headers, "Vary",
+		    "Accept-Encoding");
+
+	accept = evhttp_find_header(req->input_headers, "Accept-Encoding");
+	if (accept == NULL)
+		return;
+	/* Use whichever the client prefers; gzip if it doesn't mind. */
+	gzip_q = evhttp_coding_qvalue(accept, "gzip");
+	deflate_q = evhttp_coding_qvalue(accept, "deflate");
+	if (gzip_q == 0 && deflate_q == 0)
+		return;
+	if (gzip_q >= deflate_q) {
+		coding = "gzip";
+		window_bits = 15 + 16;
+	} else {
+		coding = "deflate";
+		window_bits = 15;
+	}
+
+	if ((c = mm_calloc(1, sizeof(*c))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return;
+	}
+	if (deflateInit2(&c->stream, http->compress_level, Z_DEFLATED,
+		window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		event_warnx("%s: deflateInit2 failed", __func__);
+		mm_free(c);
+		return;
+	}
+
+	if (streamed) {
+		req->compressor = c;
+	} else {
+		struct evbuffer *buf = evbuffer_new();
+		if (buf == NULL ||
+		    evhttp_deflate(&c->stream, req->output_buffer, buf,
+			Z_FINISH) == -1) {
+			/* whatever is left of the body can't be trusted */
+			event_warnx("%s: deflate failed", __func__);
+			if (buf != NULL)
+				evbuffer_free(buf);
+			evhttp_compressor_free(c);
+			return;
+		}
+		evbuffer_add_buffer(req->output_buffer, buf);
+		evbuffer_free(buf);
+		evhttp_compressor_free(c);
+		/* let evhttp_make_header() count the compressed body */
+		evhttp_remove_header(req->output_headers, "Content-Length");
+	}
+	evhttp_add_header(req->output_headers, "Content-Encoding", coding);
+}
+#endif
+
 /* Requires that headers and response code are already set up */
 
 static inline void
@@ -2419,6 +2873,11 @@ evhttp_send(struct evhttp_request *req, struct evbuffer *databuf)
 	if (databuf != NULL)
 		evbuffer_add_buffer(req->output_buffer, databuf);
 
+#ifdef _EVENT_HAVE_LIBZ
+	if (req->kind == EVHTTP_RESPONSE)
+		evhttp_response_maybe_compress(req, 0);
+#endif
+
 	/* Adds headers to the response */
 	evhttp_make_header(evcon, req);
 
@@ -2439,6 +2898,9 @@ evhttp_send_reply_start(struct evhttp_request *req, int code,
     const char *reason)
 {
 	evhttp_response_code(req, code, reason);
+#ifdef _EVENT_HAVE_LIBZ
+	evhttp_response_maybe_compress(req, 1);
+#endif
 	if (evhttp_find_header(req->output_headers, "Content-Length") == NULL &&
 	    REQ_VERSION_ATLEAST(req, 1, 1) &&
 	    evhttp_response_needs_body(req)) {
@@ -2457,29 +2919,61 @@ evhttp_send_reply_start(struct evhttp_request *req, int code,
 	evhttp_write_buffer(req->evcon, NULL, NULL);
 }
 
+/* Write databuf to the output of req's connection as the next piece of a
+ * streamed body, compressing it and framing it as a chunk as needed.
+ * 'last' is set for the end of the body. */
+static void
+evhttp_send_body_data(struct evhttp_request *req, struct evbuffer *databuf,
+    int last)
+{
+	struct evbuffer *output = bufferevent_get_output(req->evcon->bufev);
+#ifdef _EVENT_HAVE_LIBZ
+	struct evbuffer *zbuf = NULL;
+
+	if (req->compressor != NULL) {
+		if ((zbuf = evbuffer_new()) == NULL ||
+		    evhttp_deflate(&req->compressor->stream, databuf, zbuf,
+			last ? Z_FINISH : Z_SYNC_FLUSH) == -1) {
+			event_warnx("%s: deflate failed", __func__);
+			if (zbuf != NULL)
+				evbuffer_free(zbuf);
+			evbuffer_drain(databuf, evbuffer_get_length(databuf));
+			return;
+		}
+		databuf = zbuf;
+	}
+#endif
+
+	if (evbuffer_get_length(databuf) > 0) {
+		if (req->chunked) {
+			evbuffer_add_printf(output, "%x\r\n",
+			    (unsigned)evbuffer_get_length(databuf));
+		}
+		evbuffer_add_buffer(output, databuf);
+		if (req->chunked) {
+			evbuffer_add(output, "\r\n", 2);
+		}
+	}
+
+#ifdef _EVENT_HAVE_LIBZ
+	if (zbuf != NULL)
+		evbuffer_free(zbuf);
+#endif
+}
+
 void
 evhttp_send_reply_chunk(struct evhttp_request *req, struct evbuffer *databuf)
 {
 	struct evhttp_connection *evcon = req->evcon;
-	struct evbuffer *output;
 
 	if (evcon == NULL)
 		return;
 
-	output = bufferevent_get_output(evcon->bufev);
-
 	if (evbuffer_get_length(databuf) == 0)
 		return;
 	if (!evhttp_response_needs_body(req))
 		return;
-	if (req->chunked) {
-		evbuffer_add_printf(output, "%x\r\n",
-				    (unsigned)evbuffer_get_length(databuf));
-	}
-	evbuffer_add_buffer(output, databuf);
-	if (req->chunked) {
-		evbuffer_add(output, "\r\n", 2);
-	}
+	evhttp_send_body_data(req, databuf, 0);
 	evhttp_write_buffer(evcon, NULL, NULL);
 }
 
@@ -2499,6 +2993,21 @@ evhttp_send_reply_end(struct evhttp_request *req)
 	/* we expect no more calls form the user on this request */
 	req->userdone = 1;
 
+#ifdef _EVENT_HAVE_LIBZ
+	if (req->compressor != NULL) {
+		/* Write out the end of the compressed stream. */
+		struct evbuffer *empty = evbuffer_new();
+		if (empty != NULL) {
+			evhttp_send_body_data(req, empty, 1);
+			evbuffer_free(empty);
+		}
+		evhttp_compressor_free(req->compressor);
+		req->compressor = NULL;
+		if (!req->chunked)
+			evhttp_write_buffer(evcon, NULL, NULL);
+	}
+#endif
+
 	if (req->chunked) {
 		evbuffer_add(output, "0\r\n\r\n", 5);
 		evhttp_write_buffer(req->evcon, evhttp_send_done, NULL);
@@ -2868,51 +3377,815 @@ evhttp_parse_query_str(const char *uri, struct evkeyvalq *headers)
 	return evhttp_parse_query_impl(uri, headers, 0);
 }
 
-static struct evhttp_cb *
-evhttp_dispatch_callback(struct httpcbq *callbacks, struct evhttp_request *req)
-{
-	struct evhttp_cb *cb;
-	size_t offset = 0;
-	char *translated;
-	const char *path;
-
-	/* Test for different URLs */
-	path = evhttp_uri_get_path(req->uri_elems);
-	offset = strlen(path);
-	if ((translated = mm_malloc(offset + 1)) == NULL)
-		return (NULL);
-	evhttp_decode_uri_internal(path, offset, translated,
-	    0 /* decode_plus */);
+/*
+ * Static file serving.
+ */
 
-	TAILQ_FOREACH(cb, callbacks, next) {
-		if (!strcmp(cb->what, translated)) {
-			mm_free(translated);
-			return (cb);
-		}
-	}
+#define EVHTTP_STATIC_CACHE_DEFAULT	64
 
-	mm_free(translated);
-	return (NULL);
+static unsigned
+evhttp_static_file_hash(const struct evhttp_static_file *file)
+{
+	return ht_string_hash(file->path);
 }
 
-
 static int
-prefix_suffix_match(const char *pattern, const char *name, int ignorecase)
+evhttp_static_file_eq(const struct evhttp_static_file *a,
+    const struct evhttp_static_file *b)
 {
-	char c;
+	return !strcmp(a->path, b->path);
+}
 
-	while (1) {
-		switch (c = *pattern++) {
-		case '\0':
-			return *name == '\0';
+HT_PROTOTYPE(evhttp_static_map, evhttp_static_file, node,
+    evhttp_static_file_hash, evhttp_static_file_eq)
+HT_GENERATE(evhttp_static_map, evhttp_static_file, node,
+    evhttp_static_file_hash, evhttp_static_file_eq,
+    0.5, mm_malloc, mm_realloc, mm_free)
 
-		case '*':
-			while (*name != '\0') {
-				if (prefix_suffix_match(pattern, name,
-					ignorecase))
-					return (1);
-				++name;
-			}
+#ifndef WIN32
+
+static const struct {
+	const char *extension;
+	const char *content_type;
+} evhttp_static_types[] = {
+	{ "html", "text/html" },
+	{ "htm", "text/html" },
+	{ "css", "text/css" },
+	{ "js", "application/javascript" },
+	{ "json", "application/json" },
+	{ "txt", "text/plain" },
+	{ "xml", "text/xml" },
+	{ "svg", "image/svg+xml" },
+	{ "png", "image/png" },
+	{ "gif", "image/gif" },
+	{ "jpg", "image/jpeg" },
+	{ "jpeg", "image/jpeg" },
+	{ "ico", "image/x-icon" },
+	{ "woff", "application/font-woff" },
+	{ "pdf", "application/pdf" },
+	{ "gz", "application/x-gzip" },
+	{ NULL, NULL },
+};
+
+static const char *
+evhttp_static_content_type(const char *path)
+{
+	const char *last_period, *last_slash;
+	int i;
+
+	last_slash = strrchr(path, '/');
+	last_period = strrchr(path, '.');
+	if (!last_period || (last_slash && last_slash > last_period))
+		return "application/octet-stream";
+	for (i = 0; evhttp_static_types[i].extension; ++i) {
+		if (!evutil_ascii_strcasecmp(evhttp_static_types[i].extension,
+			last_period + 1))
+			return evhttp_static_types[i].content_type;
+	}
+	return "application/octet-stream";
+}
+
+static void
+evhttp_static_file_free(struct evhttp *http, struct evhttp_static_file *file)
+{
+	HT_REMOVE(evhttp_static_map, &http->static_files, file);
+	TAILQ_REMOVE(&http->static_lru, file, lru);
+	close(file->fd);
+	mm_free(file->path);
+	mm_free(file);
+}
+
+/* Close least recently used files until we are within the cache limit. */
+static void
+evhttp_static_cache_trim(struct evhttp *http)
+{
+	while (HT_SIZE(&http->static_files) > http->static_cache_max)
+		evhttp_static_file_free(http,
+		    TAILQ_LAST(&http->static_lru, evhttp_static_lru));
+}
+
+/* Return the cache entry for the regular file at 'path', opening and
+ * stat()ing it if we have no fresh entry.  Returns NULL if the file
+ * cannot be served. */
+static struct evhttp_static_file *
+evhttp_static_file_get(struct evhttp *http, struct event_base *base,
+    const char *path)
+{
+	struct evhttp_static_file find, *file;
+	struct stat st;
+	struct timeval now;
+	int fd, flags = O_RDONLY;
+
+	event_base_gettimeofday_cached(base, &now);
+
+	find.path = (char *)path;
+	file = HT_FIND(evhttp_static_map, &http->static_files, &find);
+	if (file != NULL && file->checked != now.tv_sec) {
+		/* Make sure that the file is still the one we have open. */
+		if (stat(path, &st) == 0 &&
+		    (ev_uint64_t)st.st_dev == file->dev &&
+		    (ev_uint64_t)st.st_ino == file->ino &&
+		    st.st_size == file->size &&
+		    st.st_mtime == file->mtime) {
+			file->checked = now.tv_sec;
+		} else {
+			evhttp_static_file_free(http, file);
+			file = NULL;
+		}
+	}
+
+	if (file == NULL) {
+#ifdef O_CLOEXEC
+		flags |= O_CLOEXEC;
+#endif
+		if ((fd = open(path, flags)) == -1)
+			return (NULL);
+		if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+			close(fd);
+			return (NULL);
+		}
+
+		if ((file = mm_calloc(1, sizeof(*file))) == NULL) {
+			event_warn("%s: calloc", __func__);
+			close(fd);
+			return (NULL);
+		}
+		if ((file->path = mm_strdup(path)) == NULL) {
+			event_warn("%s: strdup", __func__);
+			mm_free(file);
+			close(fd);
+			return (NULL);
+		}
+		file->fd = fd;
+		file->size = st.st_size;
+		file->mtime = st.st_mtime;
+		file->dev = st.st_dev;
+		file->ino = st.st_ino;
+		file->checked = now.tv_sec;
+		file->content_type = evhttp_static_content_type(path);
+		evutil_snprintf(file->etag, sizeof(file->etag),
+		    "\"" EV_I64_FMT "-" EV_I64_FMT "\"",
+		    EV_I64_ARG((ev_int64_t)file->mtime),
+		    EV_I64_ARG((ev_int64_t)file->size));
+		if (evhttp_format_date(file->mtime, file->last_modified,
+			sizeof(file->last_modified)) == -1)
+			file->last_modified[0] = '\0';
+
+		HT_INSERT(evhttp_static_map, &http->static_files, file);
+		TAILQ_INSERT_HEAD(&http->static_lru, file, lru);
+	} else if (file != TAILQ_FIRST(&http->static_lru)) {
+		TAILQ_REMOVE(&http->static_lru, file, lru);
+		TAILQ_INSERT_HEAD(&http->static_lru, file, lru);
+	}
+
+	return (file);
+}
+
+/* Parse an RFC 1123 date, as produced by evhttp_format_date().  Returns
+ * -1 if the date cannot be parsed. */
+static time_t
+evhttp_parse_date(const char *date)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	char month[4];
+	const char *m;
+	int mday, year, hour, min, sec, mon;
+	ev_int64_t days;
+
+	if (sscanf(date, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT",
+		&mday, month, &year, &hour, &min, &sec) != 6)
+		return (-1);
+	if (strlen(month) != 3 || (m = strstr(months, month)) == NULL ||
+	    (m - months) % 3 != 0)
+		return (-1);
+	mon = (int)(m - months) / 3 + 1;
+	if (year < 1970 || mday < 1 || mday > 31 || hour > 23 ||
+	    min > 59 || sec > 60)
+		return (-1);
+
+	/* Days since the epoch, counting years from March so that the
+	 * leap day comes last. */
+	if (mon <= 2) {
+		year -= 1;
+		mon += 12;
+	}
+	days = 365 * (ev_int64_t)year + year / 4 - year / 100 + year / 400 +
+	    (153 * (mon - 3) + 2) / 5 + mday - 719469;
+
+	return (time_t)(((days * 24 + hour) * 60 + min) * 60 + sec);
+}
+
+/* Return true iff the If-None-Match style list in 'value' names 'etag'. */
+static int
+evhttp_static_etag_match(const char *value, const char *etag)
+{
+	size_t etag_len = strlen(etag);
+
+	while (*value) {
+		size_t len;
+		while (*value == ' ' || *value == '\t' || *value == ',')
+			++value;
+		if (*value == '*')
+			return (1);
+		if (!strncmp(value, "W/", 2))
+			value += 2;
+		len = strcspn(value, ", \t");
+		if (len == etag_len && !strncmp(value, etag, len))
+			return (1);
+		value += len;
+	}
+	return (0);
+}
+
+/* Return true iff the conditional headers of req tell us that the client
+ * already has the current version of file. */
+static int
+evhttp_static_not_modified(struct evhttp_request *req,
+    const struct evhttp_static_file *file)
+{
+	const char *value;
+	time_t since;
+
+	/* If-None-Match takes precedence over If-Modified-Since. */
+	value = evhttp_find_header(req->input_headers, "If-None-Match");
+	if (value != NULL)
+		return evhttp_static_etag_match(value, file->etag);
+
+	value = evhttp_find_header(req->input_headers, "If-Modified-Since");
+	if (value != NULL && (since = evhttp_parse_date(value)) != -1)
+		return (file->mtime <= since);
+
+	return (0);
+}
+
+/*
+ * Parse a "bytes=" Range header for a file of 'size' bytes.  Returns 1
+ * and sets *offset and *length if it names one satisfiable range, -1 if
+ * the range cannot be satisfied, and 0 if the header should be ignored.
+ * Requests for several ranges are ignored; the whole file is a valid
+ * answer to them.
+ */
+static int
+evhttp_static_parse_range(const char *value, ev_off_t size,
+    ev_off_t *offset, ev_off_t *length)
+{
+	ev_int64_t first, last;
+	char *endp;
+
+	if (evutil_ascii_strncasecmp(value, "bytes=", 6) != 0)
+		return (0);
+	value += 6;
+	if (strchr(value, ',') != NULL)
+		return (0);
+
+	if (*value == '-') {
+		/* The last N bytes of the file. */
+		last = evutil_strtoll(value + 1, &endp, 10);
+		if (endp == value + 1 || *endp != '\0' || last < 0)
+			return (0);
+		if (last == 0 || size == 0)
+			return (-1);
+		if (last > size)
+			last = size;
+		*offset = size - last;
+		*length = last;
+		return (1);
+	}
+
+	first = evutil_strtoll(value, &endp, 10);
+	if (endp == value || *endp != '-' || first < 0)
+		return (0);
+	value = endp + 1;
+	if (*value == '\0') {
+		last = size - 1;
+	} else {
+		last = evutil_strtoll(value, &endp, 10);
+		if (*endp != '\0' || last < first)
+			return (0);
+	}
+	if (first >= size)
+		return (-1);
+	if (last >= size)
+		last = size - 1;
+	*offset = first;
+	*length = last - first + 1;
+	return (1);
+}
+
+/* Like evhttp_send(), but takes the body from 'length' bytes of 'fd'
+ * starting at 'offset'.  Takes ownership of fd.  The file goes straight
+ * to the bufferevent's output buffer, so that evbuffer_add_file() can
+ * use sendfile() when that buffer drains to a socket. */
+static void
+evhttp_send_file(struct evhttp_request *req, int fd, ev_off_t offset,
+    ev_off_t length)
+{
+	struct evhttp_connection *evcon = req->evcon;
+	char len[22];
+
+	if (evcon == NULL) {
+		close(fd);
+		evhttp_request_free(req);
+		return;
+	}
+
+	EVUTIL_ASSERT(TAILQ_FIRST(&evcon->requests) == req);
+
+	/* we expect no more calls form the user on this request */
+	req->userdone = 1;
+
+	evhttp_remove_header(req->output_headers, "Content-Length");
+	evutil_snprintf(len, sizeof(len), EV_I64_FMT, EV_I64_ARG(length));
+	evhttp_add_header(req->output_headers, "Content-Length", len);
+
+	evhttp_make_header(evcon, req);
+
+	if (evhttp_response_needs_body(req) && length > 0) {
+		if (evbuffer_add_file(bufferevent_get_output(evcon->bufev),
+			fd, offset, length) == -1) {
+			close(fd);
+			evhttp_connection_free(evcon);
+			return;
+		}
+	} else {
+		close(fd);
+	}
+
+	evhttp_write_buffer(evcon, evhttp_send_done, NULL);
+}
+
+/* Find the static directory with the longest prefix of 'path'.  Prefixes
+ * only match whole path segments: "/img" matches "/img/a.png" but not
+ * "/imgs/a.png". */
+static struct evhttp_static_dir *
+evhttp_static_find_dir(struct evhttp *http, const char *path)
+{
+	struct evhttp_static_dir *dir, *best = NULL;
+
+	TAILQ_FOREACH(dir, &http->static_dirs, next) {
+		size_t len = dir->prefix_len;
+		if (best != NULL && len <= best->prefix_len)
+			continue;
+		if (strncmp(dir->prefix, path, len) != 0)
+			continue;
+		if (len == 0 || dir->prefix[len - 1] == '/' ||
+		    path[len] == '/' || path[len] == '\0')
+			best = dir;
+	}
+	return (best);
+}
+
+/* Return true iff 'path' has a ".." segment. */
+static int
+evhttp_static_path_escapes(const char *path)
+{
+	const char *p = path;
+
+	while ((p = strstr(p, "..")) != NULL) {
+		if ((p == path || p[-1] == '/') && (p[2] == '/' || p[2] == '\0'))
+			return (1);
+		p += 2;
+	}
+	return (0);
+}
+
+/*
+ * Answer req from a static directory of http.  Returns 1 if the request
+ * was handled, or 0 if no static directory matches its path.
+ */
+static int
+evhttp_static_handle(struct evhttp *http, struct evhttp_request *req)
+{
+	struct evhttp_static_dir *dir;
+	struct evhttp_static_file *file;
+	const char *path, *rest, *value;
+	char *decoded, *fullpath;
+	size_t decoded_len, len;
+	ev_off_t offset, length;
+	int code, range = 0, fd;
+
+	path = evhttp_uri_get_path(req->uri_elems);
+	if ((decoded = evhttp_uridecode(path, 0, &decoded_len)) == NULL)
+		return (0);
+	if ((dir = evhttp_static_find_dir(http, decoded)) == NULL) {
+		mm_free(decoded);
+		return (0);
+	}
+
+	if (req->type != EVHTTP_REQ_GET && req->type != EVHTTP_REQ_HEAD) {
+		mm_free(decoded);
+		evhttp_add_header(req->output_headers, "Allow", "GET, HEAD");
+		evhttp_send_reply(req, HTTP_BADMETHOD, NULL, NULL);
+		return (1);
+	}
+
+	rest = decoded + dir->prefix_len;
+	while (*rest == '/')
+		++rest;
+	/* Refuse embedded NULs and anything that leaves the docroot. */
+	if (strlen(decoded) != decoded_len || *rest == '\0' ||
+	    evhttp_static_path_escapes(rest)) {
+		mm_free(decoded);
+		evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+		return (1);
+	}
+
+	len = strlen(dir->docroot) + strlen(rest) + 2;
+	if ((fullpath = mm_malloc(len)) == NULL) {
+		event_warn("%s: malloc", __func__);
+		mm_free(decoded);
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return (1);
+	}
+	evutil_snprintf(fullpath, len, "%s/%s", dir->docroot, rest);
+	mm_free(decoded);
+
+	file = evhttp_static_file_get(http, req->evcon->base, fullpath);
+	mm_free(fullpath);
+	if (file == NULL) {
+		evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+		return (1);
+	}
+
+	evhttp_add_header(req->output_headers, "ETag", file->etag);
+	if (file->last_modified[0])
+		evhttp_add_header(req->output_headers, "Last-Modified",
+		    file->last_modified);
+
+	if (evhttp_static_not_modified(req, file)) {
+		evhttp_static_cache_trim(http);
+		evhttp_send_reply(req, HTTP_NOTMODIFIED, NULL, NULL);
+		return (1);
+	}
+
+	offset = 0;
+	length = file->size;
+	value = evhttp_find_header(req->input_headers, "Range");
+	if (value != NULL) {
+		/* A Range only applies if If-Range names what we have. */
+		const char *if_range =
+		    evhttp_find_header(req->input_headers, "If-Range");
+		if (if_range == NULL || !strcmp(if_range, file->etag) ||
+		    (file->last_modified[0] &&
+			!strcmp(if_range, file->last_modified)))
+			range = evhttp_static_parse_range(value, file->size,
+			    &offset, &length);
+	}
+
+	evhttp_add_header(req->output_headers, "Accept-Ranges", "bytes");
+	if (range == -1) {
+		char content_range[48];
+		evutil_snprintf(content_range, sizeof(content_range),
+		    "bytes */" EV_I64_FMT, EV_I64_ARG((ev_int64_t)file->size));
+		evhttp_add_header(req->output_headers, "Content-Range",
+		    content_range);
+		evhttp_static_cache_trim(http);
+		evhttp_send_reply(req, HTTP_RANGENOTSATISFIABLE, NULL, NULL);
+		return (1);
+	} else if (range == 1) {
+		char content_range[80];
+		evutil_snprintf(content_range, sizeof(content_range),
+		    "bytes " EV_I64_FMT "-" EV_I64_FMT "/" EV_I64_FMT,
+		    EV_I64_ARG((ev_int64_t)offset),
+		    EV_I64_ARG((ev_int64_t)(offset + length - 1)),
+		    EV_I64_ARG((ev_int64_t)file->size));
+		evhttp_add_header(req->output_headers, "Content-Range",
+		    content_range);
+		code = HTTP_PARTIALCONTENT;
+	} else {
+		code = HTTP_OK;
+	}
+	evhttp_add_header(req->output_headers, "Content-Type",
+	    file->content_type);
+
+	/* evbuffer_add_file() owns the descriptor it is given; the cached
+	 * one stays open for the next request. */
+	fd = dup(file->fd);
+	evhttp_static_cache_trim(http);
+	if (fd == -1) {
+		event_warn("%s: dup", __func__);
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return (1);
+	}
+
+	evhttp_response_code(req, code, NULL);
+	evhttp_send_file(req, fd, offset, length);
+	return (1);
+}
+
+#endif /* !WIN32 */
+
+int
+evhttp_set_static_dir(struct evhttp *http, const char *prefix,
+    const char *docroot)
+{
+#ifdef WIN32
+	event_warnx("%s: static file serving is not supported on Windows",
+	    __func__);
+	return (-1);
+#else
+	struct evhttp_static_dir *dir;
+
+	TAILQ_FOREACH(dir, &http->static_dirs, next) {
+		if (strcmp(dir->prefix, prefix) == 0)
+			return (-1);
+	}
+
+	if ((dir = mm_calloc(1, sizeof(*dir))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (-1);
+	}
+	dir->prefix = mm_strdup(prefix);
+	dir->docroot = mm_strdup(docroot);
+	if (dir->prefix == NULL || dir->docroot == NULL) {
+		event_warn("%s: strdup", __func__);
+		if (dir->prefix)
+			mm_free(dir->prefix);
+		if (dir->docroot)
+			mm_free(dir->docroot);
+		mm_free(dir);
+		return (-1);
+	}
+	dir->prefix_len = strlen(prefix);
+
+	TAILQ_INSERT_TAIL(&http->static_dirs, dir, next);
+
+	return (0);
+#endif
+}
+
+int
+evhttp_del_static_dir(struct evhttp *http, const char *prefix)
+{
+	struct evhttp_static_dir *dir;
+
+	TAILQ_FOREACH(dir, &http->static_dirs, next) {
+		if (strcmp(dir->prefix, prefix) == 0)
+			break;
+	}
+	if (dir == NULL)
+		return (-1);
+
+	TAILQ_REMOVE(&http->static_dirs, dir, next);
+	mm_free(dir->prefix);
+	mm_free(dir->docroot);
+	mm_free(dir);
+
+	return (0);
+}
+
+void
+evhttp_set_static_cache_size(struct evhttp *http, unsigned max_files)
+{
+	http->static_cache_max = max_files;
+#ifndef WIN32
+	evhttp_static_cache_trim(http);
+#endif
+}
+
+int
+evhttp_set_compression(struct evhttp *http, int level, size_t min_size)
+{
+#ifdef _EVENT_HAVE_LIBZ
+	if (level < -1 || level > 9)
+		return (-1);
+	http->compress_level = level;
+	http->compress_min_size = min_size;
+	return (0);
+#else
+	return (-1);
+#endif
+}
+
+static unsigned
+evhttp_cb_hash(const struct evhttp_cb *cb)
+{
+	return ht_string_hash(cb->what);
+}
+
+static int
+evhttp_cb_eq(const struct evhttp_cb *a, const struct evhttp_cb *b)
+{
+	return !strcmp(a->what, b->what);
+}
+
+HT_PROTOTYPE(evhttp_cb_map, evhttp_cb, node, evhttp_cb_hash, evhttp_cb_eq)
+HT_GENERATE(evhttp_cb_map, evhttp_cb, node, evhttp_cb_hash, evhttp_cb_eq,
+    0.5, mm_malloc, mm_realloc, mm_free)
+
+static struct evhttp_cb *
+evhttp_dispatch_callback(struct evhttp *http, struct evhttp_request *req)
+{
+	struct evhttp_cb *cb, find;
+	size_t offset = 0;
+	char *translated;
+	const char *path;
+
+	/* Test for different URLs */
+	path = evhttp_uri_get_path(req->uri_elems);
+	offset = strlen(path);
+	if ((translated = mm_malloc(offset + 1)) == NULL)
+		return (NULL);
+	evhttp_decode_uri_internal(path, offset, translated,
+	    0 /* decode_plus */);
+
+	find.what = translated;
+	cb = HT_FIND(evhttp_cb_map, &http->cb_map, &find);
+
+	mm_free(translated);
+	return (cb);
+}
+
+static unsigned
+evhttp_route_node_hash(const struct evhttp_route_node *node)
+{
+	return ht_improve_hash(ht_string_hash(node->segment) ^
+	    (unsigned)(ev_uintptr_t)node->parent);
+}
+
+static int
+evhttp_route_node_eq(const struct evhttp_route_node *a,
+    const struct evhttp_route_node *b)
+{
+	return a->parent == b->parent && !strcmp(a->segment, b->segment);
+}
+
+HT_PROTOTYPE(evhttp_route_map, evhttp_route_node, node,
+    evhttp_route_node_hash, evhttp_route_node_eq)
+HT_GENERATE(evhttp_route_map, evhttp_route_node, node,
+    evhttp_route_node_hash, evhttp_route_node_eq,
+    0.5, mm_malloc, mm_realloc, mm_free)
+
+/* Find the node for segs[i..n-1] below node.  A literal child is tried
+ * first, then the parameter, then the catch-all, so a literal that leads
+ * nowhere doesn't hide a parameter next to it.  Each node can only be
+ * reached along one path, at its own depth, so no node is tried twice
+ * and a lookup never costs more than the nodes it could match. */
+static struct evhttp_route_node *
+evhttp_route_match_from(struct evhttp *http, struct evhttp_route_node *node,
+    char **segs, int i, int n)
+{
+	struct evhttp_route_node find, *child, *found;
+
+	if (i == n)
+		return (TAILQ_EMPTY(&node->handlers) ? NULL : node);
+
+	find.parent = node;
+	find.segment = segs[i];
+	if (node->n_literals != 0 &&
+	    (child = HT_FIND(evhttp_route_map, &http->route_edges, &find))
+	    != NULL &&
+	    (found = evhttp_route_match_from(http, child, segs, i + 1, n))
+	    != NULL)
+		return (found);
+	if (node->param != NULL && *segs[i] != '\0' &&
+	    (found = evhttp_route_match_from(http, node->param, segs, i + 1, n))
+	    != NULL)
+		return (found);
+	if (node->catchall != NULL && !TAILQ_EMPTY(&node->catchall->handlers))
+		return (node->catchall);
+	return (NULL);
+}
+
+/* Find the route for the path segs[0..n-1], or NULL. */
+static struct evhttp_route_node *
+evhttp_route_match(struct evhttp *http, char **segs, int n)
+{
+	return (evhttp_route_match_from(http, http->route_root, segs, 0, n));
+}
+
+/* Record the parameters of the route that ends in node, in the order in
+ * which they appear in its pattern. */
+static void
+evhttp_route_add_params(struct evkeyvalq *params,
+    struct evhttp_route_node *node, char **segs, int n)
+{
+	struct evhttp_route_node *parent = node->parent;
+	int i;
+
+	if (parent == NULL)
+		return;
+	evhttp_route_add_params(params, parent, segs, n);
+
+	if (node == parent->param) {
+		evhttp_add_header(params, node->segment, segs[node->depth - 1]);
+	} else if (node == parent->catchall && *node->segment != '\0') {
+		/* The segments are stored one after the other; put the
+		 * slashes back to get the rest of the path. */
+		for (i = node->depth; i < n; ++i)
+			segs[i][-1] = '/';
+		evhttp_add_header(params, node->segment, segs[node->depth - 1]);
+	}
+}
+
+static void
+evhttp_route_send_badmethod(struct evhttp_request *req,
+    struct evhttp_route_node *node)
+{
+	struct evhttp_route_handler *handler;
+	ev_uint16_t methods = 0;
+	char allow[128] = "";
+	const char *method;
+	size_t len = 0;
+	unsigned bit;
+
+	TAILQ_FOREACH(handler, &node->handlers, next)
+		methods |= handler->methods;
+	for (bit = 1; bit <= EVHTTP_REQ_PATCH; bit <<= 1) {
+		if (!(methods & bit) ||
+		    (method = evhttp_method((enum evhttp_cmd_type)bit)) == NULL)
+			continue;
+		evutil_snprintf(allow + len, sizeof(allow) - len, "%s%s",
+		    len ? ", " : "", method);
+		len = strlen(allow);
+	}
+
+	/* not evhttp_send_error(): that would drop the Allow header */
+	evhttp_add_header(req->output_headers, "Allow", allow);
+	evhttp_send_reply(req, HTTP_BADMETHOD, "Method Not Allowed", NULL);
+}
+
+/* Dispatch req to the route matching its path, if there is one.  Returns
+ * 1 if the request was handled. */
+static int
+evhttp_route_request(struct evhttp *http, struct evhttp_request *req)
+{
+	struct evhttp_route_node *node;
+	struct evhttp_route_handler *handler;
+	struct evkeyvalq *params;
+	const char *path;
+	char *buf = NULL, **segs = NULL, *p;
+	int i, n, handled = 0;
+
+	path = evhttp_uri_get_path(req->uri_elems);
+	if (*path++ != '/')
+		return (0);
+	for (n = 1, i = 0; path[i] != '\0'; ++i) {
+		if (path[i] == '/')
+			++n;
+	}
+
+	/* Decode each segment on its own, so that an escaped slash stays
+	 * part of the segment it is in. */
+	if ((buf = mm_malloc(strlen(path) + 1)) == NULL ||
+	    (segs = mm_calloc(n, sizeof(char *))) == NULL) {
+		event_warn("%s: malloc", __func__);
+		goto done;
+	}
+	for (p = buf, i = 0; i < n; ++i) {
+		size_t len = strcspn(path, "/");
+		segs[i] = p;
+		p += evhttp_decode_uri_internal(path, len, p, 0) + 1;
+		path += len + 1;
+	}
+
+	if ((node = evhttp_route_match(http, segs, n)) == NULL)
+		goto done;
+
+	handled = 1;
+	TAILQ_FOREACH(handler, &node->handlers, next) {
+		if (handler->methods & req->type)
+			break;
+	}
+	if (handler == NULL) {
+		evhttp_route_send_badmethod(req, node);
+		goto done;
+	}
+
+	if ((params = evhttp_request_get_route_params(req)) != NULL)
+		evhttp_route_add_params(params, node, segs, n);
+	mm_free(segs);
+	mm_free(buf);
+
+	(*handler->cb)(req, handler->cbarg);
+	return (1);
+
+done:
+	if (segs != NULL)
+		mm_free(segs);
+	if (buf != NULL)
+		mm_free(buf);
+	return (handled);
+}
+
+
+static int
+prefix_suffix_match(const char *pattern, const char *name, int ignorecase)
+{
+	char c;
+
+	while (1) {
+		switch (c = *pattern++) {
+		case '\0':
+			return *name == '\0';
+
+		case '*':
+			while (*name != '\0') {
+				if (prefix_suffix_match(pattern, name,
+					ignorecase))
+					return (1);
+				++name;
+			}
 			return (0);
 		default:
 			if (c != *name) {
@@ -3026,11 +4299,20 @@ evhttp_handle_request(struct evhttp_request *req, void *arg)
 		evhttp_find_vhost(http, &http, hostname);
 	}
 
-	if ((cb = evhttp_dispatch_callback(&http->callbacks, req)) != NULL) {
+	if ((cb = evhttp_dispatch_callback(http, req)) != NULL) {
 		(*cb->cb)(req, cb->cbarg);
 		return;
 	}
 
+	if (http->route_root != NULL && evhttp_route_request(http, req))
+		return;
+
+#ifndef WIN32
+	if (!TAILQ_EMPTY(&http->static_dirs) &&
+	    evhttp_static_handle(http, req))
+		return;
+#endif
+
 	/* Generic call back */
 	if (http->gencb) {
 		(*http->gencb)(req, http->gencbarg);
@@ -3080,6 +4362,29 @@ accept_socket_cb(struct evconnlistener *listener, evutil_socket_t nfd, struct so
 	evhttp_get_request(http, nfd, peer_sa, peer_socklen);
 }
 
+/* Listener callback when accept() fails. */
+static void
+accept_error_cb(struct evconnlistener *listener, void *arg)
+{
+	struct evhttp *http = arg;
+	int err = EVUTIL_SOCKET_ERROR();
+
+#ifndef WIN32
+	if (err == EMFILE || err == ENFILE) {
+		/* Out of descriptors: free one up, or stop for a while
+		 * rather than spin on accept(). */
+		if (!evhttp_evict_idle(http)) {
+			evhttp_pause_accepting(http);
+			evhttp_retry_accepting_later(http,
+			    evconnlistener_get_base(listener));
+		}
+		return;
+	}
+#endif
+	event_sock_warn(evconnlistener_get_fd(listener),
+	    "%s: accept: %s", __func__, evutil_socket_error_to_string(err));
+}
+
 int
 evhttp_bind_socket(struct evhttp *http, const char *address, ev_uint16_t port)
 {
@@ -3163,6 +4468,9 @@ evhttp_bind_listener(struct evhttp *http, struct evconnlistener *listener)
 	TAILQ_INSERT_TAIL(&http->sockets, bound, next);
 
 	evconnlistener_set_cb(listener, accept_socket_cb, http);
+	evconnlistener_set_error_cb(listener, accept_error_cb);
+	if (http->accept_paused)
+		evconnlistener_disable(listener);
 	return bound;
 }
 
@@ -3208,9 +4516,17 @@ evhttp_new_object(void)
 
 	TAILQ_INIT(&http->sockets);
 	TAILQ_INIT(&http->callbacks);
+	HT_INIT(evhttp_cb_map, &http->cb_map);
+	HT_INIT(evhttp_route_map, &http->route_edges);
+	TAILQ_INIT(&http->route_nodes);
 	TAILQ_INIT(&http->connections);
+	TAILQ_INIT(&http->idle_connections);
 	TAILQ_INIT(&http->virtualhosts);
 	TAILQ_INIT(&http->aliases);
+	TAILQ_INIT(&http->static_dirs);
+	HT_INIT(evhttp_static_map, &http->static_files);
+	TAILQ_INIT(&http->static_lru);
+	http->static_cache_max = EVHTTP_STATIC_CACHE_DEFAULT;
 
 	return (http);
 }
@@ -3256,6 +4572,12 @@ evhttp_free(struct evhttp* http)
 	struct evhttp_bound_socket *bound;
 	struct evhttp* vhost;
 	struct evhttp_server_alias *alias;
+	struct evhttp_static_dir *dir;
+	struct evhttp_route_node *node;
+	struct evhttp_route_handler *handler;
+#ifndef WIN32
+	struct evhttp_static_file *file;
+#endif
 
 	/* Remove the accepting part */
 	while ((bound = TAILQ_FIRST(&http->sockets)) != NULL) {
@@ -3276,6 +4598,18 @@ evhttp_free(struct evhttp* http)
 		mm_free(http_cb->what);
 		mm_free(http_cb);
 	}
+	HT_CLEAR(evhttp_cb_map, &http->cb_map);
+
+	while ((node = TAILQ_FIRST(&http->route_nodes)) != NULL) {
+		TAILQ_REMOVE(&http->route_nodes, node, next);
+		while ((handler = TAILQ_FIRST(&node->handlers)) != NULL) {
+			TAILQ_REMOVE(&node->handlers, handler, next);
+			mm_free(handler);
+		}
+		mm_free(node->segment);
+		mm_free(node);
+	}
+	HT_CLEAR(evhttp_route_map, &http->route_edges);
 
 	while ((vhost = TAILQ_FIRST(&http->virtualhosts)) != NULL) {
 		TAILQ_REMOVE(&http->virtualhosts, vhost, next_vhost);
@@ -3292,6 +4626,22 @@ evhttp_free(struct evhttp* http)
 		mm_free(alias);
 	}
 
+	while ((dir = TAILQ_FIRST(&http->static_dirs)) != NULL) {
+		TAILQ_REMOVE(&http->static_dirs, dir, next);
+		mm_free(dir->prefix);
+		mm_free(dir->docroot);
+		mm_free(dir);
+	}
+
+#ifndef WIN32
+	while ((file = TAILQ_FIRST(&http->static_lru)) != NULL)
+		evhttp_static_file_free(http, file);
+#endif
+	HT_CLEAR(evhttp_static_map, &http->static_files);
+
+	if (http->accept_retry != NULL)
+		event_free(http->accept_retry);
+
 	mm_free(http);
 }
 
@@ -3370,6 +4720,18 @@ evhttp_set_timeout(struct evhttp* http, int timeout_in_secs)
 	http->timeout = timeout_in_secs;
 }
 
+void
+evhttp_set_max_connections(struct evhttp *http, int max_connections)
+{
+	http->connection_max = max_connections > 0 ? max_connections : 0;
+	while (http->connection_max &&
+	    http->connection_cnt > http->connection_max &&
+	    evhttp_evict_idle(http))
+		;
+	if (http->accept_paused)
+		evhttp_resume_accepting(http);
+}
+
 void
 evhttp_set_max_headers_size(struct evhttp* http, ev_ssize_t max_headers_size)
 {
@@ -3398,12 +4760,11 @@ int
 evhttp_set_cb(struct evhttp *http, const char *uri,
     void (*cb)(struct evhttp_request *, void *), void *cbarg)
 {
-	struct evhttp_cb *http_cb;
+	struct evhttp_cb *http_cb, find;
 
-	TAILQ_FOREACH(http_cb, &http->callbacks, next) {
-		if (strcmp(http_cb->what, uri) == 0)
-			return (-1);
-	}
+	find.what = (char *)uri;
+	if (HT_FIND(evhttp_cb_map, &http->cb_map, &find) != NULL)
+		return (-1);
 
 	if ((http_cb = mm_calloc(1, sizeof(struct evhttp_cb))) == NULL) {
 		event_warn("%s: calloc", __func__);
@@ -3420,6 +4781,7 @@ evhttp_set_cb(struct evhttp *http, const char *uri,
 	http_cb->cbarg = cbarg;
 
 	TAILQ_INSERT_TAIL(&http->callbacks, http_cb, next);
+	HT_INSERT(evhttp_cb_map, &http->cb_map, http_cb);
 
 	return (0);
 }
@@ -3427,13 +4789,10 @@ evhttp_set_cb(struct evhttp *http, const char *uri,
 int
 evhttp_del_cb(struct evhttp *http, const char *uri)
 {
-	struct evhttp_cb *http_cb;
+	struct evhttp_cb *http_cb, find;
 
-	TAILQ_FOREACH(http_cb, &http->callbacks, next) {
-		if (strcmp(http_cb->what, uri) == 0)
-			break;
-	}
-	if (http_cb == NULL)
+	find.what = (char *)uri;
+	if ((http_cb = HT_REMOVE(evhttp_cb_map, &http->cb_map, &find)) == NULL)
 		return (-1);
 
 	TAILQ_REMOVE(&http->callbacks, http_cb, next);
@@ -3443,6 +4802,194 @@ evhttp_del_cb(struct evhttp *http, const char *uri)
 	return (0);
 }
 
+static struct evhttp_route_node *
+evhttp_route_node_new(struct evhttp *http, struct evhttp_route_node *parent,
+    const char *segment)
+{
+	struct evhttp_route_node *node;
+
+	if ((node = mm_calloc(1, sizeof(struct evhttp_route_node))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	if ((node->segment = mm_strdup(segment)) == NULL) {
+		event_warn("%s: strdup", __func__);
+		mm_free(node);
+		return (NULL);
+	}
+	node->parent = parent;
+	node->depth = parent ? parent->depth + 1 : 0;
+	TAILQ_INIT(&node->handlers);
+	TAILQ_INSERT_TAIL(&http->route_nodes, node, next);
+
+	return (node);
+}
+
+/* Returns the child of node for the pattern segment seg, of length len,
+ * creating it if create is set.  Returns NULL if there is no such child
+ * or the segment is invalid. */
+static struct evhttp_route_node *
+evhttp_route_child(struct evhttp *http, struct evhttp_route_node *node,
+    const char *seg, size_t len, int create)
+{
+	struct evhttp_route_node find, *child = NULL, **slot = NULL;
+	char *name;
+
+	if ((name = mm_malloc(len + 1)) == NULL) {
+		event_warn("%s: malloc", __func__);
+		return (NULL);
+	}
+	memcpy(name, seg, len);
+	name[len] = '\0';
+
+	if (*name == ':' || *name == '*') {
+		/* a parameter needs a name; a catch-all must come last */
+		if ((*name == ':' && len == 1) ||
+		    (*name == '*' && seg[len] != '\0'))
+			goto done;
+		slot = *name == ':' ? &node->param : &node->catchall;
+		if ((child = *slot) != NULL) {
+			/* only one name per parameter position */
+			if (strcmp(child->segment, name + 1))
+				child = NULL;
+			goto done;
+		}
+		if (create &&
+		    (child = evhttp_route_node_new(http, node, name + 1)) != NULL)
+			*slot = child;
+	} else {
+		find.parent = node;
+		find.segment = name;
+		child = HT_FIND(evhttp_route_map, &http->route_edges, &find);
+		if (child == NULL && create &&
+		    (child = evhttp_route_node_new(http, node, name)) != NULL) {
+			HT_INSERT(evhttp_route_map, &http->route_edges, child);
+			++node->n_literals;
+		}
+	}
+
+done:
+	mm_free(name);
+	return (child);
+}
+
+/* Free node and its ancestors for as long as no route goes through them,
+ * so that matching doesn't keep walking into dead ends. */
+static void
+evhttp_route_prune(struct evhttp *http, struct evhttp_route_node *node)
+{
+	struct evhttp_route_node *parent;
+
+	while ((parent = node->parent) != NULL &&
+	    TAILQ_EMPTY(&node->handlers) && node->param == NULL &&
+	    node->catchall == NULL && node->n_literals == 0) {
+		if (node == parent->param) {
+			parent->param = NULL;
+		} else if (node == parent->catchall) {
+			parent->catchall = NULL;
+		} else {
+			HT_REMOVE(evhttp_route_map, &http->route_edges, node);
+			--parent->n_literals;
+		}
+		TAILQ_REMOVE(&http->route_nodes, node, next);
+		mm_free(node->segment);
+		mm_free(node);
+		node = parent;
+	}
+}
+
+/* Returns the node for pattern, creating the nodes it needs if create is
+ * set, or NULL. */
+static struct evhttp_route_node *
+evhttp_route_find(struct evhttp *http, const char *pattern, int create)
+{
+	struct evhttp_route_node *node, *child;
+	size_t len;
+
+	if (*pattern++ != '/')
+		return (NULL);
+	if (http->route_root == NULL) {
+		if (!create ||
+		    (http->route_root = evhttp_route_node_new(http, NULL, ""))
+		    == NULL)
+			return (NULL);
+	}
+
+	node = http->route_root;
+	for (;;) {
+		len = strcspn(pattern, "/");
+		child = evhttp_route_child(http, node, pattern, len, create);
+		if (child == NULL) {
+			/* don't leave half of a bad pattern behind */
+			if (create)
+				evhttp_route_prune(http, node);
+			return (NULL);
+		}
+		node = child;
+		if (pattern[len] == '\0')
+			break;
+		pattern += len + 1;
+	}
+
+	return (node);
+}
+
+int
+evhttp_set_route(struct evhttp *http, ev_uint16_t methods,
+    const char *pattern, void (*cb)(struct evhttp_request *, void *),
+    void *cbarg)
+{
+	struct evhttp_route_node *node;
+	struct evhttp_route_handler *handler;
+
+	if (methods == 0 || (node = evhttp_route_find(http, pattern, 1)) == NULL)
+		return (-1);
+
+	TAILQ_FOREACH(handler, &node->handlers, next) {
+		if (handler->methods & methods)
+			return (-1);
+	}
+
+	if ((handler = mm_calloc(1, sizeof(*handler))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		evhttp_route_prune(http, node);
+		return (-1);
+	}
+	handler->methods = methods;
+	handler->cb = cb;
+	handler->cbarg = cbarg;
+	TAILQ_INSERT_TAIL(&node->handlers, handler, next);
+
+	return (0);
+}
+
+int
+evhttp_del_route(struct evhttp *http, ev_uint16_t methods,
+    const char *pattern)
+{
+	struct evhttp_route_node *node;
+	struct evhttp_route_handler *handler, *next;
+	int found = 0;
+
+	if ((node = evhttp_route_find(http, pattern, 0)) == NULL)
+		return (-1);
+
+	for (handler = TAILQ_FIRST(&node->handlers); handler; handler = next) {
+		next = TAILQ_NEXT(handler, next);
+		if (!(handler->methods & methods))
+			continue;
+		found = 1;
+		handler->methods &= ~methods;
+		if (handler->methods == 0) {
+			TAILQ_REMOVE(&node->handlers, handler, next);
+			mm_free(handler);
+		}
+	}
+	evhttp_route_prune(http, node);
+
+	return (found ? 0 : -1);
+}
+
 void
 evhttp_set_gencb(struct evhttp *http,
     void (*cb)(struct evhttp_request *, void *), void *cbarg)
@@ -3451,6 +4998,14 @@ evhttp_set_gencb(struct evhttp *http,
 	http->gencbarg = cbarg;
 }
 
+void
+evhttp_set_header_cb(struct evhttp *http,
+    int (*cb)(struct evhttp_request *, void *), void *cbarg)
+{
+	http->headercb = cb;
+	http->headercbarg = cbarg;
+}
+
 /*
  * Request related functions
  */
@@ -3530,12 +5085,26 @@ evhttp_request_free(struct evhttp_request *req)
 	evhttp_clear_headers(req->output_headers);
 	mm_free(req->output_headers);
 
-	if (req->input_buffer != NULL)
+	if (req->input_buffer != NULL) {
+		if (req->body_highmark)
+			evbuffer_remove_cb(req->input_buffer,
+			    evhttp_body_drained_cb, req);
 		evbuffer_free(req->input_buffer);
+	}
 
 	if (req->output_buffer != NULL)
 		evbuffer_free(req->output_buffer);
 
+#ifdef _EVENT_HAVE_LIBZ
+	if (req->compressor != NULL)
+		evhttp_compressor_free(req->compressor);
+#endif
+
+	if (req->route_params != NULL) {
+		evhttp_clear_headers(req->route_params);
+		mm_free(req->route_params);
+	}
+
 	mm_free(req);
 }
 
@@ -3570,6 +5139,24 @@ evhttp_request_set_chunked_cb(struct evhttp_request *req,
 	req->chunk_cb = cb;
 }
 
+void
+evhttp_request_set_body_watermark(struct evhttp_request *req,
+    size_t highmark)
+{
+	if (req->body_highmark == 0 && highmark != 0)
+		evbuffer_add_cb(req->input_buffer, evhttp_body_drained_cb, req);
+	else if (req->body_highmark != 0 && highmark == 0)
+		evbuffer_remove_cb(req->input_buffer,
+		    evhttp_body_drained_cb, req);
+	req->body_highmark = highmark;
+
+	if (highmark == 0)
+		req->flags &= ~EVHTTP_REQ_BODY_PAUSED;
+	if (req->evcon != NULL)
+		bufferevent_setwatermark(req->evcon->bufev, EV_READ,
+		    0, highmark);
+}
+
 /*
  * Allows for inspection of the request URI
  */
@@ -3650,6 +5237,20 @@ struct evkeyvalq *evhttp_request_get_output_headers(struct evhttp_request *req)
 	return (req->output_headers);
 }
 
+/** Returns the parameters of the matched route */
+struct evkeyvalq *evhttp_request_get_route_params(struct evhttp_request *req)
+{
+	if (req->route_params == NULL) {
+		req->route_params = mm_calloc(1, sizeof(struct evkeyvalq));
+		if (req->route_params == NULL) {
+			event_warn("%s: calloc", __func__);
+			return (NULL);
+		}
+		TAILQ_INIT(req->route_params);
+	}
+	return (req->route_params);
+}
+
 /** Returns the input buffer */
 struct evbuffer *evhttp_request_get_input_buffer(struct evhttp_request *req)
 {
@@ -3738,6 +5339,8 @@ evhttp_associate_new_request_with_connection(struct evhttp_connection *evcon)
 
 
 	evhttp_start_read(evcon);
+	if (evbuffer_get_length(bufferevent_get_input(evcon->bufev)) == 0)
+		evhttp_connection_set_idle(evcon);
 
 	return (0);
 }
@@ -3748,6 +5351,16 @@ evhttp_get_request(struct evhttp *http, evutil_socket_t fd,
 {
 	struct evhttp_connection *evcon;
 
+	if (http->connection_max &&
+	    http->connection_cnt >= http->connection_max &&
+	    !evhttp_evict_idle(http)) {
+		/* Everybody is busy; turn this one away, and don't take
+		 * any more until somebody leaves. */
+		evutil_closesocket(fd);
+		evhttp_pause_accepting(http);
+		return;
+	}
+
 	evcon = evhttp_get_request_connection(http, fd, sa, salen);
 	if (evcon == NULL) {
 		event_sock_warn(fd, "%s: cannot get connection on "EV_SOCK_FMT,
@@ -3766,9 +5379,17 @@ evhttp_get_request(struct evhttp *http, evutil_socket_t fd,
 	 */
 	evcon->http_server = http;
 	TAILQ_INSERT_TAIL(&http->connections, evcon, next);
+	++http->connection_cnt;
 
-	if (evhttp_associate_new_request_with_connection(evcon) == -1)
+	if (evhttp_associate_new_request_with_connection(evcon) == -1) {
 		evhttp_connection_free(evcon);
+		return;
+	}
+
+	if (http->connection_max &&
+	    http->connection_cnt >= http->connection_max &&
+	    TAILQ_EMPTY(&http->idle_connections))
+		evhttp_pause_accepting(http);
 }
 
 
@@ -377,6 +377,7 @@ void *evthread_setup_global_lock_(void *lock_, unsigned locktype,　　//？
 int event_global_setup_locks_(const int enable_locks);
 int evsig_global_setup_locks_(const int enable_locks);
 int evutil_secure_rng_global_setup_locks_(const int enable_locks);
+int bufferevent_ratelim_global_setup_locks_(const int enable_locks);
 
 #endif
 
@@ -1400,6 +1400,7 @@ evutil_freeaddrinfo(struct evutil_addrinfo *ai)
 }
 
 static evdns_getaddrinfo_fn evdns_getaddrinfo_impl = NULL;
+static evdns_getaddrinfo_cancel_fn evdns_getaddrinfo_cancel_impl = NULL;
 
 void
 evutil_set_evdns_getaddrinfo_fn(evdns_getaddrinfo_fn fn)
@@ -1408,26 +1409,44 @@ evutil_set_evdns_getaddrinfo_fn(evdns_getaddrinfo_fn fn)
 		evdns_getaddrinfo_impl = fn;
 }
 
+void
+evutil_set_evdns_getaddrinfo_cancel_fn(evdns_getaddrinfo_cancel_fn fn)
+{
+	if (!evdns_getaddrinfo_cancel_impl)
+		evdns_getaddrinfo_cancel_impl = fn;
+}
+
 /* Internal helper function: act like evdns_getaddrinfo if dns_base is set;
  * otherwise do a blocking resolve and pass the result to the callback in the
- * way that evdns_getaddrinfo would.
+ * way that evdns_getaddrinfo would.  Returns a request that can be passed to
+ * evutil_getaddrinfo_cancel_async(), or NULL if the callback has already
+ * been invoked.
  */
-int
+struct evdns_getaddrinfo_request *
 evutil_getaddrinfo_async(struct evdns_base *dns_base,
     const char *nodename, const char *servname,
     const struct evutil_addrinfo *hints_in,
     void (*cb)(int, struct evutil_addrinfo *, void *), void *arg)
 {
 	if (dns_base && evdns_getaddrinfo_impl) {
-		evdns_getaddrinfo_impl(
+		return evdns_getaddrinfo_impl(
 			dns_base, nodename, servname, hints_in, cb, arg);
 	} else {
 		struct evutil_addrinfo *ai=NULL;
 		int err;
 		err = evutil_getaddrinfo(nodename, servname, hints_in, &ai);
 		cb(err, ai, arg);
+		return NULL;
 	}
-	return 0;
+}
+
+/* Internal helper function: cancel a request returned by
+ * evutil_getaddrinfo_async().  Its callback will still be invoked. */
+void
+evutil_getaddrinfo_cancel_async(struct evdns_getaddrinfo_request *req)
+{
+	if (req && evdns_getaddrinfo_cancel_impl)
+		evdns_getaddrinfo_cancel_impl(req);
 }
 
 const char *
@@ -246,6 +246,9 @@ typedef struct evdns_getaddrinfo_request* (*evdns_getaddrinfo_fn)(
     void (*cb)(int, struct evutil_addrinfo *, void *), void *arg);
 
 void evutil_set_evdns_getaddrinfo_fn(evdns_getaddrinfo_fn fn);
+typedef void (*evdns_getaddrinfo_cancel_fn)(
+    struct evdns_getaddrinfo_request *req);
+void evutil_set_evdns_getaddrinfo_cancel_fn(evdns_getaddrinfo_cancel_fn fn);
 
 struct evutil_addrinfo *evutil_new_addrinfo(struct sockaddr *sa,
     ev_socklen_t socklen, const struct evutil_addrinfo *hints);
@@ -255,10 +258,12 @@ void evutil_adjust_hints_for_addrconfig(struct evutil_addrinfo *hints);
 int evutil_getaddrinfo_common(const char *nodename, const char *servname,
     struct evutil_addrinfo *hints, struct evutil_addrinfo **res, int *portnum);
 
-int evutil_getaddrinfo_async(struct evdns_base *dns_base,
+struct evdns_getaddrinfo_request *evutil_getaddrinfo_async(
+    struct evdns_base *dns_base,
     const char *nodename, const char *servname,
     const struct evutil_addrinfo *hints_in,
     void (*cb)(int, struct evutil_addrinfo *, void *), void *arg);
+void evutil_getaddrinfo_cancel_async(struct evdns_getaddrinfo_request *req);
 
 /** Return true iff sa is a looback address. (That is, it is 127.0.0.1/8, or
  * ::1). */
@@ -274,6 +279,15 @@ const char *evutil_format_sockaddr_port(const struct sockaddr *sa, char *out, si
 
 long evutil_tv_to_msec(const struct timeval *tv);
 
+struct event_base;
+/** Set tv to the current time on the clock that base runs its timers on:
+ * a monotonic clock where the platform has one, so that it doesn't jump
+ * when someone sets the system time.  Only differences between two of
+ * these times mean anything.  A NULL base means the current base, as for
+ * event_base_gettimeofday_cached().  Returns 0 on success, -1 on failure. */
+int _event_base_gettime_monotonic(struct event_base *base,
+    struct timeval *tv);
+
 int evutil_hex_char_to_int(char c);
 
 #ifdef WIN32
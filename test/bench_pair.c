@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This benchmark pushes many small writes through a bufferevent pair, a
+ * burst at a time, and reports how long that took and how many read
+ * callbacks and buffer chains the reading side saw, with and without
+ * bufferevent_pair_set_batching().
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _EVENT_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+static int n_messages = 1000000;
+static int burst = 64;
+static int msg_size = 32;
+
+static int n_written;
+static size_t n_read;
+static int n_readcbs;
+static int n_chains;
+
+static void
+write_burst(struct bufferevent *bev, void *arg)
+{
+	char msg[1024];
+	int i;
+
+	memset(msg, 'x', msg_size);
+	for (i = 0; i < burst && n_written < n_messages; ++i, ++n_written)
+		bufferevent_write(bev, msg, msg_size);
+}
+
+static void
+read_all(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	size_t len = evbuffer_get_length(input);
+
+	++n_readcbs;
+	n_chains += evbuffer_peek(input, -1, NULL, NULL, 0);
+	n_read += len;
+	evbuffer_drain(input, len);
+	if (n_read == (size_t)n_messages * msg_size)
+		event_base_loopbreak(bufferevent_get_base(bev));
+}
+
+static double
+run(struct event_base *base, size_t threshold)
+{
+	struct bufferevent *pair[2];
+	struct timeval start, end;
+
+	n_written = n_readcbs = n_chains = 0;
+	n_read = 0;
+
+	if (bufferevent_pair_new(base, 0, pair) < 0) {
+		fprintf(stderr, "bufferevent_pair_new failed\n");
+		exit(1);
+	}
+	bufferevent_pair_set_batching(pair[0], threshold);
+	bufferevent_setcb(pair[0], NULL, write_burst, NULL, NULL);
+	bufferevent_setcb(pair[1], read_all, NULL, NULL, NULL);
+	bufferevent_enable(pair[0], EV_WRITE);
+	bufferevent_enable(pair[1], EV_READ);
+
+	evutil_gettimeofday(&start, NULL);
+	write_burst(pair[0], NULL);
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+
+	bufferevent_free(pair[0]);
+	bufferevent_free(pair[1]);
+
+	evutil_timersub(&end, &start, &end);
+	return end.tv_sec + end.tv_usec / 1e6;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct event_base *base;
+	size_t threshold = 16384;
+	double t;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:b:s:t:")) != -1) {
+		switch (c) {
+		case 'n':
+			n_messages = atoi(optarg);
+			break;
+		case 'b':
+			burst = atoi(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		case 't':
+			threshold = (size_t)atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n messages] [-b burst] "
+			    "[-s size] [-t threshold]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (n_messages <= 0 || burst <= 0 || msg_size <= 0 ||
+	    msg_size > 1024 || threshold == 0) {
+		fprintf(stderr, "Bad argument\n");
+		exit(1);
+	}
+
+	if (!(base = event_base_new())) {
+		fprintf(stderr, "event_base_new failed\n");
+		exit(1);
+	}
+
+	printf("%d messages of %d bytes, %d per burst\n",
+	    n_messages, msg_size, burst);
+
+	t = run(base, 0);
+	printf("unbatched:        %8.3f s, %8d read callbacks, %9d chains\n",
+	    t, n_readcbs, n_chains);
+
+	t = run(base, threshold);
+	printf("batched (%6lu): %8.3f s, %8d read callbacks, %9d chains\n",
+	    (unsigned long)threshold, t, n_readcbs, n_chains);
+
+	event_base_free(base);
+	return 0;
+}
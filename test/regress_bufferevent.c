@@ -779,6 +779,404 @@ end:
 		bufferevent_free(bev2);
 }
 
+static void
+pair_batch_read_cb(struct bufferevent *bev, void *arg)
+{
+	int *n_calls = arg;
+	++*n_calls;
+}
+
+static void
+test_bufferevent_pair_batching(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *pair[2] = { NULL, NULL };
+	int n_calls = 0;
+
+	tt_int_op(0, ==, bufferevent_pair_new(data->base, 0, pair));
+	tt_int_op(0, ==, bufferevent_pair_set_batching(pair[0], 16));
+	bufferevent_setcb(pair[1], pair_batch_read_cb, NULL, NULL, &n_calls);
+	bufferevent_enable(pair[1], EV_READ);
+
+	/* Small writes wait for the loop... */
+	bufferevent_write(pair[0], "abc", 3);
+	bufferevent_write(pair[0], "def", 3);
+	tt_int_op(evbuffer_get_length(bufferevent_get_input(pair[1])), ==, 0);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(bufferevent_get_input(pair[1])), ==, 6);
+	tt_int_op(n_calls, ==, 1);
+
+	/* ...unless enough of them pile up. */
+	bufferevent_write(pair[0], "0123456789", 10);
+	tt_int_op(evbuffer_get_length(bufferevent_get_input(pair[1])), ==, 6);
+	bufferevent_write(pair[0], "0123456789", 10);
+	tt_int_op(evbuffer_get_length(bufferevent_get_input(pair[1])), ==, 26);
+
+	/* Turning batching off hands writes over at once again. */
+	tt_int_op(0, ==, bufferevent_pair_set_batching(pair[0], 0));
+	bufferevent_write(pair[0], "x", 1);
+	tt_int_op(evbuffer_get_length(bufferevent_get_input(pair[1])), ==, 27);
+
+end:
+	if (pair[0])
+		bufferevent_free(pair[0]);
+	if (pair[1])
+		bufferevent_free(pair[1]);
+}
+
+struct single_limits_info {
+	size_t largest;
+	size_t total;
+};
+
+static void
+single_limits_read_cb(struct bufferevent *bev, void *arg)
+{
+	struct single_limits_info *info = arg;
+	size_t n = evbuffer_get_length(bufferevent_get_input(bev));
+	if (n > info->largest)
+		info->largest = n;
+	info->total += n;
+	evbuffer_drain(bufferevent_get_input(bev), n);
+}
+
+static void
+test_bufferevent_single_limits(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev1 = NULL, *bev2 = NULL;
+	char *buf = NULL;
+	struct single_limits_info info = { 0, 0 };
+
+	/* A per-base default applies to bufferevents created later. */
+	tt_int_op(0, ==, bufferevent_base_set_max_single_read(data->base,
+		65536));
+	bev1 = bufferevent_socket_new(data->base, data->pair[0], 0);
+	bev2 = bufferevent_socket_new(data->base, data->pair[1], 0);
+	tt_int_op(bufferevent_get_max_single_read(bev1), ==, 65536);
+	tt_int_op(bufferevent_get_max_single_write(bev1), ==, 16384);
+	tt_int_op(bufferevent_get_max_to_read(bev1), ==, 65536);
+	tt_int_op(bufferevent_get_max_to_write(bev1), ==, 16384);
+
+	/* Per-bufferevent settings override it; 0 restores it. */
+	tt_int_op(0, ==, bufferevent_set_max_single_read(bev1, 1000));
+	tt_int_op(0, ==, bufferevent_set_max_single_write(bev1, 65536));
+	tt_int_op(bufferevent_get_max_to_read(bev1), ==, 1000);
+	tt_int_op(bufferevent_get_max_to_write(bev1), ==, 65536);
+	tt_int_op(0, ==, bufferevent_set_max_single_read(bev1, 0));
+	tt_int_op(bufferevent_get_max_single_read(bev1), ==, 65536);
+
+	/* A large limit lets a single read pick up more than the old
+	 * 16384-byte cap. */
+	buf = malloc(65536);
+	tt_assert(buf);
+	memset(buf, 'x', 65536);
+	bufferevent_setcb(bev2, single_limits_read_cb, NULL, NULL, &info);
+	bufferevent_enable(bev2, EV_READ);
+	bufferevent_write(bev1, buf, 65536);
+	while (info.total < 65536 &&
+	    event_base_loop(data->base, EVLOOP_ONCE) == 0)
+		;
+	tt_int_op(info.total, ==, 65536);
+	tt_int_op(info.largest, <=, 65536);
+#ifdef __linux__
+	tt_int_op(info.largest, >, 16384);
+
+	tt_int_op(0, ==, bufferevent_socket_set_write_autosize(bev1, 1));
+	tt_int_op(bufferevent_get_max_single_write(bev1), >=, 65536);
+	tt_int_op(bufferevent_get_max_single_write(bev1) % 65536, ==, 0);
+	tt_int_op(0, ==, bufferevent_socket_set_write_autosize(bev1, 0));
+	tt_int_op(bufferevent_get_max_single_write(bev1), ==, 16384);
+#endif
+
+	/* With nothing set anywhere, a socket bufferevent keeps reading
+	 * 4096 bytes at a time, as evbuffer_read() does. */
+	bufferevent_free(bev2);
+	tt_int_op(0, ==, bufferevent_base_set_max_single_read(data->base, 0));
+	bev2 = bufferevent_socket_new(data->base, data->pair[1], 0);
+	tt_int_op(bufferevent_get_max_single_read(bev2), ==, 16384);
+	info.largest = info.total = 0;
+	bufferevent_setcb(bev2, single_limits_read_cb, NULL, NULL, &info);
+	bufferevent_enable(bev2, EV_READ);
+	bufferevent_write(bev1, buf, 65536);
+	while (info.total < 65536 &&
+	    event_base_loop(data->base, EVLOOP_ONCE) == 0)
+		;
+	tt_int_op(info.total, ==, 65536);
+	tt_int_op(info.largest, <=, 4096);
+
+	/* Choosing the default explicitly still counts as choosing it. */
+	tt_int_op(0, ==, bufferevent_set_max_single_read(bev2, 16384));
+	info.largest = info.total = 0;
+	bufferevent_write(bev1, buf, 65536);
+	while (info.total < 65536 &&
+	    event_base_loop(data->base, EVLOOP_ONCE) == 0)
+		;
+	tt_int_op(info.total, ==, 65536);
+	tt_int_op(info.largest, <=, 16384);
+#ifdef __linux__
+	tt_int_op(info.largest, >, 4096);
+#endif
+
+end:
+	if (buf)
+		free(buf);
+	if (bev1)
+		bufferevent_free(bev1);
+	if (bev2)
+		bufferevent_free(bev2);
+}
+
+/* How long until bev's refill timer fires, in msec, or -1 if it isn't
+ * armed. */
+static long
+refill_timer_msec(struct bufferevent *bev)
+{
+	struct bufferevent_rate_limit *rlim = BEV_UPCAST(bev)->rate_limiting;
+	struct timeval when, now, left;
+
+	if (!event_pending(&rlim->refill_bucket_event, EV_TIMEOUT, &when))
+		return -1;
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&when, &now, &left);
+	return left.tv_sec * 1000 + left.tv_usec / 1000;
+}
+
+static void
+test_bufferevent_refill_timer(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	struct ev_token_bucket_cfg *cfg = NULL;
+	struct timeval tick = { 0, 100000 }, wait = { 0, 600000 };
+	long msec;
+
+	cfg = ev_token_bucket_cfg_new(100, 100, 100, 100, &tick);
+	tt_assert(cfg);
+	bev = bufferevent_socket_new(data->base, -1, 0);
+	tt_assert(bev);
+	tt_int_op(0, ==, bufferevent_set_rate_limit(bev, cfg));
+
+	/* Nothing to wait for while the buckets have room. */
+	tt_int_op(refill_timer_msec(bev), ==, -1);
+	tt_int_op(0, ==, bufferevent_decrement_read_limit(bev, 50));
+	tt_int_op(refill_timer_msec(bev), ==, -1);
+
+	/* Emptying a bucket arms the timer for the next tick, through the
+	 * common timeout for the tick length. */
+	tt_int_op(0, ==, bufferevent_decrement_write_limit(bev, 100));
+	tt_assert(BEV_UPCAST(bev)->rate_limiting->tick_timeout);
+	msec = refill_timer_msec(bev);
+	tt_int_op(msec, >, 50);
+	tt_int_op(msec, <=, 100);
+	tt_int_op(0, ==, bufferevent_decrement_write_limit(bev, -100));
+	tt_int_op(refill_timer_msec(bev), ==, -1);
+
+	/* A bucket that is deep in debt sleeps through the ticks that
+	 * wouldn't make it positive: 450 bytes at 100 per tick is five
+	 * ticks away. */
+	tt_int_op(0, ==, bufferevent_decrement_read_limit(bev, 500));
+	tt_int_op(bufferevent_get_read_limit(bev), ==, -450);
+	msec = refill_timer_msec(bev);
+	tt_int_op(msec, >, 400);
+	tt_int_op(msec, <=, 500);
+
+	/* Once that has passed, the bucket is positive again, and the timer
+	 * isn't rearmed. */
+	event_base_loopexit(data->base, &wait);
+	event_base_dispatch(data->base);
+	tt_int_op(bufferevent_get_read_limit(bev), >, 0);
+	tt_int_op(refill_timer_msec(bev), ==, -1);
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+	if (cfg)
+		ev_token_bucket_cfg_free(cfg);
+}
+
+/* Has bev had its turn at its group's bucket for reading? */
+#define RR_SERVED(bev) (bufferevent_get_max_to_read(bev) > 0)
+
+static void
+test_bufferevent_group_round_robin(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev[5] = { NULL, NULL, NULL, NULL, NULL };
+	struct ev_token_bucket_cfg *cfg = NULL;
+	struct bufferevent_rate_limit_group *g = NULL;
+	/* Long enough that the bucket only refills when we say so. */
+	struct timeval tick = { 60, 0 };
+	int i;
+
+	cfg = ev_token_bucket_cfg_new(400, 400, 400, 400, &tick);
+	tt_assert(cfg);
+	g = bufferevent_rate_limit_group_new(data->base, cfg);
+	tt_assert(g);
+	tt_int_op(0, ==, bufferevent_rate_limit_group_set_min_share(g, 1));
+	for (i = 0; i < 4; ++i) {
+		bev[i] = bufferevent_socket_new(data->base, -1, 0);
+		tt_assert(bev[i]);
+		tt_int_op(0, ==, bufferevent_add_to_rate_limit_group(bev[i], g));
+	}
+
+	/* Each member's share is a quarter of the refill, however much
+	 * the others have used. */
+	tt_int_op(bufferevent_get_max_to_read(bev[0]), ==, 100);
+	tt_int_op(0, ==, _bufferevent_decrement_read_buckets(BEV_UPCAST(bev[2]),
+		100));
+	tt_int_op(0, ==, _bufferevent_decrement_read_buckets(BEV_UPCAST(bev[0]),
+		100));
+	tt_int_op(bufferevent_get_max_to_read(bev[1]), ==, 100);
+
+	/* Now 1 has gone longest without reading, then 3, 2 and 0.  When 3
+	 * empties the bucket, it goes to the back of the line too. */
+	tt_int_op(0, ==, _bufferevent_decrement_read_buckets(BEV_UPCAST(bev[3]),
+		200));
+	for (i = 0; i < 4; ++i)
+		tt_assert(!RR_SERVED(bev[i]));
+
+	/* Half a refill is enough for two of them: the first two in line. */
+	tt_int_op(0, ==, bufferevent_rate_limit_group_decrement_read(g, -200));
+	tt_assert(RR_SERVED(bev[1]));
+	tt_assert(RR_SERVED(bev[2]));
+	tt_assert(!RR_SERVED(bev[0]));
+	tt_assert(!RR_SERVED(bev[3]));
+
+	/* Someone who joins now waits behind everybody else. */
+	bev[4] = bufferevent_socket_new(data->base, -1, 0);
+	tt_assert(bev[4]);
+	tt_int_op(0, ==, bufferevent_add_to_rate_limit_group(bev[4], g));
+	tt_assert(!RR_SERVED(bev[4]));
+
+	/* The ones that were woken go behind the ones that weren't, so
+	 * the rest get their turns one refill at a time, in order. */
+	tt_int_op(0, ==, bufferevent_rate_limit_group_decrement_read(g, 200));
+	tt_int_op(0, ==, bufferevent_rate_limit_group_decrement_read(g, -80));
+	tt_assert(RR_SERVED(bev[0]));
+	tt_assert(!RR_SERVED(bev[3]));
+	tt_assert(!RR_SERVED(bev[4]));
+	tt_assert(!RR_SERVED(bev[1]));
+	tt_int_op(0, ==, bufferevent_rate_limit_group_decrement_read(g, 80));
+	tt_int_op(0, ==, bufferevent_rate_limit_group_decrement_read(g, -80));
+	tt_assert(RR_SERVED(bev[3]));
+	tt_assert(!RR_SERVED(bev[4]));
+	tt_int_op(0, ==, bufferevent_rate_limit_group_decrement_read(g, 80));
+	tt_int_op(0, ==, bufferevent_rate_limit_group_decrement_read(g, -80));
+	tt_assert(RR_SERVED(bev[4]));
+	tt_assert(!RR_SERVED(bev[1]));
+	tt_assert(!RR_SERVED(bev[2]));
+
+	/* Writing has a line of its own, which nobody has had to join.
+	 * There are five members to share it now. */
+	for (i = 0; i < 5; ++i)
+		tt_int_op(bufferevent_get_max_to_write(bev[i]), ==, 80);
+
+end:
+	for (i = 0; i < 5; ++i)
+		if (bev[i])
+			bufferevent_free(bev[i]);
+	if (g)
+		bufferevent_rate_limit_group_free(g);
+	if (cfg)
+		ev_token_bucket_cfg_free(cfg);
+}
+
+static void
+test_bufferevent_group_parent(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev1 = NULL, *bev2 = NULL;
+	struct ev_token_bucket_cfg *parent_cfg = NULL, *child_cfg = NULL;
+	struct bufferevent_rate_limit_group *parent = NULL;
+	struct bufferevent_rate_limit_group *child1 = NULL, *child2 = NULL;
+	/* Long enough that no bucket refills while we look at it. */
+	struct timeval tick = { 60, 0 };
+
+	parent_cfg = ev_token_bucket_cfg_new(1000, 1000, 1000, 1000, &tick);
+	child_cfg = ev_token_bucket_cfg_new(4000, 4000, 4000, 4000, &tick);
+	tt_assert(parent_cfg && child_cfg);
+	parent = bufferevent_rate_limit_group_new(data->base, parent_cfg);
+	child1 = bufferevent_rate_limit_group_new(data->base, child_cfg);
+	child2 = bufferevent_rate_limit_group_new(data->base, child_cfg);
+	tt_assert(parent && child1 && child2);
+	tt_int_op(0, ==, bufferevent_rate_limit_group_set_parent(child1,
+		parent));
+	tt_int_op(0, ==, bufferevent_rate_limit_group_set_parent(child2,
+		parent));
+	/* No cycles. */
+	tt_int_op(-1, ==, bufferevent_rate_limit_group_set_parent(parent,
+		child1));
+	tt_int_op(-1, ==, bufferevent_rate_limit_group_set_parent(child1,
+		child1));
+
+	bev1 = bufferevent_socket_new(data->base, data->pair[0], 0);
+	bev2 = bufferevent_socket_new(data->base, data->pair[1], 0);
+	tt_int_op(0, ==, bufferevent_add_to_rate_limit_group(bev1, child1));
+	tt_int_op(0, ==, bufferevent_add_to_rate_limit_group(bev2, child2));
+
+	/* The parent's bucket is split between the members of both
+	 * children, and it is the smaller share. */
+	tt_int_op(bufferevent_get_max_to_read(bev1), ==, 500);
+	tt_int_op(bufferevent_get_max_to_write(bev2), ==, 500);
+
+	/* Charging a child charges its parent too, but not its sibling. */
+	tt_int_op(0, ==, bufferevent_rate_limit_group_decrement_read(child1,
+		600));
+	tt_int_op(bufferevent_rate_limit_group_get_read_limit(child1), ==,
+	    3400);
+	tt_int_op(bufferevent_rate_limit_group_get_read_limit(parent), ==, 400);
+	tt_int_op(bufferevent_rate_limit_group_get_read_limit(child2), ==,
+	    4000);
+	tt_int_op(bufferevent_get_max_to_read(bev2), ==, 400);
+
+	/* When the parent runs dry, members of every child wait for it,
+	 * though their own groups have plenty left. */
+	tt_int_op(0, ==, bufferevent_rate_limit_group_decrement_read(child2,
+		400));
+	tt_int_op(bufferevent_rate_limit_group_get_read_limit(parent), ==, 0);
+	tt_int_op(bufferevent_get_max_to_read(bev1), ==, 0);
+	tt_int_op(bufferevent_get_max_to_read(bev2), ==, 0);
+	tt_int_op(bufferevent_get_max_to_write(bev1), ==, 500);
+
+	/* A detached child is limited by its own bucket alone, right away,
+	 * and stops charging its old parent. */
+	tt_int_op(0, ==, bufferevent_rate_limit_group_set_parent(child1,
+		NULL));
+	tt_int_op(bufferevent_get_max_to_read(bev1), ==, 3400);
+	tt_int_op(bufferevent_get_max_to_write(bev1), ==, 4000);
+	tt_int_op(bufferevent_get_max_to_read(bev2), ==, 0);
+	tt_int_op(0, ==, bufferevent_rate_limit_group_decrement_read(child1,
+		400));
+	tt_int_op(bufferevent_rate_limit_group_get_read_limit(child1), ==,
+	    3000);
+	tt_int_op(bufferevent_rate_limit_group_get_read_limit(parent), ==, 0);
+	/* The one that's left gets the whole parent bucket to itself. */
+	tt_int_op(bufferevent_get_max_to_write(bev2), ==, 1000);
+
+	/* Attaching a child under an empty parent makes it wait. */
+	tt_int_op(0, ==, bufferevent_rate_limit_group_set_parent(child1,
+		parent));
+	tt_int_op(bufferevent_get_max_to_read(bev1), ==, 0);
+	tt_int_op(bufferevent_get_max_to_write(bev1), ==, 500);
+
+end:
+	if (bev1)
+		bufferevent_free(bev1);
+	if (bev2)
+		bufferevent_free(bev2);
+	if (child1)
+		bufferevent_rate_limit_group_free(child1);
+	if (child2)
+		bufferevent_rate_limit_group_free(child2);
+	if (parent)
+		bufferevent_rate_limit_group_free(parent);
+	if (parent_cfg)
+		ev_token_bucket_cfg_free(parent_cfg);
+	if (child_cfg)
+		ev_token_bucket_cfg_free(child_cfg);
+}
+
 struct testcase_t bufferevent_testcases[] = {
 
 	LEGACY(bufferevent, TT_ISOLATED),
@@ -809,6 +1207,16 @@ struct testcase_t bufferevent_testcases[] = {
 	  TT_FORK|TT_NEED_BASE, &basic_setup, (void*)"filter" },
 	{ "bufferevent_timeout_filter_pair", test_bufferevent_timeouts,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, (void*)"filter pair" },
+	{ "bufferevent_pair_batching", test_bufferevent_pair_batching,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_single_limits", test_bufferevent_single_limits,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "bufferevent_refill_timer", test_bufferevent_refill_timer,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_group_round_robin", test_bufferevent_group_round_robin,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_group_parent", test_bufferevent_group_parent,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
 #ifdef _EVENT_HAVE_LIBZ
 	LEGACY(bufferevent_zlib, TT_ISOLATED),
 #else
@@ -66,6 +66,7 @@
 #include "event2/event_struct.h"
 #include "event2/util.h"
 #include "event2/listener.h"
+#include "event2/buffer.h"
 #include "event2/bufferevent.h"
 #include "log-internal.h"
 #include "regress.h"
@@ -807,6 +808,984 @@ end:
 		evdns_close_server_port(port2);
 }
 
+static struct regress_dns_server_table wildcard_table[] = {
+	{ "*", "A", "10.0.0.1", 0 },
+	{ NULL, NULL, NULL, 0 }
+};
+
+static void
+dns_inflight_many_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	ev_uint16_t portnum = 0;
+	char buf[64];
+
+	struct generic_dns_callback_result *r = NULL;
+	const int n = 300;
+	int i, pass;
+
+	tt_assert(regress_dnsserver(base, &portnum, wildcard_table));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	r = calloc(n, sizeof(*r));
+	tt_assert(r);
+
+	/* Distinct names, so nothing coalesces: first with most requests
+	 * waiting for a slot, then with all of them inflight at once. */
+	for (pass = 0; pass < 2; ++pass) {
+		tt_assert(! evdns_base_set_option(dns, "max-inflight:",
+			pass ? "1000" : "7"));
+		memset(r, 0, n * sizeof(*r));
+		for (i = 0; i < n; ++i) {
+			evutil_snprintf(buf, sizeof(buf), "h%d.p%d.example.com",
+			    i, pass);
+			tt_assert(evdns_base_resolve_ipv4(dns, buf,
+				DNS_NO_SEARCH, generic_dns_callback, &r[i]));
+		}
+		n_replies_left = n;
+		exit_base = base;
+		event_base_dispatch(base);
+		for (i = 0; i < n; ++i) {
+			tt_int_op(r[i].result, ==, DNS_ERR_NONE);
+			tt_int_op(((ev_uint32_t*)r[i].addrs)[0], ==,
+			    htonl(0x0a000001));
+		}
+	}
+	tt_int_op(wildcard_table[0].seen, ==, 2 * n);
+
+end:
+	if (r)
+		free(r);
+	if (dns)
+		evdns_base_free(dns, 0);
+	regress_clean_dnsserver();
+}
+
+struct server_burst_state {
+	struct event_base *base;
+	int n_replies;
+	int seen[64];
+};
+
+static void
+server_burst_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct server_burst_state *st = arg;
+	unsigned char buf[512];
+	int r;
+
+	if (what & EV_TIMEOUT) {
+		event_base_loopexit(st->base, NULL);
+		return;
+	}
+	while ((r = recv(fd, (void*)buf, sizeof(buf), 0)) >= 12) {
+		int id = (buf[0] << 8) | buf[1];
+		/* A response, with one answer. */
+		if (id < 64 && (buf[2] & 0x80) && buf[7] == 1 && !st->seen[id]) {
+			st->seen[id] = 1;
+			++st->n_replies;
+		}
+	}
+	if (st->n_replies == 64)
+		event_base_loopexit(st->base, NULL);
+}
+
+static void
+dns_server_burst_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct event *ev = NULL;
+	struct server_burst_state st;
+	struct sockaddr_in sin;
+	struct timeval tv = { 5, 0 };
+	evutil_socket_t fd = -1;
+	ev_uint16_t portnum = 0;
+	/* id, flags=RD, qdcount=1, then test.example.com IN A */
+	unsigned char query[] = {
+		0, 0, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0,
+		4, 't', 'e', 's', 't', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+		3, 'c', 'o', 'm', 0, 0, 1, 0, 1
+	};
+	int i;
+
+	memset(&st, 0, sizeof(st));
+	st.base = base;
+	wildcard_table[0].seen = 0;
+	tt_assert(regress_dnsserver(base, &portnum, wildcard_table));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	sin.sin_port = htons(portnum);
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(fd >= 0);
+	evutil_make_socket_nonblocking(fd);
+	tt_assert(!connect(fd, (struct sockaddr*)&sin, sizeof(sin)));
+
+	/* Queue up more queries than the server reads in one batch before
+	 * it gets a chance to run. */
+	for (i = 0; i < 64; ++i) {
+		query[1] = (unsigned char)i;
+		tt_int_op(send(fd, (void*)query, sizeof(query), 0), ==,
+		    (int)sizeof(query));
+	}
+
+	ev = event_new(base, fd, EV_READ|EV_PERSIST, server_burst_read_cb, &st);
+	event_add(ev, &tv);
+	event_base_dispatch(base);
+
+	tt_int_op(st.n_replies, ==, 64);
+	tt_int_op(wildcard_table[0].seen, ==, 64);
+
+end:
+	if (ev)
+		event_free(ev);
+	if (fd >= 0)
+		evutil_closesocket(fd);
+	regress_clean_dnsserver();
+}
+
+/* Answers every A question with more addresses than fit in 512 bytes. */
+static void
+big_answer_server_cb(struct evdns_server_request *req, void *arg)
+{
+	ev_uint32_t addrs[128];
+	int i;
+	(void) arg;
+
+	for (i = 0; i < 128; ++i)
+		addrs[i] = htonl(0x0a000000 + i);
+	for (i = 0; i < req->nquestions; ++i) {
+		if (req->questions[i]->type == EVDNS_TYPE_A)
+			evdns_server_request_add_a_reply(req,
+			    req->questions[i]->name, 128, addrs, 10);
+	}
+	evdns_server_request_respond(req, 0);
+}
+
+struct tcp_dns_state {
+	struct bufferevent *bevs[4];
+	int n_conns;
+	int n_queries;
+	int n_edns;
+};
+
+/* A minimal DNS-over-TCP server: answers each query with 1.2.3.4. */
+static void
+tcp_dns_readcb(struct bufferevent *bev, void *arg)
+{
+	struct tcp_dns_state *st = arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	static const unsigned char answer[] = {
+		0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 1, 2, 3, 4
+	};
+	unsigned char lenbuf[2], *q;
+	size_t len, j;
+
+	while (evbuffer_copyout(input, lenbuf, 2) == 2) {
+		len = (lenbuf[0] << 8) | lenbuf[1];
+		if (evbuffer_get_length(input) < len + 2)
+			break;
+		q = evbuffer_pullup(input, len + 2) + 2;
+		++st->n_queries;
+		/* one additional record: an OPT advertising 1232 bytes */
+		if (q[11] == 1 && len >= 11 && q[len-11] == 0 &&
+		    q[len-10] == 0 && q[len-9] == 41 &&
+		    q[len-8] == (1232 >> 8) && q[len-7] == (1232 & 0xff))
+			++st->n_edns;
+		for (j = 12; j < len && q[j]; j += q[j] + 1)
+			;
+		j += 5;	/* the root label, the type, and the class */
+
+		lenbuf[0] = (unsigned char)((j + sizeof(answer)) >> 8);
+		lenbuf[1] = (unsigned char)((j + sizeof(answer)) & 0xff);
+		q[2] = 0x81; q[3] = 0x80;	/* response, RD, RA */
+		q[6] = 0; q[7] = 1;		/* one answer */
+		q[10] = 0; q[11] = 0;		/* no additional */
+		bufferevent_write(bev, lenbuf, 2);
+		bufferevent_write(bev, q, j);
+		bufferevent_write(bev, answer, sizeof(answer));
+		evbuffer_drain(input, len + 2);
+	}
+}
+
+static void
+tcp_dns_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+    struct sockaddr *addr, int socklen, void *arg)
+{
+	struct tcp_dns_state *st = arg;
+	struct bufferevent *bev;
+	(void) addr;
+	(void) socklen;
+
+	bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd,
+	    BEV_OPT_CLOSE_ON_FREE);
+	if (st->n_conns < 4)
+		st->bevs[st->n_conns] = bev;
+	++st->n_conns;
+	bufferevent_setcb(bev, tcp_dns_readcb, NULL, NULL, st);
+	bufferevent_enable(bev, EV_READ);
+}
+
+static void
+dns_tcp_fallback_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	struct evconnlistener *listener = NULL;
+	struct tcp_dns_state st;
+	struct sockaddr_in sin;
+	struct generic_dns_callback_result r[3];
+	ev_uint16_t portnum = 0;
+	char buf[64];
+	int i;
+
+	memset(&st, 0, sizeof(st));
+	memset(r, 0, sizeof(r));
+	port = regress_get_dnsserver(base, &portnum, NULL,
+	    big_answer_server_cb, NULL);
+	tt_assert(port);
+
+	/* The TCP side of the nameserver listens on the same port number. */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	sin.sin_port = htons(portnum);
+	listener = evconnlistener_new_bind(base, tcp_dns_accept_cb, &st,
+	    LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_FREE, -1,
+	    (struct sockaddr *)&sin, sizeof(sin));
+	tt_assert(listener);
+
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "edns-udp-size:", "1232"));
+
+	for (i = 0; i < 3; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "big%d.example.com", i);
+		tt_assert(evdns_base_resolve_ipv4(dns, buf, DNS_NO_SEARCH,
+			generic_dns_callback, &r[i]));
+	}
+	n_replies_left = 3;
+	exit_base = base;
+	event_base_dispatch(base);
+
+	for (i = 0; i < 3; ++i) {
+		tt_int_op(r[i].result, ==, DNS_ERR_NONE);
+		tt_int_op(r[i].count, ==, 1);
+		tt_int_op(((ev_uint32_t*)r[i].addrs)[0], ==,
+		    htonl(0x01020304));
+	}
+	/* All three truncated answers were fetched over one connection. */
+	tt_int_op(st.n_conns, ==, 1);
+	tt_int_op(st.n_queries, ==, 3);
+	tt_int_op(st.n_edns, ==, 3);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	for (i = 0; i < st.n_conns && i < 4; ++i)
+		bufferevent_free(st.bevs[i]);
+	if (listener)
+		evconnlistener_free(listener);
+	if (port)
+		evdns_close_server_port(port);
+}
+
+struct delayed_dns_server {
+	struct event_base *base;
+	ev_uint32_t addr;	/* what we answer with, in host order */
+	int delay_msec;	/* how long we take to answer */
+	int seen;
+	int dead;	/* drop everything instead of answering */
+	int probes;	/* google.com queries dropped while dead */
+};
+
+static void
+delayed_dns_respond_cb(evutil_socket_t fd, short what, void *arg)
+{
+	evdns_server_request_respond(arg, 0);
+}
+
+static void
+delayed_dns_server_cb(struct evdns_server_request *req, void *arg)
+{
+	struct delayed_dns_server *srv = arg;
+	ev_uint32_t addr = htonl(srv->addr);
+	struct timeval tv;
+
+	if (srv->dead) {
+		if (!evutil_ascii_strcasecmp(req->questions[0]->name,
+			"google.com"))
+			++srv->probes;
+		evdns_server_request_drop(req);
+		return;
+	}
+	++srv->seen;
+	evdns_server_request_add_a_reply(req, req->questions[0]->name,
+	    1, &addr, 10);
+	if (!srv->delay_msec) {
+		evdns_server_request_respond(req, 0);
+		return;
+	}
+	tv.tv_sec = 0;
+	tv.tv_usec = srv->delay_msec * 1000;
+	event_base_once(srv->base, -1, EV_TIMEOUT, delayed_dns_respond_cb,
+	    req, &tv);
+}
+
+struct rtt_report {
+	ev_uint16_t port;
+	long srtt_msec;
+	int n_samples;
+};
+
+static void
+rtt_report_cb(const struct sockaddr *addr, ev_socklen_t addrlen,
+    const struct timeval *srtt, const struct timeval *rttvar,
+    int n_samples, void *arg)
+{
+	struct rtt_report *rep = arg;
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+	(void) rttvar;
+
+	if (rep[0].port != ntohs(sin->sin_port))
+		++rep;
+	rep->srtt_msec = srtt->tv_sec * 1000 + srtt->tv_usec / 1000;
+	rep->n_samples = n_samples;
+}
+
+static void
+dns_nameserver_rtt_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port_a = NULL, *port_b = NULL;
+	struct delayed_dns_server srv_a, srv_b;
+	struct rtt_report rep[2];
+	struct generic_dns_callback_result r[2];
+	struct timeval start, end, elapsed, drain = { 0, 400000 };
+	ev_uint16_t portnum_a = 0, portnum_b = 0;
+	char buf[64];
+
+	memset(&srv_a, 0, sizeof(srv_a));
+	memset(&srv_b, 0, sizeof(srv_b));
+	memset(r, 0, sizeof(r));
+	srv_a.base = srv_b.base = base;
+	srv_a.addr = 0x0a000001;
+	srv_a.delay_msec = 30;
+	srv_b.addr = 0x0a000002;
+	port_a = regress_get_dnsserver(base, &portnum_a, NULL,
+	    delayed_dns_server_cb, &srv_a);
+	port_b = regress_get_dnsserver(base, &portnum_b, NULL,
+	    delayed_dns_server_cb, &srv_b);
+	tt_assert(port_a && port_b);
+
+	dns = evdns_base_new(base, 0);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum_a);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum_b);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+
+	/* Neither server has been timed yet, so each gets one of these. */
+	tt_assert(evdns_base_resolve_ipv4(dns, "one.example.com",
+		DNS_NO_SEARCH, generic_dns_callback, &r[0]));
+	tt_assert(evdns_base_resolve_ipv4(dns, "two.example.com",
+		DNS_NO_SEARCH, generic_dns_callback, &r[1]));
+	n_replies_left = 2;
+	exit_base = base;
+	event_base_dispatch(base);
+	tt_int_op(srv_a.seen, ==, 1);
+	tt_int_op(srv_b.seen, ==, 1);
+
+	memset(rep, 0, sizeof(rep));
+	rep[0].port = portnum_a;
+	tt_int_op(evdns_base_foreach_nameserver_rtt(dns, rtt_report_cb, rep),
+	    ==, 2);
+	tt_int_op(rep[0].n_samples, ==, 1);
+	tt_int_op(rep[1].n_samples, ==, 1);
+	tt_int_op(rep[0].srtt_msec, >=, 25);
+	tt_int_op(rep[1].srtt_msec, <, rep[0].srtt_msec);
+
+	/* B is faster, so it gets the next request.  When B turns slow,
+	 * the request is hedged to A, which answers first. */
+	srv_b.delay_msec = 300;
+	tt_assert(!evdns_base_set_option(dns, "hedge:", "1"));
+	memset(r, 0, sizeof(r));
+	evutil_gettimeofday(&start, NULL);
+	tt_assert(evdns_base_resolve_ipv4(dns, "three.example.com",
+		DNS_NO_SEARCH, generic_dns_callback, &r[0]));
+	n_replies_left = 1;
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &elapsed);
+
+	tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+	tt_int_op(((ev_uint32_t*)r[0].addrs)[0], ==, htonl(0x0a000001));
+	tt_int_op(srv_b.seen, ==, 2);
+	tt_int_op(srv_a.seen, ==, 2);
+	tt_assert(elapsed.tv_sec == 0 && elapsed.tv_usec < 250000);
+
+	/* Let B's late answer go out. */
+	event_base_loopexit(base, &drain);
+	event_base_dispatch(base);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port_a)
+		evdns_close_server_port(port_a);
+	if (port_b)
+		evdns_close_server_port(port_b);
+}
+
+/* What evdns has said about the nameserver at dns_probe_addr. */
+static char dns_probe_addr[64];
+static int dns_probe_n_up, dns_probe_n_failed;
+
+static void
+dns_probe_log_fn(int is_warning, const char *msg)
+{
+	const size_t len = strlen(dns_probe_addr);
+	(void) is_warning;
+
+	if (strncmp(msg, "Nameserver ", 11) ||
+	    strncmp(msg + 11, dns_probe_addr, len))
+		return;
+	msg += 11 + len;
+	if (!strcmp(msg, " is back up"))
+		++dns_probe_n_up;
+	else if (!strncmp(msg, " has failed", 11))
+		++dns_probe_n_failed;
+}
+
+/* Make an evdns_base that uses the first n servers in srv, with the first
+ * one fastest, and then kill that one: it drops everything until evdns
+ * decides it has failed and starts probing it. */
+static struct evdns_base *
+dns_probe_setup(struct event_base *base, struct delayed_dns_server *srv,
+    const ev_uint16_t *ports, int n)
+{
+	struct evdns_base *dns;
+	struct generic_dns_callback_result r[4];
+	char buf[64];
+	int i;
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(dns);
+	for (i = 0; i < n; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d",
+		    (int)ports[i]);
+		tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+		srv[i].dead = 0;
+	}
+	tt_assert(!evdns_base_set_option(dns, "timeout:", "0.2"));
+	tt_assert(!evdns_base_set_option(dns, "attempts:", "2"));
+	tt_assert(!evdns_base_set_option(dns, "max-timeouts:", "1"));
+	tt_assert(!evdns_base_set_option(dns, "initial-probe-timeout", "0.1"));
+	evutil_snprintf(dns_probe_addr, sizeof(dns_probe_addr),
+	    "127.0.0.1:%d", (int)ports[0]);
+	dns_probe_n_up = dns_probe_n_failed = 0;
+	exit_base = base;
+
+	/* None of them has been timed yet, so each gets one of these. */
+	memset(r, 0, sizeof(r));
+	n_replies_left = n;
+	for (i = 0; i < n; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "warm%d.example.com", i);
+		tt_assert(evdns_base_resolve_ipv4(dns, buf, DNS_NO_SEARCH,
+			generic_dns_callback, &r[i]));
+	}
+	event_base_dispatch(base);
+	for (i = 0; i < n; ++i)
+		tt_int_op(r[i].result, ==, DNS_ERR_NONE);
+
+	/* These all go to the first server, and time out there. */
+	srv[0].dead = 1;
+	memset(r, 0, sizeof(r));
+	n_replies_left = 4;
+	for (i = 0; i < 4; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "kill%d.example.com", i);
+		tt_assert(evdns_base_resolve_ipv4(dns, buf, DNS_NO_SEARCH,
+			generic_dns_callback, &r[i]));
+	}
+	event_base_dispatch(base);
+	for (i = 0; i < 4; ++i)
+		tt_int_op(r[i].result, ==, DNS_ERR_NONE);
+	tt_int_op(dns_probe_n_failed, ==, 1);
+	srv[0].probes = 0;
+	return dns;
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	return NULL;
+}
+
+/* Asks for google.com, the name evdns probes with, every few msec. */
+struct dns_probe_load {
+	struct evdns_base *dns;
+	int sent, ok;
+};
+
+static void
+dns_probe_load_answer_cb(int result, char type, int count, int ttl,
+    void *addresses, void *arg)
+{
+	struct dns_probe_load *load = arg;
+	if (result == DNS_ERR_NONE)
+		++load->ok;
+}
+
+static void
+dns_probe_load_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct dns_probe_load *load = arg;
+	if (evdns_base_resolve_ipv4(load->dns, "google.com", DNS_NO_SEARCH,
+		dns_probe_load_answer_cb, load))
+		++load->sent;
+}
+
+static void
+dns_probe_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port[3] = { NULL, NULL, NULL };
+	struct delayed_dns_server srv[3];
+	struct generic_dns_callback_result r;
+	struct dns_probe_load load;
+	struct event *load_ev = NULL;
+	struct timeval dead_tv = { 0, 900000 }, tick_tv = { 0, 100000 };
+	struct timeval load_tv = { 0, 10000 };
+	ev_uint16_t portnum[3] = { 0, 0, 0 };
+	int i;
+
+	memset(srv, 0, sizeof(srv));
+	for (i = 0; i < 3; ++i) {
+		srv[i].base = base;
+		srv[i].addr = 0x0a000001 + i;
+		srv[i].delay_msec = i ? 20 : 0;
+		port[i] = regress_get_dnsserver(base, &portnum[i], NULL,
+		    delayed_dns_server_cb, &srv[i]);
+		tt_assert(port[i]);
+	}
+	evdns_set_log_fn(dns_probe_log_fn);
+
+	/* The answer to the probe is in the cache, but only the dead
+	 * server can say it's back up. */
+	dns = dns_probe_setup(base, srv, portnum, 2);
+	tt_assert(dns);
+	tt_assert(!evdns_base_set_option(dns, "cache-size:", "16"));
+	memset(&r, 0, sizeof(r));
+	n_replies_left = 1;
+	tt_assert(evdns_base_resolve_ipv4(dns, "google.com", DNS_NO_SEARCH,
+		generic_dns_callback, &r));
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	event_base_loopexit(base, &dead_tv);
+	event_base_dispatch(base);
+	tt_int_op(srv[0].probes, >=, 1);
+	tt_int_op(dns_probe_n_up, ==, 0);
+
+	/* Once it answers, the next probe notices. */
+	srv[0].dead = 0;
+	for (i = 0; i < 30 && !dns_probe_n_up; ++i) {
+		event_base_loopexit(base, &tick_tv);
+		event_base_dispatch(base);
+	}
+	tt_int_op(dns_probe_n_up, ==, 1);
+	evdns_base_free(dns, 0);
+
+	/* Other requests for the same name are always in flight, but the
+	 * probe doesn't wait on them, and they don't wait on the probe. */
+	dns = dns_probe_setup(base, srv, portnum, 2);
+	tt_assert(dns);
+	memset(&load, 0, sizeof(load));
+	load.dns = dns;
+	load_ev = event_new(base, -1, EV_PERSIST, dns_probe_load_cb, &load);
+	event_add(load_ev, &load_tv);
+	event_base_loopexit(base, &dead_tv);
+	event_base_dispatch(base);
+	event_del(load_ev);
+	event_base_loopexit(base, &tick_tv);
+	event_base_dispatch(base);
+	tt_int_op(load.sent, >=, 10);
+	tt_int_op(load.ok, ==, load.sent);
+	tt_int_op(srv[0].probes, >=, 1);
+	tt_int_op(dns_probe_n_up, ==, 0);
+	evdns_base_free(dns, 0);
+
+	/* With two good servers left, other requests to the dead one get
+	 * hedged, but the probe doesn't. */
+	dns = dns_probe_setup(base, srv, portnum, 3);
+	tt_assert(dns);
+	tt_assert(!evdns_base_set_option(dns, "hedge:", "1"));
+	event_base_loopexit(base, &dead_tv);
+	event_base_dispatch(base);
+	tt_int_op(srv[0].probes, >=, 1);
+	tt_int_op(dns_probe_n_up, ==, 0);
+
+end:
+	evdns_set_log_fn(NULL);
+	if (load_ev)
+		event_free(load_ev);
+	if (dns)
+		evdns_base_free(dns, 0);
+	for (i = 0; i < 3; ++i)
+		if (port[i])
+			evdns_close_server_port(port[i]);
+}
+
+#ifdef SO_REUSEPORT
+static void
+reuseport_server_cb(struct evdns_server_request *req, void *arg)
+{
+	int *seen = arg;
+	ev_uint32_t addr = htonl(0x0a000001);
+	++*seen;
+	evdns_server_request_add_a_reply(req, req->questions[0]->name,
+	    1, &addr, 10);
+	evdns_server_request_respond(req, 0);
+}
+
+static void
+dns_server_reuseport_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *bases[2] = { NULL, NULL };
+	struct evdns_server_port *ports[2] = { NULL, NULL };
+	struct sockaddr_in sin;
+	evutil_socket_t fds[32];
+	unsigned char query[] = {
+		0, 0, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0,
+		4, 't', 'e', 's', 't', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+		3, 'c', 'o', 'm', 0, 0, 1, 0, 1
+	};
+	unsigned char reply[512];
+	int seen = 0, seen_by_first = 0, n_replies = 0, i, tries;
+
+	for (i = 0; i < 32; ++i)
+		fds[i] = -1;
+	bases[0] = data->base;
+	bases[1] = event_base_new();
+	tt_assert(bases[1]);
+
+	/* Find a free port. */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	fds[0] = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(fds[0] >= 0);
+	tt_assert(!bind(fds[0], (struct sockaddr *)&sin, sizeof(sin)));
+	sin.sin_port = htons(regress_get_socket_port(fds[0]));
+	evutil_closesocket(fds[0]);
+
+	tt_int_op(evdns_add_server_ports_with_bases(bases, 2,
+		(struct sockaddr *)&sin, sizeof(sin), 0,
+		reuseport_server_cb, &seen, ports), ==, 0);
+	tt_assert(ports[0] && ports[1]);
+
+	/* The kernel spreads clients over the two sockets by address. */
+	for (i = 0; i < 32; ++i) {
+		fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		tt_assert(fds[i] >= 0);
+		evutil_make_socket_nonblocking(fds[i]);
+		tt_assert(!connect(fds[i], (struct sockaddr *)&sin,
+			sizeof(sin)));
+		query[1] = (unsigned char)i;
+		tt_int_op(send(fds[i], (void*)query, sizeof(query), 0), ==,
+		    (int)sizeof(query));
+	}
+
+	for (tries = 0; tries < 100 && n_replies < 32; ++tries) {
+		event_base_loop(bases[0], EVLOOP_NONBLOCK);
+		if (!tries)
+			seen_by_first = seen;
+		event_base_loop(bases[1], EVLOOP_NONBLOCK);
+		for (i = 0; i < 32; ++i) {
+			if (fds[i] >= 0 && recv(fds[i], (void*)reply,
+				sizeof(reply), 0) > 12) {
+				tt_int_op(reply[1], ==, i);
+				tt_int_op(reply[7], ==, 1);
+				++n_replies;
+				evutil_closesocket(fds[i]);
+				fds[i] = -1;
+			}
+		}
+		if (n_replies < 32)
+			usleep(10000);
+	}
+
+	tt_int_op(n_replies, ==, 32);
+	tt_int_op(seen, ==, 32);
+	/* Each base answered some of them. */
+	tt_int_op(seen_by_first, >, 0);
+	tt_int_op(seen_by_first, <, 32);
+
+end:
+	for (i = 0; i < 32; ++i)
+		if (fds[i] >= 0)
+			evutil_closesocket(fds[i]);
+	if (ports[0])
+		evdns_close_server_port(ports[0]);
+	if (ports[1])
+		evdns_close_server_port(ports[1]);
+	if (bases[1])
+		event_base_free(bases[1]);
+}
+#endif
+
+static struct regress_dns_server_table cache_table[] = {
+	{ "cached.example.com", "A", "11.22.33.44", 0 },
+	{ "missing.example.com", "errsoa", "3", 0 },
+	{ "nosoa.example.com", "err", "3", 0 },
+	{ "missing", "err", "3", 0 },
+	{ NULL, NULL, NULL, 0 }
+};
+
+static void
+dns_cache_resolve_all(struct event_base *base, struct evdns_base *dns,
+    struct generic_dns_callback_result *r)
+{
+	memset(r, 0, sizeof(*r) * 3);
+	n_replies_left = 3;
+	exit_base = base;
+	evdns_base_resolve_ipv4(dns, "cached.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r[0]);
+	evdns_base_resolve_ipv4(dns, "missing.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r[1]);
+	evdns_base_resolve_ipv4(dns, "nosoa.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r[2]);
+	event_base_dispatch(base);
+}
+
+static void
+dns_cache_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	ev_uint16_t portnum = 0;
+	ev_uint64_t hits, misses;
+	int n_entries;
+	char buf[64];
+
+	struct generic_dns_callback_result r[3];
+
+	tt_assert(regress_dnsserver(base, &portnum, cache_table));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "cache-size:", "16"));
+
+	dns_cache_resolve_all(base, dns, r);
+	tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+	tt_int_op(r[0].ttl, ==, 100);
+	tt_int_op(r[1].result, ==, DNS_ERR_NOTEXIST);
+	tt_int_op(r[1].ttl, ==, 42);
+	tt_int_op(r[2].result, ==, DNS_ERR_NOTEXIST);
+
+	/* The answer and the NXDOMAIN with an SOA come from the cache. */
+	dns_cache_resolve_all(base, dns, r);
+	tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+	tt_int_op(r[0].count, ==, 1);
+	tt_int_op(((ev_uint32_t*)r[0].addrs)[0], ==, htonl(0x0b16212c));
+	tt_int_op(r[0].ttl, <=, 100);
+	tt_int_op(r[0].ttl, >=, 98);
+	tt_int_op(r[1].result, ==, DNS_ERR_NOTEXIST);
+	tt_int_op(r[1].ttl, <=, 42);
+	tt_int_op(r[2].result, ==, DNS_ERR_NOTEXIST);
+
+	tt_int_op(cache_table[0].seen, ==, 1);
+	tt_int_op(cache_table[1].seen, ==, 1);
+	tt_int_op(cache_table[2].seen, ==, 2);
+
+	evdns_base_cache_get_stats(dns, &hits, &misses, &n_entries);
+	tt_int_op((int)hits, ==, 2);
+	tt_int_op((int)misses, ==, 4);
+	tt_int_op(n_entries, ==, 2);
+
+	/* TTLs get clamped on the way in. */
+	evdns_base_cache_clear(dns);
+	tt_assert(!evdns_base_set_option(dns, "cache-max-ttl:", "10"));
+	dns_cache_resolve_all(base, dns, r);
+	dns_cache_resolve_all(base, dns, r);
+	tt_int_op(cache_table[0].seen, ==, 2);
+	tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+	tt_int_op(r[0].ttl, <=, 10);
+	tt_int_op(r[1].ttl, <=, 10);
+
+	/* A cached NXDOMAIN moves a search on to the next name. */
+	evdns_base_search_add(dns, "example.com");
+	memset(r, 0, sizeof(r));
+	n_replies_left = 2;
+	evdns_base_resolve_ipv4(dns, "cached", 0, generic_dns_callback, &r[0]);
+	evdns_base_resolve_ipv4(dns, "missing", 0, generic_dns_callback, &r[1]);
+	event_base_dispatch(base);
+	tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+	tt_int_op(r[1].result, ==, DNS_ERR_NOTEXIST);
+	tt_int_op(cache_table[0].seen, ==, 2);
+	tt_int_op(cache_table[1].seen, ==, 2);
+	tt_int_op(cache_table[3].seen, ==, 1);
+
+	/* Shrinking the cache evicts the least recently used answers. */
+	tt_assert(!evdns_base_set_option(dns, "cache-size:", "1"));
+	evdns_base_cache_get_stats(dns, NULL, NULL, &n_entries);
+	tt_int_op(n_entries, ==, 1);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	regress_clean_dnsserver();
+}
+
+static struct regress_dns_server_table prefetch_table[] = {
+	{ "hot.example.com", "A", "11.22.33.44", 0 },
+	{ NULL, NULL, NULL, 0 }
+};
+
+static void
+dns_cache_prefetch_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct generic_dns_callback_result r;
+	struct timeval wait_tv = { 2, 100000 }, settle_tv = { 0, 200000 };
+	ev_uint16_t portnum = 0;
+	char buf[64];
+
+	tt_assert(regress_dnsserver(base, &portnum, prefetch_table));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "cache-size:", "16"));
+	tt_assert(!evdns_base_set_option(dns, "cache-max-ttl:", "4"));
+	tt_assert(!evdns_base_set_option(dns, "cache-prefetch:", "50"));
+
+	memset(&r, 0, sizeof(r));
+	n_replies_left = 1;
+	exit_base = base;
+	evdns_base_resolve_ipv4(dns, "hot.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(prefetch_table[0].seen, ==, 1);
+
+	/* Halfway through the TTL, a hit still gets the cached answer, but
+	 * also sends a query to refresh it. */
+	event_base_loopexit(base, &wait_tv);
+	event_base_dispatch(base);
+	memset(&r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "hot.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.ttl, <=, 2);
+	event_base_loopexit(base, &settle_tv);
+	event_base_dispatch(base);
+	tt_int_op(prefetch_table[0].seen, ==, 2);
+
+	/* Now the cache has the fresh answer. */
+	memset(&r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "hot.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(((ev_uint32_t*)r.addrs)[0], ==, htonl(0x0b16212c));
+	tt_int_op(r.ttl, >=, 3);
+	tt_int_op(prefetch_table[0].seen, ==, 2);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	regress_clean_dnsserver();
+}
+
+static struct regress_dns_server_table coalesce_table[] = {
+	{ "foof.example.com", "A", "240.15.240.15", 0 },
+	{ NULL, NULL, NULL, 0 }
+};
+
+static void
+dns_coalesce_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_request *req[8];
+	ev_uint16_t portnum = 0;
+	char buf[64];
+
+	struct generic_dns_callback_result r[8];
+	int i;
+
+	tt_assert(regress_dnsserver(base, &portnum, coalesce_table));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+
+	memset(r, 0, sizeof(r));
+	n_replies_left = 8;
+	exit_base = base;
+
+	/* The case of the name doesn't matter, but the type does. */
+	for (i = 0; i < 6; ++i)
+		req[i] = evdns_base_resolve_ipv4(dns,
+		    (i & 1) ? "FOOF.example.com" : "foof.example.com",
+		    DNS_NO_SEARCH, generic_dns_callback, &r[i]);
+	req[6] = evdns_base_resolve_ipv6(dns, "foof.example.com",
+	    DNS_NO_SEARCH, generic_dns_callback, &r[6]);
+	req[7] = evdns_base_resolve_ipv4(dns, "foof.example.com",
+	    DNS_NO_SEARCH, generic_dns_callback, &r[7]);
+	for (i = 0; i < 8; ++i)
+		tt_assert(req[i]);
+
+	/* Canceling a follower leaves the others alone; canceling the
+	 * request that went out makes the rest ask again. */
+	evdns_cancel_request(dns, req[3]);
+	evdns_cancel_request(dns, req[0]);
+
+	event_base_dispatch(base);
+
+	for (i = 0; i < 8; ++i) {
+		if (i == 0 || i == 3) {
+			tt_int_op(r[i].result, ==, DNS_ERR_CANCEL);
+		} else if (i == 6) {
+			/* our test server only has an A record */
+			tt_int_op(r[i].result, ==, DNS_ERR_NODATA);
+		} else {
+			tt_int_op(r[i].result, ==, DNS_ERR_NONE);
+			tt_int_op(r[i].type, ==, DNS_IPv4_A);
+			tt_int_op(r[i].count, ==, 1);
+			tt_int_op(((ev_uint32_t*)r[i].addrs)[0], ==,
+			    htonl(0xf00ff00f));
+		}
+	}
+	/* One A query for the canceled request, one for the rest of the A
+	 * requests, and one for the AAAA request. */
+	tt_int_op(coalesce_table[0].seen, ==, 3);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	regress_clean_dnsserver();
+}
+
 #if 0
 static void
 dumb_bytes_fn(char *p, size_t n)
@@ -974,6 +1953,39 @@ be_getaddrinfo_server_cb(struct evdns_server_request *req, void *data)
 				evdns_server_request_drop(req);
 				return;
 			}
+		} else if (!evutil_ascii_strcasecmp(qname,
+			"race.example.com") ||
+		    !evutil_ascii_strcasecmp(qname,
+			"race-slow6.example.com") ||
+		    !evutil_ascii_strcasecmp(qname,
+			"race-local.example.com")) {
+			if (qtype == EVDNS_TYPE_A) {
+				ans.s_addr = htonl(0x7f000001);
+				evdns_server_request_add_a_reply(req, qname,
+				    1, &ans.s_addr, 2000);
+				added_any = 1;
+			} else if (qtype == EVDNS_TYPE_AAAA &&
+			    !evutil_ascii_strcasecmp(qname,
+				"race-slow6.example.com")) {
+				/* Never answer; the A answer must be enough. */
+				evdns_server_request_drop(req);
+				return;
+			} else if (qtype == EVDNS_TYPE_AAAA &&
+			    !evutil_ascii_strcasecmp(qname,
+				"race-local.example.com")) {
+				ans6.s6_addr[15] = 0x01; /* ::1 */
+				evdns_server_request_add_aaaa_reply(req, qname,
+				    1, &ans6.s6_addr, 2000);
+				added_any = 1;
+			} else if (qtype == EVDNS_TYPE_AAAA) {
+				/* 100::1 is in the discard-only prefix; a
+				 * connection there never succeeds. */
+				ans6.s6_addr[0] = 0x01;
+				ans6.s6_addr[15] = 0x01;
+				evdns_server_request_add_aaaa_reply(req, qname,
+				    1, &ans6.s6_addr, 2000);
+				added_any = 1;
+			}
 		} else if (!evutil_ascii_strcasecmp(qname,
 			"all-timeout.example.com")) {
 			/* drop all requests */
@@ -1166,6 +2178,140 @@ end:
 }
 
 
+static int n_race_events_left = 0;
+
+static void
+race_accept_cb(struct evconnlistener *l, evutil_socket_t fd,
+    struct sockaddr *s, int socklen, void *arg)
+{
+	int *p = arg;
+	(*p)++;
+	evutil_closesocket(fd);
+}
+
+static void
+be_connect_race_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+	struct be_conn_hostname_result *got = ctx;
+	if (got->what) {
+		TT_FAIL(("Two events on one bufferevent. %d,%d",
+			got->what, (int)what));
+		return;
+	}
+	got->what = what;
+	got->dnserr = bufferevent_socket_get_dns_error(bev);
+	if (--n_race_events_left == 0)
+		event_base_loopexit(be_connect_hostname_base, NULL);
+}
+
+static void
+test_bufferevent_connect_race(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evconnlistener *listener = NULL;
+	struct bufferevent *be1=NULL, *be2=NULL, *be3=NULL;
+	struct be_conn_hostname_result be1_outcome={0,0}, be2_outcome={0,0},
+	       be3_outcome={0,0};
+	struct evdns_base *dns=NULL;
+	struct evdns_server_port *port=NULL;
+	struct sockaddr_in sin;
+	struct sockaddr_storage ss;
+	ev_socklen_t sslen;
+	struct timeval start, end, elapsed;
+	evutil_socket_t closed_fd = -1;
+	int listener_port=-1, closed_port=-1;
+	ev_uint16_t dns_port=0;
+	int n_accept=0, n_dns=0;
+	char buf[128];
+
+	be_connect_hostname_base = data->base;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001); /* 127.0.0.1 */
+	sin.sin_port = 0;
+	listener = evconnlistener_new_bind(data->base, race_accept_cb,
+	    &n_accept,
+	    LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_EXEC,
+	    -1, (struct sockaddr *)&sin, sizeof(sin));
+	tt_assert(listener);
+	listener_port = regress_get_socket_port(
+		evconnlistener_get_fd(listener));
+
+	/* A port that is bound but not listening refuses connections. */
+	closed_fd = socket(AF_INET, SOCK_STREAM, 0);
+	tt_assert(closed_fd >= 0);
+	tt_assert(!bind(closed_fd, (struct sockaddr *)&sin, sizeof(sin)));
+	closed_port = regress_get_socket_port(closed_fd);
+
+	port = regress_get_dnsserver(data->base, &dns_port, NULL,
+	    be_getaddrinfo_server_cb, &n_dns);
+	tt_assert(port);
+
+	dns = evdns_base_new(data->base, 0);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)dns_port);
+	evdns_base_nameserver_ip_add(dns, buf);
+
+	be1 = bufferevent_socket_new(data->base, -1, BEV_OPT_CLOSE_ON_FREE);
+	be2 = bufferevent_socket_new(data->base, -1, BEV_OPT_CLOSE_ON_FREE);
+	be3 = bufferevent_socket_new(data->base, -1, BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(be1, NULL, NULL, be_connect_race_event_cb,
+	    &be1_outcome);
+	bufferevent_setcb(be2, NULL, NULL, be_connect_race_event_cb,
+	    &be2_outcome);
+	bufferevent_setcb(be3, NULL, NULL, be_connect_race_event_cb,
+	    &be3_outcome);
+	n_race_events_left = 3;
+
+	evutil_gettimeofday(&start, NULL);
+	/* The IPv6 address never connects; the IPv4 one must win. */
+	tt_assert(!bufferevent_socket_connect_hostname(be1, dns, AF_UNSPEC,
+		"race.example.com", listener_port));
+	/* The AAAA lookup never finishes; we must not wait for it. */
+	tt_assert(!bufferevent_socket_connect_hostname(be2, dns, AF_UNSPEC,
+		"race-slow6.example.com", listener_port));
+	/* Every address fails: we hear about it once. */
+	tt_assert(!bufferevent_socket_connect_hostname(be3, dns, AF_UNSPEC,
+		"race-local.example.com", closed_port));
+
+	event_base_dispatch(data->base);
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &elapsed);
+
+	tt_int_op(be1_outcome.what, ==, BEV_EVENT_CONNECTED);
+	tt_int_op(be1_outcome.dnserr, ==, 0);
+	tt_int_op(be2_outcome.what, ==, BEV_EVENT_CONNECTED);
+	tt_int_op(be2_outcome.dnserr, ==, 0);
+	tt_int_op(be3_outcome.what, ==, BEV_EVENT_ERROR);
+	tt_int_op(be3_outcome.dnserr, ==, 0);
+	/* Well before the evdns timeout for the unanswered AAAA query. */
+	tt_int_op(elapsed.tv_sec, <, 3);
+
+	sslen = sizeof(ss);
+	tt_assert(!getpeername(bufferevent_getfd(be1),
+		(struct sockaddr *)&ss, &sslen));
+	tt_int_op(ss.ss_family, ==, AF_INET);
+	tt_int_op(bufferevent_getfd(be3), <, 0);
+	tt_int_op(n_accept, ==, 2);
+
+end:
+	if (listener)
+		evconnlistener_free(listener);
+	if (closed_fd >= 0)
+		evutil_closesocket(closed_fd);
+	if (port)
+		evdns_close_server_port(port);
+	if (be1)
+		bufferevent_free(be1);
+	if (be2)
+		bufferevent_free(be2);
+	if (be3)
+		bufferevent_free(be3);
+	if (dns)
+		evdns_base_free(dns, 0);
+}
+
+
 struct gai_outcome {
 	int err;
 	struct evutil_addrinfo *ai;
@@ -1768,6 +2914,92 @@ test_dbg_leak_shutdown(void *env_)
 }
 #endif
 
+#ifndef WIN32
+static int
+hosts_lookup(struct evdns_base *dns_base, const char *name, int family,
+    struct evutil_addrinfo **res)
+{
+	struct evutil_addrinfo hints;
+	struct gai_outcome out;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_STREAM;
+	memset(&out, 0, sizeof(out));
+	out.err = -1;
+	/* hosts file answers come back right away */
+	if (evdns_getaddrinfo(dns_base, name, "80", &hints, gai_cb, &out))
+		return -1;
+	*res = out.ai;
+	return out.err;
+}
+
+static void
+test_hosts_reload(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdns_base *dns_base = NULL;
+	struct evutil_addrinfo *ai = NULL;
+	struct timeval tv = { 0, 200*1000 };
+	char fname[] = "/tmp/eventhosts.XXXXXX";
+	FILE *fp = NULL;
+	int fd, i;
+
+	dns_base = evdns_base_new(data->base, 0);
+	tt_assert(dns_base);
+	evdns_base_load_hosts(dns_base, NULL);
+
+	tt_int_op((fd = mkstemp(fname)), >=, 0);
+	tt_assert((fp = fdopen(fd, "w")) != NULL);
+	fprintf(fp, "# a big hosts file\n");
+	for (i = 0; i < 5000; ++i)
+		fprintf(fp, "10.0.%d.%d host%d\n", i / 256, i % 256, i);
+	fprintf(fp, "127.0.0.9 localhost\n");
+	fprintf(fp, "10.1.1.1 Multi # comment\n");
+	fprintf(fp, "::2 multi\n");
+	fprintf(fp, "10.2.2.2 other MULTI");
+	fclose(fp);
+	fp = NULL;
+
+	tt_int_op(evdns_base_reload_hosts(dns_base, "/nonexistent/hosts"), ==, -1);
+	tt_int_op(evdns_base_reload_hosts(dns_base, fname), ==, 0);
+
+	/* Until the loop has parsed the whole file, the old entries stay. */
+	tt_int_op(hosts_lookup(dns_base, "localhost", PF_INET, &ai), ==, 0);
+	test_ai_eq(ai, "127.0.0.1:80", SOCK_STREAM, IPPROTO_TCP);
+	evutil_freeaddrinfo(ai);
+	ai = NULL;
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	tt_int_op(hosts_lookup(dns_base, "localhost", PF_INET, &ai), ==, 0);
+	test_ai_eq(ai, "127.0.0.9:80", SOCK_STREAM, IPPROTO_TCP);
+	evutil_freeaddrinfo(ai);
+
+	tt_int_op(hosts_lookup(dns_base, "HOST4321", PF_INET, &ai), ==, 0);
+	test_ai_eq(ai, "10.0.16.225:80", SOCK_STREAM, IPPROTO_TCP);
+	evutil_freeaddrinfo(ai);
+
+	/* Several entries for one name come back in file order. */
+	tt_int_op(hosts_lookup(dns_base, "mULTi", PF_UNSPEC, &ai), ==, 0);
+	test_ai_eq(ai, "10.1.1.1:80", SOCK_STREAM, IPPROTO_TCP);
+	test_ai_eq(ai->ai_next, "[::2]:80", SOCK_STREAM, IPPROTO_TCP);
+	test_ai_eq(ai->ai_next->ai_next, "10.2.2.2:80", SOCK_STREAM,
+	    IPPROTO_TCP);
+	tt_ptr_op(ai->ai_next->ai_next->ai_next, ==, NULL);
+
+end:
+	if (ai)
+		evutil_freeaddrinfo(ai);
+	if (fp)
+		fclose(fp);
+	unlink(fname);
+	if (dns_base)
+		evdns_base_free(dns_base, 0);
+}
+#endif
+
 static void
 test_getaddrinfo_async_cancel_stress(void *ptr)
 {
@@ -1837,13 +3069,36 @@ struct testcase_t dns_testcases[] = {
 	{ "retry", dns_retry_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "reissue", dns_reissue_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "inflight", dns_inflight_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "inflight_many", dns_inflight_many_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "server_burst", dns_server_burst_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "tcp_fallback", dns_tcp_fallback_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "nameserver_rtt", dns_nameserver_rtt_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+#ifdef SO_REUSEPORT
+	{ "server_reuseport", dns_server_reuseport_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+#endif
+	{ "cache", dns_cache_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "cache_prefetch", dns_cache_prefetch_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "coalesce", dns_coalesce_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "probe", dns_probe_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "bufferevent_connect_hostname", test_bufferevent_connect_hostname,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_connect_race", test_bufferevent_connect_race,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 
 	{ "getaddrinfo_async", test_getaddrinfo_async,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, (char*)"" },
 	{ "getaddrinfo_cancel_stress", test_getaddrinfo_async_cancel_stress,
 	  TT_FORK, NULL, NULL },
+#ifndef WIN32
+	{ "hosts_reload", test_hosts_reload, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+#endif
 
 #ifdef EVENT_SET_MEM_FUNCTIONS_IMPLEMENTED
 	{ "leak_shutdown", test_dbg_leak_shutdown, TT_FORK, &testleak_funcs, NULL },
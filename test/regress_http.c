@@ -44,6 +44,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <sys/resource.h>
 #endif
 #include <fcntl.h>
 #include <stdlib.h>
@@ -51,6 +52,19 @@
 #include <string.h>
 #include <errno.h>
 
+#ifdef _EVENT_HAVE_LIBZ
+#ifndef _LARGEFILE64_SOURCE
+#define _LARGEFILE64_SOURCE 0
+#endif
+#ifndef _LFS64_LARGEFILE
+#define _LFS64_LARGEFILE 0
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 0
+#endif
+#include <zlib.h>
+#endif
+
 #include "event2/dns.h"
 
 #include "event2/event.h"
@@ -3010,6 +3024,726 @@ http_stream_in_cancel_test(void *arg)
 
 }
 
+struct stream_body_state {
+	struct evhttp_request *req;
+	struct evbuffer *body;
+	struct event *drain_ev;
+	int paused;
+};
+
+static void
+http_stream_body_drain_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct stream_body_state *state = arg;
+	struct evbuffer *input = evhttp_request_get_input_buffer(state->req);
+	struct timeval tv = { 0, 5000 };
+
+	/* A slow consumer: take a little at a time.  Draining below the
+	 * watermark is what lets the server read the rest of the body. */
+	evbuffer_remove_buffer(input, state->body, 16);
+	if (evbuffer_get_length(input))
+		event_add(state->drain_ev, &tv);
+}
+
+static void
+http_stream_body_chunk_cb(struct evhttp_request *req, void *arg)
+{
+	struct stream_body_state *state = arg;
+	struct evbuffer *input = evhttp_request_get_input_buffer(req);
+	struct timeval tv = { 0, 5000 };
+
+	state->req = req;
+	if (evbuffer_get_length(input) >= 64)
+		++state->paused;
+	if (!event_pending(state->drain_ev, EV_TIMEOUT, NULL))
+		event_add(state->drain_ev, &tv);
+}
+
+static int
+http_stream_body_header_cb(struct evhttp_request *req, void *arg)
+{
+	if (!strcmp(evhttp_request_get_uri(req), "/reject"))
+		return (-1);
+	if (!strcmp(evhttp_request_get_uri(req), "/upload")) {
+		evhttp_request_set_chunked_cb(req, http_stream_body_chunk_cb);
+		evhttp_request_set_body_watermark(req, 64);
+	}
+	return (0);
+}
+
+static void
+http_stream_body_upload_cb(struct evhttp_request *req, void *arg)
+{
+	struct stream_body_state *state = arg;
+	struct evbuffer *evb = evbuffer_new();
+
+	event_del(state->drain_ev);
+	evbuffer_add_buffer(state->body, evhttp_request_get_input_buffer(req));
+	evbuffer_add_printf(evb, "%lu",
+	    (unsigned long)evbuffer_get_length(state->body));
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_stream_body_done(struct evhttp_request *req, void *arg)
+{
+	int *code = arg;
+
+	*code = req ? evhttp_request_get_response_code(req) : -1;
+	event_base_loopexit(exit_base, NULL);
+}
+
+static void
+http_stream_body_readcb(struct bufferevent *bev, void *arg)
+{
+	evbuffer_add_buffer(arg, bufferevent_get_input(bev));
+}
+
+static void
+http_stream_body_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	event_base_loopexit(exit_base, NULL);
+}
+
+static void
+http_stream_body_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_connection *evcon = NULL;
+	struct evhttp_request *req;
+	struct bufferevent *bev = NULL;
+	struct evbuffer *reply = evbuffer_new();
+	struct stream_body_state state;
+	char body[1000];
+	ev_uint16_t port = 0;
+	int code, i;
+
+	exit_base = data->base;
+	memset(&state, 0, sizeof(state));
+	state.body = evbuffer_new();
+	state.drain_ev = evtimer_new(data->base, http_stream_body_drain_cb,
+	    &state);
+	for (i = 0; i < (int)sizeof(body); ++i)
+		body[i] = 'a' + i % 26;
+
+	http = http_setup(&port, data->base);
+	evhttp_set_cb(http, "/upload", http_stream_body_upload_cb, &state);
+	evhttp_set_header_cb(http, http_stream_body_header_cb, &state);
+
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	tt_assert(evcon);
+
+	/* A Content-Length body, consumed far slower than it arrives. */
+	req = evhttp_request_new(http_stream_body_done, &code);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Host", "somehost");
+	evbuffer_add(evhttp_request_get_output_buffer(req), body, sizeof(body));
+	code = 0;
+	tt_assert(!evhttp_make_request(evcon, req, EVHTTP_REQ_POST, "/upload"));
+	event_base_dispatch(data->base);
+	tt_int_op(code, ==, HTTP_OK);
+	tt_int_op(evbuffer_get_length(state.body), ==, sizeof(body));
+	tt_assert(!memcmp(evbuffer_pullup(state.body, -1), body, sizeof(body)));
+	tt_assert(state.paused > 0);
+
+	/* The header callback can refuse a request before its body is read. */
+	req = evhttp_request_new(http_stream_body_done, &code);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Host", "somehost");
+	evbuffer_add(evhttp_request_get_output_buffer(req), body, sizeof(body));
+	code = 0;
+	tt_assert(!evhttp_make_request(evcon, req, EVHTTP_REQ_POST, "/reject"));
+	event_base_dispatch(data->base);
+	tt_int_op(code, ==, HTTP_BADREQUEST);
+
+	/* A chunked body whose chunks are larger than the watermark. */
+	evbuffer_drain(state.body, evbuffer_get_length(state.body));
+	state.paused = 0;
+	bev = bufferevent_socket_new(data->base,
+	    http_connect("127.0.0.1", port), BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(bev, http_stream_body_readcb, NULL,
+	    http_stream_body_eventcb, reply);
+	bufferevent_enable(bev, EV_READ);
+	evbuffer_add_printf(bufferevent_get_output(bev),
+	    "POST /upload HTTP/1.1\r\n"
+	    "Host: somehost\r\n"
+	    "Connection: close\r\n"
+	    "Transfer-Encoding: chunked\r\n\r\n");
+	for (i = 0; i < 5; ++i) {
+		evbuffer_add_printf(bufferevent_get_output(bev), "c8\r\n");
+		bufferevent_write(bev, body + i * 200, 200);
+		evbuffer_add_printf(bufferevent_get_output(bev), "\r\n");
+	}
+	evbuffer_add_printf(bufferevent_get_output(bev), "0\r\n\r\n");
+	event_base_dispatch(data->base);
+
+	tt_assert(evbuffer_contains(reply, "HTTP/1.1 200"));
+	tt_assert(evbuffer_contains(reply, "\r\n\r\n1000"));
+	tt_int_op(evbuffer_get_length(state.body), ==, sizeof(body));
+	tt_assert(!memcmp(evbuffer_pullup(state.body, -1), body, sizeof(body)));
+	tt_assert(state.paused > 0);
+
+	test_ok = 1;
+ end:
+	if (bev)
+		bufferevent_free(bev);
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (http)
+		evhttp_free(http);
+	event_free(state.drain_ev);
+	evbuffer_free(state.body);
+	evbuffer_free(reply);
+}
+
+/* What http_fetch() got back: the status, the start of the body, and the
+ * response headers that the tests below look at. */
+struct http_fetch_result {
+	int code;
+	char body[256];
+	size_t body_len;
+	char etag[48];
+	char content_range[48];
+	char content_encoding[16];
+	char vary[32];
+	char allow[64];
+};
+
+static void
+http_fetch_copy_header(struct evhttp_request *req, const char *name,
+    char *buf, size_t buflen)
+{
+	const char *value = evhttp_find_header(
+		evhttp_request_get_input_headers(req), name);
+	if (value)
+		evutil_snprintf(buf, buflen, "%s", value);
+}
+
+static void
+http_fetch_done(struct evhttp_request *req, void *arg)
+{
+	struct http_fetch_result *res = arg;
+	struct evbuffer *body;
+	size_t len;
+
+	if (req != NULL) {
+		res->code = evhttp_request_get_response_code(req);
+		body = evhttp_request_get_input_buffer(req);
+		len = evbuffer_get_length(body);
+		if (len >= sizeof(res->body))
+			len = sizeof(res->body) - 1;
+		res->body_len = evbuffer_remove(body, res->body, len);
+		http_fetch_copy_header(req, "ETag", res->etag,
+		    sizeof(res->etag));
+		http_fetch_copy_header(req, "Content-Range",
+		    res->content_range, sizeof(res->content_range));
+		http_fetch_copy_header(req, "Content-Encoding",
+		    res->content_encoding, sizeof(res->content_encoding));
+		http_fetch_copy_header(req, "Vary", res->vary,
+		    sizeof(res->vary));
+		http_fetch_copy_header(req, "Allow", res->allow,
+		    sizeof(res->allow));
+	}
+	event_base_loopexit(exit_base, NULL);
+}
+
+/* Make a request on evcon, with one extra header if header isn't NULL,
+ * and wait for the answer. */
+static void
+http_fetch(struct evhttp_connection *evcon, enum evhttp_cmd_type type,
+    const char *uri, const char *header, const char *value,
+    struct http_fetch_result *res)
+{
+	struct evhttp_request *req;
+
+	memset(res, 0, sizeof(*res));
+	res->code = -1;
+	req = evhttp_request_new(http_fetch_done, res);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Host", "somehost");
+	if (header)
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    header, value);
+	if (evhttp_make_request(evcon, req, type, uri) == 0)
+		event_base_dispatch(exit_base);
+}
+
+#ifdef _EVENT_HAVE_LIBZ
+/* Fetch uri with the given Accept-Encoding, and inflate the body if it
+ * came back compressed.  A body that doesn't inflate sets code to -2. */
+static void
+http_compress_fetch(struct evhttp_connection *evcon, const char *uri,
+    const char *accept, struct http_fetch_result *res)
+{
+	unsigned char raw[sizeof(res->body)];
+	z_stream z;
+
+	http_fetch(evcon, EVHTTP_REQ_GET, uri,
+	    accept ? "Accept-Encoding" : NULL, accept, res);
+	if (res->content_encoding[0] == '\0')
+		return;
+
+	memcpy(raw, res->body, res->body_len);
+	memset(res->body, 0, sizeof(res->body));
+	/* 15 + 32 accepts both the zlib and the gzip format. */
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 15 + 32) != Z_OK) {
+		res->code = -2;
+		return;
+	}
+	z.next_in = raw;
+	z.avail_in = (uInt)res->body_len;
+	z.next_out = (unsigned char *)res->body;
+	z.avail_out = sizeof(res->body) - 1;
+	if (inflate(&z, Z_FINISH) != Z_STREAM_END)
+		res->code = -2;
+	inflateEnd(&z);
+}
+
+static void
+http_compress_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_connection *evcon = NULL;
+	struct http_fetch_result res;
+	ev_uint16_t port = 0;
+
+	exit_base = data->base;
+	http = http_setup(&port, data->base);
+	tt_int_op(evhttp_set_compression(http, 10, 0), ==, -1);
+	tt_int_op(evhttp_set_compression(http, 6, 10), ==, 0);
+
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	tt_assert(evcon);
+
+	/* A complete body. */
+	http_compress_fetch(evcon, "/test", "deflate, gzip", &res);
+	tt_int_op(res.code, ==, HTTP_OK);
+	tt_str_op(res.content_encoding, ==, "gzip");
+	tt_str_op(res.vary, ==, "Accept-Encoding");
+	tt_str_op(res.body, ==, BASIC_REQUEST_BODY);
+
+	/* A streamed body, one chunk at a time. */
+	http_compress_fetch(evcon, "/chunked", "gzip;q=0, deflate;q=0.5", &res);
+	tt_int_op(res.code, ==, HTTP_OK);
+	tt_str_op(res.content_encoding, ==, "deflate");
+	tt_str_op(res.body, ==, "This is funnybut not hilarious.bwv 1052");
+
+	/* Clients that don't ask for it get the body as is. */
+	http_compress_fetch(evcon, "/test", NULL, &res);
+	tt_int_op(res.code, ==, HTTP_OK);
+	tt_str_op(res.content_encoding, ==, "");
+	tt_str_op(res.vary, ==, "Accept-Encoding");
+	tt_str_op(res.body, ==, BASIC_REQUEST_BODY);
+
+	http_compress_fetch(evcon, "/test", "identity, *;q=0", &res);
+	tt_str_op(res.content_encoding, ==, "");
+	tt_str_op(res.body, ==, BASIC_REQUEST_BODY);
+
+	http_compress_fetch(evcon, "/test", "br, *", &res);
+	tt_str_op(res.content_encoding, ==, "gzip");
+	tt_str_op(res.body, ==, BASIC_REQUEST_BODY);
+
+	/* The client's preference wins over ours. */
+	http_compress_fetch(evcon, "/test", "deflate;q=1, gzip;q=0.1", &res);
+	tt_str_op(res.content_encoding, ==, "deflate");
+	tt_str_op(res.body, ==, BASIC_REQUEST_BODY);
+
+	http_compress_fetch(evcon, "/test", "gzip;q=0.25, *;q=0.3", &res);
+	tt_str_op(res.content_encoding, ==, "deflate");
+	tt_str_op(res.body, ==, BASIC_REQUEST_BODY);
+
+	http_compress_fetch(evcon, "/test", "deflate;q=0.001, gzip;q=0.000",
+	    &res);
+	tt_str_op(res.content_encoding, ==, "deflate");
+	tt_str_op(res.body, ==, BASIC_REQUEST_BODY);
+
+	/* Small bodies aren't worth it. */
+	tt_int_op(evhttp_set_compression(http, -1, 100), ==, 0);
+	http_compress_fetch(evcon, "/test", "gzip", &res);
+	tt_str_op(res.content_encoding, ==, "");
+	tt_str_op(res.vary, ==, "");
+	tt_str_op(res.body, ==, BASIC_REQUEST_BODY);
+
+	tt_int_op(evhttp_set_compression(http, 0, 0), ==, 0);
+	http_compress_fetch(evcon, "/chunked", "gzip", &res);
+	tt_str_op(res.content_encoding, ==, "");
+	tt_str_op(res.body, ==, "This is funnybut not hilarious.bwv 1052");
+
+	test_ok = 1;
+ end:
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (http)
+		evhttp_free(http);
+}
+#endif
+
+/* Replies with the tag in arg followed by the route parameters. */
+static void
+http_route_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+	struct evkeyval *param;
+
+	evbuffer_add_printf(evb, "%s", (const char *)arg);
+	TAILQ_FOREACH(param, evhttp_request_get_route_params(req), next)
+		evbuffer_add_printf(evb, " %s=%s", param->key, param->value);
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_route_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_connection *evcon = NULL;
+	struct http_fetch_result res;
+	ev_uint16_t port = 0;
+
+	exit_base = data->base;
+	http = http_setup(&port, data->base);
+
+	tt_int_op(evhttp_set_route(http, EVHTTP_REQ_GET, "/users/:id",
+		http_route_cb, "user"), ==, 0);
+	tt_int_op(evhttp_set_route(http, EVHTTP_REQ_PUT|EVHTTP_REQ_POST,
+		"/users/:id", http_route_cb, "update"), ==, 0);
+	tt_int_op(evhttp_set_route(http, EVHTTP_REQ_GET, "/users/me",
+		http_route_cb, "me"), ==, 0);
+	tt_int_op(evhttp_set_route(http, EVHTTP_REQ_GET,
+		"/users/:id/posts/:post", http_route_cb, "post"), ==, 0);
+	tt_int_op(evhttp_set_route(http, EVHTTP_REQ_GET, "/files/*path",
+		http_route_cb, "file"), ==, 0);
+	tt_int_op(evhttp_set_route(http, EVHTTP_REQ_GET, "/test/:x",
+		http_route_cb, "test"), ==, 0);
+
+	/* Conflicts and malformed patterns. */
+	tt_int_op(evhttp_set_route(http, EVHTTP_REQ_GET, "/users/:id",
+		http_route_cb, NULL), ==, -1);
+	tt_int_op(evhttp_set_route(http, EVHTTP_REQ_DELETE, "/users/:name",
+		http_route_cb, NULL), ==, -1);
+	tt_int_op(evhttp_set_route(http, EVHTTP_REQ_GET, "/a/*rest/b",
+		http_route_cb, NULL), ==, -1);
+	tt_int_op(evhttp_set_route(http, EVHTTP_REQ_GET, "/a/:",
+		http_route_cb, NULL), ==, -1);
+	tt_int_op(evhttp_set_route(http, EVHTTP_REQ_GET, "a",
+		http_route_cb, NULL), ==, -1);
+
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	tt_assert(evcon);
+
+	http_fetch(evcon, EVHTTP_REQ_GET, "/users/42", NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_OK);
+	tt_str_op(res.body, ==, "user id=42");
+
+	http_fetch(evcon, EVHTTP_REQ_PUT, "/users/a%20b", NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_OK);
+	tt_str_op(res.body, ==, "update id=a b");
+
+	http_fetch(evcon, EVHTTP_REQ_GET, "/users/me", NULL, NULL, &res);
+	tt_str_op(res.body, ==, "me");
+
+	http_fetch(evcon, EVHTTP_REQ_GET, "/users/42/posts/7",
+	    NULL, NULL, &res);
+	tt_str_op(res.body, ==, "post id=42 post=7");
+
+	/* "me" leads nowhere here, so matching goes back to try ":id". */
+	http_fetch(evcon, EVHTTP_REQ_GET, "/users/me/posts/7",
+	    NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_OK);
+	tt_str_op(res.body, ==, "post id=me post=7");
+
+	http_fetch(evcon, EVHTTP_REQ_GET, "/files/a/b%2Fc/d.txt",
+	    NULL, NULL, &res);
+	tt_str_op(res.body, ==, "file path=a/b/c/d.txt");
+
+	http_fetch(evcon, EVHTTP_REQ_DELETE, "/users/42", NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_BADMETHOD);
+	tt_str_op(res.allow, ==, "GET, POST, PUT");
+
+	http_fetch(evcon, EVHTTP_REQ_GET, "/users", NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_NOTFOUND);
+	http_fetch(evcon, EVHTTP_REQ_GET, "/users/", NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_NOTFOUND);
+
+	/* Exact callbacks come first. */
+	http_fetch(evcon, EVHTTP_REQ_GET, "/test", NULL, NULL, &res);
+	tt_str_op(res.body, ==, BASIC_REQUEST_BODY);
+	http_fetch(evcon, EVHTTP_REQ_GET, "/test/1", NULL, NULL, &res);
+	tt_str_op(res.body, ==, "test x=1");
+
+	/* Once "/users/me" is gone, its node doesn't hide ":id". */
+	tt_int_op(evhttp_del_route(http, EVHTTP_REQ_GET, "/users/me"), ==, 0);
+	tt_int_op(evhttp_del_route(http, EVHTTP_REQ_GET, "/users/me"), ==, -1);
+	tt_int_op(evhttp_del_route(http, EVHTTP_REQ_GET, "/nothing"), ==, -1);
+	http_fetch(evcon, EVHTTP_REQ_GET, "/users/me", NULL, NULL, &res);
+	tt_str_op(res.body, ==, "user id=me");
+	http_fetch(evcon, EVHTTP_REQ_GET, "/users/me/posts/7",
+	    NULL, NULL, &res);
+	tt_str_op(res.body, ==, "post id=me post=7");
+
+	/* Neither does what's left of a pattern we refused. */
+	tt_int_op(evhttp_set_route(http, EVHTTP_REQ_GET, "/test/y/:",
+		http_route_cb, NULL), ==, -1);
+	http_fetch(evcon, EVHTTP_REQ_GET, "/test/y", NULL, NULL, &res);
+	tt_str_op(res.body, ==, "test x=y");
+
+	tt_int_op(evhttp_del_route(http, EVHTTP_REQ_POST, "/users/:id"), ==, 0);
+	http_fetch(evcon, EVHTTP_REQ_POST, "/users/42", NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_BADMETHOD);
+	tt_str_op(res.allow, ==, "GET, PUT");
+
+	test_ok = 1;
+ end:
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (http)
+		evhttp_free(http);
+}
+
+#define HTTP_ROUTE_DEPTH 12
+
+/* Every combination of "a" and ":pN" over HTTP_ROUTE_DEPTH segments is a
+ * route, so a matcher that backtracked would try all 2^HTTP_ROUTE_DEPTH
+ * of them for a path that fails at the end. */
+static void
+http_route_deep_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_connection *evcon = NULL;
+	struct http_fetch_result res;
+	char pattern[HTTP_ROUTE_DEPTH * 5 + 8], path[HTTP_ROUTE_DEPTH * 2 + 8];
+	ev_uint16_t port = 0;
+	int i, j;
+
+	exit_base = data->base;
+	http = http_setup(&port, data->base);
+
+	for (i = 0; i < (1 << HTTP_ROUTE_DEPTH); ++i) {
+		char *p = pattern;
+		for (j = 0; j < HTTP_ROUTE_DEPTH; ++j) {
+			if (i & (1 << j))
+				p += sprintf(p, "/:p%d", j);
+			else
+				p += sprintf(p, "/a");
+		}
+		strcpy(p, "/end");
+		tt_int_op(evhttp_set_route(http, EVHTTP_REQ_GET, pattern,
+			http_route_cb, "deep"), ==, 0);
+	}
+	tt_int_op(evhttp_set_route(http, EVHTTP_REQ_GET, "/a/a/*rest",
+		http_route_cb, "rest"), ==, 0);
+
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	tt_assert(evcon);
+
+	for (i = 0, path[0] = '\0'; i < HTTP_ROUTE_DEPTH; ++i)
+		strcat(path, "/a");
+
+	/* Literals all the way down. */
+	strcat(path, "/end");
+	http_fetch(evcon, EVHTTP_REQ_GET, path, NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_OK);
+	tt_str_op(res.body, ==, "deep");
+
+	/* A parameter where there is no literal to take. */
+	path[1] = 'b';
+	http_fetch(evcon, EVHTTP_REQ_GET, path, NULL, NULL, &res);
+	tt_str_op(res.body, ==, "deep p0=b");
+	path[1] = 'a';
+
+	/* The last segment matches nothing: the deepest catch-all on the
+	 * way gets it. */
+	strcpy(path + HTTP_ROUTE_DEPTH * 2, "/nope");
+	http_fetch(evcon, EVHTTP_REQ_GET, path, NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_OK);
+	tt_str_op(res.body, ==, "rest rest=a/a/a/a/a/a/a/a/a/a/nope");
+
+	tt_int_op(evhttp_del_route(http, EVHTTP_REQ_GET, "/a/a/*rest"), ==, 0);
+	http_fetch(evcon, EVHTTP_REQ_GET, path, NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_NOTFOUND);
+
+	test_ok = 1;
+ end:
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (http)
+		evhttp_free(http);
+}
+
+struct http_max_conn_client {
+	struct bufferevent *bev;
+	struct evbuffer *reply;
+	int eof;
+	int waiting;
+};
+
+static void
+http_max_conn_readcb(struct bufferevent *bev, void *arg)
+{
+	struct http_max_conn_client *client = arg;
+
+	evbuffer_add_buffer(client->reply, bufferevent_get_input(bev));
+	if (client->waiting &&
+	    evbuffer_contains(client->reply, BASIC_REQUEST_BODY))
+		event_base_loopexit(exit_base, NULL);
+}
+
+static void
+http_max_conn_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct http_max_conn_client *client = arg;
+
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		client->eof = 1;
+		if (client->waiting)
+			event_base_loopexit(exit_base, NULL);
+	}
+}
+
+/* Sends a request for /test on client's connection, and waits for the
+ * reply. */
+static void
+http_max_conn_request(struct http_max_conn_client *client)
+{
+	evbuffer_drain(client->reply, evbuffer_get_length(client->reply));
+	bufferevent_write(client->bev, "GET /test HTTP/1.1\r\n"
+	    "Host: somehost\r\n\r\n", 38);
+	client->waiting = 1;
+	event_base_dispatch(exit_base);
+	client->waiting = 0;
+}
+
+static void
+http_max_connections_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct http_max_conn_client clients[3];
+	struct timeval tv = { 0, 100000 };
+	ev_uint16_t port = 0;
+	int i;
+
+	exit_base = data->base;
+	memset(clients, 0, sizeof(clients));
+	http = http_setup(&port, data->base);
+	evhttp_set_max_connections(http, 2);
+
+	for (i = 0; i < 3; ++i) {
+		clients[i].reply = evbuffer_new();
+		clients[i].bev = bufferevent_socket_new(data->base,
+		    http_connect("127.0.0.1", port), BEV_OPT_CLOSE_ON_FREE);
+		bufferevent_setcb(clients[i].bev, http_max_conn_readcb, NULL,
+		    http_max_conn_eventcb, &clients[i]);
+		bufferevent_enable(clients[i].bev, EV_READ);
+		http_max_conn_request(&clients[i]);
+		tt_assert(evbuffer_contains(clients[i].reply, "HTTP/1.1 200"));
+		tt_assert(!clients[i].eof);
+	}
+
+	/* The third connection pushed out the one idle the longest. */
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_assert(clients[0].eof);
+	tt_assert(!clients[1].eof);
+	tt_assert(!clients[2].eof);
+
+	/* B is now the oldest; a new request on it makes C the oldest. */
+	http_max_conn_request(&clients[1]);
+	tt_assert(evbuffer_contains(clients[1].reply, "HTTP/1.1 200"));
+
+	bufferevent_free(clients[0].bev);
+	evbuffer_drain(clients[0].reply, evbuffer_get_length(clients[0].reply));
+	clients[0].eof = 0;
+	clients[0].bev = bufferevent_socket_new(data->base,
+	    http_connect("127.0.0.1", port), BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(clients[0].bev, http_max_conn_readcb, NULL,
+	    http_max_conn_eventcb, &clients[0]);
+	bufferevent_enable(clients[0].bev, EV_READ);
+	http_max_conn_request(&clients[0]);
+	tt_assert(evbuffer_contains(clients[0].reply, "HTTP/1.1 200"));
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_assert(!clients[0].eof);
+	tt_assert(!clients[1].eof);
+	tt_assert(clients[2].eof);
+
+	test_ok = 1;
+ end:
+	for (i = 0; i < 3; ++i) {
+		if (clients[i].bev)
+			bufferevent_free(clients[i].bev);
+		if (clients[i].reply)
+			evbuffer_free(clients[i].reply);
+	}
+	if (http)
+		evhttp_free(http);
+}
+
+#ifndef WIN32
+static struct rlimit http_emfile_limit;
+static int http_emfile_paused;
+
+static void
+http_emfile_restore_cb(evutil_socket_t fd, short what, void *arg)
+{
+	http_emfile_paused = http->accept_paused;
+	setrlimit(RLIMIT_NOFILE, &http_emfile_limit);
+}
+
+static void
+http_accept_emfile_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct http_max_conn_client client;
+	struct rlimit rl;
+	struct timeval tv = { 0, 200000 }, give_up = { 5, 0 };
+	ev_uint16_t port = 0;
+	int fd;
+
+	exit_base = data->base;
+	memset(&client, 0, sizeof(client));
+	http = http_setup(&port, data->base);
+
+	client.reply = evbuffer_new();
+	client.bev = bufferevent_socket_new(data->base,
+	    http_connect("127.0.0.1", port), BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(client.bev, http_max_conn_readcb, NULL,
+	    http_max_conn_eventcb, &client);
+	bufferevent_enable(client.bev, EV_READ);
+
+	/* Leave no descriptor for accept() to use.  The server has no
+	 * connection of its own that could go away, so only the retry
+	 * timer can start it accepting again once we give the limit back. */
+	tt_int_op(getrlimit(RLIMIT_NOFILE, &http_emfile_limit), ==, 0);
+	fd = dup(bufferevent_getfd(client.bev));
+	tt_int_op(fd, >=, 0);
+	close(fd);
+	rl = http_emfile_limit;
+	rl.rlim_cur = fd;
+	tt_int_op(setrlimit(RLIMIT_NOFILE, &rl), ==, 0);
+	event_base_once(data->base, -1, EV_TIMEOUT, http_emfile_restore_cb,
+	    NULL, &tv);
+	event_base_loopexit(data->base, &give_up);
+
+	http_max_conn_request(&client);
+	tt_int_op(http_emfile_paused, ==, 1);
+	tt_assert(evbuffer_contains(client.reply, "HTTP/1.1 200"));
+	tt_int_op(http->accept_paused, ==, 0);
+
+	test_ok = 1;
+ end:
+	setrlimit(RLIMIT_NOFILE, &http_emfile_limit);
+	if (client.bev)
+		bufferevent_free(client.bev);
+	if (client.reply)
+		evbuffer_free(client.reply);
+	if (http)
+		evhttp_free(http);
+}
+#endif
+
 static void
 http_connection_fail_done(struct evhttp_request *req, void *arg)
 {
@@ -3569,6 +4303,109 @@ http_terminate_chunked_test(void *arg)
 		evhttp_free(http);
 }
 
+#ifndef WIN32
+/*
+ * Static file serving test.
+ */
+
+static void
+http_static_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	ev_uint16_t port = 0;
+	struct evhttp_connection *evcon = NULL;
+	struct http_fetch_result res;
+	char dirname[] = "/tmp/eventstatic.XXXXXX";
+	char filename[64] = "";
+	char etag[48];
+	const char *contents = "Hello, static world";
+	FILE *fp;
+
+	exit_base = data->base;
+	tt_assert(mkdtemp(dirname) != NULL);
+	evutil_snprintf(filename, sizeof(filename), "%s/hello.txt", dirname);
+	tt_assert((fp = fopen(filename, "w")) != NULL);
+	fputs(contents, fp);
+	fclose(fp);
+
+	http = http_setup(&port, data->base);
+	tt_int_op(evhttp_set_static_dir(http, "/static", dirname), ==, 0);
+	tt_int_op(evhttp_set_static_dir(http, "/static", dirname), ==, -1);
+
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	tt_assert(evcon);
+
+	/* The whole file. */
+	http_fetch(evcon, EVHTTP_REQ_GET, "/static/hello.txt",
+	    NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_OK);
+	tt_str_op(res.body, ==, contents);
+	tt_assert(res.etag[0] == '"');
+	evutil_snprintf(etag, sizeof(etag), "%s", res.etag);
+
+	/* A range, served from the cached descriptor. */
+	http_fetch(evcon, EVHTTP_REQ_GET, "/static/hello.txt",
+	    "Range", "bytes=7-12", &res);
+	tt_int_op(res.code, ==, HTTP_PARTIALCONTENT);
+	tt_str_op(res.body, ==, "static");
+	tt_str_op(res.content_range, ==, "bytes 7-12/19");
+
+	http_fetch(evcon, EVHTTP_REQ_GET, "/static/hello.txt",
+	    "Range", "bytes=-5", &res);
+	tt_int_op(res.code, ==, HTTP_PARTIALCONTENT);
+	tt_str_op(res.body, ==, "world");
+
+	http_fetch(evcon, EVHTTP_REQ_GET, "/static/hello.txt",
+	    "Range", "bytes=19-", &res);
+	tt_int_op(res.code, ==, HTTP_RANGENOTSATISFIABLE);
+	tt_str_op(res.content_range, ==, "bytes */19");
+
+	/* Conditional requests. */
+	http_fetch(evcon, EVHTTP_REQ_GET, "/static/hello.txt",
+	    "If-None-Match", etag, &res);
+	tt_int_op(res.code, ==, HTTP_NOTMODIFIED);
+	tt_str_op(res.body, ==, "");
+
+	http_fetch(evcon, EVHTTP_REQ_GET, "/static/hello.txt",
+	    "If-Modified-Since", "Thu, 01 Jan 1970 00:00:00 GMT", &res);
+	tt_int_op(res.code, ==, HTTP_OK);
+
+	/* Things that are not there, or not ours to serve. */
+	http_fetch(evcon, EVHTTP_REQ_GET, "/static/missing.txt",
+	    NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_NOTFOUND);
+	http_fetch(evcon, EVHTTP_REQ_GET, "/static/%2e%2e/hello.txt",
+	    NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_NOTFOUND);
+	http_fetch(evcon, EVHTTP_REQ_GET, "/static", NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_NOTFOUND);
+
+	/* With caching disabled, every request opens the file. */
+	evhttp_set_static_cache_size(http, 0);
+	http_fetch(evcon, EVHTTP_REQ_GET, "/static/hello.txt",
+	    NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_OK);
+	tt_str_op(res.body, ==, contents);
+
+	/* Explicit callbacks still win over the static handler. */
+	tt_int_op(evhttp_del_static_dir(http, "/static"), ==, 0);
+	tt_int_op(evhttp_set_static_dir(http, "/", dirname), ==, 0);
+	http_fetch(evcon, EVHTTP_REQ_GET, "/test", NULL, NULL, &res);
+	tt_int_op(res.code, ==, HTTP_OK);
+	tt_str_op(res.body, ==, BASIC_REQUEST_BODY);
+
+	test_ok = 1;
+ end:
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (http)
+		evhttp_free(http);
+	if (filename[0])
+		unlink(filename);
+	rmdir(dirname);
+}
+#endif
+
 #define HTTP_LEGACY(name)						\
 	{ #name, run_legacy_test_fn, TT_ISOLATED|TT_LEGACY, &legacy_setup, \
 		    http_##name##_test }
@@ -3611,10 +4448,23 @@ struct testcase_t http_testcases[] = {
 
 	HTTP(stream_in),
 	HTTP(stream_in_cancel),
+	HTTP(stream_body),
+#ifdef _EVENT_HAVE_LIBZ
+	HTTP(compress),
+#endif
+	HTTP(route),
+	HTTP(route_deep),
+	HTTP(max_connections),
+#ifndef WIN32
+	HTTP(accept_emfile),
+#endif
 
 	HTTP(connection_fail),
 	HTTP(connection_retry),
 	HTTP(data_length_constraints),
+#ifndef WIN32
+	HTTP(static),
+#endif
 
 	END_OF_TESTCASES
 };
@@ -40,11 +40,6 @@
 #include <sys/wait.h>
 #endif
 
-#ifdef _EVENT_HAVE_PTHREADS
-#include <pthread.h>
-#elif defined(WIN32)
-#include <process.h>
-#endif
 #include <assert.h>
 #ifdef _EVENT_HAVE_UNISTD_H
 #include <unistd.h>
@@ -56,31 +51,16 @@
 #include "event2/util.h"
 #include "event2/event.h"
 #include "event2/event_struct.h"
+#include "event2/buffer.h"
+#include "event2/bufferevent.h"
 #include "event2/thread.h"
 #include "evthread-internal.h"
 #include "event-internal.h"
 #include "defer-internal.h"
 #include "regress.h"
+#include "regress_thread.h"
 #include "tinytest_macros.h"
 
-#ifdef _EVENT_HAVE_PTHREADS
-#define THREAD_T pthread_t
-#define THREAD_FN void *
-#define THREAD_RETURN() return (NULL)
-#define THREAD_START(threadvar, fn, arg) \
-	pthread_create(&(threadvar), NULL, fn, arg)
-#define THREAD_JOIN(th) pthread_join(th, NULL)
-#else
-#define THREAD_T HANDLE
-#define THREAD_FN unsigned __stdcall
-#define THREAD_RETURN() return (0)
-#define THREAD_START(threadvar, fn, arg) do {		\
-	uintptr_t threadhandle = _beginthreadex(NULL,0,fn,(arg),0,NULL); \
-	(threadvar) = (HANDLE) threadhandle; \
-	} while (0)
-#define THREAD_JOIN(th) WaitForSingleObject(th, INFINITE)
-#endif
-
 struct cond_wait {
 	void *lock;
 	void *cond;
@@ -493,6 +473,223 @@ end:
 		THREAD_JOIN(load_threads[i]);
 }
 
+#define XPAIR_CHUNK 1000
+#define XPAIR_TOTAL (XPAIR_CHUNK * 2000)
+
+struct xpair_test {
+	struct event_base *worker_base;
+	struct bufferevent *main_end;
+	struct bufferevent *worker_end;
+	size_t n_written;
+	size_t n_echoed;
+	int bad_data;
+	int main_eof;
+	int worker_eof;
+	unsigned long main_thread, worker_thread;
+	int wrong_thread;
+};
+
+/* Runs in the worker thread: send everything back. */
+static void
+xpair_echo_readcb(struct bufferevent *bev, void *arg)
+{
+	struct xpair_test *t = arg;
+	if (EVTHREAD_GET_ID() != t->worker_thread)
+		t->wrong_thread = 1;
+	bufferevent_write_buffer(bev, bufferevent_get_input(bev));
+}
+
+static void
+xpair_echo_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct xpair_test *t = arg;
+	if (what & BEV_EVENT_EOF) {
+		t->worker_eof = 1;
+		bufferevent_free(bev);
+	}
+}
+
+static THREAD_FN
+xpair_worker(void *arg)
+{
+	struct xpair_test *t = arg;
+	t->worker_thread = EVTHREAD_GET_ID();
+	event_base_dispatch(t->worker_base);
+	THREAD_RETURN();
+}
+
+/* Runs in the main thread: keep writing until everything's been sent. */
+static void
+xpair_main_writecb(struct bufferevent *bev, void *arg)
+{
+	struct xpair_test *t = arg;
+	char buf[XPAIR_CHUNK];
+	int i;
+
+	if (t->n_written == XPAIR_TOTAL)
+		return;
+	for (i = 0; i < XPAIR_CHUNK; ++i)
+		buf[i] = (char)(t->n_written + i);
+	t->n_written += XPAIR_CHUNK;
+	bufferevent_write(bev, buf, sizeof(buf));
+}
+
+static void
+xpair_main_readcb(struct bufferevent *bev, void *arg)
+{
+	struct xpair_test *t = arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	char buf[4096];
+	int i, n;
+
+	if (EVTHREAD_GET_ID() != t->main_thread)
+		t->wrong_thread = 1;
+	while ((n = evbuffer_remove(input, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; ++i) {
+			if (buf[i] != (char)(t->n_echoed + i))
+				t->bad_data = 1;
+		}
+		t->n_echoed += n;
+	}
+	if (t->n_echoed == XPAIR_TOTAL)
+		bufferevent_flush(bev, EV_WRITE, BEV_FINISHED);
+}
+
+static void
+xpair_main_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct xpair_test *t = arg;
+	if (what & BEV_EVENT_EOF)
+		t->main_eof = 1;
+}
+
+static void
+thread_bufferevent_pair_cross(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct xpair_test t;
+	struct bufferevent *pair[2] = { NULL, NULL };
+	THREAD_T thread;
+	int started = 0;
+
+	memset(&t, 0, sizeof(t));
+	t.worker_base = event_base_new();
+	tt_assert(t.worker_base);
+
+	tt_int_op(0, ==, bufferevent_pair_new_cross_thread(data->base,
+		t.worker_base, 0, pair));
+	t.main_end = pair[0];
+	t.worker_end = pair[1];
+	tt_ptr_op(bufferevent_pair_get_partner(pair[0]), ==, pair[1]);
+	tt_ptr_op(bufferevent_get_base(pair[1]), ==, t.worker_base);
+
+	bufferevent_setcb(pair[0], xpair_main_readcb, xpair_main_writecb,
+	    xpair_main_eventcb, &t);
+	bufferevent_setcb(pair[1], xpair_echo_readcb, NULL,
+	    xpair_echo_eventcb, &t);
+	bufferevent_enable(pair[0], EV_READ|EV_WRITE);
+	bufferevent_enable(pair[1], EV_READ|EV_WRITE);
+
+	t.main_thread = EVTHREAD_GET_ID();
+	THREAD_START(thread, xpair_worker, &t);
+	started = 1;
+
+	xpair_main_writecb(pair[0], &t);
+	event_base_dispatch(data->base);
+
+	THREAD_JOIN(thread);
+	started = 0;
+
+	tt_int_op(t.n_written, ==, XPAIR_TOTAL);
+	tt_int_op(t.n_echoed, ==, XPAIR_TOTAL);
+	tt_assert(!t.bad_data);
+	tt_assert(!t.wrong_thread);
+	tt_assert(t.worker_eof);
+	tt_assert(t.main_eof);
+	tt_ptr_op(bufferevent_pair_get_partner(pair[0]), ==, NULL);
+
+end:
+	if (started) {
+		event_base_loopbreak(t.worker_base);
+		THREAD_JOIN(thread);
+	}
+	if (pair[0])
+		bufferevent_free(pair[0]);
+	if (t.worker_base) {
+		if (!t.worker_eof && pair[1])
+			bufferevent_free(pair[1]);
+		event_base_free(t.worker_base);
+	}
+}
+
+#define RLIM_ITERATIONS 20000
+
+struct rlim_reparent {
+	struct bufferevent_rate_limit_group *g, *parent;
+	int n_attached;
+};
+
+/* Keep putting g under parent and taking it out again. */
+static THREAD_FN
+rlim_reparent_thread(void *arg)
+{
+	struct rlim_reparent *r = arg;
+	int i;
+	for (i = 0; i < RLIM_ITERATIONS; ++i) {
+		if (!bufferevent_rate_limit_group_set_parent(r->g, r->parent))
+			++r->n_attached;
+		bufferevent_rate_limit_group_set_parent(r->g, NULL);
+	}
+	THREAD_RETURN();
+}
+
+static void
+thread_rlim_set_parent(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct ev_token_bucket_cfg *cfg = NULL;
+	struct bufferevent_rate_limit_group *a = NULL, *b = NULL;
+	struct rlim_reparent r[2];
+	THREAD_T threads[2];
+	int i;
+
+	cfg = ev_token_bucket_cfg_new(1000000, 1000000, 1000000, 1000000,
+	    NULL);
+	tt_assert(cfg);
+	a = bufferevent_rate_limit_group_new(data->base, cfg);
+	b = bufferevent_rate_limit_group_new(data->base, cfg);
+	tt_assert(a && b);
+
+	/* One thread tries to put a under b while the other tries to put
+	 * b under a, which locks the same two groups in opposite orders.
+	 * Meanwhile we charge both groups, which locks whatever chain each
+	 * one is on at the moment. */
+	memset(r, 0, sizeof(r));
+	r[0].g = a;
+	r[0].parent = b;
+	r[1].g = b;
+	r[1].parent = a;
+	THREAD_START(threads[0], rlim_reparent_thread, &r[0]);
+	THREAD_START(threads[1], rlim_reparent_thread, &r[1]);
+	for (i = 0; i < RLIM_ITERATIONS; ++i) {
+		bufferevent_rate_limit_group_decrement_read(a, 1);
+		bufferevent_rate_limit_group_decrement_write(b, 1);
+	}
+	THREAD_JOIN(threads[0]);
+	THREAD_JOIN(threads[1]);
+
+	/* Getting here at all means nobody deadlocked. */
+	tt_int_op(r[0].n_attached + r[1].n_attached, >, 0);
+
+end:
+	if (a)
+		bufferevent_rate_limit_group_free(a);
+	if (b)
+		bufferevent_rate_limit_group_free(b);
+	if (cfg)
+		ev_token_bucket_cfg_free(cfg);
+}
+
 #define TEST(name)							\
 	{ #name, thread_##name, TT_FORK|TT_NEED_THREADS|TT_NEED_BASE,	\
 	  &basic_setup, NULL }
@@ -506,6 +703,8 @@ struct testcase_t thread_testcases[] = {
 #endif
 	TEST(conditions_simple),
 	TEST(deferred_cb_skew),
+	TEST(bufferevent_pair_cross),
+	TEST(rlim_set_parent),
 	END_OF_TESTCASES
 };
 
@@ -58,6 +58,7 @@ static int cfg_n_connections = 30;
 static int cfg_duration = 5;
 static int cfg_connlimit = 0;
 static int cfg_grouplimit = 0;
+static int cfg_parentlimit = 0;
 static int cfg_tick_msec = 1000;
 static int cfg_min_share = -1;
 
@@ -73,6 +74,7 @@ static struct timeval cfg_tick = { 0, 500*1000 };
 
 static struct ev_token_bucket_cfg *conn_bucket_cfg = NULL;
 static struct ev_token_bucket_cfg *group_bucket_cfg = NULL;
+static struct ev_token_bucket_cfg *parent_bucket_cfg = NULL;
 struct bufferevent_rate_limit_group *ratelim_group = NULL;
 static double seconds_per_tick = 0.0;
 
@@ -180,6 +182,7 @@ test_ratelimiting(void)
 	struct bufferevent **bevs;
 	struct client_state *states;
 	struct bufferevent_rate_limit_group *group = NULL;
+	struct bufferevent_rate_limit_group *parent = NULL;
 
 	int i;
 
@@ -245,6 +248,28 @@ test_ratelimiting(void)
 		if (cfg_min_share >= 0)
 			bufferevent_rate_limit_group_set_min_share(
 				ratelim_group, cfg_min_share);
+
+		if (cfg_parentlimit > 0) {
+			parent_bucket_cfg = ev_token_bucket_cfg_new(
+				cfg_parentlimit, cfg_parentlimit * 4,
+				cfg_parentlimit, cfg_parentlimit * 4,
+				&cfg_tick);
+			parent = bufferevent_rate_limit_group_new(
+				base, parent_bucket_cfg);
+			assert(parent);
+			if (cfg_min_share >= 0)
+				bufferevent_rate_limit_group_set_min_share(
+					parent, cfg_min_share);
+			bufferevent_rate_limit_group_set_parent(group, parent);
+			if (cfg_parentlimit < cfg_grouplimit) {
+				expected_total_persec = cfg_parentlimit;
+				expected_avg_persec =
+				    cfg_parentlimit / cfg_n_connections;
+				if (cfg_connlimit > 0 &&
+				    expected_avg_persec > cfg_connlimit)
+					expected_avg_persec = cfg_connlimit;
+			}
+		}
 	}
 
 	if (expected_avg_persec < 0 && cfg_connlimit > 0)
@@ -297,6 +322,8 @@ test_ratelimiting(void)
 
 	if (group)
 		bufferevent_rate_limit_group_free(group);
+	if (parent)
+		bufferevent_rate_limit_group_free(parent);
 
 	total_received = 0;
 	total_persec = 0.0;
@@ -359,6 +386,7 @@ static struct option {
 	{ "-d", &cfg_duration, 1, 0 },
 	{ "-c", &cfg_connlimit, 0, 0 },
 	{ "-g", &cfg_grouplimit, 0, 0 },
+	{ "-G", &cfg_parentlimit, 0, 0 },
 	{ "-t", &cfg_tick_msec, 10, 0 },
 	{ "--min-share", &cfg_min_share, 0, 0 },
 	{ "--check-connlimit", &cfg_connlimit_tolerance, 0, 0 },
@@ -403,7 +431,7 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-"test-ratelim [-v] [-n INT] [-d INT] [-c INT] [-g INT] [-t INT]\n\n"
+"test-ratelim [-v] [-n INT] [-d INT] [-c INT] [-g INT] [-G INT] [-t INT]\n\n"
 "Pushes bytes through a number of possibly rate-limited connections, and\n"
 "displays average throughput.\n\n"
 "  -n INT: Number of connections to open (default: 30)\n"
@@ -413,6 +441,8 @@ usage(void)
 "	   (default: None.)\n"
 "  -g INT: Group-rate limit applied to sum of all usage in bytes per second\n"
 "	   (default: None.)\n"
+"  -G INT: Rate limit for a parent group above the -g group, in bytes per\n"
+"	   second (default: None.)\n"
 "  -t INT: Granularity of timing, in milliseconds (default: 1000 msec)\n");
 }
 
@@ -459,6 +489,7 @@ main(int argc, char **argv)
 
 	cfg_connlimit *= ratio;
 	cfg_grouplimit *= ratio;
+	cfg_parentlimit *= ratio;
 
 	{
 		struct timeval tv;